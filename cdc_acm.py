@@ -0,0 +1,114 @@
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# CDC-ACM (virtual COM port) interfaces for descriptors.py
+# see hal5_usb_cdc_acm.h for the driver
+#
+# cdc_acm_interfaces returns the two interfaces of a CDC-ACM function,
+# they are added to the interfaces of a configuration, e.g.:
+#
+#   from cdc_acm import cdc_acm_interfaces
+#   configuration['interfaces'].extend(cdc_acm_interfaces(0, 3, 1, 2))
+#
+# and the device class is set to CDC:
+#
+#   descriptors['class-proto'] = CDC_DEVICE_CLASS_PROTO
+#
+# - communication class interface (comm_interface) with the header, 
+#   call management, ACM and union functional descriptors and the 
+#   notification (interrupt IN) endpoint
+# - data class interface (comm_interface + 1) with bulk IN and OUT 
+#   endpoints
+# endpoint arguments are endpoint numbers (1..7)
+
+CDC_DEVICE_CLASS_PROTO = (0x02, 0x00, 0x00)
+
+# Communications Class, Abstract Control Model, no protocol
+CDC_COMM_CLASS_PROTO = (0x02, 0x02, 0x00)
+# Data Class
+CDC_DATA_CLASS_PROTO = (0x0A, 0x00, 0x00)
+
+CS_INTERFACE = 0x24
+
+# bmCapabilities of ACM functional descriptor
+# D1: Set_Line_Coding, Set_Control_Line_State, Get_Line_Coding, Serial_State
+# D2: Send_Break
+ACM_CAPABILITIES = 0x06
+
+def cdc_acm_interfaces(
+        comm_interface,
+        notification_endpoint,
+        data_in_endpoint,
+        data_out_endpoint,
+        data_max_packet_size=64,
+        double_buffer=False,
+        label=None):
+    data_interface = comm_interface + 1
+    comm = {
+        'number':               comm_interface,
+        'label':                label,
+        'alternate-setting':    0,
+        'class-proto':          CDC_COMM_CLASS_PROTO,
+        'class-descriptors':
+        [
+            # header, bcdCDC 1.10
+            [5, CS_INTERFACE, 0x00, 0x10, 0x01],
+            # call management, no call management, bDataInterface
+            [5, CS_INTERFACE, 0x01, 0x00, data_interface],
+            # abstract control management
+            [4, CS_INTERFACE, 0x02, ACM_CAPABILITIES],
+            # union, bControlInterface and bSubordinateInterface0
+            [5, CS_INTERFACE, 0x06, comm_interface, data_interface],
+        ],
+        'endpoints':
+        [
+            {
+                'address':          notification_endpoint,
+                'direction':        'in',
+                'transfer-type':    'interrupt',
+                'max-packet-size':  16,
+                'interval':         16,
+            },
+        ]
+    }
+    data = {
+        'number':               data_interface,
+        'label':                None,
+        'alternate-setting':    0,
+        'class-proto':          CDC_DATA_CLASS_PROTO,
+        'endpoints':
+        [
+            {
+                'address':          data_in_endpoint,
+                'direction':        'in',
+                'transfer-type':    'bulk',
+                'max-packet-size':  data_max_packet_size,
+                'double-buffer':    double_buffer,
+            },
+            {
+                'address':          data_out_endpoint,
+                'direction':        'out',
+                'transfer-type':    'bulk',
+                'max-packet-size':  data_max_packet_size,
+                'double-buffer':    double_buffer,
+            },
+        ]
+    }
+    return [comm, data]
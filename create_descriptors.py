@@ -21,23 +21,41 @@
 #
 
 from math import ceil
+import importlib.util
+import os
 import sys
 
-from descriptors import descriptors
+# descriptors.py (in the current directory) is used by default
+# another module can be given as the first argument
+if len(sys.argv) > 1:
+    module_path = sys.argv[1]
+    module_name = os.path.splitext(os.path.basename(module_path))[0]
+    spec = importlib.util.spec_from_file_location(module_name, module_path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    descriptors = module.descriptors
+else:
+    from descriptors import descriptors
 
 strings = ['LANGID en-US']
 encoded_strings = [b'\x09\x04']
 
-def encode_string(s, padding=0):
+def encode_string(s):
     if s is None or len(s) == 0:
         return 0
     idx = len(strings)
-    s = s + ' ' * padding
     strings.append(s)
     encoded_string = s.encode('utf-16le')
     encoded_strings.append(encoded_string)
     return idx
 
+# an empty string descriptor for a string synthesized at runtime
+def encode_runtime_string(label):
+    idx = len(strings)
+    strings.append('(%s)' % label)
+    encoded_strings.append(b'')
+    return idx
+
 indent = 0
 
 def p(*args, **kwargs):
@@ -56,7 +74,7 @@ def untab():
     indent-=4
 
 def create_string_descriptor(i):
-    p('static hal5_usb_string_descriptor_t hal5_usb_string_descriptor_%d = ' % i)
+    p('static const hal5_usb_string_descriptor_t hal5_usb_string_descriptor_%d = ' % i)
     p('{')
     tab()
     # size
@@ -98,11 +116,22 @@ def create_string_descriptors():
     untab()
     p('};')
 
-def create_endpoint_descriptor(d):
+# names are unique per configuration and interface
+# so different configurations can use the same endpoints
+def endpoint_descriptor_name(cidx, interface, d):
+    address = d['address']
+    if d.get('direction', 'out').lower() == 'in':
+        address = 0x80 | address
+    return 'hal5_usb_endpoint_descriptor_%d_%d_%02X' % (cidx, interface['number'], address)
+
+def interface_descriptor_name(cidx, d):
+    return 'hal5_usb_interface_descriptor_%d_%d' % (cidx, d['number'])
+
+def create_endpoint_descriptor(cidx, interface, d):
     address = d['address']
     assert address != 0, 'endpoint address cannot be 0'
     assert address < 16, 'endpoint address has to be < 16'
-    p('static const hal5_usb_endpoint_descriptor_t hal5_usb_endpoint_descriptor_%d = ' % address)
+    p('static const hal5_usb_endpoint_descriptor_t %s = ' % endpoint_descriptor_name(cidx, interface, d))
     p('{')
     tab()
     p('7, // bLength')
@@ -115,6 +144,8 @@ def create_endpoint_descriptor(d):
         assert 'direction' in d, 'direction not given but the endpoint is not control'
         if d['direction'].lower() == 'in':
             address = 0x80 | address
+    if d.get('double-buffer', False):
+        assert tt == 'bul' or tt == 'iso', 'double-buffer given but the endpoint is neither bulk nor iso'
     p('0x%02X, // bEndpointAddress' % address)
     attr = 0
     # if tt is iso, st and ut is checked
@@ -162,17 +193,21 @@ def create_endpoint_descriptor(d):
     assert wMaxPacketSize <= 1023, 'wMaxPacketSize should be <= 1023'
     assert wMaxPacketSize % 4 == 0, 'not a must but highly recommended to make wMaxPacketSize a multiple of 4'
     p('%d, // wMaxPacketSize' % d['max-packet-size'])
+    interval = 0
     if tt == 'iso' or tt == 'int':
-        p('%d, // bInterval' % d['interval'])
+        interval = d['interval']
+        p('%d, // bInterval' % interval)
     else:
         assert 'interval' not in d, 'interval is given but the endpoint is neither iso nor interrupt'
     untab()
     p('};')
+    return [7, 0x05, address, attr, wMaxPacketSize & 0xFF, wMaxPacketSize >> 8, interval]
 
-def create_interface_descriptor(d):
+def create_interface_descriptor(cidx, d):
+    endpoints = []
     for endpoint in d['endpoints']:
-        create_endpoint_descriptor(endpoint)
-    p('static const hal5_usb_interface_descriptor_t hal5_usb_interface_descriptor_%d = ' % d['number'])
+        endpoints.append(create_endpoint_descriptor(cidx, d, endpoint))
+    p('static const hal5_usb_interface_descriptor_t %s = ' % interface_descriptor_name(cidx, d))
     p('{')
     tab()
     cp = d['class-proto']
@@ -184,19 +219,40 @@ def create_interface_descriptor(d):
     p('0x%02X, // bInterfaceClass' % cp[0])
     p('0x%02X, // bInterfaceSubClass' % cp[1])
     p('0x%02X, // bInterfaceProtocol' % cp[2])
-    p('%d, // iInterface' % encode_string(d['label']));
+    iInterface = encode_string(d['label'])
+    p('%d, // iInterface' % iInterface);
     p('{')
     tab()
     for endpoint in d['endpoints']:
-        p('&hal5_usb_endpoint_descriptor_%d, ' % endpoint['address'])
+        p('&%s, ' % endpoint_descriptor_name(cidx, d, endpoint))
     untab()
     p('},')
     untab()
     p('};')
+    interface = [9, 0x04, d['number'], d['alternate-setting'], len(d['endpoints']), cp[0], cp[1], cp[2], iInterface]
+    return [interface] + class_descriptors(d) + endpoints
+
+# class-specific descriptors of an interface (e.g. CDC functional descriptors)
+# they are only in the configuration descriptor blob
+def class_descriptors(d):
+    descriptors = []
+    for descriptor in d.get('class-descriptors', []):
+        descriptor = list(descriptor)
+        assert len(descriptor) >= 2, 'class descriptor is too short'
+        assert descriptor[0] == len(descriptor), 'bLength of class descriptor is wrong'
+        assert all(0 <= b <= 0xFF for b in descriptor), 'class descriptor contains non-byte values'
+        descriptors.append(descriptor)
+    return descriptors
+
+# configuration descriptors with their interface and endpoint descriptors
+# as returned to Get Descriptor (Configuration), one list of descriptors 
+# (each a list of bytes) for each configuration
+configuration_blobs = []
 
 def create_configuration_descriptor(idx, d):
+    descriptors = []
     for interface in d['interfaces']:
-        create_interface_descriptor(interface)
+        descriptors.extend(create_interface_descriptor(idx, interface))
     p('static const hal5_usb_configuration_descriptor_t hal5_usb_configuration_descriptor_%d = ' % idx)
     p('{')
     tab()
@@ -205,12 +261,15 @@ def create_configuration_descriptor(idx, d):
     total_length = 9
     for i in d['interfaces']:
         total_length = total_length + 9
+        for c in class_descriptors(i):
+            total_length = total_length + len(c)
         for e in i['endpoints']:
             total_length = total_length + 7
     p('%d, // wTotalLength' % total_length)
     p('%d, // bNumInterfaces' % len(d['interfaces']))
     p('%d, // bConfigurationValue' % d['value'])
-    p('%d, // iConfiguration' % encode_string(d['label']));
+    iConfiguration = encode_string(d['label'])
+    p('%d, // iConfiguration' % iConfiguration);
     # attr[7] reserved one
     # attr[4:0] reserved zero
     attr = 0x80
@@ -223,11 +282,33 @@ def create_configuration_descriptor(idx, d):
     p('{')
     tab()
     for interface in d['interfaces']:
-        p('&hal5_usb_interface_descriptor_%d, ' % interface['number'])
+        p('&%s, ' % interface_descriptor_name(idx, interface))
     untab()
     p('},')
     untab()
     p('};')
+    configuration = [9, 0x02, total_length & 0xFF, total_length >> 8, len(d['interfaces']), d['value'], iConfiguration, attr, ceil(d['max-power-ma']/2.0)]
+    descriptors = [configuration] + descriptors
+    assert sum(len(descriptor) for descriptor in descriptors) == total_length
+    configuration_blobs.append(descriptors)
+
+# the configuration descriptors are served from these as they are
+def create_configuration_descriptor_blobs():
+    for idx in range(0, len(configuration_blobs)):
+        p('static const uint8_t hal5_usb_configuration_descriptor_blob_%d[] =' % idx)
+        p('{')
+        tab()
+        for descriptor in configuration_blobs[idx]:
+            p(', '.join('0x%02X' % b for b in descriptor) + ',')
+        untab()
+        p('};')
+    p('const uint8_t* const hal5_usb_configuration_descriptor_blobs[] =')
+    p('{')
+    tab()
+    for idx in range(0, len(configuration_blobs)):
+        p('hal5_usb_configuration_descriptor_blob_%d,' % idx)
+    untab()
+    p('};')
 
 def create_device_descriptor(d):
     for i in range(0, len(d['configurations'])):
@@ -255,11 +336,13 @@ def create_device_descriptor(d):
     p('0x%04X, // idProduct'  % ids[1])
     p('0x%02X%02X, // bcdDevice' % (dv[0], dv[1]))
     p('%d, // iManufacturer' % encode_string(d['manufacturer']))
-    version_padding = 0
-    if d.get('append_version', True):
-        version_padding = len(' v00.00')
-    p('%d, // iProduct' % encode_string(d['product'], padding=version_padding))
-    p('%d, // iSerialNumber' % encode_string(d['serial']))
+    # the version is appended at runtime (not to the descriptor)
+    p('%d, // iProduct' % encode_string(d['product']))
+    if d.get('serial_from_uid', False):
+        assert d['serial'] is None, 'serial given but serial_from_uid is True'
+        p('%d, // iSerialNumber' % encode_runtime_string('UID'))
+    else:
+        p('%d, // iSerialNumber' % encode_string(d['serial']))
     p('%d, // bNumConfigurations' % len(d['configurations']))
     p('{')
     tab()
@@ -274,6 +357,224 @@ def create_device_descriptor(d):
         p('const bool hal5_usb_product_string_append_version = true;')
     else:
         p('const bool hal5_usb_product_string_append_version = false;')
+    if d.get('serial_from_uid', False):
+        p('const bool hal5_usb_serial_number_from_uid = true;')
+    else:
+        p('const bool hal5_usb_serial_number_from_uid = false;')
+    create_configuration_descriptor_blobs()
+    create_double_buffered_endpoints(d)
+    create_pma_layouts(d)
+    create_interface_class_descriptors(d)
+    create_endpoint_pool(d)
+
+# iso endpoints are always double buffered
+def is_double_buffered(endpoint):
+    tt = endpoint['transfer-type'].lower()[0:3]
+    return tt == 'iso' or endpoint.get('double-buffer', False)
+
+# bit n is set if endpoint n is double buffered, one entry per configuration
+# both buffer descriptors of endpoint n are used by a double buffered endpoint
+# so the endpoint number cannot be used in the other direction
+def create_double_buffered_endpoints(d):
+    p('const uint16_t hal5_usb_double_buffered_endpoints[] =')
+    p('{')
+    tab()
+    for conf in d['configurations']:
+        used = []
+        mask = 0
+        for interface in conf['interfaces']:
+            for endpoint in interface['endpoints']:
+                used.append(endpoint['address'])
+                if is_double_buffered(endpoint):
+                    mask = mask | (1 << endpoint['address'])
+        for address in range(0, 16):
+            if mask & (1 << address):
+                assert used.count(address) == 1, 'endpoint %d is double buffered but used more than once' % address
+        p('0x%04X, // configuration %d' % (mask, conf['value']))
+    untab()
+    p('};')
+
+# USB SRAM (PMA) layout, see hal5_usb_pma.c, the same rules are used here
+# the first 64 bytes are the buffer descriptor table
+# endpoint 0 is allocated first (at bus reset) with separate rx and tx buffers
+# the endpoints of a configuration are placed after endpoint 0
+# in the order of the descriptors (all others are freed at Set Configuration)
+PMA_SIZE = 2048
+PMA_BDT_SIZE = 64
+
+def pma_tx_buffer_size(mps):
+    return (mps + 3) & ~0x3
+
+# 2 byte blocks up to 62 bytes, 32 byte blocks above that
+def pma_rx_buffer_size(mps):
+    if mps <= 62:
+        return (mps + 3) & ~0x3
+    else:
+        return (mps + 31) & ~0x1F
+
+# addr:16, count:10, num_block:5, blsize:1
+def pma_txbd(addr):
+    return addr
+
+def pma_rxbd(addr, size):
+    if size < 64:
+        return addr | ((size // 2) << 26)
+    else:
+        return addr | (((size // 32) - 1) << 26) | (1 << 31)
+
+def create_pma_layout(cidx, conf, mps0):
+    ep0_size = pma_rx_buffer_size(mps0) + pma_tx_buffer_size(mps0)
+    addr = PMA_BDT_SIZE + ep0_size
+    entries = []
+    for interface in conf['interfaces']:
+        for endpoint in interface['endpoints']:
+            mps = endpoint['max-packet-size']
+            dir_in = endpoint.get('direction', 'out').lower() == 'in'
+            address = endpoint['address'] | (0x80 if dir_in else 0)
+            tx_size = pma_tx_buffer_size(mps)
+            rx_size = pma_rx_buffer_size(mps)
+            if endpoint['transfer-type'].lower()[0:3] == 'con':
+                # both directions, rx buffer first
+                size = rx_size + tx_size
+                txbd = pma_txbd(addr + rx_size)
+                rxbd = pma_rxbd(addr, rx_size)
+            elif is_double_buffered(endpoint):
+                # buffer 0 (txbd) and buffer 1 (rxbd) in the endpoint direction
+                if dir_in:
+                    size = 2 * tx_size
+                    txbd = pma_txbd(addr)
+                    rxbd = pma_txbd(addr + tx_size)
+                else:
+                    size = 2 * rx_size
+                    txbd = pma_rxbd(addr, rx_size)
+                    rxbd = pma_rxbd(addr + rx_size, rx_size)
+            elif dir_in:
+                size = tx_size
+                txbd = pma_txbd(addr)
+                rxbd = 0
+            else:
+                size = rx_size
+                txbd = 0
+                rxbd = pma_rxbd(addr, rx_size)
+            entries.append((address, addr, size, txbd, rxbd))
+            addr = addr + size
+    assert addr <= PMA_SIZE, 'configuration %d requires %d bytes of USB SRAM (max. %d)' % (conf['value'], addr, PMA_SIZE)
+    p('// configuration %d: %d bytes of USB SRAM used (%d bytes for endpoint 0), %d bytes free' % (conf['value'], addr, ep0_size, PMA_SIZE - addr))
+    if len(entries) == 0:
+        return 0
+    p('static const hal5_usb_pma_layout_entry_t hal5_usb_pma_layout_%d[] =' % cidx)
+    p('{')
+    tab()
+    for (address, addr, size, txbd, rxbd) in entries:
+        p('{0x%02X, %d, %d, 0x%08X, 0x%08X}, // %d-%d' % (address, addr, size, txbd, rxbd, addr, addr + size - 1))
+    untab()
+    p('};')
+    return len(entries)
+
+# buffer addresses and buffer descriptors of the endpoints, one entry per configuration
+# generation fails if a configuration does not fit to USB SRAM
+def create_pma_layouts(d):
+    number_of_entries = []
+    for i in range(0, len(d['configurations'])):
+        number_of_entries.append(create_pma_layout(i, d['configurations'][i], d['max-packet-size-ep0']))
+    p('const hal5_usb_pma_layout_t hal5_usb_pma_layouts[] =')
+    p('{')
+    tab()
+    for i in range(0, len(d['configurations'])):
+        if number_of_entries[i] > 0:
+            p('{%d, hal5_usb_pma_layout_%d},' % (number_of_entries[i], i))
+        else:
+            p('{0, NULL},')
+    untab()
+    p('};')
+
+# descriptors of the interfaces returned to Get Descriptor with interface 
+# recipient (e.g. HID report descriptor), one entry per configuration
+# an interface lists them as (bDescriptorType, bytes) in 'interface-descriptors'
+def create_interface_class_descriptors(d):
+    number_of_descriptors = []
+    for cidx in range(0, len(d['configurations'])):
+        conf = d['configurations'][cidx]
+        entries = []
+        for interface in conf['interfaces']:
+            for (descriptor_type, data) in interface.get('interface-descriptors', []):
+                data = list(data)
+                assert 0 <= descriptor_type <= 0xFF, 'descriptor type of interface descriptor is not a byte'
+                assert 0 < len(data) <= 0xFFFF, 'length of interface descriptor is wrong'
+                assert all(0 <= b <= 0xFF for b in data), 'interface descriptor contains non-byte values'
+                for (number, other_type, _) in entries:
+                    assert (number, other_type) != (interface['number'], descriptor_type), 'interface %d has more than one descriptor of type 0x%02X' % (number, descriptor_type)
+                entries.append((interface['number'], descriptor_type, data))
+        for (number, descriptor_type, data) in entries:
+            p('static const uint8_t hal5_usb_interface_class_descriptor_%d_%d_%02X[] =' % (cidx, number, descriptor_type))
+            p('{')
+            tab()
+            for i in range(0, len(data), 16):
+                p(', '.join('0x%02X' % b for b in data[i:i+16]) + ',')
+            untab()
+            p('};')
+        if len(entries) > 0:
+            p('static const hal5_usb_interface_class_descriptor_t hal5_usb_interface_class_descriptors_%d[] =' % cidx)
+            p('{')
+            tab()
+            for (number, descriptor_type, data) in entries:
+                p('{%d, 0x%02X, %d, hal5_usb_interface_class_descriptor_%d_%d_%02X},' % (number, descriptor_type, len(data), cidx, number, descriptor_type))
+            untab()
+            p('};')
+        number_of_descriptors.append(len(entries))
+    p('const hal5_usb_interface_class_descriptors_t hal5_usb_interface_class_descriptors[] =')
+    p('{')
+    tab()
+    for cidx in range(0, len(d['configurations'])):
+        if number_of_descriptors[cidx] > 0:
+            p('{%d, hal5_usb_interface_class_descriptors_%d},' % (number_of_descriptors[cidx], cidx))
+        else:
+            p('{0, NULL},')
+    untab()
+    p('};')
+
+# endpoints and rx_data/tx_data buffers for endpoint 0 and the configuration
+# requiring the most of them (only one configuration is active at a time)
+# control endpoints have both rx_data and tx_data
+# OUT endpoints have rx_data and IN endpoints have tx_data
+def create_endpoint_pool(d):
+    number_of_endpoints = 0
+    number_of_rx_data = 0
+    number_of_tx_data = 0
+    for conf in d['configurations']:
+        endpoints = 0
+        rx_data = 0
+        tx_data = 0
+        for interface in conf['interfaces']:
+            for endpoint in interface['endpoints']:
+                endpoints = endpoints + 1
+                if endpoint['transfer-type'].lower()[0:3] == 'con':
+                    rx_data = rx_data + 1
+                    tx_data = tx_data + 1
+                elif endpoint.get('direction', 'out').lower() == 'in':
+                    tx_data = tx_data + 1
+                else:
+                    rx_data = rx_data + 1
+        number_of_endpoints = max(number_of_endpoints, endpoints)
+        number_of_rx_data = max(number_of_rx_data, rx_data)
+        number_of_tx_data = max(number_of_tx_data, tx_data)
+    # endpoint 0
+    number_of_endpoints = number_of_endpoints + 1
+    number_of_rx_data = number_of_rx_data + 1
+    number_of_tx_data = number_of_tx_data + 1
+    # the pool keeps a 32-bit used mask
+    assert number_of_endpoints <= 32
+    p('static hal5_usb_endpoint_t hal5_usb_endpoint_pool_endpoints[%d];' % number_of_endpoints)
+    p('static uint8_t hal5_usb_endpoint_pool_rx_data[%d][HAL5_USB_EP_DATA_SIZE] __ALIGNED(4);' % number_of_rx_data)
+    p('static uint8_t hal5_usb_endpoint_pool_tx_data[%d][HAL5_USB_EP_DATA_SIZE] __ALIGNED(4);' % number_of_tx_data)
+    p('hal5_usb_endpoint_pool_t hal5_usb_endpoint_pool =')
+    p('{')
+    tab()
+    p('%d, hal5_usb_endpoint_pool_endpoints,' % number_of_endpoints)
+    p('%d, hal5_usb_endpoint_pool_rx_data,' % number_of_rx_data)
+    p('%d, hal5_usb_endpoint_pool_tx_data,' % number_of_tx_data)
+    untab()
+    p('};')
 
 def create_descriptors(d):
     p('#include <stdbool.h>')
@@ -0,0 +1,167 @@
+#!/usr/bin/python3
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# decodes the binary transaction trace (hal5_usb_trace.h) to a transcript
+#
+# usage: decode_trace.py <dump file> [SYSCLK in Hz]
+#
+# the dump is the events read with hal5_usb_trace_read or the trace vendor
+# request, as they are in memory (24 bytes each, little endian)
+
+import os
+import re
+import struct
+import sys
+
+EVENT_FORMAT = '<III BBBB HHHH'
+EVENT_SIZE = struct.calcsize(EVENT_FORMAT)
+assert EVENT_SIZE == 24
+
+TRACE_EVENT_IRQ = 1
+TRACE_EVENT_TRANSACTION = 2
+TRACE_EVENT_SETUP = 3
+
+ISTR_BITS = [
+    (15, 'CTR'),
+    (14, 'PMAOVR'),
+    (13, 'ERR'),
+    (12, 'WKUP'),
+    (11, 'SUSP'),
+    (10, 'RESET'),
+    (9, 'SOF'),
+    (8, 'ESOF'),
+]
+
+STATUS = ['X', 'S', 'N', 'V']
+
+REQUESTS = {
+    0x00: 'GET_STATUS',
+    0x01: 'CLEAR_FEATURE',
+    0x03: 'SET_FEATURE',
+    0x05: 'SET_ADDRESS',
+    0x06: 'GET_DESCRIPTOR',
+    0x07: 'SET_DESCRIPTOR',
+    0x08: 'GET_CONFIGURATION',
+    0x09: 'SET_CONFIGURATION',
+    0x0A: 'GET_INTERFACE',
+    0x0B: 'SET_INTERFACE',
+    0x0C: 'SYNCH_FRAME',
+}
+
+# usb_standard_request_t is read from hal5_usb.h, so it does not go stale
+def read_standard_requests():
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'hal5_usb.h')
+    with open(path) as f:
+        s = f.read()
+    m = re.search(r'typedef enum\s*{([^}]*)}\s*usb_standard_request_t;', s)
+    assert m is not None
+    body = re.sub(r'//[^\n]*', '', m.group(1))
+    names = [n.strip() for n in body.split(',') if n.strip() != '']
+    # values are sequential starting from 0
+    return [re.sub(r'\s*=.*', '', n) for n in names]
+
+def decode_istr(istr):
+    flags = [name for (bit, name) in ISTR_BITS if istr & (1 << bit)]
+    s = ' '.join(flags)
+    if istr & (1 << 15):
+        s += ' EP%u %s' % (istr & 0xF, 'OUT' if istr & (1 << 4) else 'IN')
+    return s
+
+def decode_transaction(chep):
+    if chep & (1 << 15):
+        return 'SETUP' if chep & (1 << 11) else 'OUT'
+    elif chep & (1 << 7):
+        return 'IN'
+    else:
+        return '?'
+
+def decode_request_type(bmRequestType):
+    direction = 'in' if bmRequestType & 0x80 else 'out'
+    t = ['standard', 'class', 'vendor', 'reserved'][(bmRequestType >> 5) & 0x3]
+    r = (bmRequestType & 0x1F)
+    r = ['device', 'interface', 'endpoint', 'other'][r] if r < 4 else str(r)
+    return '%s.%s.%s' % (t, r, direction)
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: %s <dump file> [SYSCLK in Hz]' % sys.argv[0])
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+
+    sysclk = float(sys.argv[2]) if len(sys.argv) > 2 else 240e6
+
+    standard_requests = read_standard_requests()
+
+    def standard_request_name(v):
+        if v < len(standard_requests):
+            return standard_requests[v].replace('standard_request_', '')
+        return str(v)
+
+    first = None
+    last = None
+    elapsed = 0
+
+    for offset in range(0, len(data) - EVENT_SIZE + 1, EVENT_SIZE):
+        (cycles, a, b,
+         type, endp, standard_request, status,
+         rxbd_count, txbd_count,
+         rx_received, tx_sent) = struct.unpack_from(EVENT_FORMAT, data, offset)
+
+        # cycle counter is 32-bit and wraps around
+        if last is not None:
+            elapsed += (cycles - last) & 0xFFFFFFFF
+        last = cycles
+
+        t = '%12.3f us' % (elapsed * 1e6 / sysclk)
+
+        if type == TRACE_EVENT_IRQ:
+            print('%s  <<<<<< ISTR=0x%08X %s' % (t, a, decode_istr(a)))
+
+        elif type == TRACE_EVENT_SETUP:
+            (bmRequestType, bRequest, wValue,
+             wIndex, wLength) = struct.unpack('<BBHHH', struct.pack('<II', a, b))
+            label = REQUESTS.get(bRequest, '0x%02X' % bRequest)
+            if (bmRequestType & 0x60) != 0:
+                label = '0x%02X' % bRequest
+            print('%s  S 0x%02X 0x%02X 0x%04X 0x%04X 0x%04X %s %s' % (
+                t,
+                bmRequestType, bRequest, wValue, wIndex, wLength,
+                decode_request_type(bmRequestType),
+                label))
+
+        elif type == TRACE_EVENT_TRANSACTION:
+            print('%s  EP%u %s (rx %u, %u) (tx %u, %u) %s%s %s' % (
+                t,
+                endp,
+                decode_transaction(b),
+                rxbd_count, rx_received,
+                txbd_count, tx_sent,
+                STATUS[status & 0x3],
+                STATUS[(status >> 4) & 0x3],
+                standard_request_name(standard_request)))
+
+        else:
+            print('%s  unknown event type %u' % (t, type))
+
+if __name__ == '__main__':
+    main()
@@ -61,6 +61,10 @@ descriptors = {
     # iSerialNumber
     'serial':           None,
 
+    # if True, serial number is the MCU UID (96-bit) as 24 hex digits
+    # serial above should be None
+    'serial_from_uid':  True,
+
     # configurations
     'configurations':   []
 }
@@ -106,6 +110,12 @@ interface0 = {
     # 0xFF means it is vendor-specific
     'class-proto': (0xFF, 0xFF, 0xFF),
 
+    # class-specific descriptors, optional
+    # each is a list of bytes starting with bLength
+    # they are placed after the interface descriptor
+    # e.g. CDC functional descriptors, see cdc_acm.py
+    #'class-descriptors': [],
+
     # endpoints
     'endpoints':
     [
@@ -136,6 +146,13 @@ interface0 = {
 
             # bInterval, required only for iso and interrupt endpoints
             #'interval':         1
+
+            # use both buffer descriptors of this endpoint number as
+            # ping-pong buffers (DBL_BUF), optional, False by default
+            # only for bulk endpoints, the endpoint number cannot be used
+            # in the other direction and 2 x max-packet-size is allocated
+            # iso endpoints are always double buffered
+            #'double-buffer':    False,
         }
     ]
 }
@@ -179,6 +196,7 @@ def testmps(mps):
     descriptors['append_version'] = False
     descriptors['manufacturer'] = genstr(mps - 2)
     descriptors['product'] = genstr(mps)
+    descriptors['serial_from_uid'] = False
     descriptors['serial'] = genstr(mps + 2)
     configuration0['label'] = genstr(mps * 2)
     interface0['label'] = genstr(mps * 2 + 2)
@@ -29,6 +29,13 @@
 
 #include "hal5.h"
 #include "hal5_usb.h"
+#include "hal5_usb_copy.h"
+#include "hal5_usb_pma.h"
+#include "hal5_usb_profile.h"
+#include "hal5_usb_trace.h"
+
+#define HAL5_USB_LOG_MODULE_LEVEL HAL5_USB_EP_LOG_LEVEL
+#include "hal5_usb_log.h"
 
 void hal5_usb_configure()
 {
@@ -58,6 +65,15 @@ void hal5_usb_configure()
             high_speed,
             AF10);
 
+#if HAL5_USB_TRACE_ENABLED
+    // before events are recorded in USB IRQ
+    hal5_usb_trace_initialize();
+#endif
+
+#if HAL5_USB_PROFILE_ENABLED
+    hal5_usb_profile_initialize();
+#endif
+
     // enable USB IRQ
     NVIC_SetPriority(USB_DRD_FS_IRQn, 6);
     NVIC_EnableIRQ(USB_DRD_FS_IRQn);
@@ -82,7 +98,7 @@ void hal5_usb_configure()
     // reset is not released
     // pull-up is not enabled
     
-    CONSOLE("USB configured.\n");
+    USB_INFO("USB configured.\n");
 }
 
 
@@ -111,15 +127,19 @@ static uint32_t hal5_usb_find_chep_status_toggle(
     return (current & 0b11);
 }
 
-uint32_t apply_to_chep(uint32_t old, uint32_t new)
+uint32_t hal5_usb_apply_to_chep(
+        uint32_t old, 
+        uint32_t new)
 {
-    uint32_t rc_w0  = 0b01111110100000001000000010000000;
-    uint32_t t      = 0b00000000000000000111000001110000;
-    uint32_t r      = 0b00000000000000000000100000000000;
-    uint32_t rw     = 0b00000001011111110000011100001111;
-
-    uint32_t cleared = old & ~(t & new);
-    uint32_t toggled = old ^ (t & new);
+    const uint32_t rc_w0  = 0b01111110100000001000000010000000;
+    const uint32_t t      = 0b00000000000000000111000001110000;
+    const uint32_t r      = 0b00000000000000000000100000000000;
+    const uint32_t rw     = 0b00000001011111110000011100001111;
+
+    // rc_w0: writing 0 clears, writing 1 keeps
+    uint32_t cleared = rc_w0 & old & new;
+    // t: writing 1 toggles, writing 0 keeps
+    uint32_t toggled = t & (old ^ new);
     uint32_t read    = r & old;
     uint32_t written = rw & new;
 
@@ -129,7 +149,10 @@ uint32_t apply_to_chep(uint32_t old, uint32_t new)
 void hal5_usb_ep_clear_data(
         hal5_usb_endpoint_t* ep)
 {
-    ep->rx_received = 0;
+    ep->rx_received     = 0;
+    ep->rx_overflow     = false;
+    ep->rx_target       = ep->rx_data;
+    ep->rx_target_size  = (ep->rx_data != NULL) ? HAL5_USB_EP_DATA_SIZE : 0;
 
     ep->tx_zlp_sent         = false;
     ep->tx_expected_valid   = 0;
@@ -137,6 +160,7 @@ void hal5_usb_ep_clear_data(
 
     ep->tx_sent         = 0;
     ep->tx_data_size    = 0;
+    ep->tx_source       = ep->tx_data;
 
 }
 
@@ -175,10 +199,10 @@ static void dump_status(
 {
     switch (status)
     {
-        case ep_status_valid: CONSOLE("V"); break;
-        case ep_status_stall: CONSOLE("S"); break;
-        case ep_status_nak: CONSOLE("N"); break;
-        case ep_status_disabled: CONSOLE("X"); break;
+        case ep_status_valid: USB_TRACE("V"); break;
+        case ep_status_stall: USB_TRACE("S"); break;
+        case ep_status_nak: USB_TRACE("N"); break;
+        case ep_status_disabled: USB_TRACE("X"); break;
     }
 }
 
@@ -187,7 +211,7 @@ void hal5_usb_ep_dump_status(
 {
     dump_status(ep->rx_status);
     dump_status(ep->tx_status);
-    CONSOLE("\n");
+    USB_TRACE("\n");
 }
 
 void hal5_usb_ep_sync_from_reg(
@@ -234,21 +258,255 @@ void hal5_usb_ep_sync_from_reg(
 void hal5_usb_ep_sync_to_reg(
         hal5_usb_endpoint_t* ep)
 {
-    ep->chep_reg->v = ep->chep2sync->v;
+    HAL5_USB_WRITE_CHEP(ep->chep_reg->v, ep->chep2sync->v);
+}
+
+// sets the size of the buffer the hardware can receive into
+// count is set by the hardware
+static void hal5_usb_bd_set_rx_size(
+        hal5_usb_bd_t* bd,
+        uint32_t allocated_memory)
+{
+    assert (allocated_memory > 0);
+    assert (allocated_memory <= 1024);
+    assert ((allocated_memory % 2) == 0);
+
+    if (allocated_memory < 64)
+    {
+        // block size 2 bytes
+        bd->blsize = 0;
+        // num_block = 0 is not allowed, condition already asserted above
+        bd->num_block = allocated_memory / 2;
+    }
+    else
+    {
+        // block size 32 bytes
+        assert ((allocated_memory % 32) == 0);
+        bd->blsize = 1;
+        // the last value actually means 1023 bytes (max packet size of USB FS)
+        // -1 because num_block=0 means 32 bytes
+        bd->num_block = (allocated_memory / 32) - 1;
+    } 
+
+    bd->count = 0;
+}
+
+// DOUBLE BUFFERED (BULK) ENDPOINTS
+//
+// EPKIND=1 on a bulk endpoint enables double buffering (DBL_BUF)
+// both buffer descriptors (txbd=buffer 0, rxbd=buffer 1) are then used
+// in the endpoint direction as ping-pong buffers
+//
+// the buffer used by the hardware is selected by DTOG
+// (DTOG_TX for IN, DTOG_RX for OUT) and it is toggled by the hardware
+// after each transaction
+// the buffer used by the software is selected by SW_BUF
+// (DTOG_RX for IN, DTOG_TX for OUT) and it is toggled only by the software
+// when DTOG == SW_BUF, the hardware waits for the buffer used by the software
+// and NAKs, STAT bits are not changed by the hardware and stays VALID
+//
+// so the software fills (IN) or empties (OUT) one buffer 
+// while the hardware sends or receives the other one
+
+static void hal5_usb_ep_initialize_double_buffer(
+        hal5_usb_endpoint_t* ep)
+{
+    hal5_usb_ep_sync_from_reg(ep);
+
+    ep->chep2sync->epkind = 1;
+
+    if (ep->dir_in)
+    {
+        // DTOG_TX=0 and SW_BUF=0
+        // hardware waits for buffer 0 until it is filled and released
+        ep->chep2sync->dtogtx = ep->chep->dtogtx;
+        ep->chep2sync->dtogrx = ep->chep->dtogrx;
+
+        hal5_usb_ep_set_status(
+                ep,
+                ep_status_disabled,
+                ep_status_valid);
+    }
+    else
+    {
+        // DTOG_RX=0 and SW_BUF=1
+        // hardware receives to buffer 0 when the endpoint is VALID
+        ep->chep2sync->dtogrx = ep->chep->dtogrx;
+        ep->chep2sync->dtogtx = !ep->chep->dtogtx;
+
+        hal5_usb_ep_set_status(
+                ep,
+                ep_status_nak,
+                ep_status_disabled);
+    }
+
+    hal5_usb_ep_sync_to_reg(ep);
+}
+
+// ISOCHRONOUS ENDPOINTS
+//
+// both buffer descriptors (txbd=buffer 0, rxbd=buffer 1) are always used
+// in the endpoint direction, EPKIND is not used
+//
+// the buffer used by the hardware is selected by DTOG and it is toggled by
+// the hardware after each transaction as for double buffered endpoints,
+// but there is no SW_BUF and no handshake, the hardware never waits
+// for the software and STAT stays VALID
+// IN: the packet in the buffer is sent (again) whenever the host asks
+// OUT: the packet is received to the buffer even if it is not read yet
+//
+// so the software has to fill (IN) or empty (OUT) the other buffer
+// before the next transaction, this is done at SOF 
+// (see hal5_usb_device.c)
+
+static void hal5_usb_ep_initialize_iso(
+        hal5_usb_endpoint_t* ep)
+{
+    hal5_usb_ep_sync_from_reg(ep);
+
+    // DTOG=0, the hardware uses buffer 0 first
+    if (ep->dir_in)
+    {
+        // ZLPs are sent until a stream is started
+        ep->txbd->count = 0;
+        ep->rxbd->count = 0;
+
+        ep->chep2sync->dtogtx = ep->chep->dtogtx;
+
+        hal5_usb_ep_set_status(
+                ep,
+                ep_status_disabled,
+                ep_status_valid);
+    }
+    else
+    {
+        ep->chep2sync->dtogrx = ep->chep->dtogrx;
+
+        hal5_usb_ep_set_status(
+                ep,
+                ep_status_valid,
+                ep_status_disabled);
+    }
+
+    hal5_usb_ep_sync_to_reg(ep);
+
+    ep->iso_dtog = 0;
+    ep->iso_idle_frames = 0;
+}
+
+// nothing is cleared and nothing is toggled when v is written to CHEPnR
+static void chep_set_unchanged(hal5_usb_chep_t* chep)
+{
+    chep->three_err_rx = 0b11;
+    chep->three_err_tx = 0b11;
+    chep->err_rx = 0b1;
+    chep->err_tx = 0b1;
+    chep->nak = 0b1;
+    chep->vtrx = 0b1;
+    chep->vttx = 0b1;
+    chep->dtogrx = 0b0;
+    chep->statrx = 0b00;
+    chep->dtogtx = 0b0;
+    chep->stattx = 0b00;
+}
+
+void hal5_usb_chep_clear_ctr(
+        hal5_usb_chep_t* chep_reg,
+        bool vtrx)
+{
+    hal5_usb_chep_t chep;
+    chep.v = chep_reg->v;
+
+    chep_set_unchanged(&chep);
+
+    if (vtrx) chep.vtrx = 0b0;
+    else chep.vttx = 0b0;
+
+    HAL5_USB_WRITE_CHEP(chep_reg->v, chep.v);
+}
+
+void hal5_usb_ep_double_buffer_update(
+        hal5_usb_endpoint_t* ep,
+        bool clear_ctr,
+        bool toggle_sw_buf)
+{
+    assert (ep->double_buffered);
+
+    hal5_usb_chep_t chep;
+    chep.v = ep->chep->v;
+
+    // nothing is cleared and nothing is toggled by default
+    chep_set_unchanged(&chep);
+
+#if HAL5_USB_DEFERRED_ENABLED
+    // CTR is cleared when the event is queued, clearing it here would lose
+    // a transaction completed since then
+    clear_ctr = false;
+#endif
+
+    if (ep->dir_in)
+    {
+        if (clear_ctr) chep.vttx = 0b0;
+        if (toggle_sw_buf) chep.dtogrx = 0b1;
+    }
+    else
+    {
+        if (clear_ctr) chep.vtrx = 0b0;
+        if (toggle_sw_buf) chep.dtogtx = 0b1;
+    }
+
+    // this is written immediately (not at sync_to_reg)
+    // so the hardware can use the released buffer as soon as possible
+    HAL5_USB_WRITE_CHEP(ep->chep_reg->v, chep.v);
+
+    // keep the cached copy in sync
+    if (toggle_sw_buf)
+    {
+        if (ep->dir_in) ep->chep->dtogrx = !ep->chep->dtogrx;
+        else ep->chep->dtogtx = !ep->chep->dtogtx;
+    }
+}
+
+// returns the first free entry of a pool and marks it used
+// entries are size bytes each, starting at base
+static void* pool_take(
+        uint32_t* used,
+        uint8_t n,
+        void* base,
+        size_t size)
+{
+    for (uint8_t i = 0; i < n; i++)
+    {
+        if ((*used & (1 << i)) == 0)
+        {
+            *used |= (1 << i);
+            return ((uint8_t*) base) + (i * size);
+        }
+    }
+
+    return NULL;
+}
+
+static void pool_release(
+        uint32_t* used,
+        void* base,
+        size_t size,
+        void* entry)
+{
+    if (entry == NULL) return;
+
+    const size_t i = (((uint8_t*) entry) - ((uint8_t*) base)) / size;
+
+    assert (*used & (1 << i));
+    *used &= ~(1 << i);
 }
 
 hal5_usb_endpoint_t* hal5_usb_ep_create(
         const hal5_usb_endpoint_descriptor_t* ed,
         uint8_t bMaxPacketSize0,
-        const uint32_t next_bd_addr)
+        const bool double_buffered,
+        const hal5_usb_pma_layout_entry_t* layout)
 {
-    // first 64 bytes are buffer descriptors
-    assert (next_bd_addr >= 64);
-    // USB_SRAM is 2048 bytes
-    assert (next_bd_addr <= 2048);
-    // USB_SRAM is word wide, so addr must be word aligned
-    assert ((next_bd_addr % 4) == 0);
-
     uint32_t endpoint_address;
     uint16_t max_packet_size;
     usb_ep_utype_t utype;
@@ -276,17 +534,46 @@ hal5_usb_endpoint_t* hal5_usb_ep_create(
         }
     }
 
-    hal5_usb_endpoint_t* ep = (hal5_usb_endpoint_t*) 
-        calloc(1, sizeof(hal5_usb_endpoint_t));
+    hal5_usb_endpoint_pool_t* const pool = &hal5_usb_endpoint_pool;
+    // generated with the descriptors
+    assert (pool != NULL);
+
+    hal5_usb_endpoint_t* ep = (hal5_usb_endpoint_t*) pool_take(
+            &pool->endpoints_used,
+            pool->number_of_endpoints,
+            pool->endpoints,
+            sizeof(hal5_usb_endpoint_t));
+    // more endpoints than the pool is generated for
+    assert (ep != NULL);
+
+    memset(ep, 0, sizeof(hal5_usb_endpoint_t));
     ep->endp = endpoint_address & 0xF;
     ep->dir_in = endpoint_address & 0x80;
     ep->utype = utype;
     ep->mps = max_packet_size;
-    ep->packet32 = (uint32_t*) malloc(ep->mps);
 
-    if ((utype == ep_utype_control) || ep->dir_in)
+    // only bulk endpoints can be double buffered
+    // isochronous endpoints always are
+    assert (!double_buffered || 
+            (utype == ep_utype_bulk) || 
+            (utype == ep_utype_iso));
+    ep->double_buffered = double_buffered || (utype == ep_utype_iso);
+
+    if (utype == ep_utype_iso)
+    {
+        // FS isochronous bInterval is 1 to 16
+        assert ((ed->bInterval >= 1) && (ed->bInterval <= 16));
+        ep->iso_interval = 1 << (ed->bInterval - 1);
+    }
+
+    if ((utype == ep_utype_control) || !ep->dir_in)
     {
-        ep->rx_data = (uint8_t*) malloc(1024);
+        ep->rx_data = (uint8_t*) pool_take(
+                &pool->rx_data_used,
+                pool->number_of_rx_data,
+                pool->rx_data,
+                HAL5_USB_EP_DATA_SIZE);
+        assert (ep->rx_data != NULL);
         ep->rx_data32 = (uint32_t*) ep->rx_data;
     } 
     else
@@ -295,10 +582,18 @@ hal5_usb_endpoint_t* hal5_usb_ep_create(
     }
 
     ep->rx_received = 0;
+    ep->rx_overflow = false;
+    ep->rx_target = ep->rx_data;
+    ep->rx_target_size = (ep->rx_data != NULL) ? HAL5_USB_EP_DATA_SIZE : 0;
 
-    if ((utype == ep_utype_control) || !ep->dir_in)
+    if ((utype == ep_utype_control) || ep->dir_in)
     {
-        ep->tx_data = (uint8_t*) malloc(1024);
+        ep->tx_data = (uint8_t*) pool_take(
+                &pool->tx_data_used,
+                pool->number_of_tx_data,
+                pool->tx_data,
+                HAL5_USB_EP_DATA_SIZE);
+        assert (ep->tx_data != NULL);
         ep->tx_data32 = (uint32_t*) ep->tx_data;
     }
     else
@@ -308,10 +603,53 @@ hal5_usb_endpoint_t* hal5_usb_ep_create(
 
     ep->tx_sent             = 0;
     ep->tx_zlp_sent         = false;
+    ep->tx_source           = ep->tx_data;
+
+    // rx and tx buffer sizes in USB SRAM
+    // both directions are used by control endpoints
+    // and both buffers are used in one direction if double buffered
+    const uint16_t rx_size = hal5_usb_pma_rx_buffer_size(ep->mps);
+    const uint16_t tx_size = hal5_usb_pma_tx_buffer_size(ep->mps);
+
+    if (utype == ep_utype_control) ep->pma_size = rx_size + tx_size;
+    else if (ep->dir_in) ep->pma_size = tx_size;
+    else ep->pma_size = rx_size;
+
+    if (ep->double_buffered) ep->pma_size = 2 * ep->pma_size;
+
+    if (layout != NULL)
+    {
+        assert (layout->bEndpointAddress == endpoint_address);
+        assert (layout->pma_size == ep->pma_size);
+
+        ep->pma_addr = layout->pma_addr;
+        // the region has to be free
+        const bool reserved = hal5_usb_pma_alloc_at(
+                ep->pma_addr, 
+                ep->pma_size);
+        assert (reserved);
+    }
+    else
+    {
+        ep->pma_addr = hal5_usb_pma_alloc(ep->pma_size);
+        // no space left in USB SRAM
+        assert (ep->pma_addr != 0);
+    }
 
     ep->chep_reg = (hal5_usb_chep_t*) (USB_DRD_BASE + 4*ep->endp);
-    ep->chep_reg->ea = ep->endp;
-    ep->chep_reg->utype = ep->utype;
+
+    {
+        // STAT and DTOG are not toggled and CTR is not cleared here
+        // EPKIND is set again for double buffered bulk endpoints
+        hal5_usb_chep_t chep;
+        chep.v = ep->chep_reg->v;
+        chep_set_unchanged(&chep);
+        chep.ea = ep->endp;
+        chep.utype = ep->utype;
+        chep.epkind = 0;
+        HAL5_USB_WRITE_CHEP(ep->chep_reg->v, chep.v);
+    }
+
     hal5_usb_ep_sync_from_reg(ep);
 
     // a buffer descriptor for each endpoint has two 32-bit registers (txbd and rxbd)
@@ -320,63 +658,100 @@ hal5_usb_endpoint_t* hal5_usb_ep_create(
     //   8 endpoints x 8 bytes = 64 bytes (the first 64 bytes of USB SRAM)
 
     // txbd is first
-    if ((ep->utype == ep_utype_control) |
-        (ep->dir_in))
+    hal5_usb_bd_t* const txbd = (hal5_usb_bd_t*) (USB_SRAM + 8*ep->endp);
+    // then rxbd (the structure is uint32_t, +1 means +4 bytes)
+    hal5_usb_bd_t* const rxbd = txbd + 1;
+
+    // both buffer descriptors are used in the endpoint direction 
+    // if double buffered, txbd describes buffer 0 and rxbd describes buffer 1
+    // control endpoint is bidirectional, so requires both rxbd and txbd
+    if (ep->double_buffered || 
+            (ep->utype == ep_utype_control) ||
+            ep->dir_in)
     {
-        ep->txbd = (hal5_usb_bd_t*) (USB_SRAM + 8*ep->endp);
+        ep->txbd = txbd;
     }
-    // then rxbd (the structure is uint32_t, +1 means +4 bytes)
-    if ((ep->utype == ep_utype_control) |
-        (!ep->dir_in))
+
+    if (ep->double_buffered || 
+            (ep->utype == ep_utype_control) ||
+            !ep->dir_in)
     {
-        ep->rxbd = ep->txbd + 1;
+        ep->rxbd = rxbd;
     }
 
-    // control endpoint is bidirectional, so requires both rxbd and txbd
-    // setup rxbd for control and other endpoints with IN direction
-    // rxbd count is set by the hardware
-    // the size of (allocated) buffer has to be specified
-    if (ep->rxbd != NULL)
+    if (layout != NULL)
+    {
+        // buffer descriptors are precomputed by create_descriptors.py
+        // only the ones used by this endpoint are loaded
+        // the other one might be used by the endpoint in the other direction
+        if (ep->txbd != NULL) ep->txbd->v = layout->txbd;
+        if (ep->rxbd != NULL) ep->rxbd->v = layout->rxbd;
+    }
+    else if (ep->double_buffered)
     {
-        const uint32_t allocated_memory = ep->mps;
-        assert (allocated_memory > 0);
-        assert (allocated_memory <= 1024);
-        assert ((allocated_memory % 2) == 0);
+        // the buffers are placed one after the other
+        const uint16_t buffer_size = ep->pma_size / 2;
 
-        if (allocated_memory < 64)
+        if (ep->dir_in)
         {
-            // block size 2 bytes
-            ep->rxbd->blsize = 0;
-            // num_block = 0 is not allowed, condition already asserted above
-            ep->rxbd->num_block = allocated_memory / 2;
+            ep->txbd->count = 0;
+            ep->rxbd->count = 0;
         }
         else
         {
-            // block size 32 bytes
-            ep->rxbd->blsize = 1;
-            // the last value actually means 1023 bytes (max packet size of USB FS)
-            // -1 because num_block=0 means 32 bytes
-            ep->rxbd->num_block = (allocated_memory / 32) - 1;
-        } 
+            hal5_usb_bd_set_rx_size(ep->txbd, buffer_size);
+            hal5_usb_bd_set_rx_size(ep->rxbd, buffer_size);
+        }
 
-        ep->rxbd->count = 0;
-        ep->rxbd->addr  = next_bd_addr;
+        ep->txbd->addr = ep->pma_addr;
+        ep->rxbd->addr = ep->pma_addr + buffer_size;
+    }
+    else
+    {
+        // setup rxbd for control and other endpoints with OUT direction
+        // rxbd count is set by the hardware
+        // the size of (allocated) buffer has to be specified
+        // rx buffer is placed first
+        if (ep->rxbd != NULL)
+        {
+            hal5_usb_bd_set_rx_size(ep->rxbd, rx_size);
+            ep->rxbd->addr  = ep->pma_addr;
+        }
+
+        // setup txbd for control and other endpoints with IN direction
+        // txbd count is set before every transaction
+        // tx buffer is placed after rx buffer (if there is one)
+        if (ep->txbd != NULL)
+        {
+            ep->txbd->count = 0;
+            ep->txbd->addr  = ep->pma_addr + ((ep->rxbd != NULL) ? rx_size : 0);
+        }
+    }
 
+    if (ep->rxbd != NULL)
+    {
         ep->rxaddr = USB_SRAM + ep->rxbd->addr;
         ep->rxaddr32 = (uint32_t*) ep->rxaddr;
     }
 
-    // setup txbd for control and other endpoints with OUT direction
-    // txbd count is set before every transaction
     if (ep->txbd != NULL)
     {
-        ep->txbd->count = 0;
-        ep->txbd->addr  = next_bd_addr;
-
         ep->txaddr = USB_SRAM + ep->txbd->addr;
         ep->txaddr32 = (uint32_t*) ep->txaddr;
     }
 
+    if (ep->utype == ep_utype_iso)
+    {
+        hal5_usb_ep_initialize_iso(ep);
+        return ep;
+    }
+
+    if (ep->double_buffered)
+    {
+        hal5_usb_ep_initialize_double_buffer(ep);
+        return ep;
+    }
+
     /*
     CONSOLE("USB_DRD_BASE   = %p\n", (uint32_t*) USB_DRD_BASE);
     CONSOLE("USB_SRAM       = %p\n", USB_SRAM);
@@ -394,6 +769,18 @@ hal5_usb_endpoint_t* hal5_usb_ep_create(
     CONSOLE("ep.txbd.addr       = %u\n", ep->txbd->addr);
     */
 
+    // until a transfer is started, the endpoint NAKs
+    // endpoint 0 is prepared after bus reset
+    if (ep->utype != ep_utype_control)
+    {
+        hal5_usb_ep_set_status(
+                ep,
+                ep->dir_in ? ep_status_disabled : ep_status_nak,
+                ep->dir_in ? ep_status_nak : ep_status_disabled);
+
+        hal5_usb_ep_sync_to_reg(ep);
+    }
+
     return ep;
 }
 
@@ -402,27 +789,46 @@ void hal5_usb_ep_free(
 {
     if (ep != NULL)
     {
-        free(ep->packet32);
-        free(ep->rx_data);
-        free(ep->tx_data);
-        free(ep);
+        hal5_usb_endpoint_pool_t* const pool = &hal5_usb_endpoint_pool;
+
+        hal5_usb_pma_free(ep->pma_addr, ep->pma_size);
+
+        pool_release(
+                &pool->rx_data_used, 
+                pool->rx_data, 
+                HAL5_USB_EP_DATA_SIZE,
+                ep->rx_data);
+
+        pool_release(
+                &pool->tx_data_used, 
+                pool->tx_data, 
+                HAL5_USB_EP_DATA_SIZE,
+                ep->tx_data);
+
+        pool_release(
+                &pool->endpoints_used, 
+                pool->endpoints, 
+                sizeof(hal5_usb_endpoint_t),
+                ep);
     }
 }
 
 // ATTENTION
 // copy from and copy to USB SRAM is word aligned
-// so memcpy cannot be used
+// so memcpy cannot be used, see hal5_usb_copy.c
 
-// the functions below assumes the buffer pointers are word aligned
+// USB SRAM buffer pointers (addr32) are word aligned
 // this is ensured when buffer descriptors are initialized
+// tx_source and rx_data pointers can be at any alignment
+// (e.g. when max packet size is not a multiple of 4)
 
-// using an extra buffer as big as max packet size (packet32)
-// simplifies the operations
-
-size_t hal5_usb_device_copy_to_endpoint(
-        hal5_usb_endpoint_t* ep)
+static size_t hal5_usb_ep_copy_to_pma(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_bd_t* bd,
+        uint32_t* addr32,
+        size_t offset)
 {
-    size_t tx_count = ep->tx_sent_limit - ep->tx_sent;
+    size_t tx_count = ep->tx_sent_limit - offset;
    
     // cannot pass max packet size
     if (tx_count > ep->mps)
@@ -432,83 +838,112 @@ size_t hal5_usb_device_copy_to_endpoint(
 
     if (tx_count > 0)
     {
-        // COPY bytes IN MAIN MEMORY
-        memcpy(
-                ep->packet32, 
-                ep->tx_data + ep->tx_sent,
+        hal5_usb_copy_to_pma(
+                addr32, 
+                ep->tx_source + offset, 
                 tx_count);
 
-        // len in number of words
-        uint32_t len32 = tx_count >> 2;
-
-        // if tx_count is not a multiple of word, add one more word to copy
-        if (tx_count & 0x03)
-        {
-            len32++;
-        }
-
-        // COPY words TO USB SRAM
-        for (size_t i = 0; i < len32; i++)
-        {
-            ep->txaddr32[i] = ep->packet32[i];
-        }
+        HAL5_USB_PMA_ACCESS((tx_count + 3) & ~0x3);
     }
 
-    ep->txbd->count = tx_count;
+    bd->count = tx_count;
 
     return tx_count;
 }
 
-size_t hal5_usb_device_copy_from_endpoint(
-        hal5_usb_endpoint_t* ep)
+static size_t hal5_usb_ep_copy_from_pma(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_bd_t* bd,
+        uint32_t* addr32)
 {
-    const uint32_t rx_count = ep->rxbd->count;
-
-    // len in number of words
-    size_t len32 = rx_count >> 2;
+    uint32_t rx_count = bd->count;
 
-    // if rx_count is not a multiple of word, add one more word to copy
-    if (rx_count & 0x03)
+    // never copy beyond rx_target
+    if (rx_count > (ep->rx_target_size - ep->rx_received))
     {
-        len32++;
+        rx_count = ep->rx_target_size - ep->rx_received;
+        ep->rx_overflow = true;
     }
 
-    // COPY words FROM USB SRAM
-    for (size_t i = 0; i < len32; i++)
+    if (rx_count > 0)
     {
-        ep->packet32[i] = ep->rxaddr32[i];
-    }
+        hal5_usb_copy_from_pma(
+                ep->rx_target + ep->rx_received,
+                addr32,
+                rx_count);
 
-    // COPY bytes IN MAIN MEMORY
-    memcpy(
-            ep->rx_data + ep->rx_received,
-            ep->packet32,
-            rx_count);
+        HAL5_USB_PMA_ACCESS((rx_count + 3) & ~0x3);
+    }
 
     return rx_count;
 }
 
-void hal5_usb_ep_prepare_for_in(
+size_t hal5_usb_device_copy_to_endpoint(
+        hal5_usb_endpoint_t* ep)
+{
+    return hal5_usb_ep_copy_to_pma(
+            ep, 
+            ep->txbd, 
+            ep->txaddr32, 
+            ep->tx_sent);
+}
+
+size_t hal5_usb_device_copy_from_endpoint(
+        hal5_usb_endpoint_t* ep)
+{
+    return hal5_usb_ep_copy_from_pma(
+            ep, 
+            ep->rxbd, 
+            ep->rxaddr32);
+}
+
+hal5_usb_bd_t* hal5_usb_ep_double_buffer_bd(
+        hal5_usb_endpoint_t* ep,
+        uint8_t buffer)
+{
+    assert (ep->double_buffered);
+    return (buffer == 0) ? ep->txbd : ep->rxbd;
+}
+
+size_t hal5_usb_device_copy_to_double_buffer(
+        hal5_usb_endpoint_t* ep,
+        uint8_t buffer)
+{
+    const size_t tx_count = hal5_usb_ep_copy_to_pma(
+            ep,
+            hal5_usb_ep_double_buffer_bd(ep, buffer),
+            (buffer == 0) ? ep->txaddr32 : ep->rxaddr32,
+            ep->tx_copied);
+
+    ep->tx_copied += tx_count;
+
+    return tx_count;
+}
+
+size_t hal5_usb_device_copy_from_double_buffer(
+        hal5_usb_endpoint_t* ep,
+        uint8_t buffer)
+{
+    return hal5_usb_ep_copy_from_pma(
+            ep,
+            hal5_usb_ep_double_buffer_bd(ep, buffer),
+            (buffer == 0) ? ep->txaddr32 : ep->rxaddr32);
+}
+
+static void hal5_usb_ep_prepare_for_in_from(
         hal5_usb_endpoint_t* ep,
         usb_ep_status_t rx_status,
-        const void* data,
+        const uint8_t* source,
         const size_t data_size,
         const bool expected_valid,
         const size_t expected)
 {
-    hal5_usb_ep_clear_data(ep);
-
-    if (data != NULL)
-    {
-        memcpy(
-                ep->tx_data, 
-                data,
-                data_size);
-    }
-
+    ep->tx_source       = source;
     ep->tx_data_size    = data_size;
     ep->tx_sent_limit   = data_size;
     ep->tx_sent         = 0;
+    ep->tx_copied       = 0;
+    ep->tx_zlp_copied   = false;
 
     if (expected_valid)
     {
@@ -534,6 +969,56 @@ void hal5_usb_ep_prepare_for_in(
             ep_status_valid);
 }
 
+void hal5_usb_ep_prepare_for_in(
+        hal5_usb_endpoint_t* ep,
+        usb_ep_status_t rx_status,
+        const void* data,
+        const size_t data_size,
+        const bool expected_valid,
+        const size_t expected)
+{
+    hal5_usb_ep_clear_data(ep);
+
+    assert (data_size <= HAL5_USB_EP_DATA_SIZE);
+
+    if (data != NULL)
+    {
+        memcpy(
+                ep->tx_data, 
+                data,
+                data_size);
+    }
+
+    hal5_usb_ep_prepare_for_in_from(
+            ep,
+            rx_status,
+            ep->tx_data,
+            data_size,
+            expected_valid,
+            expected);
+}
+
+void hal5_usb_ep_prepare_for_in_ref(
+        hal5_usb_endpoint_t* ep,
+        usb_ep_status_t rx_status,
+        const void* data,
+        const size_t data_size,
+        const bool expected_valid,
+        const size_t expected)
+{
+    hal5_usb_ep_clear_data(ep);
+
+    assert ((data != NULL) || (data_size == 0));
+
+    hal5_usb_ep_prepare_for_in_from(
+            ep,
+            rx_status,
+            (const uint8_t*) data,
+            data_size,
+            expected_valid,
+            expected);
+}
+
 void hal5_usb_ep_prepare_for_out(
         hal5_usb_endpoint_t* ep,
         usb_ep_status_t tx_status)
@@ -545,3 +1030,30 @@ void hal5_usb_ep_prepare_for_out(
             ep_status_valid, 
             tx_status);
 }
+
+void hal5_usb_ep_prepare_for_out_buffer(
+        hal5_usb_endpoint_t* ep,
+        usb_ep_status_t tx_status,
+        void* buffer,
+        const size_t buffer_size)
+{
+    assert (buffer != NULL);
+    assert (buffer_size > 0);
+
+    hal5_usb_ep_prepare_for_out(ep, tx_status);
+
+    ep->rx_target       = (uint8_t*) buffer;
+    ep->rx_target_size  = buffer_size;
+}
+
+bool hal5_usb_ep_is_out_stage_completed(
+        hal5_usb_endpoint_t* ep,
+        const size_t packet_size)
+{
+    // a short packet terminates the data stage
+    if (packet_size < ep->mps) return true;
+    // nothing more can be received
+    if (ep->rx_received >= ep->rx_target_size) return true;
+    if (ep->rx_overflow) return true;
+    return false;
+}
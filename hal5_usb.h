@@ -21,10 +21,14 @@
 #ifndef __HAL5_USB_H__
 #define __HAL5_USB_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include <stm32h5xx.h>
 
+#include "hal5_usb_pma.h"
+
 #define FEATURE_SELECTOR_ENDPOINT_HALT          (0)
 #define FEATURE_SELECTOR_DEVICE_REMOTE_WAKEUP   (1) 
 #define FEATURE_SELECTOR_TEST_MODE              (2) 
@@ -32,6 +36,74 @@
 // usb sram
 #define USB_SRAM  ((uint8_t*) USB_DRD_PMAADDR)
 
+// size of rx_data and tx_data buffers of an endpoint
+#define HAL5_USB_EP_DATA_SIZE   (1024)
+
+// ISTR and CHEPnR have rc_w0 and toggle bits
+// so writing to them is not the same as writing to memory
+// all writes to them go through these macros
+// so the host simulation (see sim/) can model these semantics
+#ifdef HAL5_USB_SIM
+void hal5_usb_sim_write_istr(uint32_t v);
+void hal5_usb_sim_write_chep(volatile uint32_t* chep_reg, uint32_t v);
+#define HAL5_USB_WRITE_ISTR(v) hal5_usb_sim_write_istr((uint32_t) (v))
+#define HAL5_USB_WRITE_CHEP(reg, v) hal5_usb_sim_write_chep(&(reg), (uint32_t) (v))
+#else
+#define HAL5_USB_WRITE_ISTR(v) (USB_DRD_FS->ISTR = (v))
+#define HAL5_USB_WRITE_CHEP(reg, v) ((reg) = (v))
+#endif
+
+// ISTR is read through this in the interrupt handler 
+// the host simulation uses it to hide the events from the handler 
+// until its own writes take effect
+#ifdef HAL5_USB_SIM
+uint32_t hal5_usb_sim_read_istr(void);
+#define HAL5_USB_READ_ISTR() hal5_usb_sim_read_istr()
+#else
+#define HAL5_USB_READ_ISTR() (USB_DRD_FS->ISTR)
+#endif
+
+// called with the number of bytes read from or written to USB SRAM
+// the host simulation uses this to model the time spent in the handler
+#ifdef HAL5_USB_SIM
+void hal5_usb_sim_pma_access(size_t bytes);
+#define HAL5_USB_PMA_ACCESS(bytes) hal5_usb_sim_pma_access(bytes)
+#else
+#define HAL5_USB_PMA_ACCESS(bytes)
+#endif
+
+// max. number of events handled in one USB interrupt entry
+#ifndef HAL5_USB_MAX_EVENTS_PER_IRQ
+#define HAL5_USB_MAX_EVENTS_PER_IRQ (8)
+#endif
+
+// deferred event processing (make deferred=1)
+// the interrupt handler only queues the events, they are processed by
+// hal5_usb_device_process_events outside of the interrupt
+#ifndef HAL5_USB_DEFERRED_ENABLED
+#define HAL5_USB_DEFERRED_ENABLED   (0)
+#endif
+
+// number of events queued, has to be a power of 2
+#ifndef HAL5_USB_DEFERRED_QUEUE_SIZE
+#define HAL5_USB_DEFERRED_QUEUE_SIZE (16)
+#endif
+
+// number of transfers that can be submitted to an endpoint
+// see hal5_usb_device_submit
+#ifndef HAL5_USB_TRANSFER_QUEUE_SIZE
+#define HAL5_USB_TRANSFER_QUEUE_SIZE (4)
+#endif
+
+// DWT cycle counter, used for timestamps
+// the host simulation returns the modeled time in cycles
+#ifdef HAL5_USB_SIM
+uint32_t hal5_usb_sim_read_cyccnt(void);
+#define HAL5_USB_READ_CYCCNT() hal5_usb_sim_read_cyccnt()
+#else
+#define HAL5_USB_READ_CYCCNT() (DWT->CYCCNT)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -111,6 +183,22 @@ typedef __PACKED_STRUCT
     uint8_t bString[];
 } hal5_usb_string_descriptor_t;
 
+// a descriptor returned to Get Descriptor with interface recipient
+// (e.g. HID report descriptor), generated by create_descriptors.py
+typedef struct
+{
+    uint8_t bInterfaceNumber;
+    uint8_t bDescriptorType;
+    uint16_t wDescriptorLength;
+    const uint8_t* data;
+} hal5_usb_interface_class_descriptor_t;
+
+typedef struct
+{
+    uint8_t number_of_descriptors;
+    const hal5_usb_interface_class_descriptor_t* descriptors;
+} hal5_usb_interface_class_descriptors_t;
+
 typedef enum
 {
     ep_status_disabled=0b00,
@@ -192,7 +280,73 @@ typedef union
     };
 } hal5_usb_istr_t;
 
+// traffic counters of an endpoint, cleared when the endpoint is created
+// (e.g. at Set Configuration)
+// counted in USB interrupt handler, for transactions ACKed by the device
 typedef struct
+{
+    // OUT and SETUP packets
+    uint32_t rx_packets;
+    uint32_t rx_bytes;
+    uint32_t setup_packets;
+    // OUT packets less than max packet size, including ZLPs
+    uint32_t rx_short_packets;
+    uint32_t tx_packets;
+    uint32_t tx_bytes;
+    uint32_t tx_zlps;
+    // Request Errors of control endpoint, halts set on other endpoints
+    uint32_t stalls;
+    // isochronous only, service intervals without a packet while streaming
+    uint32_t missed_frames;
+} hal5_usb_ep_stats_t;
+
+typedef struct hal5_usb_endpoint hal5_usb_endpoint_t;
+
+// called when the OUT or IN stage of a non-control endpoint is completed
+typedef void (*hal5_usb_ep_stage_completed_t)(
+        hal5_usb_endpoint_t* ep,
+        void* context);
+
+// called for each packet of an endpoint in streaming mode
+// see hal5_usb_device_register_packet_callback
+typedef bool (*hal5_usb_ep_packet_t)(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context);
+
+typedef enum
+{
+    // IN only, no ZLP is sent after a transfer of a multiple of max packet
+    // size, e.g. when the host knows the length from the class protocol
+    transfer_flag_no_zlp=0x1,
+} hal5_usb_transfer_flag_t;
+
+typedef struct hal5_usb_transfer hal5_usb_transfer_t;
+
+// called when a submitted transfer is completed
+// transfer is only valid during the call
+typedef void (*hal5_usb_transfer_completed_t)(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer);
+
+struct hal5_usb_transfer
+{
+    // IN: data to send, it is sent from where it is
+    // OUT: buffer to receive to
+    void*           buffer;
+    size_t          length;
+    // hal5_usb_transfer_flag_t
+    uint32_t        flags;
+    hal5_usb_transfer_completed_t completed;
+    void*           context;
+    // set when completed, IN: bytes sent, OUT: bytes received
+    size_t          actual_length;
+    // OUT only, true if a packet did not fit to buffer
+    bool            overflow;
+};
+
+struct hal5_usb_endpoint
 {
     // endpoint number
     uint8_t         endp;
@@ -205,9 +359,11 @@ typedef struct
     usb_ep_utype_t  utype;
     // max packet size
     uint16_t        mps;
-    // temporary copy of data in main memory
-    // it simplifies buffer operations
-    uint32_t*       packet32 __ALIGNED(4);
+    // true if both buffer descriptors are used as ping-pong buffers
+    // only bulk endpoints can be double buffered, isochronous endpoints
+    // always are
+    // txbd/txaddr is buffer 0 and rxbd/rxaddr is buffer 1 in this case
+    bool            double_buffered;
 
     bool last_out;
     bool current_out;
@@ -220,6 +376,10 @@ typedef struct
     // actual chep_reg access
     hal5_usb_chep_t* chep_reg;    
 
+    // all buffers of the endpoint are allocated as one region in USB SRAM
+    uint16_t        pma_addr;
+    uint16_t        pma_size;
+
     // buffer descriptor, only if endpoint supports SETUP/OUT
     hal5_usb_bd_t*  rxbd;
     // buffer descriptor, only if endpoint supports IN
@@ -234,8 +394,15 @@ typedef struct
     // rx buffer addr in main memory
     uint8_t*        rx_data __ALIGNED(4);
     uint32_t*       rx_data32;
-    // actual amount received to rx_data
+    // OUT data is copied here
+    // it is rx_data, or an application buffer
+    uint8_t*        rx_target;
+    // size of rx_target, nothing is copied beyond this
+    size_t          rx_target_size;
+    // actual amount received to rx_target
     size_t          rx_received;
+    // true if a packet did not fit to rx_target, the rest is dropped
+    bool            rx_overflow;
 
     // tx buffer addr in USB SRAM
     void*           txaddr;
@@ -254,17 +421,78 @@ typedef struct
     size_t          tx_sent_limit;
     // the next ep tx status
     usb_ep_status_t tx_status;
+    // double buffered IN only
+    // data amount copied to USB SRAM, it is ahead of tx_sent
+    size_t          tx_copied;
+    // true if ZLP is copied as the last packet
+    bool            tx_zlp_copied;
+    // number of buffers filled but not sent yet (0, 1 or 2)
+    uint8_t         tx_buffers_filled;
 
     // tx buffer addr in main memory
     uint8_t*        tx_data __ALIGNED(4);
     uint32_t*       tx_data32;
     // the amount of data in tx buffer 
     size_t          tx_data_size;
+    // the data sent is read from here
+    // it is tx_data, or the data given by reference (e.g. in flash)
+    const uint8_t*  tx_source;
 
     // rx_data cast as device_request for ease of use
     hal5_usb_device_request_t* device_request;
 
-} hal5_usb_endpoint_t;
+    hal5_usb_ep_stats_t stats;
+
+    // called instead of hal5_usb_device_out/in_stage_completed_ex if set
+    // see hal5_usb_device_register_endpoint_callback
+    hal5_usb_ep_stage_completed_t stage_completed;
+    void*           stage_completed_context;
+
+    // called for each packet instead of combining them into stages if set
+    // see hal5_usb_device_register_packet_callback
+    hal5_usb_ep_packet_t packet;
+    void*           packet_context;
+    // false after packet returns false, until the stream is started again
+    bool            stream_started;
+
+    // submitted transfers, see hal5_usb_device_submit
+    // the one at transfers_head is in progress if transfers_count > 0
+    hal5_usb_transfer_t transfers[HAL5_USB_TRANSFER_QUEUE_SIZE];
+    uint8_t         transfers_head;
+    uint8_t         transfers_count;
+    // true while the completed callback of a transfer is called
+    bool            transfer_completing;
+
+    // ENDPOINT_HALT feature, see hal5_usb_device_set_endpoint_halt
+    bool            halted;
+
+    // isochronous only, the buffers are exchanged at SOF
+    // DTOG of the endpoint direction at the last exchange
+    bool            iso_dtog;
+    // frames in a service interval, 2^(bInterval-1)
+    uint16_t        iso_interval;
+    // frames since the last packet
+    uint16_t        iso_idle_frames;
+};
+
+// endpoints and their rx_data and tx_data buffers are taken from this pool
+// it is generated by create_descriptors.py 
+// for endpoint 0 and the largest configuration
+typedef struct
+{
+    uint8_t number_of_endpoints;
+    hal5_usb_endpoint_t* endpoints;
+    uint8_t number_of_rx_data;
+    uint8_t (*rx_data)[HAL5_USB_EP_DATA_SIZE];
+    uint8_t number_of_tx_data;
+    uint8_t (*tx_data)[HAL5_USB_EP_DATA_SIZE];
+    // bit n is set if entry n is in use
+    uint32_t endpoints_used;
+    uint32_t rx_data_used;
+    uint32_t tx_data_used;
+} hal5_usb_endpoint_pool_t;
+
+extern hal5_usb_endpoint_pool_t hal5_usb_endpoint_pool __WEAK;
 
 typedef enum
 {
@@ -282,28 +510,73 @@ typedef enum
     standard_request_interface_set_feature,
     standard_request_interface_get_interface,
     standard_request_interface_set_interface,
+    standard_request_interface_get_descriptor,
     standard_request_endpoint_get_status,
     standard_request_endpoint_clear_feature,
     standard_request_endpoint_set_feature,
     standard_request_endpoint_synch_frame,
+    // not a standard request but a registered class or vendor request
+    standard_request_class_or_vendor,
 } usb_standard_request_t;
 
 void hal5_usb_configure(void);
 
+// returns the value of a CHEPnR register after writing new to it 
+// when its value is old, according to rc_w0, toggle, rw and r bits
+uint32_t hal5_usb_apply_to_chep(
+        uint32_t old, 
+        uint32_t new);
+
 size_t hal5_usb_device_copy_to_endpoint(
         hal5_usb_endpoint_t* ep);
 
 size_t hal5_usb_device_copy_from_endpoint(
         hal5_usb_endpoint_t* ep);
 
+// double buffered endpoints only
+// buffer is 0 (txbd) or 1 (rxbd)
+hal5_usb_bd_t* hal5_usb_ep_double_buffer_bd(
+        hal5_usb_endpoint_t* ep,
+        uint8_t buffer);
+
+// copies the next packet from tx_data (after tx_copied)
+size_t hal5_usb_device_copy_to_double_buffer(
+        hal5_usb_endpoint_t* ep,
+        uint8_t buffer);
+
+// copies the packet to rx_target (after rx_received)
+size_t hal5_usb_device_copy_from_double_buffer(
+        hal5_usb_endpoint_t* ep,
+        uint8_t buffer);
+
+// writes CHEPnR immediately, it can clear VTTX (IN) or VTRX (OUT)
+// and toggle SW_BUF to release the buffer used by the software
+void hal5_usb_ep_double_buffer_update(
+        hal5_usb_endpoint_t* ep,
+        bool clear_ctr,
+        bool toggle_sw_buf);
+
+// writes CHEPnR immediately, clears VTRX (vtrx=true) or VTTX
+// nothing else is changed, it does not need an endpoint
+void hal5_usb_chep_clear_ctr(
+        hal5_usb_chep_t* chep_reg,
+        bool vtrx);
+
 // pass ed=NULL for endpoint 0
 // then it automatically reads the max packet size 
 // from hal5_usb_device_descriptor
 // and assumes it is a control endpoint
+// the buffers in USB SRAM are allocated with hal5_usb_pma_alloc
+// (two buffers in the endpoint direction if double_buffered, isochronous
+// endpoints are always double buffered)
+// and freed with hal5_usb_ep_free
+// if layout is not NULL, the buffers are placed and the buffer descriptors
+// are loaded as given (generated by create_descriptors.py)
 hal5_usb_endpoint_t* hal5_usb_ep_create(
         const hal5_usb_endpoint_descriptor_t* ed,
         uint8_t bMaxPacketSize0,
-        const uint32_t next_bd_addr);
+        const bool double_buffered,
+        const hal5_usb_pma_layout_entry_t* layout);
 
 void hal5_usb_ep_free(
         hal5_usb_endpoint_t* ep);
@@ -331,6 +604,8 @@ void hal5_usb_ep_set_status(
         usb_ep_status_t rx_status,
         usb_ep_status_t tx_status);
 
+// data is copied to tx_data (data_size <= 1024)
+// if data is NULL, the data already in tx_data is used
 void hal5_usb_ep_prepare_for_in(
         hal5_usb_endpoint_t* ep,
         usb_ep_status_t rx_status,
@@ -339,10 +614,36 @@ void hal5_usb_ep_prepare_for_in(
         const bool expected_valid,
         const size_t expected);
 
+// data is not copied, it is read directly when the packets are copied to 
+// USB SRAM, so it has to stay valid until the IN stage is completed
+// e.g. descriptors or tables in flash, there is no size limit
+void hal5_usb_ep_prepare_for_in_ref(
+        hal5_usb_endpoint_t* ep,
+        usb_ep_status_t rx_status,
+        const void* data,
+        const size_t data_size,
+        const bool expected_valid,
+        const size_t expected);
+
+// OUT data is received to rx_data (HAL5_USB_EP_DATA_SIZE bytes)
 void hal5_usb_ep_prepare_for_out(
         hal5_usb_endpoint_t* ep,
         usb_ep_status_t tx_status);
 
+// OUT data is received directly to buffer, there is no size limit
+// the stage is completed when a short packet is received or 
+// when buffer_size bytes are received
+void hal5_usb_ep_prepare_for_out_buffer(
+        hal5_usb_endpoint_t* ep,
+        usb_ep_status_t tx_status,
+        void* buffer,
+        const size_t buffer_size);
+
+// true if the OUT stage is completed after the last packet
+bool hal5_usb_ep_is_out_stage_completed(
+        hal5_usb_endpoint_t* ep,
+        const size_t packet_size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,432 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stm32h5xx.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_cdc_acm.h"
+
+static_assert ((HAL5_USB_CDC_ACM_RING_SIZE & 
+            (HAL5_USB_CDC_ACM_RING_SIZE - 1)) == 0,
+        "HAL5_USB_CDC_ACM_RING_SIZE has to be a power of 2");
+
+static_assert (sizeof(hal5_usb_cdc_acm_line_coding_t) == 7,
+        "line coding has to be 7 bytes");
+
+// single producer single consumer ring
+// head and tail are free running, each is written only by one side
+typedef struct
+{
+    uint8_t data[HAL5_USB_CDC_ACM_RING_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} ring_t;
+
+static size_t ring_used(const ring_t* ring)
+{
+    return ring->head - ring->tail;
+}
+
+static size_t ring_free(const ring_t* ring)
+{
+    return HAL5_USB_CDC_ACM_RING_SIZE - ring_used(ring);
+}
+
+// producer side
+static size_t ring_put(
+        ring_t* ring,
+        const uint8_t* data,
+        size_t size)
+{
+    size = HAL5_MIN(size, ring_free(ring));
+
+    const uint32_t offset = ring->head & (HAL5_USB_CDC_ACM_RING_SIZE - 1);
+    const size_t first = HAL5_MIN(size, HAL5_USB_CDC_ACM_RING_SIZE - offset);
+
+    memcpy(&ring->data[offset], data, first);
+    memcpy(ring->data, data + first, size - first);
+
+    // the data is written before it is published
+    __DMB();
+    ring->head = ring->head + size;
+
+    return size;
+}
+
+// consumer side
+static size_t ring_get(
+        ring_t* ring,
+        uint8_t* data,
+        size_t size)
+{
+    size = HAL5_MIN(size, ring_used(ring));
+
+    // head is read before the data
+    __DMB();
+
+    const uint32_t offset = ring->tail & (HAL5_USB_CDC_ACM_RING_SIZE - 1);
+    const size_t first = HAL5_MIN(size, HAL5_USB_CDC_ACM_RING_SIZE - offset);
+
+    memcpy(data, &ring->data[offset], first);
+    memcpy(data + first, ring->data, size - first);
+
+    // the data is read before the space is released
+    __DMB();
+    ring->tail = ring->tail + size;
+
+    return size;
+}
+
+static ring_t tx_ring;
+static ring_t rx_ring;
+
+static uint8_t comm_interface;
+static uint8_t notification_endpoint;
+static uint8_t data_in_endpoint;
+static uint8_t data_out_endpoint;
+
+// set by the packet callbacks when they stop the stream
+// cleared by write/read when they start it again
+static volatile bool tx_stopped = true;
+static volatile bool rx_stopped = true;
+// true if the last IN packet was full, so a ZLP ends the transfer
+static bool tx_last_full = false;
+
+static const hal5_usb_cdc_acm_line_coding_t default_line_coding = 
+{
+    115200, 0, 0, 8
+};
+
+static hal5_usb_cdc_acm_line_coding_t line_coding;
+
+// SET_LINE_CODING data stage is received here
+static hal5_usb_cdc_acm_line_coding_t line_coding_received;
+
+static volatile uint16_t control_line_state = 0;
+
+static uint8_t notification[10];
+static volatile bool notification_busy = false;
+
+static hal5_usb_cdc_acm_stats_t stats;
+
+static hal5_usb_endpoint_t* get_endpoint(uint8_t bEndpointAddress)
+{
+    return hal5_usb_device_get_endpoint(
+            bEndpointAddress & 0xF, 
+            (bEndpointAddress & 0x80) != 0);
+}
+
+// space needed in RX ring to receive more
+// double buffered, one more packet can arrive after the stream is stopped
+static size_t rx_space_needed(hal5_usb_endpoint_t* ep)
+{
+    return ep->double_buffered ? (2 * ep->mps) : ep->mps;
+}
+
+// the next IN packet from TX ring
+static bool in_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    const size_t packet_size = ring_get(&tx_ring, data, *size);
+
+    if ((packet_size == 0) && !tx_last_full)
+    {
+        tx_stopped = true;
+        return false;
+    }
+
+    // if TX ring is empty after a full packet, this is a ZLP
+    tx_last_full = (packet_size == ep->mps);
+    stats.tx_bytes += packet_size;
+    *size = packet_size;
+
+    return true;
+}
+
+// the OUT packet to RX ring
+static bool out_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    // there is always space, the stream is stopped before
+    const size_t put = ring_put(&rx_ring, data, *size);
+    assert (put == *size);
+
+    stats.rx_bytes += put;
+
+    // stays stopped until read starts it again
+    if (rx_stopped) return false;
+
+    if (ring_free(&rx_ring) < rx_space_needed(ep))
+    {
+        stats.rx_throttles++;
+        rx_stopped = true;
+        return false;
+    }
+
+    return true;
+}
+
+// class requests, only for the communication interface
+
+static bool set_line_coding(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    if (request->wIndex != comm_interface) return false;
+    *data = &line_coding_received;
+    *data_size = sizeof(line_coding_received);
+    return true;
+}
+
+static bool set_line_coding_completed(
+        const hal5_usb_device_request_t* request,
+        size_t data_size)
+{
+    if (data_size != sizeof(line_coding_received)) return false;
+    line_coding = line_coding_received;
+    stats.line_coding_changes++;
+    return true;
+}
+
+static bool get_line_coding(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    if (request->wIndex != comm_interface) return false;
+    *data = &line_coding;
+    *data_size = sizeof(line_coding);
+    return true;
+}
+
+static bool set_control_line_state(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    if (request->wIndex != comm_interface) return false;
+    control_line_state = request->wValue & 
+        (HAL5_USB_CDC_CONTROL_LINE_DTR | HAL5_USB_CDC_CONTROL_LINE_RTS);
+    return true;
+}
+
+static bool send_break(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    if (request->wIndex != comm_interface) return false;
+    stats.breaks++;
+    return true;
+}
+
+bool hal5_usb_cdc_acm_initialize(
+        uint8_t comm_interface_,
+        uint8_t notification_endpoint_,
+        uint8_t data_in_endpoint_,
+        uint8_t data_out_endpoint_)
+{
+    assert (notification_endpoint_ & 0x80);
+    assert (data_in_endpoint_ & 0x80);
+    assert (!(data_out_endpoint_ & 0x80));
+
+    comm_interface = comm_interface_;
+    notification_endpoint = notification_endpoint_;
+    data_in_endpoint = data_in_endpoint_;
+    data_out_endpoint = data_out_endpoint_;
+
+    line_coding = default_line_coding;
+
+    bool ok = true;
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_CDC_SET_LINE_CODING, 
+            set_line_coding, set_line_coding_completed);
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_CDC_GET_LINE_CODING, 
+            get_line_coding, NULL);
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_CDC_SET_CONTROL_LINE_STATE, 
+            set_control_line_state, NULL);
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_CDC_SEND_BREAK, 
+            send_break, NULL);
+
+    ok = ok && hal5_usb_device_register_packet_callback(
+            data_in_endpoint, in_packet, NULL);
+
+    ok = ok && hal5_usb_device_register_packet_callback(
+            data_out_endpoint, out_packet, NULL);
+
+    return ok;
+}
+
+void hal5_usb_cdc_acm_start(void)
+{
+    tx_ring.head = 0;
+    tx_ring.tail = 0;
+    rx_ring.head = 0;
+    rx_ring.tail = 0;
+
+    tx_stopped = true;
+    tx_last_full = false;
+    rx_stopped = false;
+    notification_busy = false;
+    line_coding = default_line_coding;
+    control_line_state = 0;
+
+    memset(&stats, 0, sizeof(stats));
+
+    // IN is started by write
+    hal5_usb_device_start_stream(get_endpoint(data_out_endpoint));
+}
+
+size_t hal5_usb_cdc_acm_write(
+        const void* data,
+        size_t size)
+{
+    const size_t written = ring_put(&tx_ring, (const uint8_t*) data, size);
+
+    // the data is published before tx_stopped is checked
+    // if the stream is stopped after this, it has seen the data
+    __DMB();
+
+    if ((written > 0) && tx_stopped)
+    {
+        hal5_usb_endpoint_t* ep = get_endpoint(data_in_endpoint);
+
+        // not configured yet, it is sent when started
+        if (ep != NULL)
+        {
+            tx_stopped = false;
+            hal5_usb_device_start_stream(ep);
+        }
+    }
+
+    return written;
+}
+
+size_t hal5_usb_cdc_acm_read(
+        void* data,
+        size_t size)
+{
+    const size_t read = ring_get(&rx_ring, (uint8_t*) data, size);
+
+    // the stream is stopped and NAKs, so out_packet cannot run here
+    if (rx_stopped)
+    {
+        hal5_usb_endpoint_t* ep = get_endpoint(data_out_endpoint);
+
+        if ((ep != NULL) && (ring_free(&rx_ring) >= rx_space_needed(ep)))
+        {
+            rx_stopped = false;
+            hal5_usb_device_start_stream(ep);
+        }
+    }
+
+    return read;
+}
+
+size_t hal5_usb_cdc_acm_rx_available(void)
+{
+    return ring_used(&rx_ring);
+}
+
+size_t hal5_usb_cdc_acm_tx_free(void)
+{
+    return ring_free(&tx_ring);
+}
+
+void hal5_usb_cdc_acm_get_line_coding(
+        hal5_usb_cdc_acm_line_coding_t* line_coding_)
+{
+    *line_coding_ = line_coding;
+}
+
+uint16_t hal5_usb_cdc_acm_get_control_line_state(void)
+{
+    return control_line_state;
+}
+
+static void notification_completed(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer)
+{
+    notification_busy = false;
+}
+
+bool hal5_usb_cdc_acm_send_serial_state(uint16_t serial_state)
+{
+    hal5_usb_endpoint_t* ep = get_endpoint(notification_endpoint);
+
+    if ((ep == NULL) || notification_busy) return false;
+
+    // bmRequestType, bNotification, wValue, wIndex, wLength, data
+    notification[0] = 0xA1;
+    notification[1] = HAL5_USB_CDC_SERIAL_STATE;
+    notification[2] = 0;
+    notification[3] = 0;
+    notification[4] = comm_interface;
+    notification[5] = 0;
+    notification[6] = 2;
+    notification[7] = 0;
+    notification[8] = serial_state & 0xFF;
+    notification[9] = serial_state >> 8;
+
+    notification_busy = true;
+
+    if (!hal5_usb_device_submit(
+                ep, 
+                notification, 
+                sizeof(notification),
+                0,
+                notification_completed, 
+                NULL))
+    {
+        notification_busy = false;
+        return false;
+    }
+
+    return true;
+}
+
+void hal5_usb_cdc_acm_get_stats(hal5_usb_cdc_acm_stats_t* stats_)
+{
+    *stats_ = stats;
+}
@@ -0,0 +1,149 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// CDC-ACM (virtual COM port) class driver
+//
+// the descriptors are generated with cdc_acm.py (cdc_acm_interfaces)
+// class requests of the communication interface are handled through ep0:
+// SET_LINE_CODING, GET_LINE_CODING, SET_CONTROL_LINE_STATE, SEND_BREAK
+// the line coding and the control line state are only kept, there is no UART
+//
+// the data endpoints are used in streaming mode (packet callbacks), the
+// packets are filled from the TX ring and drained to the RX ring directly
+// in the interrupt handler, so the application only writes to and reads
+// from the rings (lock-free, single producer single consumer)
+// - IN: the stream stops when the TX ring is empty (after a ZLP if the
+//   last packet was full), hal5_usb_cdc_acm_write starts it again
+// - OUT: the stream stops (the endpoint NAKs) when there is no space for
+//   another packet in the RX ring, hal5_usb_cdc_acm_read starts it again
+//
+// write and read should be called from one context (e.g. the main loop),
+// or from hal5_usb_device_process_events's context in deferred mode
+
+#ifndef __HAL5_USB_CDC_ACM_H__
+#define __HAL5_USB_CDC_ACM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <stm32h5xx.h>
+
+// size of each of TX and RX rings, has to be a power of 2
+#ifndef HAL5_USB_CDC_ACM_RING_SIZE
+#define HAL5_USB_CDC_ACM_RING_SIZE  (2048)
+#endif
+
+// class requests
+#define HAL5_USB_CDC_SET_LINE_CODING            (0x20)
+#define HAL5_USB_CDC_GET_LINE_CODING            (0x21)
+#define HAL5_USB_CDC_SET_CONTROL_LINE_STATE     (0x22)
+#define HAL5_USB_CDC_SEND_BREAK                 (0x23)
+
+// notifications
+#define HAL5_USB_CDC_SERIAL_STATE               (0x20)
+
+// SET_CONTROL_LINE_STATE wValue
+#define HAL5_USB_CDC_CONTROL_LINE_DTR           (0x01)
+#define HAL5_USB_CDC_CONTROL_LINE_RTS           (0x02)
+
+// SERIAL_STATE bitmap
+#define HAL5_USB_CDC_SERIAL_STATE_DCD           (0x01)
+#define HAL5_USB_CDC_SERIAL_STATE_DSR           (0x02)
+#define HAL5_USB_CDC_SERIAL_STATE_BREAK         (0x04)
+#define HAL5_USB_CDC_SERIAL_STATE_RING          (0x08)
+#define HAL5_USB_CDC_SERIAL_STATE_FRAMING       (0x10)
+#define HAL5_USB_CDC_SERIAL_STATE_PARITY        (0x20)
+#define HAL5_USB_CDC_SERIAL_STATE_OVERRUN       (0x40)
+
+typedef __PACKED_STRUCT
+{
+    uint32_t dwDTERate;
+    // 0: 1 stop bit, 1: 1.5 stop bits, 2: 2 stop bits
+    uint8_t bCharFormat;
+    // 0: none, 1: odd, 2: even, 3: mark, 4: space
+    uint8_t bParityType;
+    // 5, 6, 7, 8 or 16
+    uint8_t bDataBits;
+} hal5_usb_cdc_acm_line_coding_t;
+
+typedef struct
+{
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    // times the OUT endpoint is stopped because the RX ring is full
+    uint32_t rx_throttles;
+    uint32_t line_coding_changes;
+    uint32_t breaks;
+} hal5_usb_cdc_acm_stats_t;
+
+// registers the class requests and the packet callbacks of the data
+// endpoints, call once before hal5_usb_device_connect
+// comm_interface is bInterfaceNumber of the communication interface
+// the endpoints are bEndpointAddress (e.g. 0x83, 0x81 and 0x02)
+// returns false if they cannot be registered
+bool hal5_usb_cdc_acm_initialize(
+        uint8_t comm_interface,
+        uint8_t notification_endpoint,
+        uint8_t data_in_endpoint,
+        uint8_t data_out_endpoint);
+
+// call from hal5_usb_device_set_configuration_ex when a configuration
+// with the CDC-ACM interfaces is set, the rings are emptied, the line
+// coding and the control line state are reset and the OUT endpoint is started
+void hal5_usb_cdc_acm_start(void);
+
+// copies up to size bytes to the TX ring, returns the number of bytes copied
+size_t hal5_usb_cdc_acm_write(
+        const void* data,
+        size_t size);
+
+// copies up to size bytes from the RX ring, returns the number of bytes copied
+size_t hal5_usb_cdc_acm_read(
+        void* data,
+        size_t size);
+
+// number of bytes that can be read
+size_t hal5_usb_cdc_acm_rx_available(void);
+
+// number of bytes that can be written
+size_t hal5_usb_cdc_acm_tx_free(void);
+
+// the last line coding set by the host (115200 8N1 by default)
+void hal5_usb_cdc_acm_get_line_coding(
+        hal5_usb_cdc_acm_line_coding_t* line_coding);
+
+// the last control line state set by the host, DTR and RTS bits
+uint16_t hal5_usb_cdc_acm_get_control_line_state(void);
+
+// sends SERIAL_STATE notification with the bitmap (SERIAL_STATE_ bits)
+// returns false if the previous notification is not sent yet
+bool hal5_usb_cdc_acm_send_serial_state(uint16_t serial_state);
+
+void hal5_usb_cdc_acm_get_stats(hal5_usb_cdc_acm_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
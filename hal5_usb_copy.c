@@ -0,0 +1,278 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// the unrolled kernels need load32 and store32 to be inlined to single 
+// LDR/STR, which needs -O1 or above, but the firmware is built with -O0 
+// where each of them would be a function call (and a libc memcpy call)
+// so this file is always optimized, -O2 is what the kernels are measured with
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__OPTIMIZE__)
+#pragma GCC optimize ("O2")
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal5_usb_copy.h"
+
+// USB is little endian and so is Cortex-M33 
+// bytes are packed to words in little endian order
+
+// Cortex-M33 (ARMv8-M Mainline) supports unaligned LDR/STR to normal memory
+// (main memory side), USB SRAM side is always word aligned
+#if defined(__ARM_ARCH_8M_MAIN__)
+#define HAL5_USB_COPY_UNROLLED
+#endif
+
+// a (possibly) unaligned word access
+// __builtin_memcpy of 4 bytes is compiled to a single LDR/STR when it is 
+// allowed, it is never a call to libc memcpy when optimized
+__attribute__((always_inline))
+static inline uint32_t load32(const uint8_t* p)
+{
+    uint32_t w;
+    __builtin_memcpy(&w, p, 4);
+    return w;
+}
+
+__attribute__((always_inline))
+static inline void store32(uint8_t* p, uint32_t w)
+{
+    __builtin_memcpy(p, &w, 4);
+}
+
+// the last 1-3 bytes, never read past src + len
+static inline uint32_t load_tail(const uint8_t* p, size_t len)
+{
+    uint32_t w = p[0];
+    if (len > 1) w |= ((uint32_t) p[1]) << 8;
+    if (len > 2) w |= ((uint32_t) p[2]) << 16;
+    return w;
+}
+
+// the last 1-3 bytes, never write past dst + len
+static inline void store_tail(uint8_t* p, uint32_t w, size_t len)
+{
+    p[0] = w;
+    if (len > 1) p[1] = w >> 8;
+    if (len > 2) p[2] = w >> 16;
+}
+
+void hal5_usb_copy_to_pma_portable(
+        volatile uint32_t* pma,
+        const void* src,
+        size_t len)
+{
+    const uint8_t* s = (const uint8_t*) src;
+
+    if ((((uintptr_t) s) & 0x3) == 0)
+    {
+        // aligned, word by word
+        const uint32_t* s32 = (const uint32_t*) s;
+        for (; len >= 4; len -= 4)
+        {
+            *pma++ = *s32++;
+        }
+        s = (const uint8_t*) s32;
+    }
+    else
+    {
+        // unaligned, words are assembled from bytes
+        for (; len >= 4; len -= 4, s += 4)
+        {
+            *pma++ = 
+                ((uint32_t) s[0]) | 
+                (((uint32_t) s[1]) << 8) |
+                (((uint32_t) s[2]) << 16) | 
+                (((uint32_t) s[3]) << 24);
+        }
+    }
+
+    if (len > 0)
+    {
+        *pma = load_tail(s, len);
+    }
+}
+
+void hal5_usb_copy_from_pma_portable(
+        void* dst,
+        const volatile uint32_t* pma,
+        size_t len)
+{
+    uint8_t* d = (uint8_t*) dst;
+
+    if ((((uintptr_t) d) & 0x3) == 0)
+    {
+        uint32_t* d32 = (uint32_t*) d;
+        for (; len >= 4; len -= 4)
+        {
+            *d32++ = *pma++;
+        }
+        d = (uint8_t*) d32;
+    }
+    else
+    {
+        for (; len >= 4; len -= 4, d += 4)
+        {
+            const uint32_t w = *pma++;
+            d[0] = w;
+            d[1] = w >> 8;
+            d[2] = w >> 16;
+            d[3] = w >> 24;
+        }
+    }
+
+    if (len > 0)
+    {
+        store_tail(d, *pma, len);
+    }
+}
+
+// 8 words (32 bytes) at a time, then 4 words, then words, then the tail
+// USB SRAM is accessed in the same order as the portable version
+
+void hal5_usb_copy_to_pma_unrolled(
+        volatile uint32_t* pma,
+        const void* src,
+        size_t len)
+{
+    const uint8_t* s = (const uint8_t*) src;
+
+    for (; len >= 32; len -= 32, s += 32, pma += 8)
+    {
+        const uint32_t w0 = load32(s);
+        const uint32_t w1 = load32(s + 4);
+        const uint32_t w2 = load32(s + 8);
+        const uint32_t w3 = load32(s + 12);
+        const uint32_t w4 = load32(s + 16);
+        const uint32_t w5 = load32(s + 20);
+        const uint32_t w6 = load32(s + 24);
+        const uint32_t w7 = load32(s + 28);
+        pma[0] = w0;
+        pma[1] = w1;
+        pma[2] = w2;
+        pma[3] = w3;
+        pma[4] = w4;
+        pma[5] = w5;
+        pma[6] = w6;
+        pma[7] = w7;
+    }
+
+    if (len >= 16)
+    {
+        const uint32_t w0 = load32(s);
+        const uint32_t w1 = load32(s + 4);
+        const uint32_t w2 = load32(s + 8);
+        const uint32_t w3 = load32(s + 12);
+        pma[0] = w0;
+        pma[1] = w1;
+        pma[2] = w2;
+        pma[3] = w3;
+        len -= 16;
+        s += 16;
+        pma += 4;
+    }
+
+    for (; len >= 4; len -= 4, s += 4)
+    {
+        *pma++ = load32(s);
+    }
+
+    if (len > 0)
+    {
+        *pma = load_tail(s, len);
+    }
+}
+
+void hal5_usb_copy_from_pma_unrolled(
+        void* dst,
+        const volatile uint32_t* pma,
+        size_t len)
+{
+    uint8_t* d = (uint8_t*) dst;
+
+    for (; len >= 32; len -= 32, d += 32, pma += 8)
+    {
+        const uint32_t w0 = pma[0];
+        const uint32_t w1 = pma[1];
+        const uint32_t w2 = pma[2];
+        const uint32_t w3 = pma[3];
+        const uint32_t w4 = pma[4];
+        const uint32_t w5 = pma[5];
+        const uint32_t w6 = pma[6];
+        const uint32_t w7 = pma[7];
+        store32(d, w0);
+        store32(d + 4, w1);
+        store32(d + 8, w2);
+        store32(d + 12, w3);
+        store32(d + 16, w4);
+        store32(d + 20, w5);
+        store32(d + 24, w6);
+        store32(d + 28, w7);
+    }
+
+    if (len >= 16)
+    {
+        const uint32_t w0 = pma[0];
+        const uint32_t w1 = pma[1];
+        const uint32_t w2 = pma[2];
+        const uint32_t w3 = pma[3];
+        store32(d, w0);
+        store32(d + 4, w1);
+        store32(d + 8, w2);
+        store32(d + 12, w3);
+        len -= 16;
+        d += 16;
+        pma += 4;
+    }
+
+    for (; len >= 4; len -= 4, d += 4)
+    {
+        store32(d, *pma++);
+    }
+
+    if (len > 0)
+    {
+        store_tail(d, *pma, len);
+    }
+}
+
+void hal5_usb_copy_to_pma(
+        volatile uint32_t* pma,
+        const void* src,
+        size_t len)
+{
+#ifdef HAL5_USB_COPY_UNROLLED
+    hal5_usb_copy_to_pma_unrolled(pma, src, len);
+#else
+    hal5_usb_copy_to_pma_portable(pma, src, len);
+#endif
+}
+
+void hal5_usb_copy_from_pma(
+        void* dst,
+        const volatile uint32_t* pma,
+        size_t len)
+{
+#ifdef HAL5_USB_COPY_UNROLLED
+    hal5_usb_copy_from_pma_unrolled(dst, pma, len);
+#else
+    hal5_usb_copy_from_pma_portable(dst, pma, len);
+#endif
+}
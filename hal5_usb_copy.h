@@ -0,0 +1,80 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HAL5_USB_COPY_H__
+#define __HAL5_USB_COPY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// USB SRAM (PMA) can only be accessed with words
+// so memcpy cannot be used to copy to or from USB SRAM
+// the functions below copy bytes between main memory (any alignment) 
+// and USB SRAM (word aligned) in a single pass
+//
+// to_pma may write up to 3 bytes more than len (the rest of the last word)
+// from_pma never writes more than len bytes to dst
+
+void hal5_usb_copy_to_pma(
+        volatile uint32_t* pma,
+        const void* src,
+        size_t len);
+
+void hal5_usb_copy_from_pma(
+        void* dst,
+        const volatile uint32_t* pma,
+        size_t len);
+
+// the implementations used by the functions above
+// unrolled is the default on Cortex-M33 (it supports unaligned LDR/STR)
+// portable is the default elsewhere (only word aligned accesses)
+// hal5_usb_copy.c is always compiled with -O2 (GCC), the unrolled kernels
+// are slower than the portable ones without optimization
+// these are exposed only for the benchmarks
+
+void hal5_usb_copy_to_pma_portable(
+        volatile uint32_t* pma,
+        const void* src,
+        size_t len);
+
+void hal5_usb_copy_from_pma_portable(
+        void* dst,
+        const volatile uint32_t* pma,
+        size_t len);
+
+void hal5_usb_copy_to_pma_unrolled(
+        volatile uint32_t* pma,
+        const void* src,
+        size_t len);
+
+void hal5_usb_copy_from_pma_unrolled(
+        void* dst,
+        const volatile uint32_t* pma,
+        size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
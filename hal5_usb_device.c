@@ -29,12 +29,20 @@
 
 #include "hal5.h"
 #include "hal5_usb_device.h"
+#include "hal5_usb_pma.h"
+#include "hal5_usb_profile.h"
+#include "hal5_usb_trace.h"
+
+#define HAL5_USB_LOG_MODULE_LEVEL HAL5_USB_DEVICE_LOG_LEVEL
+#include "hal5_usb_log.h"
 
 
 // endpoint number, endpoint direction 0=in, 1=out
 hal5_usb_endpoint_t* endpoints[8][2] = {NULL};
 
 static hal5_usb_device_state_t usb_device_state;
+
+static hal5_usb_device_stats_t device_stats;
 static uint8_t usb_device_configuration_value = 0;
 
 // USB (visible) DEVICE STATES
@@ -55,14 +63,22 @@ static uint8_t usb_device_configuration_value = 0;
 // the diagram does not say but set address says if address 0 is given, it goes back to default
 // a bus reset returns it to default
 
-static void recreate_endpoints_for_configuration(
-        const hal5_usb_configuration_descriptor_t* cd)
+static bool is_endpoint_double_buffered(
+        uint8_t configuration_index,
+        uint8_t endp)
 {
-    assert (cd != NULL);
+    // optional, not generated for old descriptors
+    if (hal5_usb_double_buffered_endpoints == NULL) return false;
+
+    return (hal5_usb_double_buffered_endpoints[configuration_index] >> endp) & 0x1;
+}
+
+// frees the endpoints (and their buffers in USB SRAM) other than endpoint 0
+static void free_endpoints(void)
+{
+    // there is no isochronous endpoint anymore, see create_endpoint
+    CLEAR_BIT(USB_DRD_FS->CNTR, USB_CNTR_SOFM | USB_CNTR_ESOFM);
 
-    // this is called from Set Configuration
-    // so there can be different configurations = different endpoints
-    // all existing endpoints other than 0 should be cleared first
     // clear the buffer descriptors
     memset(USB_SRAM+8, 0, 7*8);
     // free/remove endpoint pointers
@@ -73,11 +89,135 @@ static void recreate_endpoints_for_configuration(
         endpoints[i][0] = NULL;
         endpoints[i][1] = NULL;
     }
+}
+
+// registered stage completed callbacks, [endp][0=IN, 1=OUT] like endpoints
+typedef struct
+{
+    hal5_usb_ep_stage_completed_t callback;
+    void* context;
+    hal5_usb_ep_packet_t packet;
+    void* packet_context;
+} endpoint_callback_t;
+
+static endpoint_callback_t endpoint_callbacks[8][2] = {0};
+
+bool hal5_usb_device_register_endpoint_callback(
+        uint8_t bEndpointAddress,
+        hal5_usb_ep_stage_completed_t callback,
+        void* context)
+{
+    const uint8_t endp = bEndpointAddress & 0xF;
+    const uint8_t dir = (bEndpointAddress & 0x80) ? 0 : 1;
+
+    if ((endp == 0) || (endp >= 8)) return false;
+
+    endpoint_callbacks[endp][dir].callback = callback;
+    endpoint_callbacks[endp][dir].context = context;
+
+    hal5_usb_endpoint_t* ep = endpoints[endp][dir];
+
+    if (ep != NULL)
+    {
+        ep->stage_completed = callback;
+        ep->stage_completed_context = context;
+    }
+
+    return true;
+}
+
+bool hal5_usb_device_register_packet_callback(
+        uint8_t bEndpointAddress,
+        hal5_usb_ep_packet_t packet,
+        void* context)
+{
+    const uint8_t endp = bEndpointAddress & 0xF;
+    const uint8_t dir = (bEndpointAddress & 0x80) ? 0 : 1;
+
+    if ((endp == 0) || (endp >= 8)) return false;
+
+    endpoint_callbacks[endp][dir].packet = packet;
+    endpoint_callbacks[endp][dir].packet_context = context;
+
+    hal5_usb_endpoint_t* ep = endpoints[endp][dir];
+
+    if (ep != NULL)
+    {
+        ep->packet = packet;
+        ep->packet_context = context;
+    }
+
+    return true;
+}
+
+static hal5_usb_endpoint_t* create_endpoint(
+        const hal5_usb_endpoint_descriptor_t* ed,
+        bool double_buffered,
+        const hal5_usb_pma_layout_entry_t* layout)
+{
+    assert (ed != NULL);
+
+    const uint8_t endp = ed->bEndpointAddress & 0xF;
+    const uint8_t dir = (ed->bEndpointAddress & 0x80) ? 0 : 1;
+
+    assert (endp != 0);
+
+    // free the existing one first, so its buffers can be reused
+    hal5_usb_ep_free(endpoints[endp][dir]);
+    endpoints[endp][dir] = NULL;
+
+    hal5_usb_endpoint_t* ep = hal5_usb_ep_create(
+            ed, 
+            0,
+            double_buffered,
+            layout);
+
+    ep->stage_completed = endpoint_callbacks[endp][dir].callback;
+    ep->stage_completed_context = endpoint_callbacks[endp][dir].context;
+    ep->packet = endpoint_callbacks[endp][dir].packet;
+    ep->packet_context = endpoint_callbacks[endp][dir].packet_context;
+
+    endpoints[endp][dir] = ep;
+
+    // the buffers of isochronous endpoints are exchanged at SOF
+    // the interrupts are requested only then, so a device without them is 
+    // not interrupted every frame
+    if (ep->utype == ep_utype_iso)
+    {
+        SET_BIT(USB_DRD_FS->CNTR, USB_CNTR_SOFM | USB_CNTR_ESOFM);
+    }
+
+    return ep;
+}
+
+hal5_usb_endpoint_t* hal5_usb_device_create_endpoint(
+        const hal5_usb_endpoint_descriptor_t* ed,
+        bool double_buffered)
+{
+    return create_endpoint(ed, double_buffered, NULL);
+}
+
+static void recreate_endpoints_for_configuration(
+        const hal5_usb_configuration_descriptor_t* cd,
+        uint8_t configuration_index)
+{
+    assert (cd != NULL);
+
+    // this is called from Set Configuration
+    // so there can be different configurations = different endpoints
+    // all existing endpoints other than 0 should be cleared first
+    free_endpoints();
+
+    // optional, not generated for old descriptors
+    // buffers are allocated if there is no layout
+    const hal5_usb_pma_layout_t* layout = 
+        (hal5_usb_pma_layouts != NULL) ? 
+        &hal5_usb_pma_layouts[configuration_index] : NULL;
 
-    // start from where endpoint 0 ends
-    uint32_t next_bd_addr = endpoints[0][0]->rxbd->addr;
+    uint8_t layout_index = 0;
 
     // reinitialize new ones according to descriptors
+    // buffers are placed to USB SRAM freed above
     for (uint8_t ii = 0; ii < cd->bNumInterfaces; ii++)
     {
         const hal5_usb_interface_descriptor_t* id = 
@@ -88,21 +228,33 @@ static void recreate_endpoints_for_configuration(
             const hal5_usb_endpoint_descriptor_t* ed = 
                 id->endpoints[ei];
 
-            // word align the addr if needed
-            next_bd_addr = next_bd_addr + (next_bd_addr & 0x3);
+            const bool double_buffered = is_endpoint_double_buffered(
+                    configuration_index,
+                    ed->bEndpointAddress & 0xF);
 
-            hal5_usb_endpoint_t* ep = hal5_usb_ep_create(
-                    ed, 
-                    0,
-                    next_bd_addr);
-
-            endpoints[ep->endp][ep->dir_in ? 0 : 1] = ep;
-
-            next_bd_addr += ed->wMaxPacketSize;
+            if (layout != NULL)
+            {
+                assert (layout_index < layout->number_of_entries);
 
+                create_endpoint(
+                        ed, 
+                        double_buffered, 
+                        &layout->entries[layout_index++]);
+            }
+            else
+            {
+                create_endpoint(ed, double_buffered, NULL);
+            }
         }
     }
 
+    hal5_usb_pma_status_t pma_status;
+    hal5_usb_pma_get_status(&pma_status);
+
+    USB_INFO("USB SRAM free: %u bytes in %u regions (largest %u)\n",
+            pma_status.free,
+            pma_status.free_regions,
+            pma_status.largest_free);
 }
 
 void hal5_usb_device_set_address(uint8_t address)
@@ -163,9 +315,11 @@ static bool hal5_usb_device_try_changing_configuration(uint8_t configuration_val
 
         if (configuration_value == cd->bConfigurationValue)
         {
-            hal5_usb_device_set_configuration_ex(configuration_value);
             usb_device_configuration_value = configuration_value;
-            recreate_endpoints_for_configuration(cd);
+            recreate_endpoints_for_configuration(cd, i);
+            // after the endpoints are created, so they can be started
+            HAL5_USB_PROFILE_CALLBACK(
+                    hal5_usb_device_set_configuration_ex(configuration_value));
             return true;
         }
     }
@@ -188,7 +342,8 @@ bool hal5_usb_device_set_configuration_value(uint8_t configuration_value)
         else
         {
             // change back to address state
-            hal5_usb_device_set_configuration_ex(0);
+            HAL5_USB_PROFILE_CALLBACK(
+                    hal5_usb_device_set_configuration_ex(0));
             usb_device_configuration_value = 0;
             usb_device_state = usb_device_state_address;
             return true;
@@ -228,6 +383,231 @@ hal5_usb_device_state_t hal5_usb_device_get_state()
     return usb_device_state;
 }
 
+const hal5_usb_device_stats_t* hal5_usb_device_get_stats(void)
+{
+    return &device_stats;
+}
+
+void hal5_usb_device_clear_stats(void)
+{
+    memset(&device_stats, 0, sizeof(device_stats));
+
+    for (uint8_t endp = 0; endp < 8; endp++)
+    {
+        for (uint8_t dir = 0; dir < 2; dir++)
+        {
+            hal5_usb_endpoint_t* ep = endpoints[endp][dir];
+            if (ep != NULL) memset(&ep->stats, 0, sizeof(ep->stats));
+        }
+    }
+}
+
+// copied at the request, it has to stay valid until the data stage is completed
+static union
+{
+    hal5_usb_device_stats_t device;
+    hal5_usb_ep_stats_t ep;
+} stats_reply;
+
+static bool stats_vendor_request(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    if ((request->bmRequestType & 0x1F) == request_recipient_device)
+    {
+        stats_reply.device = device_stats;
+        *data_size = sizeof(stats_reply.device);
+    }
+    else
+    {
+        const uint8_t endp = request->wIndex & 0xF;
+        const bool dir_in = request->wIndex & 0x80;
+
+        if ((request->wIndex & 0xFF78) != 0) return false;
+
+        const hal5_usb_endpoint_t* ep = hal5_usb_device_get_endpoint(
+                endp, 
+                dir_in);
+
+        if (ep == NULL) return false;
+
+        stats_reply.ep = ep->stats;
+        *data_size = sizeof(stats_reply.ep);
+    }
+
+    *data = &stats_reply;
+
+    return true;
+}
+
+bool hal5_usb_device_register_stats_vendor_request(uint8_t bRequest)
+{
+    return hal5_usb_device_register_request_handler(
+                request_type_vendor,
+                request_recipient_device,
+                bRequest,
+                stats_vendor_request,
+                NULL) &&
+        hal5_usb_device_register_request_handler(
+                request_type_vendor,
+                request_recipient_endpoint,
+                bRequest,
+                stats_vendor_request,
+                NULL);
+}
+
+static void count_rx_packet(
+        hal5_usb_endpoint_t* ep,
+        const size_t packet_size,
+        const bool setup)
+{
+    ep->stats.rx_packets++;
+    ep->stats.rx_bytes += packet_size;
+
+    if (setup) ep->stats.setup_packets++;
+    else if (packet_size < ep->mps) ep->stats.rx_short_packets++;
+}
+
+static void count_tx_packet(
+        hal5_usb_endpoint_t* ep,
+        const size_t packet_size)
+{
+    ep->stats.tx_packets++;
+    ep->stats.tx_bytes += packet_size;
+
+    if (packet_size == 0) ep->stats.tx_zlps++;
+}
+
+// SUBMITTED TRANSFERS
+// see hal5_usb_device_submit
+
+// prepares the transfer at the head of the queue
+// the caller syncs CHEPnR (and copies the first IN packet)
+static void prepare_transfer(
+        hal5_usb_endpoint_t* ep)
+{
+    const hal5_usb_transfer_t* transfer = &ep->transfers[ep->transfers_head];
+
+    if (ep->dir_in)
+    {
+        hal5_usb_ep_prepare_for_in_ref(
+                ep,
+                ep_status_disabled,
+                transfer->buffer,
+                transfer->length,
+                (transfer->flags & transfer_flag_no_zlp) != 0,
+                transfer->length);
+
+        // the first packet is the ZLP, it is not sent again
+        if (transfer->length == 0) ep->tx_zlp_sent = true;
+    }
+    else
+    {
+        hal5_usb_ep_prepare_for_out_buffer(
+                ep,
+                ep_status_disabled,
+                transfer->buffer,
+                transfer->length);
+    }
+}
+
+// ENDPOINT HALT
+// see hal5_usb_device_set_endpoint_halt
+
+// sets STAT of the endpoint direction, STALL if halted, otherwise NAK
+// (VALID for double buffered IN, the hardware waits for the buffers then)
+// the caller syncs CHEPnR
+static void set_halt_status(
+        hal5_usb_endpoint_t* ep)
+{
+    usb_ep_status_t status = ep_status_nak;
+
+    if (ep->halted) status = ep_status_stall;
+    else if (ep->double_buffered && ep->dir_in) status = ep_status_valid;
+
+    if (ep->dir_in)
+    {
+        hal5_usb_ep_set_status(ep, ep_status_disabled, status);
+    }
+    else
+    {
+        hal5_usb_ep_set_status(ep, status, ep_status_disabled);
+    }
+}
+
+// the next packet is DATA0
+// for double buffered endpoints, SW_BUF is set as when it is initialized
+// (see hal5_usb_ep_initialize_double_buffer)
+static void reset_data_toggle(
+        hal5_usb_endpoint_t* ep)
+{
+    if (ep->dir_in)
+    {
+        ep->chep2sync->dtogtx = ep->chep->dtogtx;
+
+        if (ep->double_buffered)
+        {
+            ep->chep2sync->dtogrx = ep->chep->dtogrx;
+            ep->tx_buffers_filled = 0;
+        }
+    }
+    else
+    {
+        ep->chep2sync->dtogrx = ep->chep->dtogrx;
+
+        if (ep->double_buffered)
+        {
+            ep->chep2sync->dtogtx = !ep->chep->dtogtx;
+        }
+    }
+}
+
+// called when the stage of the transfer at the head is completed
+// the next one is prepared here, so it starts when the interrupt returns
+static void transfer_completed(
+        hal5_usb_endpoint_t* ep)
+{
+    // a copy, the entry can be reused by a submit in the callback
+    hal5_usb_transfer_t transfer = ep->transfers[ep->transfers_head];
+
+    if (ep->dir_in)
+    {
+        transfer.actual_length = ep->tx_sent;
+        transfer.overflow = false;
+    }
+    else
+    {
+        transfer.actual_length = ep->rx_received;
+        transfer.overflow = ep->rx_overflow;
+    }
+
+    ep->transfers_head = (ep->transfers_head + 1) % 
+        HAL5_USB_TRANSFER_QUEUE_SIZE;
+    ep->transfers_count--;
+
+    if (transfer.completed != NULL)
+    {
+        ep->transfer_completing = true;
+        HAL5_USB_PROFILE_CALLBACK(transfer.completed(ep, &transfer));
+        ep->transfer_completing = false;
+    }
+
+    if (ep->halted)
+    {
+        // halted in the callback
+        // the next transfer is started when the halt is cleared
+        // CHEPnR of double buffered endpoints is not synced by the handler
+        if (ep->double_buffered) hal5_usb_ep_sync_from_reg(ep);
+        set_halt_status(ep);
+        if (ep->double_buffered) hal5_usb_ep_sync_to_reg(ep);
+    }
+    else if (ep->transfers_count > 0)
+    {
+        prepare_transfer(ep);
+    }
+}
+
 static void hal5_usb_device_out_stage_completed(
         hal5_usb_endpoint_t* ep)
 {
@@ -235,9 +615,18 @@ static void hal5_usb_device_out_stage_completed(
     {
         hal5_usb_device_out_stage_completed_ep0(ep);
     } 
+    else if (ep->transfers_count > 0)
+    {
+        transfer_completed(ep);
+    }
+    else if (ep->stage_completed != NULL)
+    {
+        HAL5_USB_PROFILE_CALLBACK(
+                ep->stage_completed(ep, ep->stage_completed_context));
+    }
     else
     {
-        hal5_usb_device_out_stage_completed_ex(ep);
+        HAL5_USB_PROFILE_CALLBACK(hal5_usb_device_out_stage_completed_ex(ep));
     }
 }
 
@@ -248,15 +637,24 @@ static void hal5_usb_device_in_stage_completed(
     {
         hal5_usb_device_in_stage_completed_ep0(ep);
     } 
+    else if (ep->transfers_count > 0)
+    {
+        transfer_completed(ep);
+    }
+    else if (ep->stage_completed != NULL)
+    {
+        HAL5_USB_PROFILE_CALLBACK(
+                ep->stage_completed(ep, ep->stage_completed_context));
+    }
     else
     {
-        hal5_usb_device_in_stage_completed_ex(ep);
+        HAL5_USB_PROFILE_CALLBACK(hal5_usb_device_in_stage_completed_ex(ep));
     }
 }
 
 static void hal5_usb_device_reset(void)
 {
-    CONSOLE("usb device reset\n");
+    USB_INFO("usb device reset\n");
 
     // probably not needed but clear the USB memory anyway
     memset(USB_SRAM, 0, 2048);
@@ -273,7 +671,7 @@ static void hal5_usb_device_reset(void)
     // this sets RST_DCONM/RESET
     // rx/tx stopped until RST_DCONM/RESET is cleared
     USB_DRD_FS->CNTR    = 0x00000001;
-    USB_DRD_FS->ISTR    = 0;
+    HAL5_USB_WRITE_ISTR(0);
     USB_DRD_FS->BCDR    = 0;
     USB_DRD_FS->DADDR   = 0;
 
@@ -301,6 +699,8 @@ static void hal5_usb_device_reset(void)
     SET_BIT(USB_DRD_FS->CNTR, USB_CNTR_WKUPM);
     // request error interrupt
     SET_BIT(USB_DRD_FS->CNTR, USB_CNTR_ERRM);
+    // SOF and ESOF interrupts are not requested here but when an 
+    // isochronous endpoint is created (see create_endpoint)
 
     // enable (device) function (EF), address is 0
     USB_DRD_FS->DADDR = USB_DADDR_EF;
@@ -323,14 +723,79 @@ static void usb_device_setup_transaction_completed(
     hal5_usb_device_setup_transaction_completed_ep0(ep);
 }
 
+// STREAMING
+// see hal5_usb_device_register_packet_callback
+// the packets are not combined into stages, each packet is handed over to
+// or taken from the packet callback through rx_data/tx_data
+
+// hands over the OUT packet received to rx_data
+// returns false if the stream is stopped
+static bool stream_out_packet(
+        hal5_usb_endpoint_t* ep)
+{
+    size_t size = ep->rx_received;
+    bool more;
+
+    HAL5_USB_PROFILE_CALLBACK(
+            more = ep->packet(ep, ep->rx_target, &size, ep->packet_context));
+
+    // the next packet is received to the start of rx_data again
+    ep->rx_received = 0;
+    ep->stream_started = more;
+
+    return more;
+}
+
+// takes the next IN packet to tx_data and prepares the endpoint to send it
+// returns false if the stream is stopped
+static bool stream_next_in_packet(
+        hal5_usb_endpoint_t* ep)
+{
+    if (!ep->stream_started) return false;
+
+    size_t size = ep->mps;
+    bool more;
+
+    HAL5_USB_PROFILE_CALLBACK(
+            more = ep->packet(ep, ep->tx_data, &size, ep->packet_context));
+
+    ep->stream_started = more;
+
+    if (more)
+    {
+        assert (size <= ep->mps);
+
+        hal5_usb_ep_prepare_for_in(
+                ep,
+                ep_status_disabled,
+                NULL,
+                size,
+                false,
+                0);
+    }
+
+    return more;
+}
+
 static void usb_device_out_transaction_completed(
         hal5_usb_endpoint_t* ep)
 {
-    if (ep->rxbd->count < ep->mps)
+    if (ep->packet != NULL)
+    {
+        // NAK until the stream is started again
+        hal5_usb_ep_set_status(
+                ep, 
+                stream_out_packet(ep) ? ep_status_valid : ep_status_nak,
+                ep->tx_status);
+        return;
+    }
+
+    if (hal5_usb_ep_is_out_stage_completed(ep, ep->rxbd->count))
     {
         // done
         // if a less than packet size data arrives
         // it means data stage is terminated
+        // it is also terminated if there is no space left in rx_target
 
         if ((ep->endp == 0) &&
                 (hal5_usb_device_ep0_get_standard_request() != 
@@ -340,6 +805,8 @@ static void usb_device_out_transaction_completed(
         }
         else
         {
+            // NAK until the endpoint is prepared again in the callback
+            hal5_usb_ep_set_status(ep, ep_status_nak, ep->tx_status);
             hal5_usb_device_out_stage_completed(ep);
         }
     }
@@ -363,6 +830,13 @@ static void usb_device_in_transaction_completed(
         done,
     } action;
 
+    if (ep->packet != NULL)
+    {
+        // the endpoint NAKs if there is no next packet
+        stream_next_in_packet(ep);
+        return;
+    }
+
     if (ep->tx_sent < ep->tx_sent_limit)
     {
         action = send_more;
@@ -399,7 +873,7 @@ static void usb_device_in_transaction_completed(
     {
         case send_more:
             {
-                CONSOLE("send_more\n");
+                USB_TRACE("send_more\n");
                 hal5_usb_ep_set_status(
                         ep,
                         ep_status_stall,
@@ -413,7 +887,7 @@ static void usb_device_in_transaction_completed(
                 // since no data is left, it sends zero data 
                 // but tx_zlp_sent flag is set below 
                 //   so ZLP is sent only once
-                CONSOLE("send_zlp\n");
+                USB_TRACE("send_zlp\n");
                 ep->tx_zlp_sent = true;
                 hal5_usb_ep_set_status(
                         ep,
@@ -425,7 +899,7 @@ static void usb_device_in_transaction_completed(
 
         case done:
             {
-                CONSOLE("done\n");
+                USB_TRACE("done\n");
                 hal5_usb_device_in_stage_completed(ep);
             }
             break;
@@ -435,10 +909,15 @@ static void usb_device_in_transaction_completed(
 static void hal5_usb_device_transaction_completed(
         hal5_usb_endpoint_t* ep)
 {
+    HAL5_USB_TRACE_TRANSACTION_BEGIN(ep);
+
     if (ep->chep->vtrx) 
     {
         // reset so the interrupt is not raised again
+        // in deferred mode it is already cleared when the event is queued
+#if !HAL5_USB_DEFERRED_ENABLED
         hal5_usb_ep_clear_vtrx(ep);
+#endif
 
         // SETUP or OUT transaction is completed 
         // from host to device
@@ -446,14 +925,14 @@ static void hal5_usb_device_transaction_completed(
         
         if (ep->chep->setup) 
         {
-            CONSOLE("SETUP");
+            USB_TRACE("SETUP");
         }
         else
         {
-            CONSOLE("OUT");
+            USB_TRACE("OUT");
         }
         
-        CONSOLE(" (%u, %u, %u)\n", 
+        USB_TRACE(" (%u, %u, %u)\n", 
                 ep->mps,
                 ep->rxbd->count,
                 ep->rx_received);
@@ -471,9 +950,12 @@ static void hal5_usb_device_transaction_completed(
     else if (ep->chep->vttx) 
     {
         // reset so the interrupt is not raised again
+        // in deferred mode it is already cleared when the event is queued
+#if !HAL5_USB_DEFERRED_ENABLED
         hal5_usb_ep_clear_vttx(ep);
+#endif
 
-        CONSOLE("IN (%u, %u, %u/%u)\n", 
+        USB_TRACE("IN (%u, %u, %u/%u)\n", 
                 ep->mps,
                 ep->txbd->count,
                 ep->tx_sent,
@@ -485,87 +967,701 @@ static void hal5_usb_device_transaction_completed(
     {
         // SETUP, OUT or IN transaction is not completed, not ACKed
         // so either a NAK or STALL received
-        CONSOLE("usb_transaction_error: 0x%08lX\n", 
+        USB_ERROR("usb_transaction_error: 0x%08lX\n", 
                 ep->istr->v);
         assert (false);
     }
+
+    HAL5_USB_TRACE_TRANSACTION_END(ep);
 }
 
-static void hal5_usb_device_bus_error(void)
+// DOUBLE BUFFERED ENDPOINTS
+// see the comments in hal5_usb.c for how DBL_BUF works
+// CHEPnR is not synced at the end of the interrupt handler for these
+// the buffers are released and CTR is cleared with immediate writes
+
+// true if there is a packet (data or ZLP) not copied to USB SRAM yet
+static bool double_buffer_has_more_to_copy(
+        hal5_usb_endpoint_t* ep)
 {
-    CONSOLE("usb_bus_error\n");
+    if (ep->tx_copied < ep->tx_sent_limit) return true;
+
+    // all data is copied but maybe ZLP is needed
+    const bool zlp_needed = 
+        ((ep->tx_sent_limit % ep->mps) == 0) &&
+        (!ep->tx_expected_valid || (ep->tx_sent_limit < ep->tx_expected));
+
+    return zlp_needed && !ep->tx_zlp_copied;
 }
 
-static void hal5_usb_device_bus_reset(void)
+// fills the buffer used by the software and releases it to the hardware
+// as long as there is data to send and a buffer is available
+// clear_ctr (VTTX) is combined with the first release
+static void double_buffer_fill(
+        hal5_usb_endpoint_t* ep,
+        bool clear_ctr)
 {
-    CONSOLE("usb_bus_reset\n");
+    while (true)
+    {
+        // DTOG_TX == SW_BUF, hardware waits for the software buffer
+        const bool hardware_waiting = (ep->chep->dtogtx == ep->chep->dtogrx);
 
-    // USB BUS RESET does not happen only once before setup
-    // it also happens before setting the address during setup
+        // if the hardware is not waiting, it has a filled buffer
+        // so the software buffer is filled only if both are filled
+        const bool software_buffer_filled = hardware_waiting ?
+            (ep->tx_buffers_filled == 1) :
+            (ep->tx_buffers_filled == 2);
 
-    switch (usb_device_state)
-    {
-        case usb_device_state_default: 
-            break;
+        if (hardware_waiting && software_buffer_filled)
+        {
+            hal5_usb_ep_double_buffer_update(ep, clear_ctr, true);
+            clear_ctr = false;
+        }
+        else if (!software_buffer_filled && 
+                ((ep->packet != NULL) ? 
+                 stream_next_in_packet(ep) :
+                 double_buffer_has_more_to_copy(ep)))
+        {
+            // SW_BUF (DTOG_RX) is the buffer used by the software
+            const size_t tx_count = hal5_usb_device_copy_to_double_buffer(
+                    ep, 
+                    ep->chep->dtogrx);
 
-        case usb_device_state_address:
-        case usb_device_state_configured:
-            // after the first enumeration
-            // windows start a second enumeration with a bus reset
-            // so device should continue functioning
-            // but naturally with address=0 at default state
-            // more info here: https://techcommunity.microsoft.com/t5/microsoft-usb-blog/how-does-usb-stack-enumerate-a-device/ba-p/270685
-            usb_device_state = usb_device_state_default;
-            USB_DRD_FS->DADDR = USB_DADDR_EF;
+            if (tx_count == 0) ep->tx_zlp_copied = true;
+
+            ep->tx_buffers_filled++;
+        }
+        else
+        {
             break;
+        }
     }
 
-    // endpoint 0 is a control endpoint
-    // so it works in both directions
-    // free in case it is allocated before
-    hal5_usb_ep_free(endpoints[0][0]);
-    hal5_usb_ep_free(endpoints[0][1]);
-    // next_bd_addr=64 because the first 64 bytes are buffer descriptor table
-    hal5_usb_endpoint_t* ep = hal5_usb_ep_create(
-            NULL,
-            hal5_usb_device_descriptor->bMaxPacketSize0,
-            64);
+    if (clear_ctr)
+    {
+        hal5_usb_ep_double_buffer_update(ep, true, false);
+    }
+}
 
-    endpoints[0][0] = ep;
-    endpoints[0][1] = ep;
+static void double_buffered_in_transaction_completed(
+        hal5_usb_endpoint_t* ep)
+{
+    // the hardware toggled DTOG_TX after sending
+    // so the sent buffer is the other one
+    const hal5_usb_bd_t* bd = hal5_usb_ep_double_buffer_bd(
+            ep, 
+            !ep->chep->dtogtx);
 
-    hal5_usb_ep_sync_from_reg(ep);
+    assert (ep->tx_buffers_filled > 0);
+    ep->tx_buffers_filled--;
+    ep->tx_sent += bd->count;
+    count_tx_packet(ep, bd->count);
 
-    hal5_usb_ep_prepare_for_out(
-            ep, 
-            ep_status_stall);
+    USB_TRACE("IN DBL (%u, %u, %u/%u)\n", 
+            ep->mps,
+            bd->count,
+            ep->tx_sent,
+            ep->tx_sent_limit);
 
-    // this is the only place sync is done manually
-    // all other transactions are automatically synced
-    // when returned from trx_completed callback in USB INT handler
-    hal5_usb_ep_sync_to_reg(ep);
+    // refill the sent buffer before anything else
+    double_buffer_fill(ep, true);
 
-}
+    // streaming, there is no stage
+    if (ep->packet != NULL) return;
 
-static void hal5_usb_device_suspend(void)
-{
-    CONSOLE("usb_suspend\n");
-}
+    if ((ep->tx_buffers_filled == 0) && 
+            !double_buffer_has_more_to_copy(ep))
+    {
+        hal5_usb_device_in_stage_completed(ep);
+
+        // if a new transfer is prepared in the callback
+        double_buffer_fill(ep, false);
+    }
+}
+
+static void double_buffered_out_transaction_completed(
+        hal5_usb_endpoint_t* ep)
+{
+    // the hardware toggled DTOG_RX after receiving
+    // so the received buffer is the other one
+    const uint8_t buffer = !ep->chep->dtogrx;
+
+    const uint32_t packet_size =
+        hal5_usb_ep_double_buffer_bd(ep, buffer)->count;
+
+    // if this packet completes the stage and there is no next transfer
+    // the other buffer is released only after the callback, otherwise
+    // a packet received to it meanwhile would be lost
+    const bool last_packet =
+        (packet_size < ep->mps) ||
+        ((ep->rx_received + packet_size) >= ep->rx_target_size);
+
+    const bool release_now =
+        (ep->packet != NULL) ||
+        !last_packet ||
+        (ep->transfers_count > 1);
+
+    // release the other buffer (SW_BUF = buffer)
+    // so the hardware can receive the next packet while this one is copied
+    hal5_usb_ep_double_buffer_update(ep, true, release_now);
+
+    ep->rx_received += hal5_usb_device_copy_from_double_buffer(
+            ep, 
+            buffer);
+    count_rx_packet(ep, packet_size, false);
+
+    USB_TRACE("OUT DBL (%u, %u, %u)\n", 
+            ep->mps,
+            packet_size,
+            ep->rx_received);
+
+    if (ep->packet != NULL)
+    {
+        // the other buffer is already released above
+        // so a packet can still be received before NAK is written
+        if (!stream_out_packet(ep))
+        {
+            hal5_usb_ep_sync_from_reg(ep);
+            hal5_usb_ep_set_status(ep, ep_status_nak, ep->tx_status);
+            hal5_usb_ep_sync_to_reg(ep);
+        }
+
+        return;
+    }
+
+    if (hal5_usb_ep_is_out_stage_completed(ep, packet_size))
+    {
+        // stage is completed, it continues only if the endpoint is prepared
+        // again in the callback (with hal5_usb_ep_prepare_for_out...)
+        ep->rx_status = ep_status_nak;
+
+        hal5_usb_device_out_stage_completed(ep);
+
+        if (ep->rx_status == ep_status_valid)
+        {
+            if (!release_now) hal5_usb_ep_double_buffer_update(ep, false, true);
+        }
+        else
+        {
+            hal5_usb_ep_sync_from_reg(ep);
+            hal5_usb_ep_set_status(
+                    ep,
+                    ep->halted ? ep_status_stall : ep_status_nak,
+                    ep->tx_status);
+            // released together with NAK, so nothing is received to it
+            if (!release_now) ep->chep2sync->dtogtx = 1;
+            hal5_usb_ep_sync_to_reg(ep);
+        }
+    }
+}
+
+static void hal5_usb_device_double_buffered_transaction_completed(
+        hal5_usb_endpoint_t* ep)
+{
+    HAL5_USB_TRACE_TRANSACTION_BEGIN(ep);
+
+    if (ep->dir_in)
+    {
+        assert (ep->chep->vttx);
+        double_buffered_in_transaction_completed(ep);
+    }
+    else
+    {
+        assert (ep->chep->vtrx);
+        double_buffered_out_transaction_completed(ep);
+    }
+
+    HAL5_USB_TRACE_TRANSACTION_END(ep);
+}
+
+// ISOCHRONOUS ENDPOINTS
+// see the comments in hal5_usb.c for how the buffers are used
+// there is no handshake, so CTR is only cleared and the buffers are 
+// exchanged at SOF (and ESOF), once per frame: the packet of the frame 
+// ended is handed over (OUT) or the buffer sent is refilled (IN)
+// while the hardware uses the other buffer in the new frame
+// the packets are taken from and handed over to the packet callback
+
+// the next packet to the buffer sent, a ZLP if the stream is stopped
+static void iso_in_fill(
+        hal5_usb_endpoint_t* ep,
+        uint8_t buffer)
+{
+    size_t size = 0;
+
+    if (ep->stream_started)
+    {
+        bool more;
+
+        size = ep->mps;
+
+        HAL5_USB_PROFILE_CALLBACK(
+                more = ep->packet(ep, ep->tx_data, &size, ep->packet_context));
+
+        ep->stream_started = more;
+
+        if (!more) size = 0;
+
+        assert (size <= ep->mps);
+    }
+
+    ep->tx_source       = ep->tx_data;
+    ep->tx_sent_limit   = size;
+    ep->tx_copied       = 0;
+
+    hal5_usb_device_copy_to_double_buffer(ep, buffer);
+}
+
+// hands over the packet received, it is dropped if the stream is stopped
+static void iso_out_drain(
+        hal5_usb_endpoint_t* ep,
+        uint8_t buffer)
+{
+    if (!ep->stream_started) return;
+
+    ep->rx_target       = ep->rx_data;
+    ep->rx_target_size  = HAL5_USB_EP_DATA_SIZE;
+    ep->rx_overflow     = false;
+    ep->rx_received     = hal5_usb_device_copy_from_double_buffer(ep, buffer);
+
+    stream_out_packet(ep);
+}
+
+static void iso_frame(
+        hal5_usb_endpoint_t* ep,
+        const uint32_t dtogs)
+{
+    const bool dtog = ep->dir_in ? 
+        ((dtogs >> ep->endp) & 1) : 
+        ((dtogs >> (8 + ep->endp)) & 1);
+
+    if (dtog == ep->iso_dtog)
+    {
+        // no packet in this frame
+        ep->iso_idle_frames++;
+
+        if (ep->iso_idle_frames >= ep->iso_interval)
+        {
+            ep->iso_idle_frames = 0;
+            if (ep->stream_started) ep->stats.missed_frames++;
+        }
+
+        return;
+    }
+
+    ep->iso_dtog = dtog;
+    ep->iso_idle_frames = 0;
+
+    // the hardware toggled DTOG after the packet
+    // so the buffer used in this frame is the other one
+    const uint8_t buffer = !dtog;
+    const size_t count = hal5_usb_ep_double_buffer_bd(ep, buffer)->count;
+
+    if (ep->dir_in)
+    {
+        count_tx_packet(ep, count);
+        iso_in_fill(ep, buffer);
+    }
+    else
+    {
+        count_rx_packet(ep, count, false);
+        iso_out_drain(ep, buffer);
+    }
+}
+
+// SOF, or ESOF when the SOF is missed (the frame still ends)
+// dtogs are the DTOGs of the endpoints when the event is acknowledged
+static void hal5_usb_device_frame(
+        bool missed,
+        const uint32_t dtogs)
+{
+    if (missed) device_stats.missed_sofs++;
+    else device_stats.sofs++;
+
+    for (uint8_t i = 1; i < 8; i++)
+    {
+        for (uint8_t dir = 0; dir < 2; dir++)
+        {
+            hal5_usb_endpoint_t* ep = endpoints[i][dir];
+
+            if ((ep != NULL) && (ep->utype == ep_utype_iso)) iso_frame(ep, dtogs);
+        }
+    }
+}
+
+hal5_usb_endpoint_t* hal5_usb_device_get_endpoint(
+        uint8_t endp,
+        bool dir_in)
+{
+    assert (endp < 8);
+    return endpoints[endp][dir_in ? 0 : 1];
+}
+
+static void hal5_usb_device_start_prepared_in(
+        hal5_usb_endpoint_t* ep)
+{
+    if (ep->double_buffered)
+    {
+        // STAT_TX is already VALID, sync_to_reg below does not change it
+        double_buffer_fill(ep, false);
+    }
+    else
+    {
+        hal5_usb_device_copy_to_endpoint(ep);
+    }
+
+    hal5_usb_ep_sync_to_reg(ep);
+}
+
+void hal5_usb_device_start_in(
+        hal5_usb_endpoint_t* ep,
+        const void* data,
+        const size_t data_size)
+{
+    assert (ep->dir_in);
+
+    hal5_usb_ep_sync_from_reg(ep);
+
+    hal5_usb_ep_prepare_for_in(
+            ep,
+            ep_status_disabled,
+            data,
+            data_size,
+            false,
+            0);
+
+    hal5_usb_device_start_prepared_in(ep);
+}
+
+void hal5_usb_device_start_in_ref(
+        hal5_usb_endpoint_t* ep,
+        const void* data,
+        const size_t data_size)
+{
+    assert (ep->dir_in);
+
+    hal5_usb_ep_sync_from_reg(ep);
+
+    hal5_usb_ep_prepare_for_in_ref(
+            ep,
+            ep_status_disabled,
+            data,
+            data_size,
+            false,
+            0);
+
+    hal5_usb_device_start_prepared_in(ep);
+}
+
+void hal5_usb_device_start_out(
+        hal5_usb_endpoint_t* ep)
+{
+    assert (!ep->dir_in);
+
+    hal5_usb_ep_sync_from_reg(ep);
+
+    hal5_usb_ep_prepare_for_out(
+            ep, 
+            ep_status_disabled);
+
+    hal5_usb_ep_sync_to_reg(ep);
+}
+
+void hal5_usb_device_start_out_buffer(
+        hal5_usb_endpoint_t* ep,
+        void* buffer,
+        const size_t buffer_size)
+{
+    assert (!ep->dir_in);
+
+    hal5_usb_ep_sync_from_reg(ep);
+
+    hal5_usb_ep_prepare_for_out_buffer(
+            ep, 
+            ep_status_disabled,
+            buffer,
+            buffer_size);
+
+    hal5_usb_ep_sync_to_reg(ep);
+}
+
+// starts the transfer at the head of the queue on an idle endpoint
+static void start_transfer(
+        hal5_usb_endpoint_t* ep)
+{
+    hal5_usb_ep_sync_from_reg(ep);
+
+    prepare_transfer(ep);
+
+    if (ep->dir_in)
+    {
+        hal5_usb_device_start_prepared_in(ep);
+    }
+    else
+    {
+        hal5_usb_ep_sync_to_reg(ep);
+    }
+}
+
+bool hal5_usb_device_submit(
+        hal5_usb_endpoint_t* ep,
+        void* buffer,
+        const size_t length,
+        const uint32_t flags,
+        hal5_usb_transfer_completed_t completed,
+        void* context)
+{
+    assert (ep != NULL);
+    assert (ep->endp != 0);
+    assert ((ep->utype == ep_utype_bulk) || 
+            (ep->utype == ep_utype_interrupt));
+    assert ((buffer != NULL) || (length == 0));
+    // OUT transfer has to receive at least one packet
+    assert (ep->dir_in || (length > 0));
+
+    hal5_usb_device_lock();
+
+    const bool submitted = 
+        (ep->transfers_count < HAL5_USB_TRANSFER_QUEUE_SIZE);
+
+    if (submitted)
+    {
+        hal5_usb_transfer_t* transfer = &ep->transfers[
+            (ep->transfers_head + ep->transfers_count) % 
+                HAL5_USB_TRANSFER_QUEUE_SIZE];
+
+        transfer->buffer            = buffer;
+        transfer->length            = length;
+        transfer->flags             = flags;
+        transfer->completed         = completed;
+        transfer->context           = context;
+        transfer->actual_length     = 0;
+        transfer->overflow          = false;
+
+        ep->transfers_count++;
+
+        // the endpoint is idle, start it now
+        // if a transfer is just completed, it is started after the callback
+        // if the endpoint is halted, it is started when the halt is cleared
+        if ((ep->transfers_count == 1) && 
+                !ep->transfer_completing && 
+                !ep->halted)
+        {
+            start_transfer(ep);
+        }
+    }
+
+    hal5_usb_device_unlock();
+
+    return submitted;
+}
+
+void hal5_usb_device_set_endpoint_halt(
+        hal5_usb_endpoint_t* ep,
+        bool halt)
+{
+    assert (ep != NULL);
+    assert (ep->endp != 0);
+    // there is no halt for isochronous endpoints
+    assert (ep->utype != ep_utype_iso);
+    // the halt is cleared by the host, not in the callbacks of the endpoint
+    assert (halt || !ep->transfer_completing);
+
+    hal5_usb_device_lock();
+
+    const bool was_halted = ep->halted;
+
+    ep->halted = halt;
+
+    if (halt && !was_halted) ep->stats.stalls++;
+
+    // in the completed callback of a transfer of the endpoint
+    // CHEPnR is updated when the callback returns
+    if (!ep->transfer_completing)
+    {
+        hal5_usb_ep_sync_from_reg(ep);
+
+        if (!halt) reset_data_toggle(ep);
+
+        // clearing the halt of an endpoint not halted only resets the toggle
+        // sync_from_reg disables the endpoint, so its status is kept
+        if (halt || was_halted) 
+        {
+            set_halt_status(ep);
+        }
+        else
+        {
+            hal5_usb_ep_set_status(ep, ep->chep->statrx, ep->chep->stattx);
+        }
+
+        hal5_usb_ep_sync_to_reg(ep);
+
+        // the transfers submitted while halted
+        if (!halt && was_halted && (ep->transfers_count > 0))
+        {
+            start_transfer(ep);
+        }
+    }
+
+    hal5_usb_device_unlock();
+}
+
+void hal5_usb_device_cancel_transfers(
+        hal5_usb_endpoint_t* ep)
+{
+    assert (ep != NULL);
+    assert (ep->endp != 0);
+
+    hal5_usb_device_lock();
+
+    ep->transfers_head = 0;
+    ep->transfers_count = 0;
+
+    // in the completed callback of a transfer of the endpoint
+    // nothing is in progress and the next one is not prepared anymore
+    if (!ep->transfer_completing)
+    {
+        // stop the transfer in progress as if the halt is cleared
+        hal5_usb_ep_sync_from_reg(ep);
+        reset_data_toggle(ep);
+        set_halt_status(ep);
+        hal5_usb_ep_sync_to_reg(ep);
+    }
+
+    hal5_usb_device_unlock();
+}
+
+void hal5_usb_device_start_stream(
+        hal5_usb_endpoint_t* ep)
+{
+    assert (ep != NULL);
+    assert (ep->packet != NULL);
+
+    hal5_usb_device_lock();
+
+    ep->stream_started = true;
+
+    // isochronous endpoints are always VALID, the stream continues at SOF
+    if (ep->utype == ep_utype_iso)
+    {
+        hal5_usb_device_unlock();
+        return;
+    }
+
+    hal5_usb_ep_sync_from_reg(ep);
+
+    if (ep->dir_in)
+    {
+        if (ep->double_buffered)
+        {
+            // takes the packets for the free buffers
+            double_buffer_fill(ep, false);
+        }
+        else if (stream_next_in_packet(ep))
+        {
+            hal5_usb_device_copy_to_endpoint(ep);
+        }
+    }
+    else
+    {
+        hal5_usb_ep_prepare_for_out(
+                ep, 
+                ep_status_disabled);
+    }
+
+    hal5_usb_ep_sync_to_reg(ep);
+
+    hal5_usb_device_unlock();
+}
+
+static void hal5_usb_device_bus_error(void)
+{
+    device_stats.bus_errors++;
+    USB_WARN("usb_bus_error\n");
+}
+
+static void hal5_usb_device_bus_reset(void)
+{
+    device_stats.resets++;
+    USB_INFO("usb_bus_reset\n");
+
+    // USB BUS RESET does not happen only once before setup
+    // it also happens before setting the address during setup
+
+    switch (usb_device_state)
+    {
+        case usb_device_state_default: 
+            break;
+
+        case usb_device_state_address:
+        case usb_device_state_configured:
+            // after the first enumeration
+            // windows start a second enumeration with a bus reset
+            // so device should continue functioning
+            // but naturally with address=0 at default state
+            // more info here: https://techcommunity.microsoft.com/t5/microsoft-usb-blog/how-does-usb-stack-enumerate-a-device/ba-p/270685
+            usb_device_state = usb_device_state_default;
+            USB_DRD_FS->DADDR = USB_DADDR_EF;
+            break;
+    }
+
+    // the device is not configured anymore
+    free_endpoints();
+
+    // endpoint 0 is a control endpoint
+    // so it works in both directions
+    // free in case it is allocated before
+    // both directions point to the same endpoint, so free only once
+    hal5_usb_ep_free(endpoints[0][0]);
+    hal5_usb_endpoint_t* ep = hal5_usb_ep_create(
+            NULL,
+            hal5_usb_device_descriptor->bMaxPacketSize0,
+            false,
+            NULL);
+
+    endpoints[0][0] = ep;
+    endpoints[0][1] = ep;
+
+    hal5_usb_ep_sync_from_reg(ep);
+
+    hal5_usb_ep_prepare_for_out(
+            ep, 
+            ep_status_stall);
+
+    // this is the only place sync is done manually
+    // all other transactions are automatically synced
+    // when returned from trx_completed callback in USB INT handler
+    hal5_usb_ep_sync_to_reg(ep);
+
+}
+
+static void hal5_usb_device_suspend(void)
+{
+    device_stats.suspends++;
+    USB_INFO("usb_suspend\n");
+}
 
 static void hal5_usb_device_wakeup(void)
 {
-    CONSOLE("usb_wakeup\n");
+    device_stats.wakeups++;
+    USB_INFO("usb_wakeup\n");
 }
 
 static void hal5_usb_device_buffer_overflow(void)
 {
-    CONSOLE("usb_buffer_overflow\n");
+    device_stats.pma_overruns++;
+    USB_ERROR("usb_buffer_overflow\n");
 }
 
-void USB_DRD_FS_IRQHandler(void)
-{
-    const uint32_t istr = USB_DRD_FS->ISTR;
+// the events are handled one at a time, in this order
+// acknowledge clears the event, so the interrupt is not raised again for it,
+// and does what has to be done immediately
+// process runs the state machine, in the interrupt handler, or later
+// in hal5_usb_device_process_events in deferred mode
 
+static void hal5_usb_device_acknowledge_event(
+        const uint32_t istr)
+{
     if (istr & USB_ISTR_RESET_Msk) 
     {
         // bus reset detected
@@ -575,9 +1671,7 @@ void USB_DRD_FS_IRQHandler(void)
         // clear RESET (called RST_DCON in reference manual)
         // suspend condition check is enabled immediately after any USB reset
         // so clear it as well
-        USB_DRD_FS->ISTR &= ~USB_ISTR_RESET_Msk;
-        USB_DRD_FS->ISTR &= ~USB_ISTR_SUSP_Msk;
-        hal5_usb_device_bus_reset();
+        HAL5_USB_WRITE_ISTR(~(USB_ISTR_RESET_Msk | USB_ISTR_SUSP_Msk));
     } 
     else if (istr & USB_ISTR_CTR) 
     {
@@ -591,15 +1685,216 @@ void USB_DRD_FS_IRQHandler(void)
         
         // ISTR CTR bit is read-only
         // no need to clear any bit in ISTR
+        // VTRX/VTTX in CHEPnR is cleared when the transaction is processed
+        // or here in deferred mode, the endpoint NAKs until it is processed
+#if HAL5_USB_DEFERRED_ENABLED
+        const uint8_t idn   = (istr & USB_ISTR_IDN_Msk) & 0xF;
+        const bool dir_out  = (istr & USB_ISTR_DIR_Msk);
+
+        hal5_usb_chep_clear_ctr(
+                (hal5_usb_chep_t*) (USB_DRD_BASE + 4*idn),
+                dir_out);
+#endif
+    } 
+    else if (istr & (USB_ISTR_SOF | USB_ISTR_ESOF)) 
+    {
+        // start of frame, or start of frame expected but not received
+        // only enabled when there are isochronous endpoints
+
+        // avoid read-modify-write of ISTR
+        // clear SOF and ESOF (both if both are set, the frame is handled once)
+        HAL5_USB_WRITE_ISTR(~(USB_ISTR_SOF | USB_ISTR_ESOF));
+    } 
+    else if (istr & USB_ISTR_PMAOVR) 
+    {
+        // PMA overrun/underrun detected
+        
+        // avoid read-modify-write of ISTR
+        // clear PMAOVR
+        HAL5_USB_WRITE_ISTR(~(1 << USB_ISTR_PMAOVR_Pos));
+    } 
+    else if (istr & USB_ISTR_ERR) 
+    {
+        // these errors can usually be ignored, 
+        //  because they will be handled by the hardware (retransmission etc)
+        // these can be counted and reported as a measure of transmission quality
+        // ideally none of these should happen
+        // NANS - No answer - timeout waiting for a response
+        // CRC - CRC error - token or data CRC was wrong
+        // BST - Bit stuffing error
+        // FVIO - framing format violation
+        
+        // avoid read-modify-write of ISTR
+        // clear ERR
+        HAL5_USB_WRITE_ISTR(~(1 << USB_ISTR_ERR_Pos));
+    } 
+    else if (istr & USB_ISTR_WKUP) 
+    {
+        // wake-up signalling detected
+        // SUSPRDY is automatically cleared
         
+        // avoid read-modify-write of ISTR
+        // clear WKUP
+        HAL5_USB_WRITE_ISTR(~(1 << USB_ISTR_WKUP_Pos));
+
+        // clear SUSPEN so suspend check is enabled
+        CLEAR_BIT(USB_DRD_FS->CNTR, USB_CNTR_SUSPEN);
+    } 
+    else if (istr & USB_ISTR_SUSP) 
+    {
+        // suspend detected
+        // no activity (no SOF) for >3ms
+        // SUSP flag is still set for reset as well
+        // so check SUSP flag after checking RESET
+
+        // set SUSPEN enabled
+        //  so suspend condition is not checked and 
+        //  SUSP interrupt is not repeatedly called 
+        SET_BIT(USB_DRD_FS->CNTR, USB_CNTR_SUSPEN);
+
+        // avoid read-modify-write of ISTR
+        // clear SUSP
+        HAL5_USB_WRITE_ISTR(~(1 << USB_ISTR_SUSP_Pos));
+
+        // remove power from USB transceivers
+        SET_BIT(USB_DRD_FS->CNTR, USB_CNTR_SUSPRDY);
+    } 
+    else 
+    {
+        USB_ERROR("UNKNOWN INTERRUPT: ISTR: 0x%08lX\n", istr);
+        assert (false);
+    }
+}
+
+// DTOG_TX (bit n) and DTOG_RX (bit 8+n) of each CHEPnR when SOF or ESOF
+// is acknowledged, so the frame ended is handled with the buffers used in
+// it, also when the event is processed later in deferred mode
+static uint32_t hal5_usb_device_frame_dtogs(void)
+{
+    uint32_t dtogs = 0;
+
+    for (uint8_t n = 1; n < 8; n++)
+    {
+        hal5_usb_chep_t chep;
+        chep.v = ((hal5_usb_chep_t*) (USB_DRD_BASE + 4*n))->v;
+
+        if (chep.dtogtx) dtogs |= (1 << n);
+        if (chep.dtogrx) dtogs |= (1 << (8 + n));
+    }
+
+    return dtogs;
+}
+
+// CHEPnR when the event is acknowledged for CTR
+// in deferred mode, only VTRX or VTTX (the one in ISTR DIR) is kept
+// the DTOGs of the endpoints for SOF and ESOF (see frame_dtogs)
+// the event is chosen in the same order as acknowledge
+static uint32_t hal5_usb_device_event_chep(
+        const uint32_t istr)
+{
+    if (!(istr & USB_ISTR_CTR)) 
+    {
+        if (istr & (USB_ISTR_SOF | USB_ISTR_ESOF)) 
+        {
+            return hal5_usb_device_frame_dtogs();
+        }
+
+        return 0;
+    }
+
+    const uint8_t idn   = (istr & USB_ISTR_IDN_Msk) & 0xF;
+
+    hal5_usb_chep_t chep;
+    chep.v = ((hal5_usb_chep_t*) (USB_DRD_BASE + 4*idn))->v;
+
+#if HAL5_USB_DEFERRED_ENABLED
+    const bool dir_out  = (istr & USB_ISTR_DIR_Msk);
+
+    if (dir_out) chep.vttx = 0;
+    else chep.vtrx = 0;
+#endif
+
+    return chep.v;
+}
+
+#if HAL5_USB_PROFILE_ENABLED
+static hal5_usb_profile_path_t hal5_usb_device_event_path(
+        const uint32_t istr,
+        const uint32_t chep)
+{
+    if (istr & USB_ISTR_RESET_Msk) return profile_path_reset;
+
+    if (istr & USB_ISTR_CTR)
+    {
+        // SETUP stays set after a SETUP transaction, so it is checked for OUT
+        if (!(istr & USB_ISTR_DIR_Msk)) return profile_path_ctr_in;
+        else if (((hal5_usb_chep_t) {.v = chep}).setup) return profile_path_ctr_setup;
+        else return profile_path_ctr_out;
+    }
+
+    if (istr & (USB_ISTR_SOF | USB_ISTR_ESOF)) return profile_path_sof;
+
+    if (istr & (USB_ISTR_PMAOVR | USB_ISTR_ERR)) return profile_path_error;
+    if (istr & USB_ISTR_WKUP) return profile_path_wakeup;
+
+    return profile_path_suspend;
+}
+#endif
+
+// in deferred mode, CHEPnR is read again when the event is processed
+// but CTR is already cleared in it, so VTRX/VTTX and SETUP are restored
+// from chep as they were when the event is acknowledged
+static void restore_ctr(
+        hal5_usb_endpoint_t* ep,
+        const uint32_t chep)
+{
+#if HAL5_USB_DEFERRED_ENABLED
+    const hal5_usb_chep_t acknowledged = {.v = chep};
+
+    ep->chep->vtrx  = acknowledged.vtrx;
+    ep->chep->vttx  = acknowledged.vttx;
+    ep->chep->setup = acknowledged.setup;
+#endif
+}
+
+static void hal5_usb_device_process_event(
+        const uint32_t istr,
+        const uint32_t chep)
+{
+    if (istr & USB_ISTR_RESET_Msk) 
+    {
+        hal5_usb_device_bus_reset();
+    } 
+    else if (istr & USB_ISTR_CTR) 
+    {
         const uint8_t idn   = (istr & USB_ISTR_IDN_Msk) & 0xF;
         const bool dir_out  = (istr & USB_ISTR_DIR_Msk);
 
         hal5_usb_endpoint_t* ep = endpoints[idn][dir_out ? 1 : 0];
         assert (ep != NULL);
 
+        if (ep->utype == ep_utype_iso)
+        {
+            // the packet is handled at SOF
+            // in deferred mode CTR is already cleared
+#if !HAL5_USB_DEFERRED_ENABLED
+            hal5_usb_chep_clear_ctr(ep->chep_reg, dir_out);
+#endif
+            return;
+        }
+
+        if (ep->double_buffered)
+        {
+            // sync_from_reg is not used, it would reset the rx/tx status
+            ep->chep->v = ep->chep_reg->v;
+            restore_ctr(ep, chep);
+            hal5_usb_device_double_buffered_transaction_completed(ep);
+            return;
+        }
+
         hal5_usb_ep_sync_from_reg(ep);
-        CONSOLE("\n<<<<<<\n");
+        restore_ctr(ep, chep);
+        USB_TRACE("\n<<<<<<\n");
 
         ep->istr->v = istr;
 
@@ -608,7 +1903,7 @@ void USB_DRD_FS_IRQHandler(void)
 
         if (ep->current_out != ep->last_out)
         {
-            CONSOLE("first of kind\n");
+            USB_TRACE("first of kind\n");
             if (ep->current_out)
             {
                 ep->rx_received = 0;
@@ -623,15 +1918,15 @@ void USB_DRD_FS_IRQHandler(void)
         switch (hal5_usb_device_get_state())
         {
             case usb_device_state_configured:
-                CONSOLE("configured\n");
+                USB_TRACE("configured\n");
                 break;
 
             case usb_device_state_address:
-                CONSOLE("address\n");
+                USB_TRACE("address\n");
                 break;
 
             case usb_device_state_default:
-                CONSOLE("default\n");
+                USB_TRACE("default\n");
                 break;
         }
 
@@ -640,16 +1935,18 @@ void USB_DRD_FS_IRQHandler(void)
             uint32_t rx_count = hal5_usb_device_copy_from_endpoint(ep);
 
             ep->rx_received += rx_count;
+            count_rx_packet(ep, ep->rxbd->count, ep->chep->setup);
 
-            CONSOLE("(out, %u, %u)\n", 
+            USB_TRACE("(out, %u, %u)\n", 
                     ep->rxbd->count,
                     ep->rx_received);
         }
         else // dir_in
         {
             ep->tx_sent += ep->txbd->count;
+            count_tx_packet(ep, ep->txbd->count);
 
-            CONSOLE("(in, %u, %u)\n", 
+            USB_TRACE("(in, %u, %u)\n", 
                     ep->txbd->count,
                     ep->tx_sent);
         }
@@ -660,88 +1957,223 @@ void USB_DRD_FS_IRQHandler(void)
         {
             uint32_t tx_count = hal5_usb_device_copy_to_endpoint(ep);
 
-            CONSOLE("TX (%u, %u, %u/%u [%u", 
+            USB_TRACE("TX (%u, %u, %u/%u [%u", 
                     ep->mps,
                     ep->txbd->count,
                     ep->tx_sent,
                     ep->tx_sent_limit,
                     ep->tx_data_size);
 
-            if (ep->tx_expected_valid) CONSOLE(", %u])", ep->tx_expected);
-            else CONSOLE(", .])");
+            if (ep->tx_expected_valid) USB_TRACE(", %u])", ep->tx_expected);
+            else USB_TRACE(", .])");
 
-            CONSOLE(" %lu\n", tx_count);
+            USB_TRACE(" %lu\n", tx_count);
         }
 
         //hal5_usb_ep_dump_status(ep);
-        CONSOLE(">>>>>>\n");
+        USB_TRACE(">>>>>>\n");
         hal5_usb_ep_sync_to_reg(ep);
     } 
+    else if (istr & (USB_ISTR_SOF | USB_ISTR_ESOF)) 
+    {
+        hal5_usb_device_frame(!(istr & USB_ISTR_SOF), chep);
+    } 
     else if (istr & USB_ISTR_PMAOVR) 
     {
-        // PMA overrun/underrun detected
-        
-        // avoid read-modify-write of ISTR
-        // clear PMAOVR
-        USB_DRD_FS->ISTR = ~(1 << USB_ISTR_PMAOVR_Pos);
         hal5_usb_device_buffer_overflow();
     } 
     else if (istr & USB_ISTR_ERR) 
     {
-        // these errors can usually be ignored, 
-        //  because they will be handled by the hardware (retransmission etc)
-        // these can be counted and reported as a measure of transmission quality
-        // ideally none of these should happen
-        // NANS - No answer - timeout waiting for a response
-        // CRC - CRC error - token or data CRC was wrong
-        // BST - Bit stuffing error
-        // FVIO - framing format violation
-        
-        // avoid read-modify-write of ISTR
-        // clear ERR
-        USB_DRD_FS->ISTR = ~(1 << USB_ISTR_ERR_Pos);
         hal5_usb_device_bus_error();
     } 
     else if (istr & USB_ISTR_WKUP) 
     {
-        // wake-up signalling detected
-        // SUSPRDY is automatically cleared
-        
-        // avoid read-modify-write of ISTR
-        // clear WKUP
-        USB_DRD_FS->ISTR = ~(1 << USB_ISTR_WKUP_Pos);
-
         // turn on external oscillators and device PLL etc.
         hal5_usb_device_wakeup();
-        // clear SUSPEN so suspend check is enabled
-        CLEAR_BIT(USB_DRD_FS->CNTR, USB_CNTR_SUSPEN);
     } 
     else if (istr & USB_ISTR_SUSP) 
     {
-        // suspend detected
-        // no activity (no SOF) for >3ms
-        // SUSP flag is still set for reset as well
-        // so check SUSP flag after checking RESET
+        // turn off external oscillators and device PLL etc.
+        hal5_usb_device_suspend();
+    } 
+}
 
-        // set SUSPEN enabled
-        //  so suspend condition is not checked and 
-        //  SUSP interrupt is not repeatedly called 
-        SET_BIT(USB_DRD_FS->CNTR, USB_CNTR_SUSPEN);
+#if HAL5_USB_DEFERRED_ENABLED
 
-        // avoid read-modify-write of ISTR
-        // clear SUSP
-        USB_DRD_FS->ISTR = ~(1 << USB_ISTR_SUSP_Pos);
+// single producer (USB interrupt handler), single consumer 
+// (hal5_usb_device_process_events) queue
+// head and tail are free running, only the producer writes head
+// and only the consumer writes tail
+typedef struct
+{
+    uint32_t istr;
+    uint32_t chep;
+} deferred_event_t;
 
-        // remove power from USB transceivers
-        SET_BIT(USB_DRD_FS->CNTR, USB_CNTR_SUSPRDY);
+static_assert ((HAL5_USB_DEFERRED_QUEUE_SIZE & 
+            (HAL5_USB_DEFERRED_QUEUE_SIZE - 1)) == 0,
+        "HAL5_USB_DEFERRED_QUEUE_SIZE has to be a power of 2");
 
-        // turn off external oscillators and device PLL etc.
-        hal5_usb_device_suspend();
-    } 
-    else 
+static deferred_event_t deferred_events[HAL5_USB_DEFERRED_QUEUE_SIZE];
+static volatile uint32_t deferred_head = 0;
+static volatile uint32_t deferred_tail = 0;
+
+// USB IRQ is disabled when the queue is full, the events stay pending
+// in the peripheral until there is space again
+static volatile bool deferred_irq_disabled = false;
+
+// IPSR of the context process_events is called from, the exception number
+// or 0 for thread mode, recorded at the first call after connect
+#define DEFERRED_CONTEXT_UNKNOWN (0xFFFFFFFF)
+static uint32_t deferred_context = DEFERRED_CONTEXT_UNKNOWN;
+
+uint32_t hal5_usb_device_process_events(void)
+{
+    uint32_t processed = 0;
+
+    // always from the same context
+    const uint32_t context = __get_IPSR();
+    assert ((deferred_context == DEFERRED_CONTEXT_UNKNOWN) || 
+            (deferred_context == context));
+    deferred_context = context;
+
+    while (deferred_tail != deferred_head)
     {
-        CONSOLE("UNKNOWN INTERRUPT: ISTR: 0x%08lX\n", istr);
-        assert (false);
+        // head is read before the event
+        __DMB();
+
+        const deferred_event_t event = 
+            deferred_events[deferred_tail & (HAL5_USB_DEFERRED_QUEUE_SIZE - 1)];
+
+        // the event is read before the entry is released
+        __DMB();
+        deferred_tail = deferred_tail + 1;
+
+        if (deferred_irq_disabled)
+        {
+            deferred_irq_disabled = false;
+            NVIC_EnableIRQ(USB_DRD_FS_IRQn);
+        }
+
+        // recorded here, there is only one producer of the trace
+        HAL5_USB_TRACE_IRQ(event.istr);
+
+        hal5_usb_device_process_event(event.istr, event.chep);
+
+        processed++;
+    }
+
+    return processed;
+}
+
+// returns false if the queue is full, the event is not acknowledged then
+static bool hal5_usb_device_handle_event(
+        const uint32_t istr,
+        const uint32_t chep)
+{
+    if ((deferred_head - deferred_tail) == HAL5_USB_DEFERRED_QUEUE_SIZE)
+    {
+        deferred_irq_disabled = true;
+        NVIC_DisableIRQ(USB_DRD_FS_IRQn);
+        return false;
+    }
+
+    hal5_usb_device_acknowledge_event(istr);
+
+    deferred_event_t* event = 
+        &deferred_events[deferred_head & (HAL5_USB_DEFERRED_QUEUE_SIZE - 1)];
+
+    event->istr = istr;
+    event->chep = chep;
+
+    // the event is written before it is published
+    __DMB();
+    deferred_head = deferred_head + 1;
+
+    return true;
+}
+
+// process_events is not masked by lock, it can run from the main loop, 
+// a task or an interrupt with a lower priority than USB (e.g. PendSV), 
+// so the API has to be called from the same context 
+// (with an RTOS, the same task) and then nothing runs concurrently
+void hal5_usb_device_lock(void)
+{
+    assert ((deferred_context == DEFERRED_CONTEXT_UNKNOWN) || 
+            (deferred_context == __get_IPSR()));
+}
+
+void hal5_usb_device_unlock(void)
+{
+}
+
+#else
+
+uint32_t hal5_usb_device_process_events(void)
+{
+    return 0;
+}
+
+void hal5_usb_device_lock(void)
+{
+    NVIC_DisableIRQ(USB_DRD_FS_IRQn);
+}
+
+void hal5_usb_device_unlock(void)
+{
+    NVIC_EnableIRQ(USB_DRD_FS_IRQn);
+}
+
+static bool hal5_usb_device_handle_event(
+        const uint32_t istr,
+        const uint32_t chep)
+{
+    HAL5_USB_TRACE_IRQ(istr);
+
+    hal5_usb_device_acknowledge_event(istr);
+    hal5_usb_device_process_event(istr, chep);
+
+    return true;
+}
+
+#endif
+
+// the events in ISTR handled, the bits enabling them in CNTR are
+// at the same positions
+#define HAL5_USB_DEVICE_IRQ_EVENTS \
+    (USB_ISTR_RESET | USB_ISTR_CTR | USB_ISTR_SOF | USB_ISTR_ESOF | \
+     USB_ISTR_PMAOVR | USB_ISTR_ERR | USB_ISTR_WKUP | USB_ISTR_SUSP)
+
+void USB_DRD_FS_IRQHandler(void)
+{
+    const uint32_t enabled = USB_DRD_FS->CNTR & HAL5_USB_DEVICE_IRQ_EVENTS;
+
+    // all pending events are handled in one entry, so the exception entry
+    // and exit is not paid for each packet
+    // ISTR is read again after each event and the events are handled in
+    // priority order (see acknowledge), so a reset does not wait behind
+    // the CTRs of the other endpoints
+    // the interrupt is raised again if there are more than the limit
+    for (uint32_t i = 0; i < HAL5_USB_MAX_EVENTS_PER_IRQ; i++)
+    {
+#if HAL5_USB_PROFILE_ENABLED
+        const uint32_t start = HAL5_USB_PROFILE_START();
+#endif
+
+        // the events not enabled (e.g. SOF without isochronous endpoints) 
+        // are set in ISTR as well, they are not handled
+        const uint32_t istr = HAL5_USB_READ_ISTR() & 
+            (enabled | ~HAL5_USB_DEVICE_IRQ_EVENTS);
+
+        if ((istr & enabled) == 0) break;
+
+        const uint32_t chep = hal5_usb_device_event_chep(istr);
+
+        if (!hal5_usb_device_handle_event(istr, chep)) break;
+
+#if HAL5_USB_PROFILE_ENABLED
+        HAL5_USB_PROFILE_STOP(hal5_usb_device_event_path(istr, chep), start);
+#endif
     }
 }
 
@@ -749,7 +2181,11 @@ void hal5_usb_device_connect(void)
 {
     hal5_usb_device_reset();
 
-    CONSOLE("USB connect: pulling-up D+\n");
+#if HAL5_USB_DEFERRED_ENABLED
+    deferred_context = DEFERRED_CONTEXT_UNKNOWN;
+#endif
+
+    USB_INFO("USB connect: pulling-up D+\n");
 
     // enable pull-up
     // effectively connects the device
@@ -764,10 +2200,10 @@ void hal5_usb_device_disconnect(void)
     // effectively disconnects the device
     CLEAR_BIT(USB_DRD_FS->BCDR, USB_BCDR_DPPU);
 
-    CONSOLE("USB disconnect: pull-up removed from D+\n");
+    USB_INFO("USB disconnect: pull-up removed from D+\n");
     
     // hold reset
     CLEAR_BIT(USB_DRD_FS->CNTR, USB_CNTR_USBRST);
 
-    CONSOLE("USB disconnect: holding USBRST\n");
+    USB_INFO("USB disconnect: holding USBRST\n");
 }
@@ -34,6 +34,22 @@ extern const hal5_usb_device_descriptor_t* const hal5_usb_device_descriptor __WE
 extern const uint32_t hal5_usb_number_of_string_descriptors __WEAK;
 extern const hal5_usb_string_descriptor_t* const hal5_usb_string_descriptors[] __WEAK;
 extern const bool hal5_usb_product_string_append_version __WEAK;
+// if true, serial number string is the MCU UID (96-bit) as 24 hex digits
+extern const bool hal5_usb_serial_number_from_uid __WEAK;
+// one entry for each configuration (in descriptor order)
+// configuration, interface and endpoint descriptors as one blob of wTotalLength
+extern const uint8_t* const hal5_usb_configuration_descriptor_blobs[] __WEAK;
+// one entry for each configuration (in descriptor order)
+// bit n is set if endpoint n is double buffered
+extern const uint16_t hal5_usb_double_buffered_endpoints[] __WEAK;
+// one entry for each configuration (in descriptor order)
+// buffer addresses and buffer descriptors of the endpoints
+// if not given, buffers are allocated at Set Configuration
+extern const hal5_usb_pma_layout_t hal5_usb_pma_layouts[] __WEAK;
+// one entry for each configuration (in descriptor order)
+// descriptors returned to Get Descriptor with interface recipient
+extern const hal5_usb_interface_class_descriptors_t 
+    hal5_usb_interface_class_descriptors[] __WEAK;
 
 typedef enum 
 {
@@ -47,6 +63,26 @@ void hal5_usb_device_disconnect(void);
 
 hal5_usb_device_state_t hal5_usb_device_get_state();
 
+// with HAL5_USB_DEFERRED_ENABLED=1, USB_DRD_FS_IRQHandler only clears and
+// queues the events (with a copy of ISTR and CHEPnR), the endpoint NAKs 
+// until its transaction is processed
+// this processes the queued events in order, the state machine and
+// all _ex callbacks run here, call it from the main loop or from an
+// interrupt with a lower priority than USB (e.g. PendSV)
+// returns the number of events processed, always 0 if not enabled
+// it has to be called always from the same context (asserted)
+uint32_t hal5_usb_device_process_events(void);
+
+// the state shared with the interrupt handler is changed between these
+// by the API (e.g. hal5_usb_device_submit) and the class drivers
+// not deferred: the USB interrupt is disabled
+// deferred: process_events is not masked, so the API has to be called 
+//   from the same context as process_events (asserted with IPSR, with an
+//   RTOS it has to be the same task) or from its callbacks
+// these do not nest
+void hal5_usb_device_lock(void);
+void hal5_usb_device_unlock(void);
+
 // these are called from endpoint 0 implementation
 // do not call these if you do not know what you are doing
 void hal5_usb_device_set_address(uint8_t device_address);
@@ -56,6 +92,169 @@ uint8_t hal5_usb_device_get_configuration_value();
 // set configuration value but also change state if needed
 bool hal5_usb_device_set_configuration_value(uint8_t configuration_value);
 
+// device event counters, kept until hal5_usb_device_clear_stats
+// the traffic counters are per endpoint (hal5_usb_endpoint_t.stats)
+// the peripheral does not report NAKs sent or the type of a bus error
+typedef struct
+{
+    uint32_t resets;
+    uint32_t suspends;
+    uint32_t wakeups;
+    // ERR: no answer, CRC, bit stuffing or framing error
+    uint32_t bus_errors;
+    // PMAOVR
+    uint32_t pma_overruns;
+    // SOF and ESOF (SOF expected but not received), only counted when
+    // there are isochronous endpoints (the interrupts are enabled then)
+    uint32_t sofs;
+    uint32_t missed_sofs;
+} hal5_usb_device_stats_t;
+
+const hal5_usb_device_stats_t* hal5_usb_device_get_stats(void);
+
+// clears the device counters and the counters of all endpoints
+void hal5_usb_device_clear_stats(void);
+
+// registers a device to host vendor request with bRequest for:
+// recipient device: replies hal5_usb_device_stats_t
+// recipient endpoint: replies hal5_usb_ep_stats_t of the endpoint in wIndex
+// (endpoint address, STALLed if the endpoint does not exist)
+bool hal5_usb_device_register_stats_vendor_request(uint8_t bRequest);
+
+// registers the stage completed callback of a non-control endpoint,
+// bEndpointAddress is the endpoint address (e.g. 0x81 for EP1 IN)
+// the callback is set whenever the endpoint is created (at Set Configuration
+// or with hal5_usb_device_create_endpoint), and to the existing endpoint
+// it is called with context instead of _out/_in_stage_completed_ex,
+// so the drivers of different interfaces can be linked together
+// callback=NULL unregisters it
+// returns false if the endpoint number is 0 or not valid
+bool hal5_usb_device_register_endpoint_callback(
+        uint8_t bEndpointAddress,
+        hal5_usb_ep_stage_completed_t callback,
+        void* context);
+
+// registers the packet callback of a non-control endpoint (streaming mode)
+// like hal5_usb_device_register_endpoint_callback
+// the packets are then not combined into stages, the callback is called
+// from the interrupt handler for each packet ACKed:
+// OUT: data is the packet received (size bytes, copied from USB SRAM)
+// IN: data is the buffer of the next packet, write up to *size (max 
+//   packet size) bytes and set *size, 0 sends a ZLP
+//   (double buffered: called for the next two packets at the start)
+// return false to stop the stream, the endpoint NAKs until it is started 
+// again with hal5_usb_device_start_stream (for double buffered OUT, a 
+// packet received to the other buffer before that is still handed over)
+// the stage completed callbacks and the submitted transfers are not used
+// for the endpoint, only rx_data/tx_data of one packet is used
+// isochronous endpoints are only used in streaming mode, the callback is
+// called at SOF (or ESOF) for the packet of the previous service interval
+// IN: the packet is sent in the frame after the next one, the endpoint 
+//   sends ZLPs when the stream is stopped, it never NAKs
+// OUT: the packets received while the stream is stopped are dropped
+// a service interval without a packet while streaming is counted in
+// ep->stats.missed_frames
+// packet=NULL unregisters it
+// returns false if the endpoint number is 0 or not valid
+bool hal5_usb_device_register_packet_callback(
+        uint8_t bEndpointAddress,
+        hal5_usb_ep_packet_t packet,
+        void* context);
+
+// returns NULL if the endpoint is not created (for the current configuration)
+hal5_usb_endpoint_t* hal5_usb_device_get_endpoint(
+        uint8_t endp,
+        bool dir_in);
+
+// creates (or recreates) a non-control endpoint of the current configuration
+// e.g. when an alternate setting is selected in _set_interface_ex
+// the existing endpoint with the same address is freed first 
+// (also its buffers in USB SRAM)
+hal5_usb_endpoint_t* hal5_usb_device_create_endpoint(
+        const hal5_usb_endpoint_descriptor_t* ed,
+        bool double_buffered);
+
+// starts an IN transfer on a (non-control) endpoint 
+// data is copied to tx_data, data_size <= 1024
+// do not call these from _stage_completed_ex callbacks
+// use hal5_usb_ep_prepare_for_in/out there instead
+void hal5_usb_device_start_in(
+        hal5_usb_endpoint_t* ep,
+        const void* data,
+        const size_t data_size);
+
+// same as above but data is not copied, it is sent from where it is
+// so it has to stay valid until the IN stage is completed
+void hal5_usb_device_start_in_ref(
+        hal5_usb_endpoint_t* ep,
+        const void* data,
+        const size_t data_size);
+
+// starts (arms) an OUT transfer on a (non-control) endpoint
+// until it is armed, and after the OUT stage is completed unless it is 
+// armed again in the callback, the endpoint NAKs
+void hal5_usb_device_start_out(
+        hal5_usb_endpoint_t* ep);
+
+// same as above but data is received directly to buffer
+// the stage is completed on a short packet or when buffer is full
+// if a packet does not fit, the rest is dropped and rx_overflow is set
+void hal5_usb_device_start_out_buffer(
+        hal5_usb_endpoint_t* ep,
+        void* buffer,
+        const size_t buffer_size);
+
+// submits a transfer to a bulk or interrupt endpoint
+// IN: length bytes are sent from buffer (no copy), followed by a ZLP if
+//   length is a multiple of max packet size (unless transfer_flag_no_zlp)
+// OUT: up to length bytes are received to buffer, the transfer is
+//   completed on a short packet or when buffer is full
+// the transfers are queued per endpoint (HAL5_USB_TRANSFER_QUEUE_SIZE)
+// and started one after the other, the next one is prepared in the
+// interrupt handler as soon as the previous one is completed, so the
+// endpoint does not NAK in between
+// completed is called (with context in transfer) from the interrupt 
+// handler (or hal5_usb_device_process_events in deferred mode),
+// new transfers can be submitted there
+// buffer has to stay valid until the transfer is completed
+// do not use hal5_usb_device_start_in/out on the same endpoint, the stage
+// completed callbacks are not called while there are submitted transfers
+// the pending transfers are dropped when the endpoint is freed
+// e.g. at Set Configuration
+// returns false if the queue is full
+bool hal5_usb_device_submit(
+        hal5_usb_endpoint_t* ep,
+        void* buffer,
+        const size_t length,
+        const uint32_t flags,
+        hal5_usb_transfer_completed_t completed,
+        void* context);
+
+// sets (halt=true) or clears the halt feature of a non-control endpoint
+// a halted endpoint STALLs, call it when the endpoint is idle (e.g. when
+// a transfer is completed, also from its completed callback)
+// the transfers submitted while it is halted are started when it is cleared
+// clearing it resets the data toggle (also if it is not halted), this is
+// usually done in _clear_endpoint_halt_ex when the host clears the feature
+// ep->halted is true while it is halted
+void hal5_usb_device_set_endpoint_halt(
+        hal5_usb_endpoint_t* ep,
+        bool halt);
+
+// drops the submitted transfers of an endpoint, completed is not called
+// the transfer in progress is stopped and the data toggle is reset like
+// when the halt is cleared, so this is for class specific resets which are
+// followed by Clear Feature (e.g. Bulk-Only Mass Storage Reset)
+// in a completed callback of the endpoint, only the queue is dropped
+void hal5_usb_device_cancel_transfers(
+        hal5_usb_endpoint_t* ep);
+
+// starts (or restarts after it is stopped) the stream of an endpoint with
+// a packet callback, IN: the first packet is taken from the callback here
+// (isochronous IN: at the next SOF after a packet is sent)
+void hal5_usb_device_start_stream(
+        hal5_usb_endpoint_t* ep);
+
 // endpoint 0 - enumeration support
 // these are implemented by hal5_usb_device_ep0.c
 void hal5_usb_device_setup_transaction_completed_ep0(
@@ -69,6 +268,62 @@ void hal5_usb_device_in_stage_completed_ep0(
 
 usb_standard_request_t hal5_usb_device_ep0_get_standard_request();
 
+// class and vendor requests (bmRequestType D6..5)
+typedef enum
+{
+    request_type_class=1,
+    request_type_vendor=2,
+} hal5_usb_device_request_type_t;
+
+// bmRequestType D4..0
+typedef enum
+{
+    request_recipient_device=0,
+    request_recipient_interface=1,
+    request_recipient_endpoint=2,
+    request_recipient_other=3,
+} hal5_usb_device_request_recipient_t;
+
+#define HAL5_USB_DEVICE_MAX_REQUEST_HANDLERS    (8)
+
+// called from USB interrupt handler at SETUP of a registered request
+// return false to STALL the request (Request Error)
+// device to host (IN) requests:
+//   set data and data_size to reply, data is sent from where it is
+//   so it has to stay valid until the data stage is completed
+//   data_size is limited to wLength
+// host to device requests without data (wLength=0):
+//   data and data_size are not used, the request is confirmed with a ZLP
+// host to device requests with data (wLength>0):
+//   set data to a writable buffer and data_size to its size
+//   the data stage is received to this buffer, it has to be at least wLength
+//   data_handler is called when the data stage is completed
+typedef bool (*hal5_usb_device_request_handler_t)(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size);
+
+// called from USB interrupt handler when the data stage of a host to device
+// request is completed, data_size bytes are received to the buffer given by
+// hal5_usb_device_request_handler_t (less than wLength if the host sent less)
+// return true to confirm the request with a ZLP, false to STALL it
+typedef bool (*hal5_usb_device_request_data_handler_t)(
+        const hal5_usb_device_request_t* request,
+        size_t data_size);
+
+// registers a handler for the requests with the given type, recipient and
+// bRequest (in both directions), e.g. by a class driver or vendor code
+// usually before hal5_usb_device_connect
+// data_handler is only needed for host to device requests with data,
+// it can be NULL otherwise, then such requests are STALLed
+// returns false if there is no space left (HAL5_USB_DEVICE_MAX_REQUEST_HANDLERS)
+bool hal5_usb_device_register_request_handler(
+        hal5_usb_device_request_type_t type,
+        hal5_usb_device_request_recipient_t recipient,
+        uint8_t bRequest,
+        hal5_usb_device_request_handler_t handler,
+        hal5_usb_device_request_data_handler_t data_handler);
+
 // _ex functions
 // must be provided by device implementations
 // see example_usb_device.c as an example
@@ -110,6 +365,9 @@ bool hal5_usb_device_get_synch_frame_ex(
         bool dir_in,
         uint16_t* frame_number);
 
+// called after the endpoints of the configuration are created
+// so the transfers (or streams) can be started here
+// configuration_value=0 when it is de-configured
 void hal5_usb_device_set_configuration_ex(
         uint8_t configuration_value);
 
@@ -121,6 +379,7 @@ bool hal5_usb_device_set_interface_ex(
         uint8_t interface,
         uint8_t alternate_setting);
 
+// called for the non-control endpoints without a registered callback
 void hal5_usb_device_out_stage_completed_ex(
         hal5_usb_endpoint_t *ep) __WEAK;
 
@@ -1,26 +1,6 @@
-/*
- * SPDX-FileCopyrightText: 2023 Mete Balci
- *
- * SPDX-License-Identifier: Apache-2.0
- *
- * Copyright (c) 2023 Mete Balci
- *
- * Licensed under the Apache License, Version 2.0 (the "License");
- * you may not use this file except in compliance with the License.
- * You may obtain a copy of the License at
- *
- * http://www.apache.org/licenses/LICENSE-2.0
- *
- * Unless required by applicable law or agreed to in writing, software
- * distributed under the License is distributed on an "AS IS" BASIS,
- * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
- * See the License for the specific language governing permissions and
- * limitations under the License.
- */
-
 #include <stdbool.h>
 #include "hal5_usb.h"
-static const hal5_usb_endpoint_descriptor_t hal5_usb_endpoint_descriptor_1 = 
+static const hal5_usb_endpoint_descriptor_t hal5_usb_endpoint_descriptor_0_0_01 = 
 {
     7, // bLength
     0x05, // bDescriptorType
@@ -28,7 +8,7 @@ static const hal5_usb_endpoint_descriptor_t hal5_usb_endpoint_descriptor_1 =
     0x00, // bmAttributes
     64, // wMaxPacketSize
 };
-static const hal5_usb_interface_descriptor_t hal5_usb_interface_descriptor_0 = 
+static const hal5_usb_interface_descriptor_t hal5_usb_interface_descriptor_0_0 = 
 {
     9, // bLength
     0x04, // bDescriptorType
@@ -40,7 +20,7 @@ static const hal5_usb_interface_descriptor_t hal5_usb_interface_descriptor_0 =
     0xFF, // bInterfaceProtocol
     1, // iInterface
     {
-        &hal5_usb_endpoint_descriptor_1, 
+        &hal5_usb_endpoint_descriptor_0_0_01, 
     },
 };
 static const hal5_usb_configuration_descriptor_t hal5_usb_configuration_descriptor_0 = 
@@ -54,7 +34,7 @@ static const hal5_usb_configuration_descriptor_t hal5_usb_configuration_descript
     0xC0, // bmAttributes
     0x00, // bMaxPower
     {
-        &hal5_usb_interface_descriptor_0, 
+        &hal5_usb_interface_descriptor_0_0, 
     },
 };
 static const hal5_usb_device_descriptor_t hal5_usb_device_descriptor_0 =
@@ -71,7 +51,7 @@ static const hal5_usb_device_descriptor_t hal5_usb_device_descriptor_0 =
     0x0100, // bcdDevice
     3, // iManufacturer
     4, // iProduct
-    0, // iSerialNumber
+    5, // iSerialNumber
     1, // bNumConfigurations
     {
         &hal5_usb_configuration_descriptor_0, 
@@ -79,42 +59,86 @@ static const hal5_usb_device_descriptor_t hal5_usb_device_descriptor_0 =
 };
 const hal5_usb_device_descriptor_t* const hal5_usb_device_descriptor = &hal5_usb_device_descriptor_0;
 const bool hal5_usb_product_string_append_version = true;
-static hal5_usb_string_descriptor_t hal5_usb_string_descriptor_0 = 
+const bool hal5_usb_serial_number_from_uid = true;
+static const uint8_t hal5_usb_configuration_descriptor_blob_0[] =
+{
+    0x09, 0x02, 0x19, 0x00, 0x01, 0x01, 0x02, 0xC0, 0x00,
+    0x09, 0x04, 0x00, 0x00, 0x01, 0xFF, 0xFF, 0xFF, 0x01,
+    0x07, 0x05, 0x01, 0x00, 0x40, 0x00, 0x00,
+};
+const uint8_t* const hal5_usb_configuration_descriptor_blobs[] =
+{
+    hal5_usb_configuration_descriptor_blob_0,
+};
+const uint16_t hal5_usb_double_buffered_endpoints[] =
+{
+    0x0000, // configuration 1
+};
+// configuration 1: 320 bytes of USB SRAM used (128 bytes for endpoint 0), 1728 bytes free
+static const hal5_usb_pma_layout_entry_t hal5_usb_pma_layout_0[] =
+{
+    {0x01, 192, 128, 0x00000100, 0x840000C0}, // 192-319
+};
+const hal5_usb_pma_layout_t hal5_usb_pma_layouts[] =
+{
+    {1, hal5_usb_pma_layout_0},
+};
+const hal5_usb_interface_class_descriptors_t hal5_usb_interface_class_descriptors[] =
+{
+    {0, NULL},
+};
+static hal5_usb_endpoint_t hal5_usb_endpoint_pool_endpoints[2];
+static uint8_t hal5_usb_endpoint_pool_rx_data[2][HAL5_USB_EP_DATA_SIZE] __ALIGNED(4);
+static uint8_t hal5_usb_endpoint_pool_tx_data[2][HAL5_USB_EP_DATA_SIZE] __ALIGNED(4);
+hal5_usb_endpoint_pool_t hal5_usb_endpoint_pool =
+{
+    2, hal5_usb_endpoint_pool_endpoints,
+    2, hal5_usb_endpoint_pool_rx_data,
+    2, hal5_usb_endpoint_pool_tx_data,
+};
+static const hal5_usb_string_descriptor_t hal5_usb_string_descriptor_0 = 
 {
     4,
     0x03,
     // "LANGID en-US"
     {0x09, 0x04},
 };
-static hal5_usb_string_descriptor_t hal5_usb_string_descriptor_1 = 
+static const hal5_usb_string_descriptor_t hal5_usb_string_descriptor_1 = 
 {
     24,
     0x03,
     // "interface 0"
     {0x69, 0x00, 0x6E, 0x00, 0x74, 0x00, 0x65, 0x00, 0x72, 0x00, 0x66, 0x00, 0x61, 0x00, 0x63, 0x00, 0x65, 0x00, 0x20, 0x00, 0x30, 0x00},
 };
-static hal5_usb_string_descriptor_t hal5_usb_string_descriptor_2 = 
+static const hal5_usb_string_descriptor_t hal5_usb_string_descriptor_2 = 
 {
     32,
     0x03,
     // "configuration 1"
     {0x63, 0x00, 0x6F, 0x00, 0x6E, 0x00, 0x66, 0x00, 0x69, 0x00, 0x67, 0x00, 0x75, 0x00, 0x72, 0x00, 0x61, 0x00, 0x74, 0x00, 0x69, 0x00, 0x6F, 0x00, 0x6E, 0x00, 0x20, 0x00, 0x31, 0x00},
 };
-static hal5_usb_string_descriptor_t hal5_usb_string_descriptor_3 = 
+static const hal5_usb_string_descriptor_t hal5_usb_string_descriptor_3 = 
 {
     20,
     0x03,
     // "metebalci"
     {0x6D, 0x00, 0x65, 0x00, 0x74, 0x00, 0x65, 0x00, 0x62, 0x00, 0x61, 0x00, 0x6C, 0x00, 0x63, 0x00, 0x69, 0x00},
 };
-static hal5_usb_string_descriptor_t hal5_usb_string_descriptor_4 = 
+static const hal5_usb_string_descriptor_t hal5_usb_string_descriptor_4 = 
 {
-    24,
+    10,
+    0x03,
+    // "hal5"
+    {0x68, 0x00, 0x61, 0x00, 0x6C, 0x00, 0x35, 0x00},
+};
+static const hal5_usb_string_descriptor_t hal5_usb_string_descriptor_5 = 
+{
+    2,
     0x03,
-    // "hal5       "
-    {0x68, 0x00, 0x61, 0x00, 0x6C, 0x00, 0x35, 0x00, 0x20, 0x00, 0x20, 0x00, 0x20, 0x00, 0x20, 0x00, 0x20, 0x00, 0x20, 0x00, 0x20, 0x00},
+    // "(UID)"
+    {},
 };
-const uint32_t hal5_usb_number_of_string_descriptors = 5;
+const uint32_t hal5_usb_number_of_string_descriptors = 6;
 const hal5_usb_string_descriptor_t* const hal5_usb_string_descriptors[] = 
 {
     &hal5_usb_string_descriptor_0,
@@ -122,4 +146,5 @@ const hal5_usb_string_descriptor_t* const hal5_usb_string_descriptors[] =
     &hal5_usb_string_descriptor_2,
     &hal5_usb_string_descriptor_3,
     &hal5_usb_string_descriptor_4,
+    &hal5_usb_string_descriptor_5,
 };
@@ -38,6 +38,10 @@
 
 #include "hal5.h"
 #include "hal5_usb_device.h"
+#include "hal5_usb_trace.h"
+
+#define HAL5_USB_LOG_MODULE_LEVEL HAL5_USB_EP0_LOG_LEVEL
+#include "hal5_usb_log.h"
 
 #define WINDEX_AS_ENDPOINT_NUMBER(ep) \
     ((uint8_t) (ep->device_request->wIndex & 0x000F))
@@ -90,11 +94,25 @@ void standard_request_completed(
             ep_status_disabled);
 }
 
-// product_string_version becomes " vXX.YY"
+// string descriptors generated by create_descriptors.py are const (in flash)
+// the product string with the version and the serial number from UID
+// are synthesized at runtime, the descriptors are never modified
+
+// product_string_version becomes " vX.Y" to " vXX.YY"
 // where XX is major and YY is minor device version 
 // queried from the device implementation
-// 7 chars in UTF-16 is 14 bytes
-static uint8_t product_string_version[14] = {0};
+// 7 chars in UTF-16 is max. 14 bytes
+static uint8_t product_string_version[14];
+static uint8_t product_string_version_length = 0;
+
+static void append_char(
+        uint8_t* s,
+        uint8_t* off,
+        char c)
+{
+    s[(*off)++] = c;
+    s[(*off)++] = 0;
+}
 
 // initializes product_string_version
 static void initialize_product_string_version()
@@ -105,43 +123,62 @@ static void initialize_product_string_version()
     uint8_t minor = hal5_usb_device_version_minor_ex();
     if (minor > 99) minor = 99;
 
-    uint32_t off = 0;
+    uint8_t off = 0;
 
-    product_string_version[off] = ' '; 
-    off+=2;
-
-    product_string_version[off] = 'v'; 
-    off+=2;
+    append_char(product_string_version, &off, ' ');
+    append_char(product_string_version, &off, 'v');
 
     if ((major / 10) > 0)
     {
-        product_string_version[off] = (major / 10) + 48;
-        off+=2;
+        append_char(product_string_version, &off, (major / 10) + 48);
     }
 
-    product_string_version[off] = (major % 10) + 48; 
-    off+=2;
-
-    product_string_version[off] = '.'; 
-    off+=2;
+    append_char(product_string_version, &off, (major % 10) + 48);
+    append_char(product_string_version, &off, '.');
 
     if ((minor / 10) > 0)
     {
-        product_string_version[off] = (minor / 10) + 48;
-        off+=2;
+        append_char(product_string_version, &off, (minor / 10) + 48);
     }
 
-    product_string_version[off] = (minor % 10) + 48;
-    off+=2;
+    append_char(product_string_version, &off, (minor % 10) + 48);
+
+    assert (off <= sizeof(product_string_version));
 
-    assert (off <= 14);
+    product_string_version_length = off;
 }
 
+// serial number string descriptor, 96-bit UID as 24 hex digits
+static uint8_t serial_number_string_descriptor[2 + 24*2] = {0};
 
-// SETUP TRANSACTION HELPERS
+// initializes serial_number_string_descriptor
+static void initialize_serial_number_string_descriptor()
+{
+    const uint32_t* uid = (const uint32_t*) UID_BASE;
+    const char* hex = "0123456789ABCDEF";
+
+    uint8_t off = 0;
+
+    serial_number_string_descriptor[off++] = 
+        sizeof(serial_number_string_descriptor);
+    serial_number_string_descriptor[off++] = 0x03;
+
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        const uint32_t w = uid[i];
+
+        for (int32_t k = 28; k >= 0; k -= 4)
+        {
+            append_char(
+                    serial_number_string_descriptor, 
+                    &off, 
+                    hex[(w >> k) & 0xF]);
+        }
+    }
+
+    assert (off == sizeof(serial_number_string_descriptor));
+}
 
-// SETUP IN_DATA OUT_0 e.g. get_descriptor
-// this is used to send data for IN
 static void setup_transaction_reply_in(
         hal5_usb_endpoint_t* ep,
         const void* data, 
@@ -156,6 +193,22 @@ static void setup_transaction_reply_in(
             ep->device_request->wLength);
 }
 
+// same as above but data is not copied, it is sent from where it is
+// data has to stay valid until the data stage is completed (e.g. descriptors)
+static void setup_transaction_reply_in_ref(
+        hal5_usb_endpoint_t* ep,
+        const void* data, 
+        const size_t len)
+{   
+    hal5_usb_ep_prepare_for_in_ref(
+            ep,
+            ep_status_stall,
+            data,
+            len,
+            true,
+            ep->device_request->wLength);
+}
+
 // SETUP IN_DATA OUT_0 e.g. get_descriptor
 // this is used to acknowledge the OUT with zero data
 static void setup_transaction_ack_out_zero(
@@ -192,6 +245,8 @@ static void setup_transaction_reply_in_with_zero(
 static void setup_transaction_stall(
         hal5_usb_endpoint_t* ep)
 {
+    ep->stats.stalls++;
+
     hal5_usb_ep_clear_data(ep);
 
     hal5_usb_ep_set_status(
@@ -200,6 +255,22 @@ static void setup_transaction_stall(
             ep_status_stall);
 }
 
+// SETUP OUT_DATA IN_0, Request Error is signalled at the data stage
+// so OUT is STALLed as well, SETUP is still received since
+// it is always ACKed by the peripheral
+static void setup_transaction_stall_data_out(
+        hal5_usb_endpoint_t* ep)
+{
+    ep->stats.stalls++;
+
+    hal5_usb_ep_clear_data(ep);
+
+    hal5_usb_ep_set_status(
+            ep,
+            ep_status_stall,
+            ep_status_stall);
+}
+
 // STANDARD REQUESTS
 
 static void device_get_status(
@@ -374,7 +445,7 @@ static void device_get_descriptor(
                 // for all other requests host behaves as expected 
                 // (waits until all data is sent)
 
-                setup_transaction_reply_in(
+                setup_transaction_reply_in_ref(
                         ep, 
                         dd, 
                         HAL5_MIN(
@@ -403,39 +474,19 @@ static void device_get_descriptor(
 
                 if (configuration_descriptor_index < dd->bNumConfigurations)
                 {
-                    // copy all chain (conf-interface*-endpoint*)
-                    // to a temporary buffer
-                    // then use only wLength part
+                    // all chain (conf-interface*-endpoint*) is generated
+                    // as one blob by create_descriptors.py
+                    // only wLength part of it is sent
                     // this covers requests only for configuration
                     // or more
                     const hal5_usb_configuration_descriptor_t* cd = 
                         dd->configurations[configuration_descriptor_index];
 
-                    uint8_t tmp[256];
-                    uint8_t offset = 0;
-                    memcpy(tmp+offset, cd, cd->bLength);
-                    offset += cd->bLength;
-
-                    for (uint8_t i = 0; i < cd->bNumInterfaces; i++)
-                    {
-                        const hal5_usb_interface_descriptor_t* id = 
-                            cd->interfaces[i];
-                        memcpy(tmp+offset, id, id->bLength);
-                        offset += id->bLength;
+                    // not generated for old descriptors
+                    assert (hal5_usb_configuration_descriptor_blobs != NULL);
 
-                        for (uint8_t k = 0; k < id->bNumEndpoints; k++)
-                        {
-                            const hal5_usb_endpoint_descriptor_t* ed = 
-                                id->endpoints[k];
-                            memcpy(tmp+offset, ed, ed->bLength);
-                            offset += ed->bLength;
-                        }
-                    }
-
-                    // just a precaution
-                    // this is impossible to happen 
-                    // when create_descriptors.py is used
-                    assert (cd->wTotalLength == offset);
+                    const uint8_t* blob = 
+                        hal5_usb_configuration_descriptor_blobs[configuration_descriptor_index];
 
                     // some hosts (linux):
                     // - first requests configuration descriptor only with wLength=9 
@@ -443,9 +494,9 @@ static void device_get_descriptor(
                     //
                     // some hosts (windows):
                     // - requests all at one call with wLength=255 > wTotalLength
-                    setup_transaction_reply_in(
+                    setup_transaction_reply_in_ref(
                                 ep,
-                                tmp,
+                                blob,
                                 HAL5_MIN(
                                     cd->wTotalLength,
                                     ep->device_request->wLength));
@@ -464,13 +515,13 @@ static void device_get_descriptor(
                 const uint32_t string_descriptor_index = 
                     ep->device_request->wValue & 0xFF;
 
-                const uint32_t lang_id = 
-                    ep->device_request->wIndex;
+                // the language id (wIndex) is not checked, 
+                // the strings are only in one language
 
                 // 0xEE is the microsoft OS string descriptor location
                 if (string_descriptor_index == 0xEE)
                 {
-                    setup_transaction_reply_in(
+                    setup_transaction_reply_in_ref(
                             ep,
                             &microsoft_os_string_descriptor,
                             HAL5_MIN(
@@ -486,29 +537,59 @@ static void device_get_descriptor(
                             (string_descriptor_index == 
                              hal5_usb_device_descriptor->iProduct))
                     {
-                        // initialize the string if not initialized before
-                        if (product_string_version[0] == 0)
+                        // initialize the version if not initialized before
+                        if (product_string_version_length == 0)
                         {
                             initialize_product_string_version();
                         }
-// do not warn for const qualifier for memcpy
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdiscarded-qualifiers"
-                        // copy the product version at the end
-                        // if the length of product_string_version changes
-                        // this code does not need to change
-                        memcpy(&(sd->bString[sd->bLength-2-sizeof(product_string_version)/sizeof(uint8_t)]),
+
+                        const size_t len = 
+                            sd->bLength + product_string_version_length;
+
+                        assert (len <= 255);
+
+                        // the reply is assembled in tx_data 
+                        // the product string followed by the version
+                        memcpy(ep->tx_data, sd, sd->bLength);
+                        memcpy(ep->tx_data + sd->bLength, 
                                 product_string_version,
-                                sizeof(product_string_version)/sizeof(uint8_t));
-#pragma GCC diagnostic pop
+                                product_string_version_length);
+                        ep->tx_data[0] = len;
+
+                        setup_transaction_reply_in_ref(
+                                ep,
+                                ep->tx_data,
+                                HAL5_MIN(
+                                    len,
+                                    ep->device_request->wLength));
                     }
+                    else if ((&hal5_usb_serial_number_from_uid != NULL) &&
+                            hal5_usb_serial_number_from_uid &&
+                            (string_descriptor_index == 
+                             hal5_usb_device_descriptor->iSerialNumber))
+                    {
+                        // initialize the string if not initialized before
+                        if (serial_number_string_descriptor[0] == 0)
+                        {
+                            initialize_serial_number_string_descriptor();
+                        }
 
-                    setup_transaction_reply_in(
-                            ep,
-                            sd,
-                            HAL5_MIN(
-                                sd->bLength,
-                                ep->device_request->wLength));
+                        setup_transaction_reply_in_ref(
+                                ep,
+                                serial_number_string_descriptor,
+                                HAL5_MIN(
+                                    serial_number_string_descriptor[0],
+                                    ep->device_request->wLength));
+                    }
+                    else
+                    {
+                        setup_transaction_reply_in_ref(
+                                ep,
+                                sd,
+                                HAL5_MIN(
+                                    sd->bLength,
+                                    ep->device_request->wLength));
+                    }
                 }
                 else
                 {
@@ -758,6 +839,68 @@ static void interface_set_interface(
     else setup_transaction_stall(ep);
 }
 
+// class descriptors of an interface, e.g. HID report descriptor
+// they are generated per configuration by create_descriptors.py
+// and only returned in configured state
+static void interface_get_descriptor(
+        hal5_usb_endpoint_t* ep)
+{
+    standard_request = standard_request_interface_get_descriptor;
+
+    if ((hal5_usb_device_get_state() != usb_device_state_configured) ||
+            (hal5_usb_interface_class_descriptors == NULL))
+    {
+        setup_transaction_stall(ep);
+        return;
+    }
+
+    const uint8_t configuration_value = 
+        hal5_usb_device_get_configuration_value();
+
+    const hal5_usb_device_descriptor_t* const dd = hal5_usb_device_descriptor;
+
+    const hal5_usb_interface_class_descriptors_t* icds = NULL;
+
+    for (uint8_t i = 0; i < dd->bNumConfigurations; i++)
+    {
+        if (dd->configurations[i]->bConfigurationValue == 
+                configuration_value)
+        {
+            icds = &hal5_usb_interface_class_descriptors[i];
+            break;
+        }
+    }
+
+    assert (icds != NULL);
+
+    const uint8_t descriptor_type = 
+        (ep->device_request->wValue >> 8) & 0xFF;
+    const uint8_t descriptor_index = 
+        ep->device_request->wValue & 0xFF;
+
+    for (uint8_t i = 0; i < icds->number_of_descriptors; i++)
+    {
+        const hal5_usb_interface_class_descriptor_t* icd = 
+            &icds->descriptors[i];
+
+        if ((icd->bInterfaceNumber == WINDEX_AS_INTERFACE_NUMBER(ep)) &&
+                (icd->bDescriptorType == descriptor_type) &&
+                (descriptor_index == 0))
+        {
+            setup_transaction_reply_in_ref(
+                    ep,
+                    icd->data,
+                    HAL5_MIN(
+                        icd->wDescriptorLength,
+                        ep->device_request->wLength));
+            return;
+        }
+    }
+
+    // no such descriptor
+    setup_transaction_stall(ep);
+}
+
 static void endpoint_get_status(
         hal5_usb_endpoint_t* ep)
 {
@@ -984,14 +1127,218 @@ static const char* wValueDescriptorTypeLabel(uint16_t wValue)
     }
 };
 
+typedef void (*request_handler_t)(hal5_usb_endpoint_t* ep);
+
+// bRequest of standard requests are 0x00 (GET_STATUS) to 0x0C (SYNCH_FRAME)
+#define NUMBER_OF_STANDARD_REQUESTS (0x0D)
+
+// standard requests indexed by 
+// recipient (device, interface, endpoint)
+// direction (0=host to device, 1=device to host)
+// and bRequest
+// NULL ones are not supported and STALLed
+static const request_handler_t 
+standard_request_handlers[3][2][NUMBER_OF_STANDARD_REQUESTS] = 
+{
+    // device
+    {
+        {
+            [0x01] = device_clear_feature,
+            [0x03] = device_set_feature,
+            [0x05] = device_set_address,
+            [0x07] = device_set_descriptor,
+            [0x09] = device_set_configuration,
+        },
+        {
+            [0x00] = device_get_status,
+            [0x06] = device_get_descriptor,
+            [0x08] = device_get_configuration,
+        },
+    },
+    // interface
+    {
+        {
+            [0x01] = interface_clear_feature,
+            [0x03] = interface_set_feature,
+            [0x0B] = interface_set_interface,
+        },
+        {
+            [0x00] = interface_get_status,
+            [0x06] = interface_get_descriptor,
+            [0x0A] = interface_get_interface,
+        },
+    },
+    // endpoint
+    {
+        {
+            [0x01] = endpoint_clear_feature,
+            [0x03] = endpoint_set_feature,
+        },
+        {
+            [0x00] = endpoint_get_status,
+            [0x0C] = endpoint_synch_frame,
+        },
+    },
+};
+
+// class and vendor requests registered by 
+// hal5_usb_device_register_request_handler
+typedef struct
+{
+    // bmRequestType without direction (D6..0)
+    uint8_t type_and_recipient;
+    uint8_t bRequest;
+    hal5_usb_device_request_handler_t handler;
+    hal5_usb_device_request_data_handler_t data_handler;
+} registered_request_handler_t;
+
+static registered_request_handler_t 
+registered_request_handlers[HAL5_USB_DEVICE_MAX_REQUEST_HANDLERS];
+
+static uint8_t number_of_registered_request_handlers = 0;
+
+// true if the class or vendor request in progress is device to host
+static bool class_or_vendor_request_in = false;
+
+// data_handler of the class or vendor request in progress
+static hal5_usb_device_request_data_handler_t class_or_vendor_data_handler;
+
+bool hal5_usb_device_register_request_handler(
+        hal5_usb_device_request_type_t type,
+        hal5_usb_device_request_recipient_t recipient,
+        uint8_t bRequest,
+        hal5_usb_device_request_handler_t handler,
+        hal5_usb_device_request_data_handler_t data_handler)
+{
+    assert ((type == request_type_class) || (type == request_type_vendor));
+    assert (recipient <= request_recipient_other);
+    assert (handler != NULL);
+
+    if (number_of_registered_request_handlers == 
+            HAL5_USB_DEVICE_MAX_REQUEST_HANDLERS)
+    {
+        return false;
+    }
+
+    registered_request_handler_t* const rh = 
+        &registered_request_handlers[number_of_registered_request_handlers];
+
+    rh->type_and_recipient = (type << 5) | recipient;
+    rh->bRequest = bRequest;
+    rh->handler = handler;
+    rh->data_handler = data_handler;
+
+    number_of_registered_request_handlers++;
+
+    return true;
+}
+
+static void class_or_vendor_request(
+        hal5_usb_endpoint_t* ep)
+{
+    const hal5_usb_device_request_t* const request = ep->device_request;
+
+    const uint8_t type_and_recipient = request->bmRequestType & 0x7F;
+
+    const registered_request_handler_t* rh = NULL;
+
+    for (uint8_t i = 0; i < number_of_registered_request_handlers; i++)
+    {
+        if ((registered_request_handlers[i].type_and_recipient == 
+                    type_and_recipient) &&
+                (registered_request_handlers[i].bRequest == 
+                 request->bRequest))
+        {
+            rh = &registered_request_handlers[i];
+            break;
+        }
+    }
+
+    // not registered, standard_request stays null so it is STALLed
+    if (rh == NULL) return;
+
+    standard_request = standard_request_class_or_vendor;
+    class_or_vendor_request_in = request->bmRequestType & 0x80;
+    class_or_vendor_data_handler = rh->data_handler;
+
+    const bool data_out = 
+        !class_or_vendor_request_in && (request->wLength > 0);
+
+    const void* data = NULL;
+    size_t data_size = 0;
+
+    if (data_out && (rh->data_handler == NULL))
+    {
+        setup_transaction_stall_data_out(ep);
+    }
+    else if (!rh->handler(request, &data, &data_size))
+    {
+        if (data_out) setup_transaction_stall_data_out(ep);
+        else setup_transaction_stall(ep);
+    }
+    else if (class_or_vendor_request_in)
+    {
+        setup_transaction_reply_in_ref(
+                ep,
+                data,
+                HAL5_MIN(data_size, request->wLength));
+    }
+    else if (data_out)
+    {
+        if ((data == NULL) || (data_size < request->wLength))
+        {
+            setup_transaction_stall_data_out(ep);
+        }
+        else
+        {
+            // the data stage is received directly to the buffer 
+            // of the handler, it is completed with a short packet 
+            // or when wLength bytes are received
+            // setup request stays in rx_data
+            hal5_usb_ep_prepare_for_out_buffer(
+                    ep,
+                    ep_status_stall,
+                    (void*) data,
+                    request->wLength);
+        }
+    }
+    else
+    {
+        setup_transaction_reply_in_with_zero(ep);
+    }
+}
+
+// SETUP OUT_DATA IN_0, OUT_DATA is completed
+static void class_or_vendor_request_data_stage_completed(
+        hal5_usb_endpoint_t* ep)
+{
+    // more than wLength is not accepted
+    if (ep->rx_overflow)
+    {
+        setup_transaction_stall_data_out(ep);
+        return;
+    }
+
+    if (class_or_vendor_data_handler(ep->device_request, ep->rx_received))
+    {
+        setup_transaction_reply_in_with_zero(ep);
+    }
+    else
+    {
+        setup_transaction_stall(ep);
+    }
+}
+
 void hal5_usb_device_setup_transaction_completed_ep0(
         hal5_usb_endpoint_t* ep)
 {
     assert (ep->endp == 0);
     assert (ep->device_request != NULL);
 
+    HAL5_USB_TRACE_SETUP(ep->device_request);
+
     // log all data of SETUP
-    CONSOLE("S 0x%02X 0x%02X 0x%04X 0x%04X 0x%04X\n", 
+    USB_TRACE("S 0x%02X 0x%02X 0x%04X 0x%04X 0x%04X\n", 
             ep->device_request->bmRequestType, 
             ep->device_request->bRequest,
             ep->device_request->wValue, 
@@ -999,7 +1346,7 @@ void hal5_usb_device_setup_transaction_completed_ep0(
             ep->device_request->wLength);
 
     // log the request type and recipient
-    CONSOLE("%s.%s",
+    USB_TRACE("%s.%s",
             bRequestLabel(ep->device_request->bRequest),
             bmRequestTypeRecipientLabel(
                 ep->device_request->bmRequestType));
@@ -1007,7 +1354,7 @@ void hal5_usb_device_setup_transaction_completed_ep0(
     // log GET_DESCRIPTOR parameters
     if (ep->device_request->bRequest == 0x06)
     {
-        CONSOLE(".%s (%u)\n",
+        USB_TRACE(".%s (%u)\n",
                 wValueDescriptorTypeLabel(
                     ep->device_request->wValue),
                 ep->device_request->wValue & 0xFF);
@@ -1015,11 +1362,11 @@ void hal5_usb_device_setup_transaction_completed_ep0(
     // log SET_ADDRESS parameters
     else if (ep->device_request->bRequest == 0x05)
     {
-        CONSOLE(" (%u)\n", ep->device_request->wValue);
+        USB_TRACE(" (%u)\n", ep->device_request->wValue);
     }
     else
     {
-        CONSOLE("\n");
+        USB_TRACE("\n");
     }
 
     // when a SETUP transaction arrives
@@ -1027,92 +1374,33 @@ void hal5_usb_device_setup_transaction_completed_ep0(
     // standard_request is set in individual functions
     standard_request = standard_request_null;
 
-    switch (ep->device_request->bmRequestType)
-    {
-        // recipient = DEVICE
-        // data transfer direction = HOST TO DEVICE
-        case 0x00:
-            {
-                switch (ep->device_request->bRequest)
-                {
-                    case 0x01: device_clear_feature(ep); break;
-                    case 0x03: device_set_feature(ep); break;
-                    case 0x05: device_set_address(ep); break;
-                    case 0x07: device_set_descriptor(ep); break;
-                    case 0x09: device_set_configuration(ep); break;
-                }
-            } 
-            break;
-
-        // recipient = DEVICE
-        // data transfer direction = DEVICE TO HOST
-        case 0x80:
-            {
-                switch (ep->device_request->bRequest)
-                {
-                    case 0x00: device_get_status(ep); break;
-                    case 0x06: device_get_descriptor(ep); break;
-                    case 0x08: device_get_configuration(ep); break;
-                }
-            } 
-            break;
-
-        // recipient = INTERFACE
-        // data transfer direction = HOST TO DEVICE
-        case 0x01:
-            {
-                switch (ep->device_request->bRequest)
-                {
-                    case 0x01: interface_clear_feature(ep); break;
-                    case 0x03: interface_set_feature(ep); break;
-                    case 0x11: interface_set_interface(ep); break;
-                }
-            } 
-            break;
-
-        // recipient = INTERFACE
-        // data transfer direction = DEVICE TO HOST
-        case 0x81:
-            {
-                switch (ep->device_request->bRequest)
-                {
-                    case 0x00: interface_get_status(ep); break;
-                    case 0x0A: interface_get_interface(ep); break;
-                }
-            } 
-            break;
+    const uint8_t bmRequestType = ep->device_request->bmRequestType;
+    const uint8_t bRequest = ep->device_request->bRequest;
 
-        // recipient = ENDPOINT
-        // data transfer direction = HOST TO DEVICE
-        case 0x02:
-            {
-                switch (ep->device_request->bRequest)
-                {
-                    case 0x01: endpoint_clear_feature(ep); break;
-                    case 0x03: endpoint_set_feature(ep); break;
-                }
-            } 
-            break;
+    const uint8_t type = (bmRequestType >> 5) & 0x3;
+    const uint8_t recipient = bmRequestType & 0x1F;
+    const uint8_t direction = (bmRequestType >> 7) & 0x1;
 
-        // recipient = ENDPOINT
-        // data transfer direction = DEVICE TO HOST
-        case 0x82:
-            {
-                switch (ep->device_request->bRequest)
-                {
-                    case 0x00: endpoint_get_status(ep); break;
-                    case 0x12: endpoint_synch_frame(ep); break;
-                }
-            } 
-            break;
+    if (type == 0)
+    {
+        if ((recipient < 3) && (bRequest < NUMBER_OF_STANDARD_REQUESTS))
+        {
+            const request_handler_t handler = 
+                standard_request_handlers[recipient][direction][bRequest];
 
+            if (handler != NULL) handler(ep);
+        }
+    }
+    else
+    {
+        class_or_vendor_request(ep);
     }
 
-    // either it is not catched by any case above
+    // either it is not catched by the tables above
     // or I have forgotten to set standard_request in individual functions
     if (standard_request == standard_request_null)
     {
-        CONSOLE("unknown standard request: bmRequestType: 0x%02X, bRequest: 0x%02X\n", 
+        USB_WARN("unknown request: bmRequestType: 0x%02X, bRequest: 0x%02X\n", 
                 ep->device_request->bmRequestType,
                 ep->device_request->bRequest);
 
@@ -1125,7 +1413,7 @@ void hal5_usb_device_out_stage_completed_ep0(
 {
     assert (ep->endp == 0);
 
-    CONSOLE("O\n");
+    USB_TRACE("O\n");
 
     switch (standard_request)
     {
@@ -1154,6 +1442,7 @@ void hal5_usb_device_out_stage_completed_ep0(
         case standard_request_endpoint_get_status:
         case standard_request_interface_get_interface:
         case standard_request_device_get_descriptor:
+        case standard_request_interface_get_descriptor:
         case standard_request_device_get_configuration:
         case standard_request_endpoint_synch_frame:
             standard_request_completed(ep);
@@ -1166,6 +1455,12 @@ void hal5_usb_device_out_stage_completed_ep0(
             // this cannot happen
             assert (false);
             break;
+
+        // SETUP IN OUT_0 or SETUP OUT IN_0
+        case standard_request_class_or_vendor:
+            if (class_or_vendor_request_in) standard_request_completed(ep);
+            else class_or_vendor_request_data_stage_completed(ep);
+            break;
     }
 }
 
@@ -1174,7 +1469,7 @@ void hal5_usb_device_in_stage_completed_ep0(
 {
     assert (ep->endp == 0);
 
-    CONSOLE("I\n");
+    USB_TRACE("I\n");
 
     switch (standard_request)
     {
@@ -1217,6 +1512,7 @@ void hal5_usb_device_in_stage_completed_ep0(
         case standard_request_interface_get_status:
         case standard_request_endpoint_get_status:
         case standard_request_device_get_descriptor:
+        case standard_request_interface_get_descriptor:
         case standard_request_device_get_configuration:
         case standard_request_interface_get_interface:
         case standard_request_endpoint_synch_frame:
@@ -1227,5 +1523,11 @@ void hal5_usb_device_in_stage_completed_ep0(
         case standard_request_device_set_descriptor:
             standard_request_completed(ep);
             break;
+
+        // SETUP IN OUT_0 or SETUP (OUT) IN_0
+        case standard_request_class_or_vendor:
+            if (class_or_vendor_request_in) setup_transaction_ack_out_zero(ep);
+            else standard_request_completed(ep);
+            break;
     }
 }
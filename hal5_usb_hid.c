@@ -0,0 +1,243 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stm32h5xx.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_hid.h"
+
+static uint8_t interface;
+static uint8_t in_endpoint;
+static size_t report_size;
+
+// the last report given, it is copied to USB SRAM by in_packet
+static uint8_t report[HAL5_USB_HID_MAX_REPORT_SIZE];
+// true if report is not copied to USB SRAM yet
+static volatile bool report_pending = false;
+
+// set by the packet callback when it stops the stream
+// cleared by send_report when it starts it again
+static volatile bool in_stopped = true;
+
+// frame number when the last report is copied to USB SRAM
+static volatile uint16_t last_frame;
+
+// in 4 ms units
+static volatile uint8_t idle_rate = 0;
+
+static hal5_usb_hid_stats_t stats;
+
+static hal5_usb_endpoint_t* get_endpoint(uint8_t bEndpointAddress)
+{
+    return hal5_usb_device_get_endpoint(
+            bEndpointAddress & 0xF, 
+            (bEndpointAddress & 0x80) != 0);
+}
+
+static uint16_t get_frame_number(void)
+{
+    return USB_DRD_FS->FNR & USB_FNR_FN;
+}
+
+// the next IN packet, called by hal5_usb_device_start_stream when the 
+// stream is started and from the interrupt handler when a report is sent
+static bool in_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    if (!report_pending)
+    {
+        in_stopped = true;
+        return false;
+    }
+
+    memcpy(data, report, report_size);
+    *size = report_size;
+
+    report_pending = false;
+    last_frame = get_frame_number();
+    stats.reports++;
+
+    return true;
+}
+
+// loads the report and starts the stream if it is stopped
+static bool send(const void* data, bool idle)
+{
+    hal5_usb_endpoint_t* ep = get_endpoint(in_endpoint);
+
+    if (ep == NULL) return false;
+
+    hal5_usb_device_lock();
+
+    if (report_pending) stats.reports_replaced++;
+    if (idle) stats.idle_reports++;
+
+    if (data != report) memcpy(report, data, report_size);
+    report_pending = true;
+
+    const bool start = in_stopped;
+    in_stopped = false;
+
+    hal5_usb_device_unlock();
+
+    // the report is copied to USB SRAM here
+    if (start) hal5_usb_device_start_stream(ep);
+
+    return true;
+}
+
+// class requests
+
+static bool get_report(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    // input report without report ID
+    if ((request->wIndex != interface) || 
+            (request->wValue != (HAL5_USB_HID_REPORT_INPUT << 8)))
+    {
+        return false;
+    }
+
+    stats.get_reports++;
+
+    *data = report;
+    *data_size = report_size;
+
+    return true;
+}
+
+static bool get_idle(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    if ((request->wIndex != interface) || (request->wValue != 0)) 
+    {
+        return false;
+    }
+
+    *data = (const void*) &idle_rate;
+    *data_size = 1;
+
+    return true;
+}
+
+static bool set_idle(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    // all reports (report ID 0)
+    if ((request->wIndex != interface) || ((request->wValue & 0xFF) != 0))
+    {
+        return false;
+    }
+
+    idle_rate = request->wValue >> 8;
+
+    return true;
+}
+
+bool hal5_usb_hid_initialize(
+        uint8_t interface_,
+        uint8_t in_endpoint_,
+        size_t report_size_)
+{
+    assert (in_endpoint_ & 0x80);
+    assert ((report_size_ > 0) && 
+            (report_size_ <= HAL5_USB_HID_MAX_REPORT_SIZE));
+
+    interface = interface_;
+    in_endpoint = in_endpoint_;
+    report_size = report_size_;
+
+    bool ok = true;
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_HID_GET_REPORT, 
+            get_report, NULL);
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_HID_GET_IDLE, 
+            get_idle, NULL);
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_HID_SET_IDLE, 
+            set_idle, NULL);
+
+    ok = ok && hal5_usb_device_register_packet_callback(
+            in_endpoint, in_packet, NULL);
+
+    return ok;
+}
+
+void hal5_usb_hid_start(void)
+{
+    assert (get_endpoint(in_endpoint)->mps >= report_size);
+
+    memset(report, 0, sizeof(report));
+    report_pending = false;
+    in_stopped = true;
+    idle_rate = 0;
+    last_frame = get_frame_number();
+
+    memset(&stats, 0, sizeof(stats));
+}
+
+bool hal5_usb_hid_send_report(
+        const void* data)
+{
+    return send(data, false);
+}
+
+void hal5_usb_hid_process(void)
+{
+    const uint8_t rate = idle_rate;
+
+    // the stream is stopped, so last_frame is not changed here
+    if ((rate == 0) || !in_stopped) return;
+
+    const uint16_t elapsed = (get_frame_number() - last_frame) & USB_FNR_FN;
+
+    if (elapsed >= (rate * 4)) send(report, true);
+}
+
+uint8_t hal5_usb_hid_get_idle_rate(void)
+{
+    return idle_rate;
+}
+
+void hal5_usb_hid_get_stats(hal5_usb_hid_stats_t* stats_)
+{
+    *stats_ = stats;
+}
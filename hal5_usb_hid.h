@@ -0,0 +1,117 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// HID class driver, one interface with an interrupt IN endpoint
+//
+// the descriptors are generated with hid.py (hid_interface), the HID and
+// report descriptors are returned to Get Descriptor by ep0 from the
+// descriptors generated by create_descriptors.py
+// class requests handled through ep0: GET_REPORT, GET_IDLE and SET_IDLE
+// there are no report IDs, no output or feature reports and no boot protocol
+//
+// the IN endpoint is used in streaming mode (packet callback)
+// hal5_usb_hid_send_report copies the report to USB SRAM and makes the 
+// endpoint VALID if it is idle, so the report is loaded before the host 
+// polls, and the endpoint NAKs the polls (without an interrupt) when there 
+// is no new report
+// if a report is already waiting in USB SRAM, the new one is loaded in the
+// interrupt handler when that one is sent, a newer report replaces it
+//
+// with a non-zero idle rate (SET_IDLE), the last report is sent again 
+// when it is not changed for the idle duration, by hal5_usb_hid_process
+//
+// send_report and process should be called from one context (e.g. the 
+// main loop), or from hal5_usb_device_process_events's context in 
+// deferred mode
+
+#ifndef __HAL5_USB_HID_H__
+#define __HAL5_USB_HID_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <stm32h5xx.h>
+
+// max. size of the input report, it has to fit to one packet
+#ifndef HAL5_USB_HID_MAX_REPORT_SIZE
+#define HAL5_USB_HID_MAX_REPORT_SIZE    (64)
+#endif
+
+// class requests
+#define HAL5_USB_HID_GET_REPORT         (0x01)
+#define HAL5_USB_HID_GET_IDLE           (0x02)
+#define HAL5_USB_HID_SET_IDLE           (0x0A)
+
+// descriptor types
+#define HAL5_USB_HID_DESCRIPTOR         (0x21)
+#define HAL5_USB_HID_REPORT_DESCRIPTOR  (0x22)
+
+// report types (wValue high byte of GET_REPORT)
+#define HAL5_USB_HID_REPORT_INPUT       (0x01)
+
+typedef struct
+{
+    // reports copied to USB SRAM, also the ones sent again for idle rate
+    uint32_t reports;
+    // reports replaced by a newer one before they are copied
+    uint32_t reports_replaced;
+    // reports sent again for idle rate
+    uint32_t idle_reports;
+    uint32_t get_reports;
+} hal5_usb_hid_stats_t;
+
+// registers the class requests and the packet callback of the IN endpoint
+// call once before hal5_usb_device_connect
+// interface is bInterfaceNumber of the HID interface
+// in_endpoint is bEndpointAddress (e.g. 0x81)
+// report_size is the size of the input report in bytes
+// returns false if the requests cannot be registered
+bool hal5_usb_hid_initialize(
+        uint8_t interface,
+        uint8_t in_endpoint,
+        size_t report_size);
+
+// call from hal5_usb_device_set_configuration_ex when a configuration 
+// with the HID interface is set, the report is all zeros then
+void hal5_usb_hid_start(void);
+
+// report_size bytes of report is sent at the next poll
+// returns false if the device is not configured
+bool hal5_usb_hid_send_report(
+        const void* report);
+
+// sends the last report again if the idle duration is passed
+// call it from the main loop, at least once in every 4 ms
+void hal5_usb_hid_process(void);
+
+// idle rate in 4 ms units, 0 means the report is only sent when it changes
+uint8_t hal5_usb_hid_get_idle_rate(void);
+
+void hal5_usb_hid_get_stats(hal5_usb_hid_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
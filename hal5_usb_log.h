@@ -0,0 +1,98 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// compile-time log levels of the USB stack
+//
+// a source file defines HAL5_USB_LOG_MODULE_LEVEL (as one of the module
+// levels below) and then includes this file, the log macros call CONSOLE
+// only if the level of the module is high enough
+// the calls above the level are compiled out, but the arguments are still
+// type checked, so they do not rot
+//
+// levels are selected at build time, e.g.
+// -DHAL5_USB_LOG_LEVEL=HAL5_USB_LOG_WARN for all modules
+// -DHAL5_USB_DEVICE_LOG_LEVEL=HAL5_USB_LOG_TRACE for hal5_usb_device.c only
+//
+// TRACE logs every transaction in USB interrupt handler, it changes the 
+// timing significantly when CONSOLE is a blocking UART
+
+#ifndef __HAL5_USB_LOG_H__
+#define __HAL5_USB_LOG_H__
+
+#include "hal5.h"
+
+#define HAL5_USB_LOG_NONE       (0)
+#define HAL5_USB_LOG_ERROR      (1)
+#define HAL5_USB_LOG_WARN       (2)
+#define HAL5_USB_LOG_INFO       (3)
+#define HAL5_USB_LOG_TRACE      (4)
+
+// default level of all modules
+#ifndef HAL5_USB_LOG_LEVEL
+#define HAL5_USB_LOG_LEVEL HAL5_USB_LOG_INFO
+#endif
+
+// hal5_usb.c
+#ifndef HAL5_USB_EP_LOG_LEVEL
+#define HAL5_USB_EP_LOG_LEVEL HAL5_USB_LOG_LEVEL
+#endif
+
+// hal5_usb_device.c
+#ifndef HAL5_USB_DEVICE_LOG_LEVEL
+#define HAL5_USB_DEVICE_LOG_LEVEL HAL5_USB_LOG_LEVEL
+#endif
+
+// hal5_usb_device_ep0.c
+#ifndef HAL5_USB_EP0_LOG_LEVEL
+#define HAL5_USB_EP0_LOG_LEVEL HAL5_USB_LOG_LEVEL
+#endif
+
+#ifndef HAL5_USB_LOG_MODULE_LEVEL
+#error "HAL5_USB_LOG_MODULE_LEVEL is not defined"
+#endif
+
+#define HAL5_USB_LOG_DISABLED(...) \
+    do { if (0) CONSOLE(__VA_ARGS__); } while (0)
+
+#if HAL5_USB_LOG_MODULE_LEVEL >= HAL5_USB_LOG_ERROR
+#define USB_ERROR(...) CONSOLE(__VA_ARGS__)
+#else
+#define USB_ERROR(...) HAL5_USB_LOG_DISABLED(__VA_ARGS__)
+#endif
+
+#if HAL5_USB_LOG_MODULE_LEVEL >= HAL5_USB_LOG_WARN
+#define USB_WARN(...) CONSOLE(__VA_ARGS__)
+#else
+#define USB_WARN(...) HAL5_USB_LOG_DISABLED(__VA_ARGS__)
+#endif
+
+#if HAL5_USB_LOG_MODULE_LEVEL >= HAL5_USB_LOG_INFO
+#define USB_INFO(...) CONSOLE(__VA_ARGS__)
+#else
+#define USB_INFO(...) HAL5_USB_LOG_DISABLED(__VA_ARGS__)
+#endif
+
+#if HAL5_USB_LOG_MODULE_LEVEL >= HAL5_USB_LOG_TRACE
+#define USB_TRACE(...) CONSOLE(__VA_ARGS__)
+#else
+#define USB_TRACE(...) HAL5_USB_LOG_DISABLED(__VA_ARGS__)
+#endif
+
+#endif
@@ -0,0 +1,712 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stm32h5xx.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_msc.h"
+
+static_assert (sizeof(hal5_usb_msc_cbw_t) == 31, "CBW has to be 31 bytes");
+static_assert (sizeof(hal5_usb_msc_csw_t) == 13, "CSW has to be 13 bytes");
+
+static_assert ((HAL5_USB_MSC_BUFFERS > 0) && 
+        (HAL5_USB_MSC_BUFFERS <= HAL5_USB_TRANSFER_QUEUE_SIZE),
+        "HAL5_USB_MSC_BUFFERS has to be 1..HAL5_USB_TRANSFER_QUEUE_SIZE");
+
+typedef enum
+{
+    // not started
+    msc_state_idle,
+    // waiting for CBW
+    msc_state_cbw,
+    // the data of a command other than READ(10)/WRITE(10) is being sent
+    msc_state_data_in,
+    // READ(10), the blocks are read and sent
+    msc_state_read,
+    // WRITE(10), the blocks are received and written
+    msc_state_write,
+    // CSW is being sent
+    msc_state_csw,
+    // invalid CBW, waiting for Bulk-Only Mass Storage Reset
+    msc_state_reset_needed,
+} msc_state_t;
+
+static uint8_t interface;
+static uint8_t in_endpoint;
+static uint8_t out_endpoint;
+static const hal5_usb_msc_block_device_t* block_device;
+
+static volatile msc_state_t state = msc_state_idle;
+
+static hal5_usb_msc_cbw_t cbw;
+static hal5_usb_msc_csw_t csw;
+
+// the data of the commands other than READ(10)/WRITE(10)
+// standard INQUIRY data is the largest
+static uint8_t response[36];
+
+// bytes transferred in the data stage
+static uint32_t data_transferred;
+
+// READ(10) and WRITE(10)
+static uint8_t blocks[HAL5_USB_MSC_BUFFERS][HAL5_USB_MSC_BLOCK_SIZE] 
+    __ALIGNED(4);
+static uint32_t blocks_lba;
+// it is reduced if the data stage ends early
+static volatile uint32_t blocks_total;
+// READ: read and submitted, WRITE: submitted (hal5_usb_msc_process)
+static uint32_t blocks_issued;
+// READ: sent, WRITE: received (interrupt handler)
+static volatile uint32_t blocks_transferred;
+// WRITE: written to block device (hal5_usb_msc_process)
+static uint32_t blocks_written;
+// WRITE: a block cannot be written, the rest is received but not written
+static bool blocks_write_failed;
+// WRITE: the host ended the data stage with a short packet
+static volatile bool blocks_short;
+
+// sense data, reported and cleared by REQUEST SENSE
+static uint8_t sense_key;
+static uint8_t sense_asc;
+
+static hal5_usb_msc_stats_t stats;
+
+static hal5_usb_endpoint_t* get_endpoint(uint8_t bEndpointAddress)
+{
+    return hal5_usb_device_get_endpoint(
+            bEndpointAddress & 0xF, 
+            (bEndpointAddress & 0x80) != 0);
+}
+
+static uint32_t get_be32(const uint8_t* p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | 
+        ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint16_t get_be16(const uint8_t* p)
+{
+    return ((uint16_t) p[0] << 8) | p[1];
+}
+
+static void put_be32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// copies s and pads it with spaces to size
+static void put_string(uint8_t* p, const char* s, size_t size)
+{
+    const size_t len = HAL5_MIN(strlen(s), size);
+    memcpy(p, s, len);
+    memset(p + len, ' ', size - len);
+}
+
+// the command fails with the sense data
+static void fail(uint8_t key, uint8_t asc)
+{
+    sense_key = key;
+    sense_asc = asc;
+    csw.bCSWStatus = HAL5_USB_MSC_CSW_FAILED;
+}
+
+// CBW and CSW
+
+static void cbw_received(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer);
+
+static void csw_sent(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer)
+{
+    if (state == msc_state_csw) state = msc_state_cbw;
+}
+
+static void send_csw(void)
+{
+    csw.dCSWSignature = HAL5_USB_MSC_CSW_SIGNATURE;
+    csw.dCSWDataResidue = cbw.dCBWDataTransferLength - data_transferred;
+
+    if (csw.bCSWStatus == HAL5_USB_MSC_CSW_FAILED) stats.failed_commands++;
+    else if (csw.bCSWStatus == HAL5_USB_MSC_CSW_PHASE_ERROR) 
+        stats.phase_errors++;
+
+    state = msc_state_csw;
+
+    // if an endpoint is halted, these are started when the host clears it
+    hal5_usb_device_submit(
+            get_endpoint(in_endpoint), 
+            &csw, 
+            sizeof(csw), 
+            0, 
+            csw_sent, 
+            NULL);
+
+    // the next CBW can be received as soon as the CSW is read
+    hal5_usb_device_submit(
+            get_endpoint(out_endpoint), 
+            &cbw, 
+            sizeof(cbw), 
+            0, 
+            cbw_received, 
+            NULL);
+}
+
+// the data stage is ended
+// the pipe in the direction of the host is STALLed if less than 
+// dCBWDataTransferLength is transferred, so the host stops waiting for it
+static void end_data(void)
+{
+    if (data_transferred < cbw.dCBWDataTransferLength)
+    {
+        hal5_usb_device_set_endpoint_halt(
+                get_endpoint(
+                    (cbw.bmCBWFlags & 0x80) ? in_endpoint : out_endpoint),
+                true);
+    }
+
+    send_csw();
+}
+
+// the device and the host disagree on the data stage (direction or length)
+static void phase_error(void)
+{
+    csw.bCSWStatus = HAL5_USB_MSC_CSW_PHASE_ERROR;
+    data_transferred = 0;
+    end_data();
+}
+
+// RESPONSE DATA (commands other than READ(10)/WRITE(10))
+
+static void response_sent(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer)
+{
+    data_transferred = transfer->actual_length;
+    end_data();
+}
+
+// READ(10)
+
+static void block_sent(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer)
+{
+    data_transferred += transfer->actual_length;
+    blocks_transferred++;
+    stats.blocks_read++;
+
+    if (blocks_transferred == blocks_total) end_data();
+}
+
+// the blocks are read to the free buffers and submitted
+// the buffers of the blocks submitted are free when they are sent
+static void read_blocks(void)
+{
+    while ((blocks_issued < blocks_total) && 
+            ((blocks_issued - blocks_transferred) < HAL5_USB_MSC_BUFFERS))
+    {
+        uint8_t* block = blocks[blocks_issued % HAL5_USB_MSC_BUFFERS];
+
+        if (!block_device->read(
+                    block_device, 
+                    blocks_lba + blocks_issued, 
+                    block))
+        {
+            fail(HAL5_USB_MSC_SENSE_MEDIUM_ERROR, 
+                    HAL5_USB_MSC_ASC_UNRECOVERED_READ_ERROR);
+
+            // the blocks already submitted are sent
+            // the data stage is ended here only if they are sent already
+            hal5_usb_device_lock();
+            blocks_total = blocks_issued;
+            const bool ended = (blocks_transferred == blocks_total);
+            hal5_usb_device_unlock();
+
+            if (ended) end_data();
+
+            return;
+        }
+
+        blocks_issued++;
+
+        hal5_usb_device_submit(
+                get_endpoint(in_endpoint),
+                block,
+                HAL5_USB_MSC_BLOCK_SIZE,
+                transfer_flag_no_zlp,
+                block_sent,
+                NULL);
+    }
+}
+
+// WRITE(10)
+
+static void block_received(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer)
+{
+    data_transferred += transfer->actual_length;
+
+    if (transfer->actual_length == HAL5_USB_MSC_BLOCK_SIZE)
+    {
+        blocks_transferred++;
+    }
+    else
+    {
+        // the partial block is not written, see write_blocks
+        blocks_short = true;
+        csw.bCSWStatus = HAL5_USB_MSC_CSW_PHASE_ERROR;
+    }
+}
+
+// the free buffers are submitted to receive the next blocks
+// the buffers of the blocks received are free when they are written
+static void submit_write_blocks(void)
+{
+    while ((blocks_issued < blocks_total) && 
+            ((blocks_issued - blocks_written) < HAL5_USB_MSC_BUFFERS) &&
+            !blocks_short)
+    {
+        hal5_usb_device_submit(
+                get_endpoint(out_endpoint),
+                blocks[blocks_issued % HAL5_USB_MSC_BUFFERS],
+                HAL5_USB_MSC_BLOCK_SIZE,
+                0,
+                block_received,
+                NULL);
+
+        blocks_issued++;
+    }
+}
+
+static void write_blocks(void)
+{
+    while (blocks_written < blocks_transferred)
+    {
+        const uint8_t* block = blocks[blocks_written % HAL5_USB_MSC_BUFFERS];
+
+        if (!blocks_write_failed && 
+                !block_device->write(
+                    block_device, 
+                    blocks_lba + blocks_written, 
+                    block))
+        {
+            blocks_write_failed = true;
+            fail(HAL5_USB_MSC_SENSE_MEDIUM_ERROR, 
+                    HAL5_USB_MSC_ASC_WRITE_ERROR);
+        }
+
+        if (!blocks_write_failed) stats.blocks_written++;
+
+        blocks_written++;
+
+        submit_write_blocks();
+    }
+
+    if (blocks_short)
+    {
+        // the host does not send the blocks submitted after the short 
+        // packet, it waits for CSW now
+        hal5_usb_device_cancel_transfers(get_endpoint(out_endpoint));
+        end_data();
+    }
+    else if (blocks_written == blocks_total)
+    {
+        end_data();
+    }
+}
+
+// SCSI COMMANDS
+// the device intends to transfer data_length bytes
+// in the direction of data_in (if data_length > 0)
+
+typedef struct
+{
+    bool data_in;
+    uint32_t data_length;
+} scsi_data_t;
+
+static void scsi_inquiry(scsi_data_t* data)
+{
+    // EVPD, vital product data pages are not supported
+    if (cbw.CBWCB[1] & 0x01)
+    {
+        fail(HAL5_USB_MSC_SENSE_ILLEGAL_REQUEST, 
+                HAL5_USB_MSC_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+
+    memset(response, 0, sizeof(response));
+    // direct access block device
+    response[0] = 0x00;
+    // removable
+    response[1] = 0x80;
+    // SPC-2
+    response[2] = 0x04;
+    // response data format
+    response[3] = 0x02;
+    // additional length
+    response[4] = sizeof(response) - 5;
+    put_string(&response[8], HAL5_USB_MSC_VENDOR, 8);
+    put_string(&response[16], HAL5_USB_MSC_PRODUCT, 16);
+    put_string(&response[32], HAL5_USB_MSC_REVISION, 4);
+
+    data->data_in = true;
+    data->data_length = HAL5_MIN(
+            get_be16(&cbw.CBWCB[3]), 
+            sizeof(response));
+}
+
+static void scsi_request_sense(scsi_data_t* data)
+{
+    // fixed format
+    memset(response, 0, 18);
+    response[0] = 0x70;
+    response[2] = sense_key;
+    // additional sense length
+    response[7] = 10;
+    response[12] = sense_asc;
+
+    sense_key = HAL5_USB_MSC_SENSE_NO_SENSE;
+    sense_asc = 0;
+
+    data->data_in = true;
+    data->data_length = HAL5_MIN(cbw.CBWCB[4], 18);
+}
+
+static void scsi_mode_sense_6(scsi_data_t* data)
+{
+    // only the header, no block descriptors and no pages
+    // mode data length, medium type, device-specific parameter
+    // (WP) and block descriptor length
+    response[0] = 3;
+    response[1] = 0;
+    response[2] = block_device->read_only ? 0x80 : 0x00;
+    response[3] = 0;
+
+    data->data_in = true;
+    data->data_length = HAL5_MIN(cbw.CBWCB[4], 4);
+}
+
+static void scsi_read_capacity_10(scsi_data_t* data)
+{
+    // the last LBA and the block size
+    put_be32(&response[0], block_device->block_count - 1);
+    put_be32(&response[4], HAL5_USB_MSC_BLOCK_SIZE);
+
+    data->data_in = true;
+    data->data_length = 8;
+}
+
+// READ(10) and WRITE(10)
+static void scsi_read_write_10(scsi_data_t* data, bool read)
+{
+    const uint32_t lba = get_be32(&cbw.CBWCB[2]);
+    const uint32_t count = get_be16(&cbw.CBWCB[7]);
+
+    if ((lba > block_device->block_count) || 
+            (count > (block_device->block_count - lba)))
+    {
+        fail(HAL5_USB_MSC_SENSE_ILLEGAL_REQUEST, 
+                HAL5_USB_MSC_ASC_LBA_OUT_OF_RANGE);
+        return;
+    }
+
+    if (!read && block_device->read_only)
+    {
+        fail(HAL5_USB_MSC_SENSE_DATA_PROTECT, 
+                HAL5_USB_MSC_ASC_WRITE_PROTECTED);
+        return;
+    }
+
+    blocks_lba = lba;
+    blocks_total = count;
+    blocks_issued = 0;
+    blocks_transferred = 0;
+    blocks_written = 0;
+    blocks_write_failed = false;
+    blocks_short = false;
+
+    data->data_in = read;
+    data->data_length = count * HAL5_USB_MSC_BLOCK_SIZE;
+}
+
+static void scsi_command(scsi_data_t* data)
+{
+    switch (cbw.CBWCB[0])
+    {
+        case HAL5_USB_MSC_SCSI_TEST_UNIT_READY: 
+            // the medium is always present
+            break;
+
+        case HAL5_USB_MSC_SCSI_REQUEST_SENSE: 
+            scsi_request_sense(data); 
+            break;
+
+        case HAL5_USB_MSC_SCSI_INQUIRY: 
+            scsi_inquiry(data); 
+            break;
+
+        case HAL5_USB_MSC_SCSI_MODE_SENSE_6: 
+            scsi_mode_sense_6(data); 
+            break;
+
+        case HAL5_USB_MSC_SCSI_READ_CAPACITY_10: 
+            scsi_read_capacity_10(data); 
+            break;
+
+        case HAL5_USB_MSC_SCSI_READ_10: 
+            scsi_read_write_10(data, true); 
+            break;
+
+        case HAL5_USB_MSC_SCSI_WRITE_10: 
+            scsi_read_write_10(data, false); 
+            break;
+
+        default:
+            fail(HAL5_USB_MSC_SENSE_ILLEGAL_REQUEST, 
+                    HAL5_USB_MSC_ASC_INVALID_COMMAND);
+            break;
+    }
+}
+
+static bool is_cbw_valid(const hal5_usb_transfer_t* transfer)
+{
+    return (transfer->actual_length == sizeof(cbw)) &&
+        !transfer->overflow &&
+        (cbw.dCBWSignature == HAL5_USB_MSC_CBW_SIGNATURE) &&
+        (cbw.bCBWLUN == 0) &&
+        (cbw.bCBWCBLength >= 1) && 
+        (cbw.bCBWCBLength <= 16);
+}
+
+static void cbw_received(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer)
+{
+    // the host sends the CBW only after it reads CSW
+    // so csw_sent might be called after this
+    if ((state != msc_state_cbw) && (state != msc_state_csw)) return;
+
+    if (!is_cbw_valid(transfer))
+    {
+        // both pipes are STALLed until Reset Recovery
+        stats.invalid_cbws++;
+        state = msc_state_reset_needed;
+        hal5_usb_device_set_endpoint_halt(ep, true);
+        hal5_usb_device_set_endpoint_halt(get_endpoint(in_endpoint), true);
+        return;
+    }
+
+    stats.commands++;
+
+    csw.dCSWTag = cbw.dCBWTag;
+    csw.bCSWStatus = HAL5_USB_MSC_CSW_PASSED;
+    data_transferred = 0;
+
+    scsi_data_t data = {false, 0};
+
+    scsi_command(&data);
+
+    const uint32_t host_length = cbw.dCBWDataTransferLength;
+    const bool host_in = (cbw.bmCBWFlags & 0x80) != 0;
+
+    // the thirteen cases of the BOT specification
+    // the host expects more data or no data, when the device sends or 
+    // receives less, the pipe is STALLed and the residue is in CSW
+    // the other cases are phase errors
+    if (data.data_length == 0)
+    {
+        end_data();
+    }
+    else if ((host_length < data.data_length) || 
+            (host_in != data.data_in))
+    {
+        phase_error();
+    }
+    else if (!data.data_in)
+    {
+        state = msc_state_write;
+        submit_write_blocks();
+    }
+    else if (cbw.CBWCB[0] == HAL5_USB_MSC_SCSI_READ_10)
+    {
+        // the blocks are read in hal5_usb_msc_process
+        state = msc_state_read;
+    }
+    else
+    {
+        state = msc_state_data_in;
+
+        hal5_usb_device_submit(
+                get_endpoint(in_endpoint),
+                response,
+                data.data_length,
+                transfer_flag_no_zlp,
+                response_sent,
+                NULL);
+    }
+}
+
+// CLASS REQUESTS
+
+static bool bulk_only_reset(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    if ((request->wIndex != interface) || (request->wValue != 0)) 
+    {
+        return false;
+    }
+
+    stats.resets++;
+
+    // the host clears the halts after this
+    hal5_usb_device_cancel_transfers(get_endpoint(in_endpoint));
+    hal5_usb_device_cancel_transfers(get_endpoint(out_endpoint));
+
+    state = msc_state_cbw;
+
+    hal5_usb_device_submit(
+            get_endpoint(out_endpoint), 
+            &cbw, 
+            sizeof(cbw), 
+            0, 
+            cbw_received, 
+            NULL);
+
+    return true;
+}
+
+static bool get_max_lun(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    static const uint8_t max_lun = 0;
+
+    if ((request->wIndex != interface) || (request->wValue != 0)) 
+    {
+        return false;
+    }
+
+    *data = &max_lun;
+    *data_size = sizeof(max_lun);
+
+    return true;
+}
+
+bool hal5_usb_msc_initialize(
+        uint8_t interface_,
+        uint8_t in_endpoint_,
+        uint8_t out_endpoint_,
+        const hal5_usb_msc_block_device_t* block_device_)
+{
+    assert (in_endpoint_ & 0x80);
+    assert (!(out_endpoint_ & 0x80));
+    assert (block_device_ != NULL);
+    assert (block_device_->block_count > 0);
+    assert (block_device_->read != NULL);
+    assert (block_device_->read_only || (block_device_->write != NULL));
+
+    interface = interface_;
+    in_endpoint = in_endpoint_;
+    out_endpoint = out_endpoint_;
+    block_device = block_device_;
+
+    bool ok = true;
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_MSC_BULK_ONLY_RESET, 
+            bulk_only_reset, NULL);
+
+    ok = ok && hal5_usb_device_register_request_handler(
+            request_type_class, request_recipient_interface,
+            HAL5_USB_MSC_GET_MAX_LUN, 
+            get_max_lun, NULL);
+
+    return ok;
+}
+
+void hal5_usb_msc_start(void)
+{
+    sense_key = HAL5_USB_MSC_SENSE_NO_SENSE;
+    sense_asc = 0;
+
+    memset(&stats, 0, sizeof(stats));
+
+    state = msc_state_cbw;
+
+    hal5_usb_device_submit(
+            get_endpoint(out_endpoint), 
+            &cbw, 
+            sizeof(cbw), 
+            0, 
+            cbw_received, 
+            NULL);
+}
+
+void hal5_usb_msc_process(void)
+{
+    switch (state)
+    {
+        case msc_state_read: read_blocks(); break;
+        case msc_state_write: write_blocks(); break;
+        default: break;
+    }
+}
+
+bool hal5_usb_msc_clear_endpoint_halt(
+        uint8_t endpoint,
+        bool dir_in)
+{
+    const uint8_t address = endpoint | (dir_in ? 0x80 : 0x00);
+
+    if ((address != in_endpoint) && (address != out_endpoint)) return false;
+
+    hal5_usb_endpoint_t* ep = get_endpoint(address);
+
+    if (ep == NULL) return false;
+
+    // STALLed until Reset Recovery
+    if (state != msc_state_reset_needed)
+    {
+        hal5_usb_device_set_endpoint_halt(ep, false);
+    }
+
+    return true;
+}
+
+void hal5_usb_msc_get_stats(hal5_usb_msc_stats_t* stats_)
+{
+    *stats_ = stats;
+}
@@ -0,0 +1,203 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// USB Mass Storage class driver, Bulk-Only Transport (BOT)
+//
+// the descriptors are generated with msc.py (msc_interface)
+// one LUN with a SCSI transparent command set subset:
+// TEST UNIT READY, REQUEST SENSE, INQUIRY, MODE SENSE(6),
+// READ CAPACITY(10), READ(10) and WRITE(10)
+// other commands fail with ILLEGAL REQUEST (see REQUEST SENSE)
+//
+// the blocks are read from and written to a block device
+// (hal5_usb_msc_block_device_t, e.g. hal5_usb_msc_ramdisk.h)
+// in hal5_usb_msc_process, not in the interrupt handler, using 
+// HAL5_USB_MSC_BUFFERS block buffers:
+// - READ(10): the blocks are submitted to the IN endpoint from where they 
+//   are read to, so they are copied from the block buffers to USB SRAM 
+//   directly, the next block is read while the previous ones are sent
+// - WRITE(10): the blocks are received to the block buffers and written
+//   while the next ones are received
+// CBW, CSW and the other commands are handled in the interrupt handler
+//
+// the endpoints are STALLed as in BOT for the cases the host and the 
+// device do not agree on the data stage, and both are STALLed after an
+// invalid CBW until Bulk-Only Mass Storage Reset
+
+#ifndef __HAL5_USB_MSC_H__
+#define __HAL5_USB_MSC_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <stm32h5xx.h>
+
+// logical block size of the block device
+#ifndef HAL5_USB_MSC_BLOCK_SIZE
+#define HAL5_USB_MSC_BLOCK_SIZE     (512)
+#endif
+
+// number of block buffers, at most HAL5_USB_TRANSFER_QUEUE_SIZE
+#ifndef HAL5_USB_MSC_BUFFERS
+#define HAL5_USB_MSC_BUFFERS        (2)
+#endif
+
+// INQUIRY strings, padded with spaces
+#ifndef HAL5_USB_MSC_VENDOR
+#define HAL5_USB_MSC_VENDOR         "hal5"
+#endif
+
+#ifndef HAL5_USB_MSC_PRODUCT
+#define HAL5_USB_MSC_PRODUCT        "mass storage"
+#endif
+
+#ifndef HAL5_USB_MSC_REVISION
+#define HAL5_USB_MSC_REVISION       "1.0"
+#endif
+
+// class requests
+#define HAL5_USB_MSC_BULK_ONLY_RESET            (0xFF)
+#define HAL5_USB_MSC_GET_MAX_LUN                (0xFE)
+
+#define HAL5_USB_MSC_CBW_SIGNATURE              (0x43425355)
+#define HAL5_USB_MSC_CSW_SIGNATURE              (0x53425355)
+
+// bCSWStatus
+#define HAL5_USB_MSC_CSW_PASSED                 (0x00)
+#define HAL5_USB_MSC_CSW_FAILED                 (0x01)
+#define HAL5_USB_MSC_CSW_PHASE_ERROR            (0x02)
+
+// SCSI operation codes
+#define HAL5_USB_MSC_SCSI_TEST_UNIT_READY       (0x00)
+#define HAL5_USB_MSC_SCSI_REQUEST_SENSE         (0x03)
+#define HAL5_USB_MSC_SCSI_INQUIRY               (0x12)
+#define HAL5_USB_MSC_SCSI_MODE_SENSE_6          (0x1A)
+#define HAL5_USB_MSC_SCSI_READ_CAPACITY_10      (0x25)
+#define HAL5_USB_MSC_SCSI_READ_10               (0x28)
+#define HAL5_USB_MSC_SCSI_WRITE_10              (0x2A)
+
+// sense keys
+#define HAL5_USB_MSC_SENSE_NO_SENSE             (0x00)
+#define HAL5_USB_MSC_SENSE_MEDIUM_ERROR         (0x03)
+#define HAL5_USB_MSC_SENSE_ILLEGAL_REQUEST      (0x05)
+#define HAL5_USB_MSC_SENSE_DATA_PROTECT         (0x07)
+
+// additional sense codes (ASCQ is 0 for all)
+#define HAL5_USB_MSC_ASC_WRITE_ERROR            (0x0C)
+#define HAL5_USB_MSC_ASC_UNRECOVERED_READ_ERROR (0x11)
+#define HAL5_USB_MSC_ASC_INVALID_COMMAND        (0x20)
+#define HAL5_USB_MSC_ASC_LBA_OUT_OF_RANGE       (0x21)
+#define HAL5_USB_MSC_ASC_INVALID_FIELD_IN_CDB   (0x24)
+#define HAL5_USB_MSC_ASC_WRITE_PROTECTED        (0x27)
+
+// Command Block Wrapper, 31 bytes
+typedef __PACKED_STRUCT
+{
+    uint32_t dCBWSignature;
+    uint32_t dCBWTag;
+    uint32_t dCBWDataTransferLength;
+    // bit 7: 1 = device to host (IN)
+    uint8_t bmCBWFlags;
+    uint8_t bCBWLUN;
+    uint8_t bCBWCBLength;
+    uint8_t CBWCB[16];
+} hal5_usb_msc_cbw_t;
+
+// Command Status Wrapper, 13 bytes
+typedef __PACKED_STRUCT
+{
+    uint32_t dCSWSignature;
+    uint32_t dCSWTag;
+    uint32_t dCSWDataResidue;
+    uint8_t bCSWStatus;
+} hal5_usb_msc_csw_t;
+
+typedef struct hal5_usb_msc_block_device hal5_usb_msc_block_device_t;
+
+// the storage, blocks are HAL5_USB_MSC_BLOCK_SIZE bytes
+// read and write are called from hal5_usb_msc_process, one block at a time
+// and in the order of the blocks, they return false on an error
+struct hal5_usb_msc_block_device
+{
+    uint32_t block_count;
+    // WRITE(10) fails with DATA PROTECT if true, write can be NULL then
+    bool read_only;
+    bool (*read)(
+            const hal5_usb_msc_block_device_t* block_device,
+            uint32_t lba,
+            uint8_t* data);
+    bool (*write)(
+            const hal5_usb_msc_block_device_t* block_device,
+            uint32_t lba,
+            const uint8_t* data);
+    void* context;
+};
+
+typedef struct
+{
+    // valid CBWs
+    uint32_t commands;
+    uint32_t blocks_read;
+    uint32_t blocks_written;
+    // CSWs with command failed, the reason is in sense data
+    uint32_t failed_commands;
+    uint32_t phase_errors;
+    uint32_t invalid_cbws;
+    uint32_t resets;
+} hal5_usb_msc_stats_t;
+
+// registers the class requests, call once before hal5_usb_device_connect
+// interface is bInterfaceNumber of the mass storage interface
+// the endpoints are bEndpointAddress (e.g. 0x81 and 0x02)
+// block_device has to stay valid
+// returns false if the requests cannot be registered
+bool hal5_usb_msc_initialize(
+        uint8_t interface,
+        uint8_t in_endpoint,
+        uint8_t out_endpoint,
+        const hal5_usb_msc_block_device_t* block_device);
+
+// call from hal5_usb_device_set_configuration_ex when a configuration 
+// with the mass storage interface is set, it waits for a CBW then
+void hal5_usb_msc_start(void);
+
+// reads and writes the blocks of READ(10) and WRITE(10)
+// call it from the main loop, or from hal5_usb_device_process_events's 
+// context in deferred mode, the endpoints NAK until the blocks are ready
+void hal5_usb_msc_process(void);
+
+// call from hal5_usb_device_clear_endpoint_halt_ex
+// returns false if the endpoint is not one of the mass storage interface
+// the halt is not cleared after an invalid CBW until the reset
+bool hal5_usb_msc_clear_endpoint_halt(
+        uint8_t endpoint,
+        bool dir_in);
+
+void hal5_usb_msc_get_stats(hal5_usb_msc_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hal5_usb_msc.h"
+#include "hal5_usb_msc_ramdisk.h"
+
+static bool ramdisk_read(
+        const hal5_usb_msc_block_device_t* block_device,
+        uint32_t lba,
+        uint8_t* data)
+{
+    const uint8_t* memory = (const uint8_t*) block_device->context;
+
+    memcpy(data, 
+            memory + (lba * HAL5_USB_MSC_BLOCK_SIZE), 
+            HAL5_USB_MSC_BLOCK_SIZE);
+
+    return true;
+}
+
+static bool ramdisk_write(
+        const hal5_usb_msc_block_device_t* block_device,
+        uint32_t lba,
+        const uint8_t* data)
+{
+    uint8_t* memory = (uint8_t*) block_device->context;
+
+    memcpy(memory + (lba * HAL5_USB_MSC_BLOCK_SIZE), 
+            data,
+            HAL5_USB_MSC_BLOCK_SIZE);
+
+    return true;
+}
+
+void hal5_usb_msc_ramdisk_initialize(
+        hal5_usb_msc_block_device_t* block_device,
+        void* memory,
+        uint32_t block_count,
+        bool read_only)
+{
+    assert (block_device != NULL);
+    assert (memory != NULL);
+    assert (block_count > 0);
+
+    block_device->block_count = block_count;
+    block_device->read_only = read_only;
+    block_device->read = ramdisk_read;
+    block_device->write = read_only ? NULL : ramdisk_write;
+    block_device->context = memory;
+}
@@ -0,0 +1,48 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// a block device (hal5_usb_msc_block_device_t) on memory
+// e.g. a RAM disk, or read-only on a memory mapped region of the internal
+// flash (read_only=true), the blocks are copied with memcpy
+
+#ifndef __HAL5_USB_MSC_RAMDISK_H__
+#define __HAL5_USB_MSC_RAMDISK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal5_usb_msc.h"
+
+// memory has to be block_count * HAL5_USB_MSC_BLOCK_SIZE bytes
+// it is not written if read_only is true
+void hal5_usb_msc_ramdisk_initialize(
+        hal5_usb_msc_block_device_t* block_device,
+        void* memory,
+        uint32_t block_count,
+        bool read_only);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal5_usb_pma.h"
+
+// one bit for each word after the buffer descriptor table, 1 if used
+#define NUMBER_OF_UNITS ((HAL5_USB_PMA_SIZE - HAL5_USB_PMA_BDT_SIZE) / HAL5_USB_PMA_UNIT)
+
+static uint32_t used[(NUMBER_OF_UNITS + 31) / 32];
+
+static inline bool is_used(uint32_t unit)
+{
+    return (used[unit / 32] >> (unit % 32)) & 0x1;
+}
+
+static void set_used(uint32_t first, uint32_t n, bool value)
+{
+    for (uint32_t unit = first; unit < (first + n); unit++)
+    {
+        // alloc only takes free units, free only releases used units
+        assert (is_used(unit) != value);
+
+        if (value) used[unit / 32] |= (1 << (unit % 32));
+        else used[unit / 32] &= ~(1 << (unit % 32));
+    }
+}
+
+static uint32_t size_to_units(uint16_t size)
+{
+    return (size + HAL5_USB_PMA_UNIT - 1) / HAL5_USB_PMA_UNIT;
+}
+
+static uint16_t unit_to_addr(uint32_t unit)
+{
+    return HAL5_USB_PMA_BDT_SIZE + (unit * HAL5_USB_PMA_UNIT);
+}
+
+// calls fn for each free region (first unit and number of units)
+static void for_each_free_region(
+        void (*fn)(uint32_t first, uint32_t n, void* arg),
+        void* arg)
+{
+    uint32_t unit = 0;
+
+    while (unit < NUMBER_OF_UNITS)
+    {
+        if (is_used(unit))
+        {
+            unit++;
+            continue;
+        }
+
+        const uint32_t first = unit;
+        while ((unit < NUMBER_OF_UNITS) && !is_used(unit)) unit++;
+
+        fn(first, unit - first, arg);
+    }
+}
+
+uint16_t hal5_usb_pma_tx_buffer_size(uint16_t mps)
+{
+    assert (mps > 0);
+    assert (mps <= 1023);
+
+    return (mps + 3) & ~0x3;
+}
+
+uint16_t hal5_usb_pma_rx_buffer_size(uint16_t mps)
+{
+    assert (mps > 0);
+    assert (mps <= 1023);
+
+    // 2 byte blocks (blsize=0) can describe up to 62 bytes
+    // the rest is described with 32 byte blocks (blsize=1)
+    // the buffer is word aligned in both cases
+    if (mps <= 62) return (mps + 3) & ~0x3;
+    else return (mps + 31) & ~0x1F;
+}
+
+typedef struct
+{
+    uint32_t units;
+    uint32_t best_first;
+    uint32_t best_n;
+} best_fit_t;
+
+static void best_fit(uint32_t first, uint32_t n, void* arg)
+{
+    best_fit_t* bf = (best_fit_t*) arg;
+
+    if ((n >= bf->units) && ((bf->best_n == 0) || (n < bf->best_n)))
+    {
+        bf->best_first = first;
+        bf->best_n = n;
+    }
+}
+
+uint16_t hal5_usb_pma_alloc(uint16_t size)
+{
+    assert (size > 0);
+
+    best_fit_t bf = {size_to_units(size), 0, 0};
+
+    for_each_free_region(best_fit, &bf);
+
+    if (bf.best_n == 0) return 0;
+
+    set_used(bf.best_first, bf.units, true);
+
+    return unit_to_addr(bf.best_first);
+}
+
+bool hal5_usb_pma_alloc_at(uint16_t addr, uint16_t size)
+{
+    assert (size > 0);
+    assert (addr >= HAL5_USB_PMA_BDT_SIZE);
+    assert ((addr % HAL5_USB_PMA_UNIT) == 0);
+
+    if ((addr + size) > HAL5_USB_PMA_SIZE) return false;
+
+    const uint32_t first = (addr - HAL5_USB_PMA_BDT_SIZE) / HAL5_USB_PMA_UNIT;
+    const uint32_t n = size_to_units(size);
+
+    for (uint32_t unit = first; unit < (first + n); unit++)
+    {
+        if (is_used(unit)) return false;
+    }
+
+    set_used(first, n, true);
+
+    return true;
+}
+
+void hal5_usb_pma_free(uint16_t addr, uint16_t size)
+{
+    assert (addr >= HAL5_USB_PMA_BDT_SIZE);
+    assert ((addr % HAL5_USB_PMA_UNIT) == 0);
+    assert ((addr + size) <= HAL5_USB_PMA_SIZE);
+
+    set_used(
+            (addr - HAL5_USB_PMA_BDT_SIZE) / HAL5_USB_PMA_UNIT, 
+            size_to_units(size), 
+            false);
+}
+
+static void add_to_status(uint32_t first, uint32_t n, void* arg)
+{
+    hal5_usb_pma_status_t* status = (hal5_usb_pma_status_t*) arg;
+
+    const uint16_t size = n * HAL5_USB_PMA_UNIT;
+
+    status->free += size;
+    if (size > status->largest_free) status->largest_free = size;
+    status->free_regions++;
+}
+
+void hal5_usb_pma_get_status(hal5_usb_pma_status_t* status)
+{
+    assert (status != NULL);
+
+    status->free = 0;
+    status->largest_free = 0;
+    status->free_regions = 0;
+
+    for_each_free_region(add_to_status, status);
+
+    if (status->free == 0) 
+    {
+        status->fragmentation = 0;
+    }
+    else
+    {
+        status->fragmentation = 
+            ((status->free - status->largest_free) * 100) / status->free;
+    }
+}
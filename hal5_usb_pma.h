@@ -0,0 +1,104 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HAL5_USB_PMA_H__
+#define __HAL5_USB_PMA_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// USB SRAM (PMA) allocator
+//
+// USB SRAM is 2048 bytes, the first 64 bytes are the buffer descriptor table
+// (8 endpoints x 8 bytes, txbd and rxbd), so buffers are allocated from the rest
+// buffers are word aligned and allocated in words, 
+// because USB SRAM can only be accessed with words
+//
+// the allocator has no initialization, everything other than the buffer
+// descriptor table is free at startup
+
+#define HAL5_USB_PMA_SIZE       (2048)
+#define HAL5_USB_PMA_BDT_SIZE   (64)
+#define HAL5_USB_PMA_UNIT       (4)
+
+typedef struct
+{
+    // total free bytes
+    uint16_t free;
+    // the largest free region, the largest buffer that can be allocated
+    uint16_t largest_free;
+    // number of free regions, 1 if not fragmented (0 if full)
+    uint8_t free_regions;
+    // 0 (not fragmented) to 100 (percentage of free bytes outside the 
+    // largest free region)
+    uint8_t fragmentation;
+} hal5_usb_pma_status_t;
+
+// the layout of a (non-control) endpoint, generated by create_descriptors.py
+typedef struct
+{
+    uint8_t bEndpointAddress;
+    // all buffers of the endpoint as one region
+    uint16_t pma_addr;
+    uint16_t pma_size;
+    // buffer descriptor values (addr, num_block and blsize)
+    // only the ones used by the endpoint are valid
+    uint32_t txbd;
+    uint32_t rxbd;
+} hal5_usb_pma_layout_entry_t;
+
+// the layout of a configuration
+// the entries are in the order of the endpoints in the descriptors
+typedef struct
+{
+    uint8_t number_of_entries;
+    const hal5_usb_pma_layout_entry_t* entries;
+} hal5_usb_pma_layout_t;
+
+// size of a buffer to send packets of max packet size
+uint16_t hal5_usb_pma_tx_buffer_size(uint16_t mps);
+
+// size of a buffer to receive packets of max packet size
+// rx buffer size is set with num_block in rxbd 
+// 2 byte blocks up to 62 bytes, 32 byte blocks above that
+uint16_t hal5_usb_pma_rx_buffer_size(uint16_t mps);
+
+// best fit, returns the address (offset in USB SRAM) of the buffer
+// or 0 if there is no free region large enough
+uint16_t hal5_usb_pma_alloc(uint16_t size);
+
+// allocates the region at the given address (e.g. from a layout)
+// returns false if the region is not free
+bool hal5_usb_pma_alloc_at(uint16_t addr, uint16_t size);
+
+// size has to be the same as the one given to alloc
+void hal5_usb_pma_free(uint16_t addr, uint16_t size);
+
+void hal5_usb_pma_get_status(hal5_usb_pma_status_t* status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
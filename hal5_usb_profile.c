@@ -0,0 +1,112 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stm32h5xx.h>
+
+#include "hal5.h"
+#include "hal5_usb_profile.h"
+
+static hal5_usb_profile_stats_t 
+profile_stats[HAL5_USB_PROFILE_NUMBER_OF_PATHS];
+
+static const char* const path_names[HAL5_USB_PROFILE_NUMBER_OF_PATHS] = 
+{
+    [profile_path_reset]        = "reset",
+    [profile_path_ctr_setup]    = "ctr_setup",
+    [profile_path_ctr_out]      = "ctr_out",
+    [profile_path_ctr_in]       = "ctr_in",
+    [profile_path_suspend]      = "suspend",
+    [profile_path_wakeup]       = "wakeup",
+    [profile_path_error]        = "error",
+    [profile_path_callback]     = "callback",
+    [profile_path_sof]          = "sof",
+};
+
+void hal5_usb_profile_initialize(void)
+{
+    // enable DWT and its cycle counter
+    SET_BIT(DCB->DEMCR, DCB_DEMCR_TRCENA_Msk);
+    SET_BIT(DWT->CTRL, DWT_CTRL_CYCCNTENA_Msk);
+
+    hal5_usb_profile_clear_stats();
+}
+
+static uint32_t histogram_bin(uint32_t duration)
+{
+    if (duration == 0) return 0;
+
+    // number of bits, so 1 is in bin 1, 2..3 in bin 2 etc.
+    const uint32_t bin = 32 - __builtin_clz(duration);
+
+    return HAL5_MIN(bin, HAL5_USB_PROFILE_HISTOGRAM_BINS - 1);
+}
+
+// called in USB IRQ
+void hal5_usb_profile_record(
+        hal5_usb_profile_path_t path, 
+        uint32_t duration)
+{
+    assert (path < HAL5_USB_PROFILE_NUMBER_OF_PATHS);
+
+    hal5_usb_profile_stats_t* stats = &profile_stats[path];
+
+    if ((stats->count == 0) || (duration < stats->min)) stats->min = duration;
+    if (duration > stats->max) stats->max = duration;
+
+    stats->count++;
+    stats->total += duration;
+    stats->histogram[histogram_bin(duration)]++;
+}
+
+void hal5_usb_profile_get_stats(
+        hal5_usb_profile_path_t path,
+        hal5_usb_profile_stats_t* stats)
+{
+    assert (path < HAL5_USB_PROFILE_NUMBER_OF_PATHS);
+    assert (stats != NULL);
+
+    // total is 64-bits, the copy should not be interrupted by a record
+    NVIC_DisableIRQ(USB_DRD_FS_IRQn);
+    memcpy(stats, &profile_stats[path], sizeof(hal5_usb_profile_stats_t));
+    NVIC_EnableIRQ(USB_DRD_FS_IRQn);
+}
+
+uint32_t hal5_usb_profile_mean(const hal5_usb_profile_stats_t* stats)
+{
+    if (stats->count == 0) return 0;
+    return (uint32_t) (stats->total / stats->count);
+}
+
+void hal5_usb_profile_clear_stats(void)
+{
+    NVIC_DisableIRQ(USB_DRD_FS_IRQn);
+    memset(profile_stats, 0, sizeof(profile_stats));
+    NVIC_EnableIRQ(USB_DRD_FS_IRQn);
+}
+
+const char* hal5_usb_profile_path_name(hal5_usb_profile_path_t path)
+{
+    assert (path < HAL5_USB_PROFILE_NUMBER_OF_PATHS);
+    return path_names[path];
+}
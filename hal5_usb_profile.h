@@ -0,0 +1,126 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// USB interrupt handler profiling
+//
+// the time USB_DRD_FS_IRQHandler spends for each event is measured and
+// recorded per path (the event handled), the time the device _ex 
+// callbacks run inside it is recorded separately
+// for each, count, min, max, total (for mean) and a log2 histogram is kept
+//
+// the firmware uses the DWT cycle counter, so the times are in SYSCLK cycles
+// the host simulation uses clock_gettime, so the times are in ns of the host
+//
+// enabled with HAL5_USB_PROFILE_ENABLED=1 (make profile=1), 
+// otherwise the record macros are compiled out
+
+#ifndef __HAL5_USB_PROFILE_H__
+#define __HAL5_USB_PROFILE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <stm32h5xx.h>
+
+#ifndef HAL5_USB_PROFILE_ENABLED
+#define HAL5_USB_PROFILE_ENABLED    (0)
+#endif
+
+// histogram[0] counts 0, histogram[i] counts [2^(i-1), 2^i)
+// the last one counts everything above
+#define HAL5_USB_PROFILE_HISTOGRAM_BINS (32)
+
+typedef enum
+{
+    profile_path_reset=0,
+    profile_path_ctr_setup=1,
+    profile_path_ctr_out=2,
+    profile_path_ctr_in=3,
+    profile_path_suspend=4,
+    profile_path_wakeup=5,
+    // ERR and PMAOVR
+    profile_path_error=6,
+    // device _ex callbacks called by the handler
+    // these are included in the paths above as well
+    profile_path_callback=7,
+    // SOF and ESOF (isochronous endpoints)
+    profile_path_sof=8,
+    HAL5_USB_PROFILE_NUMBER_OF_PATHS=9,
+} hal5_usb_profile_path_t;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    // mean is total / count
+    uint64_t total;
+    uint32_t histogram[HAL5_USB_PROFILE_HISTOGRAM_BINS];
+} hal5_usb_profile_stats_t;
+
+#ifdef HAL5_USB_SIM
+uint32_t hal5_usb_sim_read_clock(void);
+#define HAL5_USB_PROFILE_CLOCK() hal5_usb_sim_read_clock()
+#else
+#define HAL5_USB_PROFILE_CLOCK() (DWT->CYCCNT)
+#endif
+
+// enables the DWT cycle counter and clears the stats
+void hal5_usb_profile_initialize(void);
+
+void hal5_usb_profile_record(
+        hal5_usb_profile_path_t path, 
+        uint32_t duration);
+
+// copies the stats of path, USB IRQ is disabled while copying
+void hal5_usb_profile_get_stats(
+        hal5_usb_profile_path_t path,
+        hal5_usb_profile_stats_t* stats);
+
+// 0 if count is 0
+uint32_t hal5_usb_profile_mean(const hal5_usb_profile_stats_t* stats);
+
+void hal5_usb_profile_clear_stats(void);
+
+const char* hal5_usb_profile_path_name(hal5_usb_profile_path_t path);
+
+#if HAL5_USB_PROFILE_ENABLED
+#define HAL5_USB_PROFILE_START() HAL5_USB_PROFILE_CLOCK()
+#define HAL5_USB_PROFILE_STOP(path, start) \
+    hal5_usb_profile_record(path, HAL5_USB_PROFILE_CLOCK() - (start))
+// runs call (a statement) and records its time as profile_path_callback
+#define HAL5_USB_PROFILE_CALLBACK(call) \
+    do { \
+        const uint32_t profile_start = HAL5_USB_PROFILE_CLOCK(); \
+        call; \
+        HAL5_USB_PROFILE_STOP(profile_path_callback, profile_start); \
+    } while (0)
+#else
+#define HAL5_USB_PROFILE_CALLBACK(call) do { call; } while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
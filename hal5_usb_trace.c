@@ -0,0 +1,212 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stm32h5xx.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_trace.h"
+
+static_assert (sizeof(hal5_usb_trace_event_t) == 24, 
+        "decode_trace.py depends on the event size");
+
+static_assert ((HAL5_USB_TRACE_SIZE & (HAL5_USB_TRACE_SIZE - 1)) == 0,
+        "HAL5_USB_TRACE_SIZE has to be a power of 2");
+
+// single producer (USB interrupt handler), single consumer ring
+// head and tail are free running, only the producer writes head
+// and only the consumer writes tail
+static hal5_usb_trace_event_t events[HAL5_USB_TRACE_SIZE];
+static volatile uint32_t head = 0;
+static volatile uint32_t tail = 0;
+
+static volatile uint32_t dropped = 0;
+
+// transaction event between begin and end
+static hal5_usb_trace_event_t transaction;
+
+// events replied to the vendor request
+// it has to stay valid until the data stage is completed
+static hal5_usb_trace_event_t 
+vendor_request_events[HAL5_USB_TRACE_VENDOR_REQUEST_EVENTS];
+
+void hal5_usb_trace_initialize(void)
+{
+    // enable DWT and its cycle counter
+    SET_BIT(DCB->DEMCR, DCB_DEMCR_TRCENA_Msk);
+    SET_BIT(DWT->CTRL, DWT_CTRL_CYCCNTENA_Msk);
+
+    head = 0;
+    tail = 0;
+    dropped = 0;
+}
+
+// returns the next free event or NULL if the ring is full
+static hal5_usb_trace_event_t* next_event(void)
+{
+    const uint32_t h = head;
+
+    if ((h - tail) == HAL5_USB_TRACE_SIZE)
+    {
+        dropped++;
+        return NULL;
+    }
+
+    return &events[h & (HAL5_USB_TRACE_SIZE - 1)];
+}
+
+// makes the event visible to the consumer
+static void commit_event(void)
+{
+    __DMB();
+    head = head + 1;
+}
+
+void hal5_usb_trace_record_irq(uint32_t istr)
+{
+    hal5_usb_trace_event_t* e = next_event();
+    if (e == NULL) return;
+
+    e->cycles = HAL5_USB_READ_CYCCNT();
+    e->type = trace_event_irq;
+    e->istr = istr;
+    e->chep = 0;
+    e->endp = istr & USB_ISTR_IDN;
+    e->standard_request = hal5_usb_device_ep0_get_standard_request();
+    e->status = 0;
+    e->rxbd_count = 0;
+    e->txbd_count = 0;
+    e->rx_received = 0;
+    e->tx_sent = 0;
+
+    commit_event();
+}
+
+// rx_received and tx_sent are reset when a stage is completed
+// so they are taken before the transaction is processed
+void hal5_usb_trace_record_transaction_begin(
+        const hal5_usb_endpoint_t* ep)
+{
+    hal5_usb_trace_event_t* e = &transaction;
+
+    e->cycles = HAL5_USB_READ_CYCCNT();
+    e->type = trace_event_transaction;
+    e->istr = ep->istr->v;
+    e->chep = ep->chep->v;
+    e->endp = ep->endp;
+    e->rxbd_count = (ep->rxbd != NULL) ? ep->rxbd->count : 0;
+    e->txbd_count = (ep->txbd != NULL) ? ep->txbd->count : 0;
+    e->rx_received = ep->rx_received;
+    e->tx_sent = ep->tx_sent;
+}
+
+void hal5_usb_trace_record_transaction_end(
+        const hal5_usb_endpoint_t* ep)
+{
+    hal5_usb_trace_event_t* e = next_event();
+    if (e == NULL) return;
+
+    *e = transaction;
+    e->standard_request = hal5_usb_device_ep0_get_standard_request();
+    e->status = ep->rx_status | (ep->tx_status << 4);
+
+    commit_event();
+}
+
+void hal5_usb_trace_record_setup(
+        const hal5_usb_device_request_t* request)
+{
+    hal5_usb_trace_event_t* e = next_event();
+    if (e == NULL) return;
+
+    e->cycles = HAL5_USB_READ_CYCCNT();
+    e->type = trace_event_setup;
+    memcpy(&e->request, request, sizeof(hal5_usb_device_request_t));
+    e->endp = 0;
+    e->standard_request = standard_request_null;
+    e->status = 0;
+    e->rxbd_count = 0;
+    e->txbd_count = 0;
+    e->rx_received = 0;
+    e->tx_sent = 0;
+
+    commit_event();
+}
+
+size_t hal5_usb_trace_read(
+        hal5_usb_trace_event_t* dst,
+        size_t max_events)
+{
+    const uint32_t t = tail;
+    const uint32_t available = head - t;
+    // events before head are written
+    __DMB();
+
+    const size_t n = HAL5_MIN(available, max_events);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = events[(t + i) & (HAL5_USB_TRACE_SIZE - 1)];
+    }
+
+    // events are copied before they are released
+    __DMB();
+    tail = t + n;
+
+    return n;
+}
+
+void hal5_usb_trace_get_stats(hal5_usb_trace_stats_t* stats)
+{
+    stats->dropped = dropped;
+    stats->recorded = head;
+}
+
+static bool vendor_request(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    const size_t max_events = HAL5_MIN(
+            request->wLength / sizeof(hal5_usb_trace_event_t),
+            HAL5_USB_TRACE_VENDOR_REQUEST_EVENTS);
+
+    const size_t n = hal5_usb_trace_read(vendor_request_events, max_events);
+
+    *data = vendor_request_events;
+    *data_size = n * sizeof(hal5_usb_trace_event_t);
+
+    return true;
+}
+
+bool hal5_usb_trace_register_vendor_request(uint8_t bRequest)
+{
+    return hal5_usb_device_register_request_handler(
+            request_type_vendor,
+            request_recipient_device,
+            bRequest,
+            vendor_request,
+            NULL);
+}
@@ -0,0 +1,153 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// binary transaction trace
+//
+// fixed size events are recorded to a ring buffer in USB interrupt handler
+// and read from the main loop or with a vendor request
+// recording an event is a few stores, it does not change the timing like 
+// CONSOLE does, decode_trace.py converts the events to a readable transcript
+//
+// enabled with HAL5_USB_TRACE_ENABLED=1 (make trace=1), 
+// otherwise the record macros are compiled out
+
+#ifndef __HAL5_USB_TRACE_H__
+#define __HAL5_USB_TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal5_usb.h"
+
+#ifndef HAL5_USB_TRACE_ENABLED
+#define HAL5_USB_TRACE_ENABLED  (0)
+#endif
+
+// number of events in the ring, has to be a power of 2
+#ifndef HAL5_USB_TRACE_SIZE
+#define HAL5_USB_TRACE_SIZE     (128)
+#endif
+
+// max. number of events returned by the vendor request
+#define HAL5_USB_TRACE_VENDOR_REQUEST_EVENTS    (32)
+
+typedef enum
+{
+    // USB_DRD_FS_IRQHandler is entered, istr is valid
+    trace_event_irq=1,
+    // a transaction is processed, istr and chep are valid
+    // timestamp, counts and chep are from before it is processed
+    // standard_request and status are from after it is processed
+    trace_event_transaction=2,
+    // a SETUP transaction is received, request is valid
+    trace_event_setup=3,
+} hal5_usb_trace_event_type_t;
+
+// 24 bytes, little endian, decode_trace.py depends on this layout
+typedef struct
+{
+    // DWT cycle counter
+    uint32_t cycles;
+    union
+    {
+        struct
+        {
+            uint32_t istr;
+            // CHEPnR when the transaction is completed
+            uint32_t chep;
+        };
+        hal5_usb_device_request_t request;
+    };
+    // hal5_usb_trace_event_type_t
+    uint8_t  type;
+    uint8_t  endp;
+    // usb_standard_request_t
+    uint8_t  standard_request;
+    // rx_status | (tx_status << 4) after the transaction is processed
+    uint8_t  status;
+    uint16_t rxbd_count;
+    uint16_t txbd_count;
+    // lower 16-bits of rx_received and tx_sent
+    uint16_t rx_received;
+    uint16_t tx_sent;
+} hal5_usb_trace_event_t;
+
+typedef struct
+{
+    // number of events recorded
+    uint32_t recorded;
+    // number of events dropped because the ring was full
+    uint32_t dropped;
+} hal5_usb_trace_stats_t;
+
+// enables the DWT cycle counter and clears the ring
+void hal5_usb_trace_initialize(void);
+
+void hal5_usb_trace_record_irq(uint32_t istr);
+
+// begin is called before a transaction is processed and end after
+// the event is recorded at end, events recorded in between come before it
+void hal5_usb_trace_record_transaction_begin(
+        const hal5_usb_endpoint_t* ep);
+
+void hal5_usb_trace_record_transaction_end(
+        const hal5_usb_endpoint_t* ep);
+
+void hal5_usb_trace_record_setup(
+        const hal5_usb_device_request_t* request);
+
+// copies and removes at most max_events events from the ring
+// returns the number of events copied
+// there should be only one reader, either the main loop or the vendor request
+size_t hal5_usb_trace_read(
+        hal5_usb_trace_event_t* events,
+        size_t max_events);
+
+void hal5_usb_trace_get_stats(hal5_usb_trace_stats_t* stats);
+
+// registers a device to host vendor request (recipient device) with bRequest
+// it replies the events in the ring, as many as fits to wLength
+// (at most HAL5_USB_TRACE_VENDOR_REQUEST_EVENTS)
+bool hal5_usb_trace_register_vendor_request(uint8_t bRequest);
+
+#if HAL5_USB_TRACE_ENABLED
+#define HAL5_USB_TRACE_IRQ(istr) hal5_usb_trace_record_irq(istr)
+#define HAL5_USB_TRACE_TRANSACTION_BEGIN(ep) \
+    hal5_usb_trace_record_transaction_begin(ep)
+#define HAL5_USB_TRACE_TRANSACTION_END(ep) \
+    hal5_usb_trace_record_transaction_end(ep)
+#define HAL5_USB_TRACE_SETUP(request) hal5_usb_trace_record_setup(request)
+#else
+#define HAL5_USB_TRACE_IRQ(istr) do {} while (0)
+#define HAL5_USB_TRACE_TRANSACTION_BEGIN(ep) do {} while (0)
+#define HAL5_USB_TRACE_TRANSACTION_END(ep) do {} while (0)
+#define HAL5_USB_TRACE_SETUP(request) do {} while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# HID interface and report descriptors for descriptors.py
+# see hal5_usb_hid.h for the driver
+#
+# hid_interface returns the interface, it is added to the interfaces of 
+# a configuration, e.g.:
+#
+#   from hid import hid_interface, gamepad_report_descriptor
+#   (report_descriptor, report_size) = gamepad_report_descriptor(16, 4)
+#   configuration['interfaces'].append(
+#       hid_interface(0, 1, report_descriptor))
+#
+# the HID descriptor is placed after the interface descriptor in the 
+# configuration descriptor, and it is also returned with the report 
+# descriptor to Get Descriptor with interface recipient
+# the interrupt IN endpoint is polled every frame by default (bInterval=1)
+# endpoint arguments are endpoint numbers (1..7)
+
+# HID, no subclass (not boot), no protocol
+HID_CLASS_PROTO = (0x03, 0x00, 0x00)
+
+HID_DESCRIPTOR = 0x21
+REPORT_DESCRIPTOR = 0x22
+
+# report descriptor, short items
+# the value is encoded in the smallest size (0, 1, 2 or 4 bytes)
+
+def item(prefix, value=None, signed=False):
+    if value is None:
+        return [prefix]
+    if signed:
+        ranges = [(1, -0x80, 0x7F), (2, -0x8000, 0x7FFF)]
+    else:
+        ranges = [(1, 0, 0xFF), (2, 0, 0xFFFF)]
+    size = 4
+    for (n, lo, hi) in ranges:
+        if lo <= value <= hi:
+            size = n
+            break
+    value = value & ((1 << (8 * size)) - 1)
+    code = {1: 1, 2: 2, 4: 3}[size]
+    return [prefix | code] + [(value >> (8 * i)) & 0xFF for i in range(0, size)]
+
+# main item flags (Input, Output, Feature)
+DATA = 0x00
+CONSTANT = 0x01
+ARRAY = 0x00
+VARIABLE = 0x02
+ABSOLUTE = 0x00
+RELATIVE = 0x04
+
+# collection types
+PHYSICAL = 0x00
+APPLICATION = 0x01
+LOGICAL = 0x02
+
+# usage pages
+GENERIC_DESKTOP = 0x01
+BUTTON = 0x09
+VENDOR = 0xFF00
+
+# generic desktop usages
+GAMEPAD = 0x05
+X = 0x30
+
+def input_item(flags): return item(0x80, flags)
+def output_item(flags): return item(0x90, flags)
+def feature_item(flags): return item(0xB0, flags)
+def collection(kind): return item(0xA0, kind)
+def end_collection(): return item(0xC0)
+def usage_page(page): return item(0x04, page)
+def logical_minimum(value): return item(0x14, value, signed=True)
+def logical_maximum(value): return item(0x24, value, signed=True)
+def report_size(bits): return item(0x74, bits)
+def report_id(value): return item(0x84, value)
+def report_count(count): return item(0x94, count)
+def usage(value): return item(0x08, value)
+def usage_minimum(value): return item(0x18, value)
+def usage_maximum(value): return item(0x28, value)
+
+# a gamepad input report, buttons (1 bit each, padded to a byte) 
+# and signed 8-bit axes (X, Y, Z, Rx, Ry, Rz)
+# returns the report descriptor and the size of the report in bytes
+def gamepad_report_descriptor(buttons, axes):
+    assert 0 < buttons <= 32, 'number of buttons has to be 1..32'
+    assert 0 <= axes <= 6, 'number of axes has to be 0..6'
+    padding = (8 - (buttons % 8)) % 8
+    d = []
+    d += usage_page(GENERIC_DESKTOP)
+    d += usage(GAMEPAD)
+    d += collection(APPLICATION)
+    d += usage_page(BUTTON)
+    d += usage_minimum(1)
+    d += usage_maximum(buttons)
+    d += logical_minimum(0)
+    d += logical_maximum(1)
+    d += report_size(1)
+    d += report_count(buttons)
+    d += input_item(DATA | VARIABLE | ABSOLUTE)
+    if padding > 0:
+        d += report_size(padding)
+        d += report_count(1)
+        d += input_item(CONSTANT)
+    if axes > 0:
+        d += usage_page(GENERIC_DESKTOP)
+        for i in range(0, axes):
+            d += usage(X + i)
+        d += logical_minimum(-127)
+        d += logical_maximum(127)
+        d += report_size(8)
+        d += report_count(axes)
+        d += input_item(DATA | VARIABLE | ABSOLUTE)
+    d += end_collection()
+    return (d, (buttons + padding) // 8 + axes)
+
+# HID descriptor, HID 1.11, one report descriptor
+def hid_descriptor(report_descriptor, country_code=0):
+    length = len(report_descriptor)
+    return [9, HID_DESCRIPTOR, 0x11, 0x01, country_code, 1, 
+            REPORT_DESCRIPTOR, length & 0xFF, length >> 8]
+
+def hid_interface(
+        number,
+        in_endpoint,
+        report_descriptor,
+        max_packet_size=8,
+        interval=1,
+        label=None):
+    descriptor = hid_descriptor(report_descriptor)
+    return {
+        'number':               number,
+        'label':                label,
+        'alternate-setting':    0,
+        'class-proto':          HID_CLASS_PROTO,
+        'class-descriptors':    [descriptor],
+        'interface-descriptors':
+        [
+            (HID_DESCRIPTOR, descriptor),
+            (REPORT_DESCRIPTOR, report_descriptor),
+        ],
+        'endpoints':
+        [
+            {
+                'address':          in_endpoint,
+                'direction':        'in',
+                'transfer-type':    'interrupt',
+                'max-packet-size':  max_packet_size,
+                'interval':         interval,
+            },
+        ]
+    }
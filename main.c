@@ -139,6 +139,11 @@ int main(void)
 
         hal5_watchdog_heartbeat();
 
+#if HAL5_USB_DEFERRED_ENABLED
+        // USB events are processed here, not in the interrupt handler
+        hal5_usb_device_process_events();
+#endif
+
         const uint32_t now = hal5_slow_ticks;
         if (now > last) {
             last = now;
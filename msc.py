@@ -0,0 +1,66 @@
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# USB Mass Storage (Bulk-Only Transport) interface for descriptors.py
+# see hal5_usb_msc.h for the driver
+#
+# msc_interface returns the interface, it is added to the interfaces of 
+# a configuration, e.g.:
+#
+#   from msc import msc_interface
+#   configuration['interfaces'].append(msc_interface(0, 1, 2))
+#
+# the device class is defined at the interface, so the device class 
+# is (0x00, 0x00, 0x00)
+# endpoint arguments are endpoint numbers (1..7)
+
+# Mass Storage Class, SCSI transparent command set, Bulk-Only Transport
+MSC_CLASS_PROTO = (0x08, 0x06, 0x50)
+
+def msc_interface(
+        number,
+        in_endpoint,
+        out_endpoint,
+        max_packet_size=64,
+        double_buffer=False,
+        label=None):
+    return {
+        'number':               number,
+        'label':                label,
+        'alternate-setting':    0,
+        'class-proto':          MSC_CLASS_PROTO,
+        'endpoints':
+        [
+            {
+                'address':          in_endpoint,
+                'direction':        'in',
+                'transfer-type':    'bulk',
+                'max-packet-size':  max_packet_size,
+                'double-buffer':    double_buffer,
+            },
+            {
+                'address':          out_endpoint,
+                'direction':        'out',
+                'transfer-type':    'bulk',
+                'max-packet-size':  max_packet_size,
+                'double-buffer':    double_buffer,
+            },
+        ]
+    }
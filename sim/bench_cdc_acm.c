@@ -0,0 +1,333 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// measures the throughput of the CDC-ACM driver with sim/cdc_acm_device.c
+// the host runs bulk IN or OUT transactions back to back (retrying NAKs)
+// and the main loop (hal5_usb_sim_set_main_loop) keeps TX ring full or 
+// RX ring empty, the data is checked on both sides
+// bytes per frame (kB/s) is compared to raw streaming, where the packet
+// callbacks only give and take packets without the rings and the main 
+// loop, so this is the maximum of the endpoints in the modeled bus, and
+// to 19 full packets per frame, the maximum of FS bulk transfers
+// each OUT packet is NAKed once when the handler does not run before the
+// next OUT (the peripheral needs SW_BUF toggled after each packet also
+// when double buffered), and a NAKed OUT costs a whole data packet, so
+// OUT is at ~47% of line rate unless the irq latency is 0 and the
+// endpoint is double buffered, this is the same with raw streaming
+// exits with non-zero status if the data is wrong or the throughput is
+// below 90% of raw streaming, or below 90% of line rate in both 
+// directions with 0 ns irq latency and double buffering
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "cdc_acm_device.h"
+
+#define FRAMES                  (100)
+#define MAX_PACKET_SIZE         (64)
+#define LINE_RATE               (19 * MAX_PACKET_SIZE)
+
+// bConfigurationValue in sim/cdc_acm_device.py
+#define CONFIGURATION_SINGLE    (1)
+#define CONFIGURATION_DOUBLE    (2)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint8_t pattern(size_t offset)
+{
+    return (uint8_t) (offset * 7 + 3);
+}
+
+// raw streaming, the data is not checked
+static bool raw_in_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    return true;
+}
+
+static bool raw_out_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    return true;
+}
+
+// offsets of the streams in the main loop
+static size_t tx_offset;
+static size_t rx_offset;
+static uint32_t rx_errors;
+
+static void fill_tx(void)
+{
+    uint8_t data[256];
+
+    while (hal5_usb_cdc_acm_tx_free() > 0)
+    {
+        const size_t size = HAL5_MIN(sizeof(data), hal5_usb_cdc_acm_tx_free());
+
+        for (size_t i = 0; i < size; i++) data[i] = pattern(tx_offset + i);
+
+        tx_offset += hal5_usb_cdc_acm_write(data, size);
+    }
+}
+
+static void drain_rx(void)
+{
+    uint8_t data[256];
+    size_t size;
+
+    while ((size = hal5_usb_cdc_acm_read(data, sizeof(data))) > 0)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            if (data[i] != pattern(rx_offset + i)) rx_errors++;
+        }
+
+        rx_offset += size;
+    }
+}
+
+typedef struct
+{
+    hal5_usb_ep_packet_t in_packet;
+    hal5_usb_ep_packet_t out_packet;
+} driver_callbacks_t;
+
+// the callbacks of the driver, restored after raw streaming
+static driver_callbacks_t driver_callbacks;
+
+static void start(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        bool raw,
+        void (*main_loop)(void))
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    tx_offset = 0;
+    rx_offset = 0;
+    rx_errors = 0;
+
+    hal5_usb_endpoint_t* in_ep = hal5_usb_device_get_endpoint(
+            CDC_ACM_DEVICE_IN_ENDP, true);
+    hal5_usb_endpoint_t* out_ep = hal5_usb_device_get_endpoint(
+            CDC_ACM_DEVICE_OUT_ENDP, false);
+
+    if (driver_callbacks.in_packet == NULL)
+    {
+        driver_callbacks.in_packet = in_ep->packet;
+        driver_callbacks.out_packet = out_ep->packet;
+    }
+
+    CHECK (hal5_usb_device_register_packet_callback(
+                0x80 | CDC_ACM_DEVICE_IN_ENDP, 
+                raw ? raw_in_packet : driver_callbacks.in_packet, 
+                NULL));
+    CHECK (hal5_usb_device_register_packet_callback(
+                CDC_ACM_DEVICE_OUT_ENDP, 
+                raw ? raw_out_packet : driver_callbacks.out_packet, 
+                NULL));
+
+    // OUT is started by the driver at Set Configuration
+    if (raw) hal5_usb_device_start_stream(in_ep);
+
+    hal5_usb_sim_set_main_loop(raw ? NULL : main_loop);
+    hal5_usb_sim_set_irq_latency(irq_latency_ns);
+    hal5_usb_sim_set_pma_access_cost(10);
+
+    // the first write starts the stream
+    if (!raw && (main_loop == fill_tx)) fill_tx();
+
+    // start at a frame boundary
+    hal5_usb_sim_advance(
+            HAL5_USB_SIM_FRAME_NS - 
+            (hal5_usb_sim_time() % HAL5_USB_SIM_FRAME_NS));
+
+    hal5_usb_sim_clear_stats();
+}
+
+// returns bytes per frame
+static double run_in(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        bool raw)
+{
+    start(configuration_value, irq_latency_ns, raw, fill_tx);
+
+    const uint64_t end = hal5_usb_sim_time() + FRAMES * HAL5_USB_SIM_FRAME_NS;
+
+    size_t offset = 0;
+    uint32_t errors = 0;
+
+    while (hal5_usb_sim_time() < end)
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        size_t len;
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_in(
+                CDC_ACM_DEVICE_IN_ENDP, packet, sizeof(packet), &len);
+
+        if (handshake == hal5_usb_sim_nak) continue;
+        if (handshake != hal5_usb_sim_ack) break;
+
+        for (size_t i = 0; !raw && (i < len); i++)
+        {
+            if (packet[i] != pattern(offset + i)) errors++;
+        }
+
+        offset += len;
+    }
+
+    hal5_usb_sim_set_main_loop(NULL);
+
+    CHECK (errors == 0);
+    CHECK (hal5_usb_sim_get_stats()->in_bytes == offset);
+
+    return (double) offset / FRAMES;
+}
+
+static double run_out(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        bool raw)
+{
+    start(configuration_value, irq_latency_ns, raw, drain_rx);
+
+    const uint64_t end = hal5_usb_sim_time() + FRAMES * HAL5_USB_SIM_FRAME_NS;
+
+    size_t offset = 0;
+
+    while (hal5_usb_sim_time() < end)
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+
+        for (size_t i = 0; i < sizeof(packet); i++)
+        {
+            packet[i] = pattern(offset + i);
+        }
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_out(
+                CDC_ACM_DEVICE_OUT_ENDP, packet, sizeof(packet));
+
+        if (handshake == hal5_usb_sim_nak) continue;
+        if (handshake != hal5_usb_sim_ack) break;
+
+        offset += sizeof(packet);
+    }
+
+    // the interrupt of the last packet might not be serviced yet
+    hal5_usb_sim_run_irq();
+    drain_rx();
+
+    hal5_usb_sim_set_main_loop(NULL);
+
+    CHECK (rx_errors == 0);
+    CHECK (raw || (rx_offset == offset));
+
+    return (double) offset / FRAMES;
+}
+
+typedef struct
+{
+    double cdc;
+    double raw;
+} result_t;
+
+static void print_result(const char* name, const result_t* result)
+{
+    printf(" %s %6.1f (%3.0f%%, %3.0f%%)", 
+            name,
+            result->cdc, 
+            100.0 * result->cdc / result->raw,
+            100.0 * result->cdc / LINE_RATE);
+}
+
+int main(void)
+{
+    CHECK (cdc_acm_device_initialize());
+
+    const uint64_t irq_latencies[] = {0, 1000, 20000};
+    const uint8_t configurations[] = 
+        {CONFIGURATION_SINGLE, CONFIGURATION_DOUBLE};
+
+    printf("cdc acm, %u bytes max packet size, %u frames, %u B ring, "
+            "10 ns/B pma\n",
+            MAX_PACKET_SIZE, 
+            FRAMES,
+            HAL5_USB_CDC_ACM_RING_SIZE);
+    printf("kB/s (%% of raw streaming, %% of %u B/frame)\n", LINE_RATE);
+
+    for (size_t i = 0; i < sizeof(irq_latencies)/sizeof(uint64_t); i++)
+    {
+        for (size_t k = 0; k < sizeof(configurations); k++)
+        {
+            const uint64_t latency = irq_latencies[i];
+            const uint8_t configuration = configurations[k];
+
+            result_t in, out;
+
+            in.raw = run_in(configuration, latency, true);
+            in.cdc = run_in(configuration, latency, false);
+            out.raw = run_out(configuration, latency, true);
+            out.cdc = run_out(configuration, latency, false);
+
+            printf("irq latency %5lu ns, %s:",
+                    (unsigned long) latency,
+                    (configuration == CONFIGURATION_SINGLE) ? 
+                    "single" : "double");
+            print_result("IN", &in);
+            print_result("OUT", &out);
+            printf("\n");
+
+            CHECK (in.cdc >= (0.9 * in.raw));
+            CHECK (out.cdc >= (0.9 * out.raw));
+
+            if ((latency == 0) && (configuration == CONFIGURATION_DOUBLE))
+            {
+                CHECK (in.cdc >= (0.9 * LINE_RATE));
+                CHECK (out.cdc >= (0.9 * LINE_RATE));
+            }
+        }
+    }
+
+    printf("bench_cdc_acm: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
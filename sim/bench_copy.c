@@ -0,0 +1,235 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// host microbenchmark of the USB SRAM (PMA) copy kernels in hal5_usb_copy.c
+// bytes per cycle is measured for packet sizes 0..1023 with word aligned
+// and unaligned main memory buffers, and compared to the previous
+// two pass copy (memcpy to a word aligned bounce buffer, then words to PMA)
+// PMA is a plain array here, so this shows the cost of the main memory side
+// exits with non-zero status if any copy is wrong
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "hal5_usb_copy.h"
+
+#define MAX_LEN         (1023)
+#define REPEAT          (32)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLES_UNIT "tsc cycle"
+static uint64_t cycles(void)
+{
+    return __rdtsc();
+}
+#else
+#define CYCLES_UNIT "ns"
+static uint64_t cycles(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static uint32_t pma[(MAX_LEN + 3) / 4];
+static uint8_t memory[MAX_LEN + 8] __attribute__((aligned(8)));
+static uint8_t expected[MAX_LEN + 8] __attribute__((aligned(8)));
+static uint32_t bounce[(MAX_LEN + 3) / 4];
+
+// the copy before the kernels, through a word aligned bounce buffer
+
+static void two_pass_to_pma(
+        volatile uint32_t* pma,
+        const void* src,
+        size_t len)
+{
+    memcpy(bounce, src, len);
+    const size_t len32 = (len + 3) >> 2;
+    for (size_t i = 0; i < len32; i++) pma[i] = bounce[i];
+}
+
+static void two_pass_from_pma(
+        void* dst,
+        const volatile uint32_t* pma,
+        size_t len)
+{
+    const size_t len32 = (len + 3) >> 2;
+    for (size_t i = 0; i < len32; i++) bounce[i] = pma[i];
+    memcpy(dst, bounce, len);
+}
+
+typedef struct
+{
+    const char* name;
+    void (*to_pma)(volatile uint32_t*, const void*, size_t);
+    void (*from_pma)(void*, const volatile uint32_t*, size_t);
+} kernel_t;
+
+static const kernel_t kernels[] = 
+{
+    {"two pass", two_pass_to_pma, two_pass_from_pma},
+    {"portable", hal5_usb_copy_to_pma_portable, hal5_usb_copy_from_pma_portable},
+    {"unrolled", hal5_usb_copy_to_pma_unrolled, hal5_usb_copy_from_pma_unrolled},
+};
+
+#define NUMBER_OF_KERNELS (sizeof(kernels)/sizeof(kernel_t))
+
+static uint8_t pattern(size_t i)
+{
+    return (uint8_t) (i * 13 + 5);
+}
+
+static void check_to_pma(const kernel_t* k, size_t offset, size_t len)
+{
+    for (size_t i = 0; i < len; i++) memory[offset + i] = pattern(i);
+    memset(pma, 0, sizeof(pma));
+
+    k->to_pma(pma, memory + offset, len);
+
+    CHECK (memcmp(pma, memory + offset, len) == 0);
+}
+
+static void check_from_pma(const kernel_t* k, size_t offset, size_t len)
+{
+    for (size_t i = 0; i < len; i++) ((uint8_t*) pma)[i] = pattern(i);
+    memset(memory, 0xAA, sizeof(memory));
+    memcpy(expected, memory, sizeof(memory));
+    memcpy(expected + offset, pma, len);
+
+    k->from_pma(memory + offset, pma, len);
+
+    // nothing is written out of the buffer
+    CHECK (memcmp(memory, expected, sizeof(memory)) == 0);
+}
+
+// cycles of reading the timer twice
+static uint64_t overhead;
+
+static void measure_overhead(void)
+{
+    overhead = UINT64_MAX;
+
+    for (uint32_t r = 0; r < REPEAT; r++)
+    {
+        const uint64_t start = cycles();
+        const uint64_t elapsed = cycles() - start;
+        if (elapsed < overhead) overhead = elapsed;
+    }
+}
+
+// cycles of one copy of len bytes, minimum of REPEAT runs
+// timer overhead is subtracted, it is at least 1
+static uint64_t measure(const kernel_t* k, bool to_pma, size_t offset, size_t len)
+{
+    uint64_t min = UINT64_MAX;
+
+    for (uint32_t r = 0; r < REPEAT; r++)
+    {
+        const uint64_t start = cycles();
+        if (to_pma) k->to_pma(pma, memory + offset, len);
+        else k->from_pma(memory + offset, pma, len);
+        const uint64_t elapsed = cycles() - start;
+        if (elapsed < min) min = elapsed;
+    }
+
+    return (min > overhead) ? (min - overhead) : 1;
+}
+
+int main(void)
+{
+    const size_t sizes[] = {1, 3, 8, 64, 65, 512, 1023};
+
+    for (size_t k = 0; k < NUMBER_OF_KERNELS; k++)
+    {
+        for (size_t offset = 0; offset < 4; offset++)
+        {
+            for (size_t len = 0; len <= MAX_LEN; len++)
+            {
+                check_to_pma(&kernels[k], offset, len);
+                check_from_pma(&kernels[k], offset, len);
+            }
+        }
+    }
+
+    measure_overhead();
+
+    printf("bytes/%s, 0..%u bytes (total) and selected sizes\n", 
+            CYCLES_UNIT, MAX_LEN);
+
+    for (int dir = 0; dir < 2; dir++)
+    {
+        const bool to_pma = (dir == 0);
+
+        for (size_t offset = 0; offset < 2; offset++)
+        {
+            for (size_t k = 0; k < NUMBER_OF_KERNELS; k++)
+            {
+                uint64_t total_bytes = 0;
+                uint64_t total_cycles = 0;
+
+                printf("%s %-9s %-8s:", 
+                        to_pma ? "to pma  " : "from pma",
+                        (offset == 0) ? "aligned" : "unaligned",
+                        kernels[k].name);
+
+                for (size_t len = 0; len <= MAX_LEN; len++)
+                {
+                    total_bytes += len;
+                    total_cycles += measure(&kernels[k], to_pma, offset, len);
+                }
+
+                printf(" %5.2f |", (double) total_bytes / total_cycles);
+
+                for (size_t i = 0; i < sizeof(sizes)/sizeof(size_t); i++)
+                {
+                    const uint64_t c = measure(&kernels[k], to_pma, offset, sizes[i]);
+                    printf(" %4lu:%5.2f", 
+                            (unsigned long) sizes[i], 
+                            (double) sizes[i] / c);
+                }
+
+                printf("\n");
+            }
+        }
+    }
+
+    printf("bench_copy: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,282 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// compares single and double buffered bulk endpoints of sim/bulk_device.c
+// the host runs IN or OUT transactions back to back (retrying NAKs) and
+// packets per frame is measured for different handler costs (time spent 
+// per PMA byte), so the NAKs caused by the handler copying the packet
+// of a single buffered endpoint becomes visible
+//
+// double buffering does not hide the interrupt latency, the hardware
+// still waits for SW_BUF to be toggled after each packet, but it is toggled
+// at the beginning of the handler, before the packet is copied
+// the host runs the next transaction right after the ACK, so:
+// - with 0 ns irq latency, SW_BUF is toggled before the next transaction
+//   and double buffering removes the NAK the copy causes, also at 10 ns/B
+// - with 1000 ns irq latency, both NAK once per packet waiting for the
+//   handler, the NAK of an OUT costs a whole 64 bytes data packet, so
+//   the copy is only visible for OUT when it takes longer than that
+//   (~50us, 1000 ns/B)
+// exits with non-zero status if any transfer is wrong
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define FRAMES                  (100)
+#define MAX_PACKET_SIZE         (64)
+
+// bConfigurationValue in sim/bulk_device.py
+#define CONFIGURATION_SINGLE    (1)
+#define CONFIGURATION_DOUBLE    (2)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+typedef struct
+{
+    double packets_per_frame;
+    double naks_per_packet;
+    // same as kB/s since a frame is 1ms
+    double bytes_per_frame;
+} result_t;
+
+static void start(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        uint64_t pma_access_cost)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    bulk_device_start();
+
+    hal5_usb_sim_set_irq_latency(irq_latency_ns);
+    hal5_usb_sim_set_pma_access_cost(pma_access_cost);
+
+    // start at a frame boundary
+    hal5_usb_sim_advance(
+            HAL5_USB_SIM_FRAME_NS - 
+            (hal5_usb_sim_time() % HAL5_USB_SIM_FRAME_NS));
+
+    hal5_usb_sim_clear_stats();
+}
+
+static void finish(result_t* result)
+{
+    const hal5_usb_sim_stats_t* stats = hal5_usb_sim_get_stats();
+
+    const uint64_t packets = stats->acks;
+
+    CHECK (packets > 0);
+    CHECK (stats->stalls == 0);
+    CHECK (stats->no_responses == 0);
+
+    result->packets_per_frame = (double) packets / FRAMES;
+    result->naks_per_packet = (double) stats->naks / packets;
+    result->bytes_per_frame = 
+        (double) (stats->in_bytes + stats->out_bytes) / FRAMES;
+}
+
+static void run_in(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        uint64_t pma_access_cost,
+        result_t* result)
+{
+    start(configuration_value, irq_latency_ns, pma_access_cost);
+
+    const uint64_t end = hal5_usb_sim_time() + FRAMES * HAL5_USB_SIM_FRAME_NS;
+
+    size_t offset = 0;
+    uint32_t transfers = 0;
+    uint32_t errors = 0;
+
+    while (hal5_usb_sim_time() < end)
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        size_t len;
+
+        const hal5_usb_sim_handshake_t handshake = 
+            hal5_usb_sim_in(BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len);
+
+        if (handshake == hal5_usb_sim_nak) continue;
+        if (handshake != hal5_usb_sim_ack) break;
+
+        for (size_t i = 0; i < len; i++)
+        {
+            if (packet[i] != bulk_device_pattern(offset + i)) errors++;
+        }
+
+        offset += len;
+
+        if (len < MAX_PACKET_SIZE)
+        {
+            if (offset != BULK_DEVICE_TRANSFER_SIZE) errors++;
+            offset = 0;
+            transfers++;
+        }
+    }
+
+    CHECK (errors == 0);
+    CHECK (transfers > 0);
+    // the device counts the last one when ACK is received
+    CHECK (bulk_device_stats.in_transfers == transfers);
+
+    finish(result);
+}
+
+static void run_out(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        uint64_t pma_access_cost,
+        result_t* result)
+{
+    start(configuration_value, irq_latency_ns, pma_access_cost);
+
+    const uint64_t end = hal5_usb_sim_time() + FRAMES * HAL5_USB_SIM_FRAME_NS;
+
+    uint8_t transfer[BULK_DEVICE_TRANSFER_SIZE];
+
+    for (size_t i = 0; i < sizeof(transfer); i++)
+    {
+        transfer[i] = bulk_device_pattern(i);
+    }
+
+    size_t offset = 0;
+    uint32_t transfers = 0;
+
+    while (hal5_usb_sim_time() < end)
+    {
+        const size_t len = HAL5_MIN(
+                MAX_PACKET_SIZE, 
+                BULK_DEVICE_TRANSFER_SIZE - offset);
+
+        const hal5_usb_sim_handshake_t handshake = 
+            hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, transfer + offset, len);
+
+        if (handshake == hal5_usb_sim_nak) continue;
+        if (handshake != hal5_usb_sim_ack) break;
+
+        offset += len;
+
+        if (offset == BULK_DEVICE_TRANSFER_SIZE)
+        {
+            offset = 0;
+            transfers++;
+        }
+    }
+
+    // the interrupt of the last packet might not be serviced yet
+    hal5_usb_sim_run_irq();
+
+    CHECK (transfers > 0);
+    CHECK (bulk_device_stats.out_transfers == transfers);
+    CHECK (bulk_device_stats.out_errors == 0);
+
+    finish(result);
+}
+
+static void run(
+        uint64_t irq_latency,
+        uint64_t pma_access_cost,
+        result_t* in_single,
+        result_t* in_double,
+        result_t* out_single,
+        result_t* out_double)
+{
+    run_in(CONFIGURATION_SINGLE, irq_latency, pma_access_cost, in_single);
+    run_in(CONFIGURATION_DOUBLE, irq_latency, pma_access_cost, in_double);
+    run_out(CONFIGURATION_SINGLE, irq_latency, pma_access_cost, out_single);
+    run_out(CONFIGURATION_DOUBLE, irq_latency, pma_access_cost, out_double);
+
+    printf("irq %4lu ns, pma %4lu ns/B: "
+            "IN %5.2f (%4.2f) -> %5.2f (%4.2f), "
+            "OUT %5.2f (%4.2f) -> %5.2f (%4.2f)\n",
+            (unsigned long) irq_latency,
+            (unsigned long) pma_access_cost,
+            in_single->packets_per_frame,
+            in_single->naks_per_packet,
+            in_double->packets_per_frame,
+            in_double->naks_per_packet,
+            out_single->packets_per_frame,
+            out_single->naks_per_packet,
+            out_double->packets_per_frame,
+            out_double->naks_per_packet);
+
+    CHECK (in_double->packets_per_frame >= in_single->packets_per_frame);
+    CHECK (out_double->packets_per_frame >= out_single->packets_per_frame);
+}
+
+int main(void)
+{
+    const uint64_t irq_latencies[] = {0, 1000};
+    const uint64_t pma_access_costs[] = {10, 100, 400, 1000};
+
+    printf("bulk, %u bytes max packet size, %u bytes transfers, %u frames\n",
+            MAX_PACKET_SIZE, 
+            BULK_DEVICE_TRANSFER_SIZE, 
+            FRAMES);
+    printf("packets/frame (naks/packet) single -> double\n");
+
+    for (size_t i = 0; i < sizeof(irq_latencies)/sizeof(uint64_t); i++)
+    {
+        for (size_t j = 0; j < sizeof(pma_access_costs)/sizeof(uint64_t); j++)
+        {
+            result_t in_single, in_double, out_single, out_double;
+
+            run(irq_latencies[i], 
+                    pma_access_costs[j], 
+                    &in_single, 
+                    &in_double, 
+                    &out_single, 
+                    &out_double);
+
+            // SW_BUF is toggled before the next transaction, so the copy 
+            // does not cause a NAK, also at the lowest cost
+            if ((irq_latencies[i] == 0) && (pma_access_costs[j] == 10))
+            {
+                CHECK (in_double.naks_per_packet < 0.5);
+                CHECK (out_double.naks_per_packet < 0.5);
+                CHECK (out_double.packets_per_frame > 
+                        1.5 * out_single.packets_per_frame);
+            }
+        }
+    }
+
+    printf("bench_double_buffer: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
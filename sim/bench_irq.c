@@ -0,0 +1,211 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// measures the interrupt entries per packet with concurrent bulk IN and OUT
+// traffic of sim/bulk_device.c
+// the host alternates IN and OUT transactions back to back (retrying NAKs),
+// so with an interrupt latency longer than a transaction, the CTRs of both
+// endpoints are pending when the handler is entered and they are handled
+// in one entry (see HAL5_USB_MAX_EVENTS_PER_IRQ)
+// each entry costs the interrupt latency in the model
+// exits with non-zero status if any transfer is wrong
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define FRAMES                  (100)
+#define MAX_PACKET_SIZE         (64)
+#define PMA_ACCESS_COST         (10)
+
+// bConfigurationValue in sim/bulk_device.py
+#define CONFIGURATION_SINGLE    (1)
+#define CONFIGURATION_DOUBLE    (2)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+typedef struct
+{
+    double packets_per_frame;
+    double irqs_per_packet;
+} result_t;
+
+static void start(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    bulk_device_start();
+
+    hal5_usb_sim_set_irq_latency(irq_latency_ns);
+    hal5_usb_sim_set_pma_access_cost(PMA_ACCESS_COST);
+
+    // start at a frame boundary
+    hal5_usb_sim_advance(
+            HAL5_USB_SIM_FRAME_NS - 
+            (hal5_usb_sim_time() % HAL5_USB_SIM_FRAME_NS));
+
+    hal5_usb_sim_clear_stats();
+}
+
+static void run(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        result_t* result)
+{
+    start(configuration_value, irq_latency_ns);
+
+    const uint64_t end = hal5_usb_sim_time() + FRAMES * HAL5_USB_SIM_FRAME_NS;
+
+    uint8_t transfer[BULK_DEVICE_TRANSFER_SIZE];
+
+    for (size_t i = 0; i < sizeof(transfer); i++)
+    {
+        transfer[i] = bulk_device_pattern(i);
+    }
+
+    size_t in_offset = 0;
+    size_t out_offset = 0;
+    uint32_t in_transfers = 0;
+    uint32_t out_transfers = 0;
+    uint32_t errors = 0;
+
+    while (hal5_usb_sim_time() < end)
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        size_t len;
+
+        hal5_usb_sim_handshake_t handshake = 
+            hal5_usb_sim_in(BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len);
+
+        if (handshake == hal5_usb_sim_ack)
+        {
+            for (size_t i = 0; i < len; i++)
+            {
+                if (packet[i] != bulk_device_pattern(in_offset + i)) errors++;
+            }
+
+            in_offset += len;
+
+            if (len < MAX_PACKET_SIZE)
+            {
+                if (in_offset != BULK_DEVICE_TRANSFER_SIZE) errors++;
+                in_offset = 0;
+                in_transfers++;
+            }
+        }
+        else if (handshake != hal5_usb_sim_nak) break;
+
+        len = HAL5_MIN(MAX_PACKET_SIZE, BULK_DEVICE_TRANSFER_SIZE - out_offset);
+
+        handshake = hal5_usb_sim_out(
+                BULK_DEVICE_OUT_ENDP, transfer + out_offset, len);
+
+        if (handshake == hal5_usb_sim_ack)
+        {
+            out_offset += len;
+
+            if (out_offset == BULK_DEVICE_TRANSFER_SIZE)
+            {
+                out_offset = 0;
+                out_transfers++;
+            }
+        }
+        else if (handshake != hal5_usb_sim_nak) break;
+    }
+
+    // the interrupt of the last packet might not be serviced yet
+    hal5_usb_sim_run_irq();
+
+    CHECK (errors == 0);
+    CHECK (in_transfers > 0);
+    CHECK (out_transfers > 0);
+    CHECK (bulk_device_stats.in_transfers == in_transfers);
+    CHECK (bulk_device_stats.out_transfers == out_transfers);
+    CHECK (bulk_device_stats.out_errors == 0);
+
+    const hal5_usb_sim_stats_t* stats = hal5_usb_sim_get_stats();
+
+    CHECK (stats->acks > 0);
+    CHECK (stats->stalls == 0);
+    CHECK (stats->no_responses == 0);
+    // an entry handles at least one packet
+    CHECK (stats->irqs <= stats->acks);
+
+    result->packets_per_frame = (double) stats->acks / FRAMES;
+    result->irqs_per_packet = (double) stats->irqs / stats->acks;
+}
+
+int main(void)
+{
+    const uint64_t irq_latencies[] = {1000, 20000, 50000, 100000};
+
+    printf("bulk IN and OUT, %u bytes max packet size, %u frames, "
+            "%u ns/B pma, %u events/irq\n",
+            MAX_PACKET_SIZE, 
+            FRAMES,
+            PMA_ACCESS_COST,
+            HAL5_USB_MAX_EVENTS_PER_IRQ);
+    printf("packets/frame (irqs/packet) single, double\n");
+
+    for (size_t i = 0; i < sizeof(irq_latencies)/sizeof(uint64_t); i++)
+    {
+        const uint64_t latency = irq_latencies[i];
+
+        result_t single, dbl;
+
+        run(CONFIGURATION_SINGLE, latency, &single);
+        run(CONFIGURATION_DOUBLE, latency, &dbl);
+
+        printf("irq latency %6lu ns: %5.2f (%4.2f), %5.2f (%4.2f)\n",
+                (unsigned long) latency,
+                single.packets_per_frame,
+                single.irqs_per_packet,
+                dbl.packets_per_frame,
+                dbl.irqs_per_packet);
+
+        // both CTRs are pending when the latency is longer than a packet
+        if ((latency >= 100000) && (HAL5_USB_MAX_EVENTS_PER_IRQ > 1))
+        {
+            CHECK (dbl.irqs_per_packet < 1.0);
+        }
+    }
+
+    printf("bench_irq: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,382 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// measures the sequential READ(10) and WRITE(10) throughput of the mass 
+// storage driver with sim/msc_device.c (RAM disk)
+// the host runs the commands back to back, each COMMAND_BLOCKS blocks 
+// (CBW, data and CSW, retrying NAKs) for FRAMES frames, and the last one
+// is completed, the data is checked on both sides
+// MB/s is compared to raw streaming, where the packet callbacks only give 
+// and take packets, so this is the maximum of the endpoints in the modeled 
+// bus, the difference is the CBW and CSW of each command and the time the 
+// blocks wait for hal5_usb_msc_process
+// exits with non-zero status if the data is wrong or the throughput is
+// below 90% of raw streaming
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "msc_device.h"
+
+#define FRAMES                  (100)
+#define MAX_PACKET_SIZE         (64)
+#define BLOCK_SIZE              (HAL5_USB_MSC_BLOCK_SIZE)
+// 64 KB
+#define COMMAND_BLOCKS          (128)
+
+// bConfigurationValue in sim/msc_device.py
+#define CONFIGURATION_SINGLE    (1)
+#define CONFIGURATION_DOUBLE    (2)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint8_t pattern(size_t offset, uint8_t seed)
+{
+    return (uint8_t) ((offset * 7) + (offset >> 9) + seed);
+}
+
+// raw streaming, the data is not checked
+static bool raw_in_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    return true;
+}
+
+static bool raw_out_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    return true;
+}
+
+static void start(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        bool raw)
+{
+    // the endpoints are created with them at Set Configuration
+    CHECK (hal5_usb_device_register_packet_callback(
+                0x80 | MSC_DEVICE_IN_ENDP, 
+                raw ? raw_in_packet : NULL, 
+                NULL));
+    CHECK (hal5_usb_device_register_packet_callback(
+                MSC_DEVICE_OUT_ENDP, 
+                raw ? raw_out_packet : NULL, 
+                NULL));
+
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    if (raw)
+    {
+        hal5_usb_device_start_stream(
+                hal5_usb_device_get_endpoint(MSC_DEVICE_IN_ENDP, true));
+        hal5_usb_device_start_stream(
+                hal5_usb_device_get_endpoint(MSC_DEVICE_OUT_ENDP, false));
+    }
+
+    hal5_usb_sim_set_main_loop(raw ? NULL : hal5_usb_msc_process);
+    hal5_usb_sim_set_irq_latency(irq_latency_ns);
+    hal5_usb_sim_set_pma_access_cost(10);
+
+    // start at a frame boundary
+    hal5_usb_sim_advance(
+            HAL5_USB_SIM_FRAME_NS - 
+            (hal5_usb_sim_time() % HAL5_USB_SIM_FRAME_NS));
+
+    hal5_usb_sim_clear_stats();
+}
+
+// one transaction, NAKs are retried
+static hal5_usb_sim_handshake_t out_packet(const void* data, size_t len)
+{
+    hal5_usb_sim_handshake_t handshake;
+
+    do
+    {
+        handshake = hal5_usb_sim_out(MSC_DEVICE_OUT_ENDP, data, len);
+    }
+    while (handshake == hal5_usb_sim_nak);
+
+    return handshake;
+}
+
+static hal5_usb_sim_handshake_t in_packet(void* data, size_t* len)
+{
+    hal5_usb_sim_handshake_t handshake;
+
+    do
+    {
+        handshake = hal5_usb_sim_in(
+                MSC_DEVICE_IN_ENDP, data, MAX_PACKET_SIZE, len);
+    }
+    while (handshake == hal5_usb_sim_nak);
+
+    return handshake;
+}
+
+static uint32_t tag = 0;
+
+static bool send_cbw(uint8_t opcode, uint32_t lba)
+{
+    hal5_usb_msc_cbw_t cbw;
+
+    memset(&cbw, 0, sizeof(cbw));
+    cbw.dCBWSignature = HAL5_USB_MSC_CBW_SIGNATURE;
+    cbw.dCBWTag = ++tag;
+    cbw.dCBWDataTransferLength = COMMAND_BLOCKS * BLOCK_SIZE;
+    cbw.bmCBWFlags = (opcode == HAL5_USB_MSC_SCSI_READ_10) ? 0x80 : 0x00;
+    cbw.bCBWCBLength = 10;
+    cbw.CBWCB[0] = opcode;
+    cbw.CBWCB[2] = lba >> 24;
+    cbw.CBWCB[3] = lba >> 16;
+    cbw.CBWCB[4] = lba >> 8;
+    cbw.CBWCB[5] = lba;
+    cbw.CBWCB[7] = COMMAND_BLOCKS >> 8;
+    cbw.CBWCB[8] = COMMAND_BLOCKS & 0xFF;
+
+    return (out_packet(&cbw, sizeof(cbw)) == hal5_usb_sim_ack);
+}
+
+static bool receive_csw(void)
+{
+    hal5_usb_msc_csw_t csw;
+    size_t len;
+
+    return (in_packet(&csw, &len) == hal5_usb_sim_ack) &&
+        (len == sizeof(csw)) &&
+        (csw.dCSWTag == tag) &&
+        (csw.bCSWStatus == HAL5_USB_MSC_CSW_PASSED) &&
+        (csw.dCSWDataResidue == 0);
+}
+
+// returns bytes per frame
+static double run_read(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        bool raw)
+{
+    for (size_t i = 0; i < sizeof(msc_device_disk); i++) 
+    {
+        msc_device_disk[i] = pattern(i, configuration_value);
+    }
+
+    start(configuration_value, irq_latency_ns, raw);
+
+    const uint64_t begin = hal5_usb_sim_time();
+    const uint64_t end = begin + FRAMES * HAL5_USB_SIM_FRAME_NS;
+
+    size_t bytes = 0;
+    uint32_t lba = 0;
+    uint32_t errors = 0;
+
+    while (hal5_usb_sim_time() < end)
+    {
+        if (!raw && !send_cbw(HAL5_USB_MSC_SCSI_READ_10, lba)) break;
+
+        // the data is counted when the command is completed
+        size_t offset = 0;
+
+        while (offset < (COMMAND_BLOCKS * BLOCK_SIZE))
+        {
+            uint8_t packet[MAX_PACKET_SIZE];
+            size_t len;
+
+            if (in_packet(packet, &len) != hal5_usb_sim_ack) break;
+
+            for (size_t i = 0; !raw && (i < len); i++)
+            {
+                if (packet[i] != msc_device_disk[lba * BLOCK_SIZE + offset + i])
+                {
+                    errors++;
+                }
+            }
+
+            offset += len;
+        }
+
+        if (offset != (COMMAND_BLOCKS * BLOCK_SIZE)) break;
+        if (!raw && !receive_csw()) break;
+
+        bytes += offset;
+        lba = (lba + COMMAND_BLOCKS) % MSC_DEVICE_BLOCK_COUNT;
+    }
+
+    hal5_usb_sim_set_main_loop(NULL);
+
+    CHECK (errors == 0);
+    CHECK (bytes > 0);
+
+    // the last command is completed after end
+    return (double) bytes * HAL5_USB_SIM_FRAME_NS / 
+        (hal5_usb_sim_time() - begin);
+}
+
+static double run_write(
+        uint8_t configuration_value,
+        uint64_t irq_latency_ns,
+        bool raw)
+{
+    memset(msc_device_disk, 0, sizeof(msc_device_disk));
+
+    start(configuration_value, irq_latency_ns, raw);
+
+    const uint64_t begin = hal5_usb_sim_time();
+    const uint64_t end = begin + FRAMES * HAL5_USB_SIM_FRAME_NS;
+
+    size_t bytes = 0;
+    uint32_t lba = 0;
+
+    while (hal5_usb_sim_time() < end)
+    {
+        if (!raw && !send_cbw(HAL5_USB_MSC_SCSI_WRITE_10, lba)) break;
+
+        size_t offset = 0;
+
+        while (offset < (COMMAND_BLOCKS * BLOCK_SIZE))
+        {
+            uint8_t packet[MAX_PACKET_SIZE];
+
+            for (size_t i = 0; i < sizeof(packet); i++)
+            {
+                packet[i] = pattern(
+                        lba * BLOCK_SIZE + offset + i, 
+                        configuration_value);
+            }
+
+            if (out_packet(packet, sizeof(packet)) != hal5_usb_sim_ack) break;
+
+            offset += sizeof(packet);
+        }
+
+        if (offset != (COMMAND_BLOCKS * BLOCK_SIZE)) break;
+        if (!raw && !receive_csw()) break;
+
+        bytes += offset;
+        lba = (lba + COMMAND_BLOCKS) % MSC_DEVICE_BLOCK_COUNT;
+    }
+
+    hal5_usb_sim_set_main_loop(NULL);
+
+    CHECK (bytes > 0);
+
+    // the disk is written once at least
+    if (!raw && (bytes >= sizeof(msc_device_disk)))
+    {
+        uint32_t errors = 0;
+
+        for (size_t i = 0; i < sizeof(msc_device_disk); i++) 
+        {
+            if (msc_device_disk[i] != pattern(i, configuration_value)) 
+            {
+                errors++;
+            }
+        }
+
+        CHECK (errors == 0);
+    }
+
+    // the last command is completed after end
+    return (double) bytes * HAL5_USB_SIM_FRAME_NS / 
+        (hal5_usb_sim_time() - begin);
+}
+
+typedef struct
+{
+    double msc;
+    double raw;
+} result_t;
+
+static void print_result(const char* name, const result_t* result)
+{
+    // bytes per frame is kB/s
+    printf(" %s %5.3f MB/s (%3.0f%%)", 
+            name,
+            result->msc / 1000.0, 
+            100.0 * result->msc / result->raw);
+}
+
+int main(void)
+{
+    CHECK (msc_device_initialize());
+
+    const uint64_t irq_latencies[] = {1000, 20000};
+    const uint8_t configurations[] = 
+        {CONFIGURATION_SINGLE, CONFIGURATION_DOUBLE};
+
+    printf("msc, %u bytes max packet size, %u frames, %u B blocks, "
+            "%u blocks per command, %u buffers, 10 ns/B pma\n",
+            MAX_PACKET_SIZE, 
+            FRAMES,
+            BLOCK_SIZE,
+            COMMAND_BLOCKS,
+            HAL5_USB_MSC_BUFFERS);
+    printf("MB/s (%% of raw streaming)\n");
+
+    for (size_t i = 0; i < sizeof(irq_latencies)/sizeof(uint64_t); i++)
+    {
+        for (size_t k = 0; k < sizeof(configurations); k++)
+        {
+            const uint64_t latency = irq_latencies[i];
+            const uint8_t configuration = configurations[k];
+
+            result_t read, write;
+
+            read.raw = run_read(configuration, latency, true);
+            read.msc = run_read(configuration, latency, false);
+            write.raw = run_write(configuration, latency, true);
+            write.msc = run_write(configuration, latency, false);
+
+            printf("irq latency %5lu ns, %s:",
+                    (unsigned long) latency,
+                    (configuration == CONFIGURATION_SINGLE) ? 
+                    "single" : "double");
+            print_result("READ", &read);
+            print_result("WRITE", &write);
+            printf("\n");
+
+            CHECK (read.msc >= (0.9 * read.raw));
+            CHECK (write.msc >= (0.9 * write.raw));
+        }
+    }
+
+    printf("bench_msc: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
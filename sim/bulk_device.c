@@ -0,0 +1,186 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hal5_usb_device.h"
+#include "bulk_device.h"
+
+bulk_device_stats_t bulk_device_stats;
+bool bulk_device_rearm_out = true;
+
+static uint8_t transfer[BULK_DEVICE_TRANSFER_SIZE];
+static uint8_t received[BULK_DEVICE_TRANSFER_SIZE];
+
+uint8_t bulk_device_pattern(size_t offset)
+{
+    return (uint8_t) (offset * 7 + 3);
+}
+
+void bulk_device_start(void)
+{
+    for (size_t i = 0; i < BULK_DEVICE_TRANSFER_SIZE; i++)
+    {
+        transfer[i] = bulk_device_pattern(i);
+    }
+
+    memset(&bulk_device_stats, 0, sizeof(bulk_device_stats));
+
+    hal5_usb_device_start_in_ref(
+            hal5_usb_device_get_endpoint(BULK_DEVICE_IN_ENDP, true),
+            transfer,
+            BULK_DEVICE_TRANSFER_SIZE);
+
+    hal5_usb_device_start_out_buffer(
+            hal5_usb_device_get_endpoint(BULK_DEVICE_OUT_ENDP, false),
+            received,
+            sizeof(received));
+}
+
+uint8_t hal5_usb_device_version_major_ex()
+{
+    return 1;
+}
+
+uint8_t hal5_usb_device_version_minor_ex()
+{
+    return 0;
+}
+
+bool hal5_usb_device_is_device_self_powered_ex() 
+{ 
+    return true; 
+}
+
+bool hal5_usb_device_clear_endpoint_halt_ex(
+        uint8_t endpoint,
+        bool dir_in)
+{
+    return false;
+}
+
+bool hal5_usb_device_set_endpoint_halt_ex(
+        uint8_t endpoint,
+        bool dir_in)
+{
+    return false;
+}
+
+bool hal5_usb_device_is_endpoint_halt_set_ex(
+        uint8_t endpoint, 
+        bool dir_in,
+        bool* is_set) 
+{
+    return false;
+}
+
+bool hal5_usb_device_clear_device_remote_wakeup_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_set_device_remote_wakeup_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_is_device_remote_wakeup_set_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_set_test_mode_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_is_test_mode_set_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_get_synch_frame_ex(
+        uint8_t endpoint,
+        bool dir_in,
+        uint16_t* frame_number)
+{
+    return false;
+}
+
+void hal5_usb_device_set_configuration_ex(
+        uint8_t configuration_value)
+{
+}
+
+bool hal5_usb_device_get_interface_ex(
+        uint8_t interface,
+        uint8_t* alternate_setting)
+{
+    return false;
+}
+
+bool hal5_usb_device_set_interface_ex(
+        uint8_t interface,
+        uint8_t alternate_setting)
+{
+    return false;
+}
+
+// the next transfer is prepared in the callbacks
+// so the endpoints never stop
+
+void hal5_usb_device_out_stage_completed_ex(
+        hal5_usb_endpoint_t* ep)
+{
+    bulk_device_stats.out_transfers++;
+    bulk_device_stats.last_out_received = ep->rx_received;
+    bulk_device_stats.last_out_overflow = ep->rx_overflow;
+
+    if (!bulk_device_rearm_out) return;
+
+    if ((ep->rx_received != BULK_DEVICE_TRANSFER_SIZE) ||
+            ep->rx_overflow ||
+            (memcmp(received, transfer, ep->rx_received) != 0))
+    {
+        bulk_device_stats.out_errors++;
+    }
+
+    hal5_usb_ep_prepare_for_out_buffer(
+            ep, 
+            ep_status_disabled,
+            received,
+            sizeof(received));
+}
+
+void hal5_usb_device_in_stage_completed_ex(
+        hal5_usb_endpoint_t* ep)
+{
+    bulk_device_stats.in_transfers++;
+
+    hal5_usb_ep_prepare_for_in_ref(
+            ep, 
+            ep_status_disabled,
+            transfer,
+            BULK_DEVICE_TRANSFER_SIZE,
+            false,
+            0);
+}
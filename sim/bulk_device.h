@@ -0,0 +1,64 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// bulk device used by the simulation benchmarks
+// EP1 IN sends and EP2 OUT receives transfers of 
+// BULK_DEVICE_TRANSFER_SIZE bytes continuously
+// data is bulk_device_pattern(offset in transfer)
+
+#ifndef __BULK_DEVICE_H__
+#define __BULK_DEVICE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal5_usb_device.h"
+
+#define BULK_DEVICE_IN_ENDP         (1)
+#define BULK_DEVICE_OUT_ENDP        (2)
+// not a multiple of max packet size, so no ZLP
+#define BULK_DEVICE_TRANSFER_SIZE   (1000)
+
+typedef struct
+{
+    uint32_t in_transfers;
+    uint32_t out_transfers;
+    // OUT transfers with wrong size or data
+    uint32_t out_errors;
+    // of the last OUT stage
+    size_t last_out_received;
+    bool last_out_overflow;
+} bulk_device_stats_t;
+
+extern bulk_device_stats_t bulk_device_stats;
+
+// true by default, the OUT endpoint is armed again after an OUT stage 
+// with its own buffer and the data received is checked
+// if false, the endpoint NAKs until it is armed again
+extern bool bulk_device_rearm_out;
+
+uint8_t bulk_device_pattern(size_t offset);
+
+// call after the configuration is set
+// starts IN transfers and arms the OUT endpoint
+void bulk_device_start(void);
+
+#endif
@@ -0,0 +1,77 @@
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# descriptors of the bulk device used by the simulation benchmarks
+# see descriptors.py for the meaning of the keys
+
+# configuration 1 has single buffered endpoints
+# configuration 2 has the same endpoints but double buffered
+# EP1 IN and EP2 OUT, so each endpoint number is used only in one direction
+
+def bulk_configuration(value, double_buffer):
+    return {
+        'value':            value,
+        'label':            None,
+        'self-powered':     True,
+        'remote-wakeup':    False,
+        'max-power-ma':     0,
+        'interfaces':
+        [
+            {
+                'number':               0,
+                'label':                None,
+                'alternate-setting':    0,
+                'class-proto':          (0xFF, 0xFF, 0xFF),
+                'endpoints':
+                [
+                    {
+                        'address':          1,
+                        'direction':        'in',
+                        'transfer-type':    'bulk',
+                        'max-packet-size':  64,
+                        'double-buffer':    double_buffer,
+                    },
+                    {
+                        'address':          2,
+                        'direction':        'out',
+                        'transfer-type':    'bulk',
+                        'max-packet-size':  64,
+                        'double-buffer':    double_buffer,
+                    },
+                ]
+            }
+        ]
+    }
+
+descriptors = {
+    'class-proto':          (0x00, 0x00, 0x00),
+    'max-packet-size-ep0':  64,
+    'ids':                  (0x1209, 0x0001),
+    'device-version':       (1, 0),
+    'manufacturer':         'metebalci',
+    'product':              'hal5 bulk',
+    'append_version':       False,
+    'serial':               None,
+    'configurations':
+    [
+        bulk_configuration(1, False),
+        bulk_configuration(2, True),
+    ]
+}
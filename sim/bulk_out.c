@@ -0,0 +1,177 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// scripted host checking OUT transfers of sim/bulk_device.c received to
+// application buffers, with single and double buffered endpoints
+// - endpoints NAK until they are armed, and after the stage is completed
+// - a large buffer is filled and the stage is completed when it is full
+// - a short packet completes the stage
+// - a packet not fitting the buffer is truncated and rx_overflow is set
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+#define MAX_NAKS                (1000)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint8_t large[64 * 1024];
+static uint8_t small[1000];
+
+static void configure(uint8_t configuration_value)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    memset(&bulk_device_stats, 0, sizeof(bulk_device_stats));
+    bulk_device_rearm_out = false;
+}
+
+// sends len bytes of the pattern (starting from offset) as packets
+static bool send(size_t offset, size_t len)
+{
+    uint8_t packet[MAX_PACKET_SIZE];
+
+    while (len > 0)
+    {
+        const size_t packet_len = HAL5_MIN(len, MAX_PACKET_SIZE);
+
+        for (size_t i = 0; i < packet_len; i++)
+        {
+            packet[i] = bulk_device_pattern(offset + i);
+        }
+
+        hal5_usb_sim_handshake_t handshake;
+        uint32_t naks = 0;
+
+        do
+        {
+            handshake = hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, packet, packet_len);
+        } while ((handshake == hal5_usb_sim_nak) && (++naks < MAX_NAKS));
+
+        if (handshake != hal5_usb_sim_ack) return false;
+
+        offset += packet_len;
+        len -= packet_len;
+    }
+
+    return true;
+}
+
+static bool is_pattern(const uint8_t* data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (data[i] != bulk_device_pattern(i)) return false;
+    }
+    return true;
+}
+
+static bool is_naking(void)
+{
+    const uint8_t packet[MAX_PACKET_SIZE] = {0};
+    return hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, packet, sizeof(packet)) == 
+        hal5_usb_sim_nak;
+}
+
+static void check(uint8_t configuration_value)
+{
+    configure(configuration_value);
+
+    hal5_usb_endpoint_t* ep = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_OUT_ENDP, 
+            false);
+
+    CHECK (ep != NULL);
+    CHECK (ep->double_buffered == (configuration_value == 2));
+
+    // not armed
+    CHECK (is_naking());
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    size_t len;
+    CHECK (hal5_usb_sim_in(BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len) ==
+            hal5_usb_sim_nak);
+
+    // large buffer, completed when it is full
+    memset(large, 0, sizeof(large));
+    hal5_usb_device_start_out_buffer(ep, large, sizeof(large));
+
+    CHECK (send(0, sizeof(large)));
+    CHECK (bulk_device_stats.out_transfers == 1);
+    CHECK (bulk_device_stats.last_out_received == sizeof(large));
+    CHECK (!bulk_device_stats.last_out_overflow);
+    CHECK (is_pattern(large, sizeof(large)));
+    CHECK (is_naking());
+
+    // short packet
+    memset(small, 0, sizeof(small));
+    hal5_usb_device_start_out_buffer(ep, small, sizeof(small));
+
+    CHECK (send(0, MAX_PACKET_SIZE + 10));
+    CHECK (bulk_device_stats.out_transfers == 2);
+    CHECK (bulk_device_stats.last_out_received == MAX_PACKET_SIZE + 10);
+    CHECK (!bulk_device_stats.last_out_overflow);
+    CHECK (is_pattern(small, MAX_PACKET_SIZE + 10));
+    CHECK (is_naking());
+
+    // the second packet does not fit
+    memset(small, 0, sizeof(small));
+    hal5_usb_device_start_out_buffer(ep, small, 100);
+
+    CHECK (send(0, 2 * MAX_PACKET_SIZE));
+    CHECK (bulk_device_stats.out_transfers == 3);
+    CHECK (bulk_device_stats.last_out_received == 100);
+    CHECK (bulk_device_stats.last_out_overflow);
+    CHECK (is_pattern(small, 100));
+    CHECK (small[100] == 0);
+    CHECK (is_naking());
+}
+
+int main(void)
+{
+    // single buffered
+    check(1);
+    // double buffered
+    check(2);
+
+    printf("bulk_out: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,351 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the CDC-ACM driver (hal5_usb_cdc_acm.c) with sim/cdc_acm_device.c,
+// with single and double buffered data endpoints
+// - line coding, control line state and break class requests
+// - SERIAL_STATE notification
+// - TX ring to IN packets, with a ZLP after a full packet
+// - OUT packets to RX ring, NAK when it is full until it is read
+// - echo from the main loop
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "cdc_acm_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+#define MAX_NAKS                (100)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// reads IN packets until a NAK, returns the number of bytes
+static size_t read_all(uint8_t* data, size_t size)
+{
+    size_t received = 0;
+
+    while (true)
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        const int len = hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_IN_ENDP, packet, sizeof(packet));
+
+        if (len < 0) break;
+
+        if ((received + len) <= size) memcpy(data + received, packet, len);
+        received += len;
+    }
+
+    return received;
+}
+
+// writes OUT packets until a NAK, returns the number of bytes
+static size_t write_all(const uint8_t* data, size_t size)
+{
+    size_t sent = 0;
+
+    while (sent < size)
+    {
+        const size_t len = HAL5_MIN(MAX_PACKET_SIZE, size - sent);
+
+        if (hal5_usb_sim_out(CDC_ACM_DEVICE_OUT_ENDP, data + sent, len) != 
+                hal5_usb_sim_ack)
+        {
+            break;
+        }
+
+        sent += len;
+    }
+
+    return sent;
+}
+
+static void check_requests(void)
+{
+    hal5_usb_cdc_acm_line_coding_t line_coding;
+    size_t len;
+
+    const hal5_usb_device_request_t get_line_coding = 
+        {0xA1, HAL5_USB_CDC_GET_LINE_CODING, 0, 
+            CDC_ACM_DEVICE_COMM_INTERFACE, 7};
+
+    // 115200 8N1 by default
+    CHECK (hal5_usb_sim_control_read(0, &get_line_coding, &line_coding, &len));
+    CHECK (len == 7);
+    CHECK (line_coding.dwDTERate == 115200);
+    CHECK (line_coding.bCharFormat == 0);
+    CHECK (line_coding.bParityType == 0);
+    CHECK (line_coding.bDataBits == 8);
+
+    // 9600 7E2
+    const hal5_usb_cdc_acm_line_coding_t new_line_coding = {9600, 2, 2, 7};
+
+    const hal5_usb_device_request_t set_line_coding = 
+        {0x21, HAL5_USB_CDC_SET_LINE_CODING, 0, 
+            CDC_ACM_DEVICE_COMM_INTERFACE, 7};
+
+    CHECK (hal5_usb_sim_control_write(0, &set_line_coding, &new_line_coding));
+
+    hal5_usb_cdc_acm_get_line_coding(&line_coding);
+    CHECK (memcmp(&line_coding, &new_line_coding, 7) == 0);
+
+    memset(&line_coding, 0, sizeof(line_coding));
+    CHECK (hal5_usb_sim_control_read(0, &get_line_coding, &line_coding, &len));
+    CHECK (memcmp(&line_coding, &new_line_coding, 7) == 0);
+
+    // not the communication interface
+    const hal5_usb_device_request_t set_line_coding_data_interface = 
+        {0x21, HAL5_USB_CDC_SET_LINE_CODING, 0, 
+            CDC_ACM_DEVICE_COMM_INTERFACE + 1, 7};
+
+    CHECK (!hal5_usb_sim_control_write(
+                0, &set_line_coding_data_interface, &new_line_coding));
+
+    const hal5_usb_device_request_t set_control_line_state = 
+        {0x21, HAL5_USB_CDC_SET_CONTROL_LINE_STATE, 
+            HAL5_USB_CDC_CONTROL_LINE_DTR | HAL5_USB_CDC_CONTROL_LINE_RTS, 
+            CDC_ACM_DEVICE_COMM_INTERFACE, 0};
+
+    CHECK (hal5_usb_sim_control_nodata(0, &set_control_line_state));
+    CHECK (hal5_usb_cdc_acm_get_control_line_state() == 
+            (HAL5_USB_CDC_CONTROL_LINE_DTR | HAL5_USB_CDC_CONTROL_LINE_RTS));
+
+    const hal5_usb_device_request_t send_break = 
+        {0x21, HAL5_USB_CDC_SEND_BREAK, 100, 
+            CDC_ACM_DEVICE_COMM_INTERFACE, 0};
+
+    CHECK (hal5_usb_sim_control_nodata(0, &send_break));
+
+    hal5_usb_cdc_acm_stats_t stats;
+    hal5_usb_cdc_acm_get_stats(&stats);
+    CHECK (stats.line_coding_changes == 1);
+    CHECK (stats.breaks == 1);
+}
+
+static void check_notification(void)
+{
+    uint8_t packet[MAX_PACKET_SIZE];
+
+    // nothing to send
+    CHECK (hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_NOTIFICATION_ENDP, packet, sizeof(packet)) == 
+            -1);
+
+    CHECK (hal5_usb_cdc_acm_send_serial_state(
+                HAL5_USB_CDC_SERIAL_STATE_DCD | 
+                HAL5_USB_CDC_SERIAL_STATE_DSR));
+    // the previous one is not sent yet
+    CHECK (!hal5_usb_cdc_acm_send_serial_state(0));
+
+    const uint8_t expected[] = {
+        0xA1, HAL5_USB_CDC_SERIAL_STATE, 0, 0, 
+        CDC_ACM_DEVICE_COMM_INTERFACE, 0, 2, 0, 0x03, 0x00};
+
+    CHECK (hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_NOTIFICATION_ENDP, packet, sizeof(packet)) == 
+            sizeof(expected));
+    CHECK (memcmp(packet, expected, sizeof(expected)) == 0);
+
+    CHECK (hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_NOTIFICATION_ENDP, packet, sizeof(packet)) == 
+            -1);
+    CHECK (hal5_usb_cdc_acm_send_serial_state(0));
+    CHECK (hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_NOTIFICATION_ENDP, packet, sizeof(packet)) == 
+            10);
+}
+
+static void check_in(void)
+{
+    uint8_t data[256];
+    uint8_t received[256];
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t) (i * 3);
+
+    // nothing to send
+    CHECK (read_all(received, sizeof(received)) == 0);
+
+    CHECK (hal5_usb_cdc_acm_write(data, 100) == 100);
+    CHECK (read_all(received, sizeof(received)) == 100);
+    CHECK (memcmp(received, data, 100) == 0);
+
+    // 64 + 64 + ZLP
+    CHECK (hal5_usb_cdc_acm_write(data, 128) == 128);
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    CHECK (hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_IN_ENDP, packet, sizeof(packet)) == 64);
+    CHECK (hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_IN_ENDP, packet, sizeof(packet)) == 64);
+    CHECK (memcmp(packet, data + 64, 64) == 0);
+    CHECK (hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_IN_ENDP, packet, sizeof(packet)) == 0);
+    CHECK (hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_IN_ENDP, packet, sizeof(packet)) == -1);
+
+    // TX ring is full
+    size_t written = 0;
+    while (true)
+    {
+        // continues the pattern
+        const size_t offset = written % sizeof(data);
+        const size_t n = hal5_usb_cdc_acm_write(
+                data + offset, sizeof(data) - offset);
+        if (n == 0) break;
+        written += n;
+    }
+    CHECK (written >= HAL5_USB_CDC_ACM_RING_SIZE);
+    CHECK (hal5_usb_cdc_acm_tx_free() == 0);
+
+    size_t drained = 0;
+    uint32_t errors = 0;
+    while (true)
+    {
+        const int len = hal5_usb_sim_in_or_nak(
+                CDC_ACM_DEVICE_IN_ENDP, packet, sizeof(packet));
+        if (len <= 0) break;
+        for (int i = 0; i < len; i++)
+        {
+            if (packet[i] != data[(drained + i) % sizeof(data)]) errors++;
+        }
+        drained += len;
+    }
+
+    CHECK (drained == written);
+    CHECK (errors == 0);
+
+    hal5_usb_cdc_acm_stats_t stats;
+    hal5_usb_cdc_acm_get_stats(&stats);
+    CHECK (stats.tx_bytes == (100 + 128 + written));
+}
+
+static void check_out(void)
+{
+    uint8_t data[HAL5_USB_CDC_ACM_RING_SIZE * 2];
+    uint8_t received[HAL5_USB_CDC_ACM_RING_SIZE * 2];
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t) (i * 5 + 1);
+
+    CHECK (hal5_usb_cdc_acm_read(received, sizeof(received)) == 0);
+
+    CHECK (write_all(data, 100) == 100);
+    CHECK (hal5_usb_cdc_acm_rx_available() == 100);
+    CHECK (hal5_usb_cdc_acm_read(received, sizeof(received)) == 100);
+    CHECK (memcmp(received, data, 100) == 0);
+
+    // NAKs when RX ring is full
+    const size_t accepted = write_all(data, sizeof(data));
+    CHECK (accepted < sizeof(data));
+    CHECK (accepted > (HAL5_USB_CDC_ACM_RING_SIZE - 2 * MAX_PACKET_SIZE));
+    CHECK (hal5_usb_cdc_acm_rx_available() == accepted);
+
+    hal5_usb_cdc_acm_stats_t stats;
+    hal5_usb_cdc_acm_get_stats(&stats);
+    CHECK (stats.rx_throttles == 1);
+
+    // a part is read, it continues
+    CHECK (hal5_usb_cdc_acm_read(received, 1000) == 1000);
+    const size_t more = write_all(data + accepted, sizeof(data) - accepted);
+    CHECK (more > 0);
+
+    CHECK (hal5_usb_cdc_acm_read(received + 1000, sizeof(received)) == 
+            (accepted + more - 1000));
+    CHECK (memcmp(received, data, accepted + more) == 0);
+
+    hal5_usb_cdc_acm_get_stats(&stats);
+    CHECK (stats.rx_bytes == (100 + accepted + more));
+}
+
+static void echo(void)
+{
+    uint8_t data[MAX_PACKET_SIZE];
+
+    // only what fits to TX ring is read
+    const size_t size = HAL5_MIN(sizeof(data), hal5_usb_cdc_acm_tx_free());
+    const size_t read = hal5_usb_cdc_acm_read(data, size);
+
+    if (read > 0) CHECK (hal5_usb_cdc_acm_write(data, read) == read);
+}
+
+static void check_echo(void)
+{
+    hal5_usb_sim_set_main_loop(echo);
+
+    uint8_t data[1000];
+    uint8_t received[1000];
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t) (i ^ 0xA5);
+
+    size_t sent = 0;
+    size_t echoed = 0;
+
+    while (echoed < sizeof(data))
+    {
+        sent += write_all(data + sent, HAL5_MIN(100, sizeof(data) - sent));
+        echoed += read_all(received + echoed, sizeof(received) - echoed);
+        CHECK (echoed <= sent);
+        if (echoed > sent) break;
+    }
+
+    CHECK (echoed == sizeof(data));
+    CHECK (memcmp(received, data, sizeof(data)) == 0);
+
+    hal5_usb_sim_set_main_loop(NULL);
+}
+
+static void check(uint8_t configuration_value)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    check_requests();
+    check_notification();
+    check_in();
+    check_out();
+    check_echo();
+}
+
+int main(void)
+{
+    CHECK (cdc_acm_device_initialize());
+
+    // single buffered
+    check(1);
+    // double buffered
+    check(2);
+
+    printf("cdc_acm: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,40 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// CDC-ACM device used by the simulation
+// hal5_usb_cdc_acm with the descriptors in sim/cdc_acm_device.py
+// the data is written and read by the simulation programs
+
+#ifndef __CDC_ACM_DEVICE_H__
+#define __CDC_ACM_DEVICE_H__
+
+#include <stdbool.h>
+
+#include "hal5_usb_cdc_acm.h"
+
+#define CDC_ACM_DEVICE_COMM_INTERFACE   (0)
+#define CDC_ACM_DEVICE_NOTIFICATION_ENDP (3)
+#define CDC_ACM_DEVICE_IN_ENDP          (1)
+#define CDC_ACM_DEVICE_OUT_ENDP         (2)
+
+// call once, registers the CDC-ACM driver
+bool cdc_acm_device_initialize(void);
+
+#endif
@@ -0,0 +1,57 @@
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# descriptors of the CDC-ACM device used by the simulation
+# see descriptors.py for the meaning of the keys and cdc_acm.py
+
+# configuration 1 has single buffered data endpoints
+# configuration 2 has the same endpoints but double buffered
+# interface 0 (communication) with EP3 IN (notification)
+# interface 1 (data) with EP1 IN and EP2 OUT
+
+from cdc_acm import cdc_acm_interfaces, CDC_DEVICE_CLASS_PROTO
+
+def cdc_acm_configuration(value, double_buffer):
+    return {
+        'value':            value,
+        'label':            None,
+        'self-powered':     True,
+        'remote-wakeup':    False,
+        'max-power-ma':     0,
+        'interfaces':       cdc_acm_interfaces(
+            0, 3, 1, 2, 
+            double_buffer=double_buffer)
+    }
+
+descriptors = {
+    'class-proto':          CDC_DEVICE_CLASS_PROTO,
+    'max-packet-size-ep0':  64,
+    'ids':                  (0x1209, 0x0002),
+    'device-version':       (1, 0),
+    'manufacturer':         'metebalci',
+    'product':              'hal5 cdc acm',
+    'append_version':       False,
+    'serial':               None,
+    'configurations':
+    [
+        cdc_acm_configuration(1, False),
+        cdc_acm_configuration(2, True),
+    ]
+}
@@ -0,0 +1,298 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// scripted host checking class and vendor requests dispatched to the
+// handlers registered by hal5_usb_device_register_request_handler
+// - device to host requests reply the data given by the handler, 
+//   limited to wLength
+// - host to device requests without data are confirmed with a ZLP
+// - host to device requests with data are received to the buffer of the
+//   handler, and the data handler is called once before the status stage
+// - unregistered requests and requests the handler rejects are STALLed
+// - standard requests are still handled after a STALL
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define VENDOR_GET_DATA         (0x01)
+#define VENDOR_SET_VALUE        (0x02)
+#define CLASS_RESET             (0x03)
+#define VENDOR_SET_DATA         (0x04)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint8_t vendor_data[100];
+static uint16_t vendor_value = 0;
+static uint32_t class_resets = 0;
+
+static uint8_t vendor_buffer[256];
+static uint32_t vendor_data_stages = 0;
+static size_t vendor_data_received = 0;
+
+static bool vendor_get_data(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    *data = vendor_data;
+    *data_size = sizeof(vendor_data);
+    return true;
+}
+
+static bool vendor_set_value(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    vendor_value = request->wValue;
+    return true;
+}
+
+// only interface 0 is accepted
+static bool class_reset(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    if (request->wIndex != 0) return false;
+    class_resets++;
+    return true;
+}
+
+// wValue is the buffer size given, wIndex=1 rejects the data
+static bool vendor_set_data(
+        const hal5_usb_device_request_t* request,
+        const void** data,
+        size_t* data_size)
+{
+    *data = vendor_buffer;
+    *data_size = HAL5_MIN(request->wValue, sizeof(vendor_buffer));
+    return true;
+}
+
+static bool vendor_set_data_completed(
+        const hal5_usb_device_request_t* request,
+        size_t data_size)
+{
+    vendor_data_stages++;
+    vendor_data_received = data_size;
+    return (request->wIndex != 1);
+}
+
+static void check_registration(void)
+{
+    CHECK (hal5_usb_device_register_request_handler(
+                request_type_vendor, request_recipient_device,
+                VENDOR_GET_DATA, vendor_get_data, NULL));
+
+    CHECK (hal5_usb_device_register_request_handler(
+                request_type_vendor, request_recipient_device,
+                VENDOR_SET_VALUE, vendor_set_value, NULL));
+
+    CHECK (hal5_usb_device_register_request_handler(
+                request_type_class, request_recipient_interface,
+                CLASS_RESET, class_reset, NULL));
+
+    CHECK (hal5_usb_device_register_request_handler(
+                request_type_vendor, request_recipient_device,
+                VENDOR_SET_DATA, vendor_set_data, vendor_set_data_completed));
+
+    // fill the table, a dummy handler on an unused bRequest
+    uint32_t registered = 4;
+    while (hal5_usb_device_register_request_handler(
+                request_type_vendor, request_recipient_other,
+                0x80, vendor_set_value, NULL))
+    {
+        registered++;
+    }
+
+    CHECK (registered == HAL5_USB_DEVICE_MAX_REQUEST_HANDLERS);
+}
+
+static void check_in(void)
+{
+    for (size_t i = 0; i < sizeof(vendor_data); i++) vendor_data[i] = i + 1;
+
+    uint8_t data[256];
+    size_t len;
+
+    // all data, in multiple packets
+    const hal5_usb_device_request_t get_all = 
+        {0xC0, VENDOR_GET_DATA, 0x0000, 0x0000, sizeof(data)};
+
+    memset(data, 0, sizeof(data));
+    CHECK (hal5_usb_sim_control_read(0, &get_all, data, &len));
+    CHECK (len == sizeof(vendor_data));
+    CHECK (memcmp(data, vendor_data, sizeof(vendor_data)) == 0);
+
+    // limited to wLength
+    const hal5_usb_device_request_t get_some = 
+        {0xC0, VENDOR_GET_DATA, 0x0000, 0x0000, 10};
+
+    memset(data, 0, sizeof(data));
+    CHECK (hal5_usb_sim_control_read(0, &get_some, data, &len));
+    CHECK (len == 10);
+    CHECK (memcmp(data, vendor_data, 10) == 0);
+}
+
+static void check_nodata(void)
+{
+    const hal5_usb_device_request_t set_value = 
+        {0x40, VENDOR_SET_VALUE, 0x1234, 0x0000, 0};
+
+    CHECK (hal5_usb_sim_control_nodata(0, &set_value));
+    CHECK (vendor_value == 0x1234);
+
+    const hal5_usb_device_request_t reset = 
+        {0x21, CLASS_RESET, 0x0000, 0x0000, 0};
+
+    CHECK (hal5_usb_sim_control_nodata(0, &reset));
+    CHECK (class_resets == 1);
+}
+
+static bool write_data(uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+{
+    uint8_t data[256];
+
+    for (size_t i = 0; i < wLength; i++) data[i] = wLength + i;
+
+    memset(vendor_buffer, 0, sizeof(vendor_buffer));
+
+    const hal5_usb_device_request_t set_data = 
+        {0x40, VENDOR_SET_DATA, wValue, wIndex, wLength};
+
+    if (!hal5_usb_sim_control_write(0, &set_data, data)) return false;
+
+    return (memcmp(vendor_buffer, data, wLength) == 0);
+}
+
+static void check_data_out(void)
+{
+    // multiple packets and a short packet
+    CHECK (write_data(sizeof(vendor_buffer), 0, 200));
+    CHECK (vendor_data_stages == 1);
+    CHECK (vendor_data_received == 200);
+    CHECK (vendor_buffer[200] == 0);
+
+    // multiple of max packet size, completed when wLength is received
+    CHECK (write_data(sizeof(vendor_buffer), 0, 128));
+    CHECK (vendor_data_stages == 2);
+    CHECK (vendor_data_received == 128);
+
+    // single byte, buffer is exactly wLength
+    CHECK (write_data(1, 0, 1));
+    CHECK (vendor_data_stages == 3);
+    CHECK (vendor_data_received == 1);
+}
+
+static void check_stall(void)
+{
+    const hal5_usb_device_request_t get_status = 
+        {0x80, 0x00, 0x0000, 0x0000, 2};
+
+    uint8_t data[64];
+    size_t len;
+
+    // rejected by the handler
+    const hal5_usb_device_request_t reset = 
+        {0x21, CLASS_RESET, 0x0000, 0x0001, 0};
+
+    CHECK (!hal5_usb_sim_control_nodata(0, &reset));
+    CHECK (class_resets == 1);
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+
+    // not registered
+    const hal5_usb_device_request_t unknown = 
+        {0xC0, 0x55, 0x0000, 0x0000, 64};
+
+    CHECK (!hal5_usb_sim_control_read(0, &unknown, data, &len));
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+
+    // registered for vendor but sent as class
+    const hal5_usb_device_request_t wrong_type = 
+        {0xA0, VENDOR_GET_DATA, 0x0000, 0x0000, 64};
+
+    CHECK (!hal5_usb_sim_control_read(0, &wrong_type, data, &len));
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+
+    // registered for device but sent to interface
+    const hal5_usb_device_request_t wrong_recipient = 
+        {0x41, VENDOR_SET_VALUE, 0x5678, 0x0000, 0};
+
+    CHECK (!hal5_usb_sim_control_nodata(0, &wrong_recipient));
+    CHECK (vendor_value == 0x1234);
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+
+    // rejected by the data handler, STALLed at status stage
+    CHECK (!write_data(sizeof(vendor_buffer), 1, 10));
+    CHECK (vendor_data_stages == 4);
+    CHECK (vendor_data_received == 10);
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+
+    // buffer of the handler is smaller than wLength
+    CHECK (!write_data(10, 0, 11));
+    CHECK (vendor_data_stages == 4);
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+
+    // data stage but no data handler
+    const hal5_usb_device_request_t set_value = 
+        {0x40, VENDOR_SET_VALUE, 0x5678, 0x0000, 4};
+
+    CHECK (!hal5_usb_sim_control_write(0, &set_value, data));
+    CHECK (vendor_value == 0x1234);
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+}
+
+int main(void)
+{
+    check_registration();
+
+    hal5_usb_sim_initialize();
+    hal5_usb_configure();
+    hal5_usb_device_connect();
+
+    CHECK (hal5_usb_sim_enumerate(5));
+
+    check_in();
+    check_nodata();
+    check_data_out();
+    check_stall();
+
+    printf("control_requests: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,283 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the deferred event processing (built with HAL5_USB_DEFERRED_ENABLED)
+// with sim/bulk_device.c
+// - an endpoint NAKs after a transaction until its event is processed
+// - enumeration and bulk transfers with the events processed in the 
+//   main loop, with single and double buffered endpoints
+// - the interrupt is disabled when the queue is full and the events 
+//   pending in the peripheral are not lost
+// - the events processed from PendSV, and the API asserting when it is
+//   called from another context
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+#define MAX_NAKS                (1000)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint32_t events_processed = 0;
+
+// the exception the events are processed from, 0 is the main loop
+static uint32_t process_exception = 0;
+
+#define PENDSV_EXCEPTION        (14)
+
+static void main_loop(void)
+{
+    hal5_usb_sim_set_exception(process_exception);
+    events_processed += hal5_usb_device_process_events();
+    hal5_usb_sim_set_exception(0);
+}
+
+static void configure(uint8_t configuration_value)
+{
+    events_processed = 0;
+
+    CHECK (hal5_usb_sim_attach(main_loop));
+    CHECK (events_processed > 0);
+
+    hal5_usb_device_clear_stats();
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    // from the context the events are processed
+    hal5_usb_sim_set_exception(process_exception);
+    bulk_device_start();
+    hal5_usb_sim_set_exception(0);
+}
+
+static void check_nak_until_processed(void)
+{
+    configure(1);
+
+    hal5_usb_sim_set_main_loop(NULL);
+
+    uint8_t packet[MAX_PACKET_SIZE] = {0};
+    size_t len;
+
+    // OUT
+    for (size_t i = 0; i < MAX_PACKET_SIZE; i++) 
+    {
+        packet[i] = bulk_device_pattern(i);
+    }
+
+    CHECK (hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, packet, MAX_PACKET_SIZE) ==
+            hal5_usb_sim_ack);
+    CHECK (hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, packet, MAX_PACKET_SIZE) ==
+            hal5_usb_sim_nak);
+
+    CHECK (hal5_usb_device_process_events() == 1);
+    CHECK (hal5_usb_device_process_events() == 0);
+
+    for (size_t i = 0; i < MAX_PACKET_SIZE; i++) 
+    {
+        packet[i] = bulk_device_pattern(MAX_PACKET_SIZE + i);
+    }
+
+    CHECK (hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, packet, MAX_PACKET_SIZE) ==
+            hal5_usb_sim_ack);
+
+    // IN
+    CHECK (hal5_usb_sim_in(BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len) ==
+            hal5_usb_sim_ack);
+    CHECK (len == MAX_PACKET_SIZE);
+    CHECK (hal5_usb_sim_in(BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len) ==
+            hal5_usb_sim_nak);
+
+    // OUT and IN
+    CHECK (hal5_usb_device_process_events() == 2);
+
+    CHECK (hal5_usb_sim_in(BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len) ==
+            hal5_usb_sim_ack);
+    CHECK (hal5_usb_device_process_events() == 1);
+}
+
+static void check_transfers(uint8_t configuration_value)
+{
+    configure(configuration_value);
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    size_t received = 0;
+    size_t sent = 0;
+    uint32_t naks = 0;
+
+    while ((received < BULK_DEVICE_TRANSFER_SIZE) && (naks < MAX_NAKS))
+    {
+        size_t len;
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_in(
+                BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len);
+
+        if (handshake == hal5_usb_sim_ack) 
+        {
+            for (size_t i = 0; i < len; i++)
+            {
+                CHECK (packet[i] == bulk_device_pattern(received + i));
+            }
+            received += len;
+        }
+        else naks++;
+    }
+
+    CHECK (received == BULK_DEVICE_TRANSFER_SIZE);
+
+    while ((sent < BULK_DEVICE_TRANSFER_SIZE) && (naks < MAX_NAKS))
+    {
+        const size_t len = 
+            HAL5_MIN(MAX_PACKET_SIZE, BULK_DEVICE_TRANSFER_SIZE - sent);
+
+        for (size_t i = 0; i < len; i++) 
+        {
+            packet[i] = bulk_device_pattern(sent + i);
+        }
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_out(
+                BULK_DEVICE_OUT_ENDP, packet, len);
+
+        if (handshake == hal5_usb_sim_ack) sent += len;
+        else naks++;
+    }
+
+    CHECK (sent == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (bulk_device_stats.out_transfers == 1);
+    CHECK (bulk_device_stats.out_errors == 0);
+
+    hal5_usb_sim_suspend();
+    hal5_usb_sim_resume();
+
+    CHECK (hal5_usb_device_get_stats()->suspends == 1);
+    CHECK (hal5_usb_device_get_stats()->wakeups == 1);
+}
+
+static void check_queue_full(void)
+{
+    configure(1);
+
+    hal5_usb_sim_set_main_loop(NULL);
+
+    const hal5_usb_device_request_t get_status = 
+        {0x80, 0x00, 0x0000, 0x0000, 2};
+
+    const hal5_usb_ep_stats_t* stats = 
+        &hal5_usb_device_get_endpoint(0, false)->stats;
+
+    const uint32_t setup_packets = stats->setup_packets;
+
+    // SETUP is always ACKed, one more than the queue stays pending
+    for (uint32_t i = 0; i < HAL5_USB_DEFERRED_QUEUE_SIZE + 4; i++)
+    {
+        CHECK (hal5_usb_sim_setup(0, &get_status) == hal5_usb_sim_ack);
+    }
+
+    CHECK (hal5_usb_device_process_events() == HAL5_USB_DEFERRED_QUEUE_SIZE);
+
+    hal5_usb_sim_run_irq();
+    CHECK (hal5_usb_device_process_events() == 1);
+    CHECK (hal5_usb_device_process_events() == 0);
+
+    CHECK (stats->setup_packets == 
+            setup_packets + HAL5_USB_DEFERRED_QUEUE_SIZE + 1);
+
+    // and it still works
+    hal5_usb_sim_set_main_loop(main_loop);
+
+    uint8_t data[64];
+    size_t len;
+
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+    CHECK (len == 2);
+}
+
+static void check_context(void)
+{
+    process_exception = PENDSV_EXCEPTION;
+
+    // the transfers are submitted from the callbacks in PendSV
+    check_transfers(1);
+
+    // from the main loop while the events are processed from PendSV
+    // the assert aborts the child
+    fflush(stdout);
+
+    const pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        freopen("/dev/null", "w", stderr);
+
+        static uint8_t buffer[MAX_PACKET_SIZE];
+
+        hal5_usb_device_submit(
+                hal5_usb_device_get_endpoint(BULK_DEVICE_IN_ENDP, true),
+                buffer,
+                sizeof(buffer),
+                0,
+                NULL,
+                NULL);
+
+        exit(EXIT_SUCCESS);
+    }
+
+    int status = 0;
+
+    CHECK (pid > 0);
+    CHECK (waitpid(pid, &status, 0) == pid);
+    CHECK (WIFSIGNALED(status) && (WTERMSIG(status) == SIGABRT));
+
+    process_exception = 0;
+}
+
+int main(void)
+{
+    check_nak_until_processed();
+    // single buffered
+    check_transfers(1);
+    // double buffered
+    check_transfers(2);
+    check_queue_full();
+    check_context();
+
+    printf("deferred: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
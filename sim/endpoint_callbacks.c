@@ -0,0 +1,224 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the stage completed callbacks registered per endpoint with
+// sim/bulk_device.c, with single and double buffered endpoints
+// - the registered callback is called with its context instead of
+//   _out/_in_stage_completed_ex
+// - it is kept when the endpoints are recreated at Set Configuration
+// - _ex is called again when it is unregistered
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+#define MAX_NAKS                (1000)
+// the transfers of the callbacks, not a multiple of max packet size
+#define CALLBACK_TRANSFER_SIZE  (100)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+typedef struct
+{
+    uint8_t data[CALLBACK_TRANSFER_SIZE];
+    uint32_t calls;
+    size_t last_received;
+} driver_t;
+
+static driver_t in_driver;
+static driver_t out_driver;
+
+static void in_stage_completed(
+        hal5_usb_endpoint_t* ep, 
+        void* context)
+{
+    driver_t* driver = (driver_t*) context;
+    driver->calls++;
+
+    hal5_usb_ep_prepare_for_in_ref(
+            ep,
+            ep_status_disabled,
+            driver->data,
+            sizeof(driver->data),
+            false,
+            0);
+}
+
+static void out_stage_completed(
+        hal5_usb_endpoint_t* ep, 
+        void* context)
+{
+    driver_t* driver = (driver_t*) context;
+    driver->calls++;
+    driver->last_received = ep->rx_received;
+
+    hal5_usb_ep_prepare_for_out_buffer(
+            ep,
+            ep_status_disabled,
+            driver->data,
+            sizeof(driver->data));
+}
+
+static void configure(uint8_t configuration_value)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    bulk_device_start();
+}
+
+static size_t read_transfer(uint8_t* data, size_t size)
+{
+    size_t received = 0;
+    uint32_t naks = 0;
+
+    while (naks < MAX_NAKS)
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        size_t len;
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_in(
+                BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len);
+
+        if (handshake != hal5_usb_sim_ack) 
+        {
+            naks++;
+            continue;
+        }
+
+        if ((received + len) <= size) memcpy(data + received, packet, len);
+        received += len;
+
+        if (len < MAX_PACKET_SIZE) break;
+    }
+
+    return received;
+}
+
+static void write_transfer(const uint8_t* data, size_t size)
+{
+    size_t sent = 0;
+    uint32_t naks = 0;
+
+    while ((sent < size) && (naks < MAX_NAKS))
+    {
+        const size_t len = HAL5_MIN(MAX_PACKET_SIZE, size - sent);
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_out(
+                BULK_DEVICE_OUT_ENDP, data + sent, len);
+
+        if (handshake == hal5_usb_sim_ack) sent += len;
+        else naks++;
+    }
+
+    CHECK (sent == size);
+}
+
+static void check(uint8_t configuration_value)
+{
+    memset(&in_driver, 0, sizeof(in_driver));
+    memset(&out_driver, 0, sizeof(out_driver));
+
+    for (size_t i = 0; i < CALLBACK_TRANSFER_SIZE; i++)
+    {
+        in_driver.data[i] = (uint8_t) (0xA0 + i);
+    }
+
+    configure(configuration_value);
+
+    uint8_t data[BULK_DEVICE_TRANSFER_SIZE];
+
+    // the first transfers are started by bulk_device_start
+    // the callbacks prepare the next ones with their own buffers
+    CHECK (read_transfer(data, sizeof(data)) == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (in_driver.calls == 1);
+    CHECK (bulk_device_stats.in_transfers == 0);
+
+    CHECK (read_transfer(data, sizeof(data)) == CALLBACK_TRANSFER_SIZE);
+    CHECK (memcmp(data, in_driver.data, CALLBACK_TRANSFER_SIZE) == 0);
+    CHECK (in_driver.calls == 2);
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = bulk_device_pattern(i);
+
+    write_transfer(data, BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (out_driver.calls == 1);
+    CHECK (out_driver.last_received == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (bulk_device_stats.out_transfers == 0);
+
+    write_transfer(data, 10);
+    CHECK (out_driver.calls == 2);
+    CHECK (out_driver.last_received == 10);
+    CHECK (memcmp(out_driver.data, data, 10) == 0);
+
+    // unregistered, IN goes to _in_stage_completed_ex again
+    // it is armed by the callback, so the next transfer is still its data
+    CHECK (hal5_usb_device_register_endpoint_callback(
+                0x80 | BULK_DEVICE_IN_ENDP, NULL, NULL));
+    CHECK (hal5_usb_device_get_endpoint(
+                BULK_DEVICE_IN_ENDP, true)->stage_completed == NULL);
+
+    CHECK (read_transfer(data, sizeof(data)) == CALLBACK_TRANSFER_SIZE);
+    CHECK (in_driver.calls == 2);
+    CHECK (bulk_device_stats.in_transfers == 1);
+
+    CHECK (read_transfer(data, sizeof(data)) == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (bulk_device_stats.in_transfers == 2);
+
+    // register again for the next configuration
+    CHECK (hal5_usb_device_register_endpoint_callback(
+                0x80 | BULK_DEVICE_IN_ENDP, in_stage_completed, &in_driver));
+}
+
+int main(void)
+{
+    CHECK (!hal5_usb_device_register_endpoint_callback(0x80, NULL, NULL));
+    CHECK (!hal5_usb_device_register_endpoint_callback(0x08, NULL, NULL));
+
+    CHECK (hal5_usb_device_register_endpoint_callback(
+                0x80 | BULK_DEVICE_IN_ENDP, in_stage_completed, &in_driver));
+    CHECK (hal5_usb_device_register_endpoint_callback(
+                BULK_DEVICE_OUT_ENDP, out_stage_completed, &out_driver));
+
+    // single buffered
+    check(1);
+    // double buffered
+    check(2);
+
+    printf("endpoint_callbacks: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,252 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// scripted host enumerating and exercising the default control pipe
+// of the device built from descriptors.py and example_usb_device.c
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void check_device_descriptor(void)
+{
+    const hal5_usb_device_request_t request = 
+        {0x80, 0x06, 0x0100, 0x0000, 0xFF};
+
+    uint8_t buffer[255];
+    size_t len;
+
+    CHECK (hal5_usb_sim_control_read(0, &request, buffer, &len));
+    CHECK (len == 18);
+    CHECK (memcmp(buffer, hal5_usb_device_descriptor, 18) == 0);
+}
+
+static void check_configuration_descriptor(void)
+{
+    const hal5_usb_configuration_descriptor_t* cd = 
+        hal5_usb_device_descriptor->configurations[0];
+
+    const hal5_usb_device_request_t request = 
+        {0x80, 0x06, 0x0200, 0x0000, 0xFF};
+
+    uint8_t buffer[255];
+    size_t len;
+
+    CHECK (hal5_usb_sim_control_read(0, &request, buffer, &len));
+    CHECK (len == cd->wTotalLength);
+
+    // the same as the descriptors chained (conf-interface*-endpoint*)
+    uint8_t expected[255];
+    size_t offset = 0;
+    memcpy(expected+offset, cd, cd->bLength);
+    offset += cd->bLength;
+    for (uint8_t i = 0; i < cd->bNumInterfaces; i++)
+    {
+        const hal5_usb_interface_descriptor_t* id = cd->interfaces[i];
+        memcpy(expected+offset, id, id->bLength);
+        offset += id->bLength;
+        for (uint8_t k = 0; k < id->bNumEndpoints; k++)
+        {
+            const hal5_usb_endpoint_descriptor_t* ed = id->endpoints[k];
+            memcpy(expected+offset, ed, ed->bLength);
+            offset += ed->bLength;
+        }
+    }
+    CHECK (offset == cd->wTotalLength);
+    CHECK (memcmp(buffer, expected, offset) == 0);
+
+    // only the configuration descriptor (like linux)
+    const hal5_usb_device_request_t request_short = 
+        {0x80, 0x06, 0x0200, 0x0000, 9};
+
+    CHECK (hal5_usb_sim_control_read(0, &request_short, buffer, &len));
+    CHECK (len == 9);
+    CHECK (memcmp(buffer, expected, 9) == 0);
+
+    // no such configuration
+    const hal5_usb_device_request_t request_invalid = 
+        {0x80, 0x06, 0x0200 | hal5_usb_device_descriptor->bNumConfigurations, 0x0000, 0xFF};
+
+    CHECK (!hal5_usb_sim_control_read(0, &request_invalid, buffer, &len));
+}
+
+static void check_string_descriptors(void)
+{
+    uint8_t buffer[255];
+    size_t len;
+
+    for (uint32_t i = 0; i < hal5_usb_number_of_string_descriptors; i++)
+    {
+        const hal5_usb_device_request_t request = 
+            {0x80, 0x06, 0x0300 | i, 0x0409, 0xFF};
+
+        CHECK (hal5_usb_sim_control_read(0, &request, buffer, &len));
+        CHECK (buffer[0] == len);
+        CHECK (buffer[1] == 0x03);
+
+        const hal5_usb_string_descriptor_t* sd = hal5_usb_string_descriptors[i];
+
+        // the strings synthesized at runtime are checked as ascii
+        char expected[64] = {0};
+
+        if (hal5_usb_product_string_append_version && 
+                (i == hal5_usb_device_descriptor->iProduct))
+        {
+            // the generated string followed by the version
+            CHECK (memcmp(buffer+2, sd->bString, sd->bLength-2) == 0);
+
+            snprintf(expected, sizeof(expected), " v%u.%u",
+                    hal5_usb_device_version_major_ex(),
+                    hal5_usb_device_version_minor_ex());
+
+            CHECK (len == sd->bLength + 2*strlen(expected));
+        }
+        else if (hal5_usb_serial_number_from_uid &&
+                (i == hal5_usb_device_descriptor->iSerialNumber))
+        {
+            const uint32_t* uid = (const uint32_t*) UID_BASE;
+
+            snprintf(expected, sizeof(expected), "%08X%08X%08X",
+                    uid[0], uid[1], uid[2]);
+
+            CHECK (len == 2 + 2*strlen(expected));
+        }
+        else
+        {
+            CHECK (len == sd->bLength);
+            CHECK (memcmp(buffer, sd, len) == 0);
+        }
+
+        // the end of the string matches
+        const size_t expected_len = strlen(expected);
+        const uint8_t* end = buffer + len - 2*expected_len;
+
+        bool matches = true;
+        for (size_t k = 0; k < expected_len; k++)
+        {
+            if ((end[2*k] != expected[k]) || (end[2*k+1] != 0)) matches = false;
+        }
+        CHECK (matches);
+    }
+
+    // no such string
+    const hal5_usb_device_request_t request_invalid = 
+        {0x80, 0x06, 0x0300 | hal5_usb_number_of_string_descriptors, 0x0409, 0xFF};
+
+    CHECK (!hal5_usb_sim_control_read(0, &request_invalid, buffer, &len));
+}
+
+static void check_configuration(void)
+{
+    const uint8_t value = 
+        hal5_usb_device_descriptor->configurations[0]->bConfigurationValue;
+
+    const hal5_usb_device_request_t get_configuration = 
+        {0x80, 0x08, 0x0000, 0x0000, 1};
+
+    uint8_t buffer[2];
+    size_t len;
+
+    CHECK (hal5_usb_sim_control_read(0, &get_configuration, buffer, &len));
+    CHECK ((len == 1) && (buffer[0] == 0));
+    CHECK (hal5_usb_device_get_state() == usb_device_state_address);
+
+    const hal5_usb_device_request_t set_configuration = 
+        {0x00, 0x09, value, 0x0000, 0};
+
+    CHECK (hal5_usb_sim_control_nodata(0, &set_configuration));
+    CHECK (hal5_usb_device_get_state() == usb_device_state_configured);
+
+    CHECK (hal5_usb_sim_control_read(0, &get_configuration, buffer, &len));
+    CHECK ((len == 1) && (buffer[0] == value));
+
+    // no such configuration
+    const hal5_usb_device_request_t set_configuration_invalid = 
+        {0x00, 0x09, value + 1, 0x0000, 0};
+
+    CHECK (!hal5_usb_sim_control_nodata(0, &set_configuration_invalid));
+    CHECK (hal5_usb_device_get_state() == usb_device_state_configured);
+
+    const hal5_usb_device_request_t get_status = 
+        {0x80, 0x00, 0x0000, 0x0000, 2};
+
+    CHECK (hal5_usb_sim_control_read(0, &get_status, buffer, &len));
+    CHECK ((len == 2) && (buffer[0] == 0x01) && (buffer[1] == 0x00));
+
+    // unknown request
+    const hal5_usb_device_request_t unknown = 
+        {0xC0, 0x42, 0x0000, 0x0000, 2};
+
+    CHECK (!hal5_usb_sim_control_read(0, &unknown, buffer, &len));
+
+    // the pipe still works after a STALL
+    CHECK (hal5_usb_sim_control_read(0, &get_configuration, buffer, &len));
+    CHECK ((len == 1) && (buffer[0] == value));
+}
+
+int main(void)
+{
+    hal5_usb_sim_initialize();
+    hal5_usb_configure();
+    hal5_usb_device_connect();
+
+    CHECK (hal5_usb_sim_is_connected());
+    CHECK (hal5_usb_sim_enumerate(5));
+    CHECK (hal5_usb_device_get_state() == usb_device_state_address);
+
+    check_device_descriptor();
+    check_configuration_descriptor();
+    check_string_descriptors();
+    check_configuration();
+
+    // windows starts a second enumeration after the first one
+    CHECK (hal5_usb_sim_enumerate(6));
+    CHECK (hal5_usb_device_get_state() == usb_device_state_address);
+    check_configuration();
+
+    const hal5_usb_sim_stats_t* stats = hal5_usb_sim_get_stats();
+
+    printf("enumerate: %s (%lu irqs, %lu acks, %lu naks, %lu stalls, %.3f ms)\n",
+            (failures == 0) ? "OK" : "FAILED",
+            (unsigned long) stats->irqs,
+            (unsigned long) stats->acks,
+            (unsigned long) stats->naks,
+            (unsigned long) stats->stalls,
+            hal5_usb_sim_time() / 1e6);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
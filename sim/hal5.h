@@ -0,0 +1,80 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// host simulation replacement of hal5.h
+// only the parts used by hal5_usb are provided
+// see hal5_sim.c for the implementations
+
+#ifndef __HAL5_H__
+#define __HAL5_H__
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <stm32h5xx.h>
+
+#define HAL5_MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define HAL5_MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+// console output is disabled by default
+// set HAL5_SIM_CONSOLE=1 in the environment to enable it
+extern bool hal5_sim_console_enabled;
+
+void hal5_sim_console(const char* fmt, ...);
+
+#define CONSOLE(...) \
+    do { if (hal5_sim_console_enabled) hal5_sim_console(__VA_ARGS__); } while (0)
+
+typedef enum
+{
+    PA11,
+    PA12,
+} hal5_gpio_pin_t;
+
+typedef enum
+{
+    af_pp_floating,
+} hal5_gpio_af_mode_t;
+
+typedef enum
+{
+    high_speed,
+} hal5_gpio_speed_t;
+
+typedef enum
+{
+    AF10 = 10,
+} hal5_gpio_af_t;
+
+void hal5_rcc_enable_hsi48(void);
+void hal5_crs_enable_for_usb(void);
+void hal5_pwr_enable_usb33(void);
+void hal5_rcc_enable_usb(void);
+void hal5_wait(uint32_t ms);
+
+void hal5_gpio_configure_as_af(
+        hal5_gpio_pin_t pin,
+        hal5_gpio_af_mode_t mode,
+        hal5_gpio_speed_t speed,
+        hal5_gpio_af_t af);
+
+#endif
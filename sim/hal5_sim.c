@@ -0,0 +1,85 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// host simulation implementations of the hal5 functions used by hal5_usb
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hal5.h"
+
+bool hal5_sim_console_enabled = false;
+
+RCC_TypeDef hal5_sim_rcc;
+
+DWT_Type hal5_sim_dwt;
+DCB_Type hal5_sim_dcb;
+
+const uint32_t hal5_sim_uid[3] = {0x00440021, 0x3232510D, 0x38333634};
+
+__attribute__((constructor))
+static void hal5_sim_initialize(void)
+{
+    const char* console = getenv("HAL5_SIM_CONSOLE");
+    hal5_sim_console_enabled = (console != NULL) && (console[0] == '1');
+}
+
+void hal5_sim_console(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority)
+{
+}
+
+void hal5_rcc_enable_hsi48(void)
+{
+}
+
+void hal5_crs_enable_for_usb(void)
+{
+}
+
+void hal5_pwr_enable_usb33(void)
+{
+}
+
+void hal5_rcc_enable_usb(void)
+{
+}
+
+void hal5_wait(uint32_t ms)
+{
+}
+
+void hal5_gpio_configure_as_af(
+        hal5_gpio_pin_t pin,
+        hal5_gpio_af_mode_t mode,
+        hal5_gpio_speed_t speed,
+        hal5_gpio_af_t af)
+{
+}
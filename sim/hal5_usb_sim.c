@@ -0,0 +1,1117 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <stm32h5xx.h>
+
+#include "hal5.h"
+#include "hal5_usb.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+
+void USB_DRD_FS_IRQHandler(void);
+
+USB_DRD_TypeDef hal5_usb_sim_drd;
+uint32_t hal5_usb_sim_pma[USB_DRD_PMA_SIZE / 4] __ALIGNED(8);
+
+#define PMA ((uint8_t*) hal5_usb_sim_pma)
+
+// FS bit time is 1/12MHz = 83.33ns, times are calculated in bits
+// and converted to ns at the end
+// SYNC + PID + ADDR + ENDP + CRC5 + EOP
+#define TOKEN_BITS          (8 + 8 + 7 + 4 + 5 + 3)
+// SYNC + PID + EOP
+#define HANDSHAKE_BITS      (8 + 8 + 3)
+// SYNC + PID + CRC16 + EOP, data is added separately
+#define DATA_BITS           (8 + 8 + 16 + 3)
+// bus turnaround and inter packet delay
+#define TURNAROUND_BITS     (16)
+// SYNC + PID + FRAME NUMBER + CRC5 + EOP
+#define SOF_BITS            (8 + 8 + 11 + 5 + 3)
+
+// interrupt events are the ones that has a mask bit in CNTR
+// these are at the same bit positions in ISTR and CNTR
+#define ISTR_EVENT_MASK     (0xFF00UL)
+// CTR, DIR and IDN are not latched but derived from CHEPnR
+#define ISTR_DERIVED_MASK   (USB_ISTR_CTR | USB_ISTR_DIR | USB_ISTR_IDN)
+
+#define MAX_IRQS_PER_EVENT  (1024)
+// CHEPnR writes waiting for the handler to reach them
+#define MAX_DEFERRED_WRITES (64)
+// a control transfer stage is failed if it does not progress in this time
+#define MAX_STAGE_NS        (100 * HAL5_USB_SIM_FRAME_NS)
+
+static uint64_t now;
+// USB_DRD_FS_IRQn is enabled in NVIC
+static bool irq_enabled;
+static void (*main_loop)(void);
+static uint64_t irq_latency;
+static bool irq_scheduled;
+static uint64_t irq_time;
+static bool in_irq;
+// IPSR outside of the USB interrupt handler
+static uint32_t exception_number;
+
+// handler execution time model
+// the handler starts at irq_time and the time it spends is accumulated
+// in irq_cost, a CHEPnR write made by the handler takes effect 
+// (is seen by the bus) only at irq_time + irq_cost
+static uint64_t pma_access_cost;
+static uint64_t irq_cost;
+
+typedef struct
+{
+    uint64_t time;
+    volatile uint32_t* reg;
+    uint32_t v;
+} deferred_write_t;
+
+static deferred_write_t deferred_writes[MAX_DEFERRED_WRITES];
+static uint32_t number_of_deferred_writes;
+
+static hal5_usb_sim_stats_t stats;
+
+static uint8_t host_address;
+static uint8_t host_mps0 = 8;
+
+// frame number sent in SOF
+static uint16_t host_frame;
+static uint32_t sofs_to_lose;
+
+static uint64_t bits_to_ns(uint64_t bits)
+{
+    return (bits * 1000) / 12;
+}
+
+static volatile uint32_t* chep_reg(uint8_t n)
+{
+    return &(hal5_usb_sim_drd.CHEP0R) + n;
+}
+
+static hal5_usb_chep_t* chep(uint8_t n)
+{
+    return (hal5_usb_chep_t*) chep_reg(n);
+}
+
+static hal5_usb_bd_t* txbd(uint8_t n)
+{
+    return (hal5_usb_bd_t*) (PMA + 8*n);
+}
+
+static hal5_usb_bd_t* rxbd(uint8_t n)
+{
+    return (hal5_usb_bd_t*) (PMA + 8*n + 4);
+}
+
+static size_t rx_buffer_size(hal5_usb_bd_t* bd)
+{
+    if (bd->blsize) return (bd->num_block + 1) * 32;
+    else return bd->num_block * 2;
+}
+
+// CTR is set as long as an endpoint has VTRX or VTTX set
+// IDN is the endpoint with the lowest number, DIR=1 if VTRX is set
+static void update_istr(void)
+{
+    uint32_t istr = hal5_usb_sim_drd.ISTR & ~ISTR_DERIVED_MASK;
+
+    for (uint8_t n = 0; n < 8; n++)
+    {
+        if (chep(n)->vtrx || chep(n)->vttx)
+        {
+            istr |= USB_ISTR_CTR | n;
+            if (chep(n)->vtrx) istr |= USB_ISTR_DIR;
+            break;
+        }
+    }
+
+    hal5_usb_sim_drd.ISTR = istr;
+}
+
+static bool irq_pending(void)
+{
+    return irq_enabled &&
+        ((hal5_usb_sim_drd.ISTR & hal5_usb_sim_drd.CNTR & ISTR_EVENT_MASK) != 0);
+}
+
+static void schedule_irq(void)
+{
+    if (!in_irq && !irq_scheduled && irq_pending())
+    {
+        irq_scheduled = true;
+        irq_time = now + irq_latency;
+    }
+}
+
+static void write_chep(volatile uint32_t* reg, uint32_t v)
+{
+    *reg = hal5_usb_apply_to_chep(*reg, v);
+    update_istr();
+}
+
+// deferred writes are applied in order
+static void apply_deferred_writes(uint64_t until)
+{
+    uint32_t applied = 0;
+
+    while ((applied < number_of_deferred_writes) &&
+            (deferred_writes[applied].time <= until))
+    {
+        write_chep(
+                deferred_writes[applied].reg, 
+                deferred_writes[applied].v);
+        applied++;
+    }
+
+    number_of_deferred_writes -= applied;
+
+    memmove(
+            deferred_writes, 
+            deferred_writes + applied, 
+            number_of_deferred_writes * sizeof(deferred_write_t));
+}
+
+// runs the interrupt handler, as the NVIC would, 
+// until no enabled event is pending, each entry takes irq_latency
+// the next entry is possible only after the handler is finished
+static void run_due_irqs(bool ignore_latency)
+{
+    uint32_t count = 0;
+
+    while (irq_scheduled && (ignore_latency || (irq_time <= now)))
+    {
+        // handler sees its previous writes
+        apply_deferred_writes(ignore_latency ? UINT64_MAX : irq_time);
+
+        if (!irq_pending())
+        {
+            irq_scheduled = false;
+            break;
+        }
+
+        in_irq = true;
+        irq_cost = 0;
+        USB_DRD_FS_IRQHandler();
+        in_irq = false;
+
+        stats.irqs++;
+        count++;
+        // the handler is not clearing what raised the interrupt
+        assert (count < MAX_IRQS_PER_EVENT);
+
+        // pending or not is checked at the next entry
+        // after the deferred writes are applied
+        irq_time = irq_time + irq_cost + irq_latency;
+    }
+
+    if ((count > 0) && (main_loop != NULL)) main_loop();
+}
+
+// only USB_DRD_FS_IRQn is modeled
+void NVIC_EnableIRQ(IRQn_Type irqn)
+{
+    irq_enabled = true;
+    schedule_irq();
+}
+
+void NVIC_DisableIRQ(IRQn_Type irqn)
+{
+    irq_enabled = false;
+}
+
+// external interrupts start at exception number 16
+uint32_t __get_IPSR(void)
+{
+    return in_irq ? (16 + USB_DRD_FS_IRQn) : exception_number;
+}
+
+void hal5_usb_sim_set_exception(uint32_t n)
+{
+    exception_number = n;
+}
+
+void hal5_usb_sim_write_istr(uint32_t v)
+{
+    // event flags are rc_w0, others are read-only
+    hal5_usb_sim_drd.ISTR &= (v | ~ISTR_EVENT_MASK);
+    update_istr();
+    schedule_irq();
+}
+
+// the handler reads ISTR again to handle the next event in the same entry
+// if its CHEPnR writes have not taken effect yet (it is ahead of the bus),
+// it would see the event it has just handled, so no event is reported then
+// and the rest is handled in the next entry
+uint32_t hal5_usb_sim_read_istr(void)
+{
+    if (in_irq)
+    {
+        apply_deferred_writes(now);
+
+        if (number_of_deferred_writes > 0)
+        {
+            return hal5_usb_sim_drd.ISTR & ~(ISTR_EVENT_MASK | ISTR_DERIVED_MASK);
+        }
+    }
+
+    return hal5_usb_sim_drd.ISTR;
+}
+
+void hal5_usb_sim_write_chep(volatile uint32_t* reg, uint32_t v)
+{
+    const uint64_t time = irq_time + irq_cost;
+
+    if (in_irq && (time > now))
+    {
+        assert (number_of_deferred_writes < MAX_DEFERRED_WRITES);
+        deferred_writes[number_of_deferred_writes].time = time;
+        deferred_writes[number_of_deferred_writes].reg = reg;
+        deferred_writes[number_of_deferred_writes].v = v;
+        number_of_deferred_writes++;
+    }
+    else
+    {
+        // nothing can be applied after this write
+        apply_deferred_writes(UINT64_MAX);
+        write_chep(reg, v);
+        schedule_irq();
+    }
+}
+
+void hal5_usb_sim_pma_access(size_t bytes)
+{
+    if (in_irq)
+    {
+        irq_cost += bytes * pma_access_cost;
+    }
+}
+
+void hal5_usb_sim_initialize(void)
+{
+    memset(&hal5_usb_sim_drd, 0, sizeof(hal5_usb_sim_drd));
+    memset(hal5_usb_sim_pma, 0, sizeof(hal5_usb_sim_pma));
+
+    // reset value: powered down and USBRST held
+    hal5_usb_sim_drd.CNTR = USB_CNTR_PDWN | USB_CNTR_USBRST;
+
+    now = 0;
+    irq_enabled = false;
+    main_loop = NULL;
+    irq_latency = 0;
+    irq_scheduled = false;
+    in_irq = false;
+    exception_number = 0;
+    pma_access_cost = 0;
+    irq_cost = 0;
+    number_of_deferred_writes = 0;
+    host_address = 0;
+    host_mps0 = 8;
+    host_frame = 0;
+    sofs_to_lose = 0;
+
+    hal5_usb_sim_clear_stats();
+}
+
+void hal5_usb_sim_set_main_loop(void (*fn)(void))
+{
+    main_loop = fn;
+}
+
+void hal5_usb_sim_set_irq_latency(uint64_t ns)
+{
+    irq_latency = ns;
+}
+
+void hal5_usb_sim_set_pma_access_cost(uint64_t ns_per_byte)
+{
+    pma_access_cost = ns_per_byte;
+}
+
+uint64_t hal5_usb_sim_time(void)
+{
+    return now;
+}
+
+// in the handler, the time includes what the handler has spent so far
+uint32_t hal5_usb_sim_read_cyccnt(void)
+{
+    const uint64_t time = in_irq ? (irq_time + irq_cost) : now;
+    return (uint32_t) ((time * HAL5_USB_SIM_SYSCLK_MHZ) / 1000);
+}
+
+// the modeled time does not advance while the handler runs
+// so the profiling uses the time of the host, in ns
+uint32_t hal5_usb_sim_read_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+const hal5_usb_sim_stats_t* hal5_usb_sim_get_stats(void)
+{
+    return &stats;
+}
+
+void hal5_usb_sim_clear_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+bool hal5_usb_sim_is_connected(void)
+{
+    return ((hal5_usb_sim_drd.BCDR & USB_BCDR_DPPU) != 0) &&
+        ((hal5_usb_sim_drd.CNTR & (USB_CNTR_USBRST | USB_CNTR_PDWN)) == 0);
+}
+
+static void start_of_frame(void)
+{
+    stats.sofs++;
+
+    host_frame = (host_frame + 1) & USB_FNR_FN;
+
+    if (sofs_to_lose > 0)
+    {
+        sofs_to_lose--;
+
+        // LSOF saturates at 3
+        uint32_t lsof = (hal5_usb_sim_drd.FNR & USB_FNR_LSOF) >> USB_FNR_LSOF_Pos;
+        if (lsof < 3) lsof++;
+
+        hal5_usb_sim_drd.FNR = 
+            (hal5_usb_sim_drd.FNR & ~USB_FNR_LSOF) | 
+            (lsof << USB_FNR_LSOF_Pos);
+
+        if (hal5_usb_sim_is_connected())
+        {
+            hal5_usb_sim_drd.ISTR |= USB_ISTR_ESOF;
+            schedule_irq();
+        }
+    }
+    else
+    {
+        hal5_usb_sim_drd.FNR = 
+            (hal5_usb_sim_drd.FNR & ~(USB_FNR_FN | USB_FNR_LSOF)) | 
+            host_frame;
+
+        if (hal5_usb_sim_is_connected())
+        {
+            hal5_usb_sim_drd.ISTR |= USB_ISTR_SOF;
+            schedule_irq();
+        }
+    }
+
+    now += bits_to_ns(SOF_BITS);
+}
+
+void hal5_usb_sim_lose_sofs(uint32_t n)
+{
+    sofs_to_lose = n;
+}
+
+void hal5_usb_sim_advance(uint64_t ns)
+{
+    const uint64_t target = now + ns;
+
+    while (true)
+    {
+        run_due_irqs(false);
+
+        const uint64_t next_frame = 
+            ((now / HAL5_USB_SIM_FRAME_NS) + 1) * HAL5_USB_SIM_FRAME_NS;
+
+        uint64_t next = HAL5_MIN(target, next_frame);
+
+        if (irq_scheduled && (irq_time < next))
+        {
+            next = irq_time;
+        }
+
+        now = next;
+
+        if (now == next_frame)
+        {
+            start_of_frame();
+        }
+
+        if (now >= target)
+        {
+            run_due_irqs(false);
+            return;
+        }
+    }
+}
+
+void hal5_usb_sim_run_irq(void)
+{
+    schedule_irq();
+    run_due_irqs(true);
+}
+
+// EPKIND on a bulk endpoint is DBL_BUF
+static bool is_double_buffered(hal5_usb_chep_t* c)
+{
+    return (c->utype == ep_utype_bulk) && c->epkind;
+}
+
+// isochronous endpoints always use the buffer selected by DTOG
+// and STAT is not changed by the hardware
+static bool is_iso(hal5_usb_chep_t* c)
+{
+    return c->utype == ep_utype_iso;
+}
+
+// waits until the transaction of bits can be completed in this frame
+static void begin_transaction(uint64_t bits)
+{
+    const uint64_t duration = bits_to_ns(bits);
+
+    run_due_irqs(false);
+
+    // not ending at the frame boundary, so SOF is not skipped
+    if ((now % HAL5_USB_SIM_FRAME_NS) + duration >= HAL5_USB_SIM_FRAME_NS)
+    {
+        hal5_usb_sim_advance(HAL5_USB_SIM_FRAME_NS - (now % HAL5_USB_SIM_FRAME_NS));
+    }
+
+    apply_deferred_writes(now);
+}
+
+// the interrupt handler can run while the transaction is on the bus
+// (it sees the registers before the transaction)
+static void end_transaction(uint64_t bits)
+{
+    hal5_usb_sim_advance(bits_to_ns(bits));
+    apply_deferred_writes(now);
+}
+
+// the peripheral updates CHEPnR after the handshake
+// only the bits changed by the hardware are modified, so the writes of 
+// the handler during the transaction are not lost
+static void complete_transaction(
+        int n, 
+        bool setup, 
+        bool rx)
+{
+    hal5_usb_chep_t c;
+    c.v = *chep_reg(n);
+
+    if (setup)
+    {
+        c.setup = 1;
+        c.vtrx = 1;
+        // data stage starts with DATA1
+        c.dtogrx = 1;
+        c.dtogtx = 1;
+        c.statrx = ep_status_nak;
+        c.stattx = ep_status_nak;
+    }
+    else if (rx)
+    {
+        c.setup = 0;
+        c.vtrx = 1;
+        c.dtogrx = !c.dtogrx;
+        // STAT_RX is not changed if double buffered or isochronous
+        if (!is_double_buffered(&c) && !is_iso(&c)) c.statrx = ep_status_nak;
+    }
+    else
+    {
+        c.vttx = 1;
+        c.dtogtx = !c.dtogtx;
+        // STAT_TX is not changed if double buffered or isochronous
+        if (!is_double_buffered(&c) && !is_iso(&c)) c.stattx = ep_status_nak;
+    }
+
+    *chep_reg(n) = c.v;
+
+    update_istr();
+    schedule_irq();
+    run_due_irqs(false);
+}
+
+static hal5_usb_sim_handshake_t count_handshake(
+        hal5_usb_sim_handshake_t handshake)
+{
+    switch (handshake)
+    {
+        case hal5_usb_sim_ack: stats.acks++; break;
+        case hal5_usb_sim_nak: stats.naks++; break;
+        case hal5_usb_sim_stall: stats.stalls++; break;
+        case hal5_usb_sim_no_response: stats.no_responses++; break;
+    }
+    return handshake;
+}
+
+// the register (n) serving endp in the given direction, -1 if none
+static int find_chep(uint8_t endp, bool dir_in, bool setup)
+{
+    if (!hal5_usb_sim_is_connected()) return -1;
+
+    const uint32_t daddr = hal5_usb_sim_drd.DADDR;
+
+    if (!(daddr & USB_DADDR_EF)) return -1;
+    if ((daddr & USB_DADDR_ADD) != host_address) return -1;
+
+    for (uint8_t n = 0; n < 8; n++)
+    {
+        hal5_usb_chep_t* c = chep(n);
+
+        if (c->ea != endp) continue;
+
+        if (setup) 
+        {
+            if ((c->utype == ep_utype_control) && 
+                    (c->statrx != ep_status_disabled)) return n;
+        }
+        else if (dir_in)
+        {
+            if (c->stattx != ep_status_disabled) return n;
+        }
+        else
+        {
+            if (c->statrx != ep_status_disabled) return n;
+        }
+    }
+
+    return -1;
+}
+
+// hardware sets the status to NAK after a successful transaction
+static void set_stat_nak(volatile uint32_t* reg, bool rx)
+{
+    hal5_usb_chep_t c;
+    c.v = *reg;
+    if (rx) c.statrx = ep_status_nak;
+    else c.stattx = ep_status_nak;
+    *reg = c.v;
+}
+
+void hal5_usb_sim_bus_reset(void)
+{
+    // SE0 for >10ms
+    hal5_usb_sim_advance(10 * HAL5_USB_SIM_FRAME_NS);
+
+    if (!hal5_usb_sim_is_connected()) return;
+
+    apply_deferred_writes(UINT64_MAX);
+
+    // endpoint registers are reset by a bus reset
+    for (uint8_t n = 0; n < 8; n++)
+    {
+        *chep_reg(n) = 0;
+    }
+
+    host_address = 0;
+    host_mps0 = 8;
+
+    hal5_usb_sim_drd.ISTR |= USB_ISTR_RESET;
+    update_istr();
+    schedule_irq();
+    run_due_irqs(true);
+}
+
+void hal5_usb_sim_suspend(void)
+{
+    // no activity for >3ms
+    hal5_usb_sim_drd.ISTR |= USB_ISTR_SUSP;
+    schedule_irq();
+    run_due_irqs(true);
+}
+
+void hal5_usb_sim_resume(void)
+{
+    hal5_usb_sim_drd.ISTR |= USB_ISTR_WKUP;
+    schedule_irq();
+    run_due_irqs(true);
+}
+
+void hal5_usb_sim_set_address(uint8_t address)
+{
+    host_address = address;
+}
+
+uint8_t hal5_usb_sim_get_address(void)
+{
+    return host_address;
+}
+
+hal5_usb_sim_handshake_t hal5_usb_sim_setup(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request)
+{
+    const uint64_t bits = TOKEN_BITS + TURNAROUND_BITS + 
+        DATA_BITS + 8*8 + TURNAROUND_BITS + HANDSHAKE_BITS;
+
+    begin_transaction(bits);
+
+    const int n = find_chep(endp, false, true);
+
+    if (n < 0)
+    {
+        end_transaction(bits);
+        return count_handshake(hal5_usb_sim_no_response);
+    }
+
+    // SETUP is always ACKed, it cannot be NAKed or STALLed
+    hal5_usb_bd_t* bd = rxbd(n);
+    memcpy(PMA + bd->addr, request, 8);
+    bd->count = 8;
+
+    end_transaction(bits);
+    complete_transaction(n, true, true);
+
+    return count_handshake(hal5_usb_sim_ack);
+}
+
+hal5_usb_sim_handshake_t hal5_usb_sim_out(
+        uint8_t endp,
+        const void* data,
+        size_t len)
+{
+    uint64_t bits = TOKEN_BITS + TURNAROUND_BITS + 
+        DATA_BITS + 8*len + TURNAROUND_BITS + HANDSHAKE_BITS;
+
+    begin_transaction(bits);
+
+    const int n = find_chep(endp, false, false);
+
+    hal5_usb_sim_handshake_t handshake = hal5_usb_sim_no_response;
+
+    if (n >= 0)
+    {
+        hal5_usb_chep_t c;
+        c.v = *chep_reg(n);
+
+        if (is_iso(&c))
+        {
+            // no handshake, DTOG_RX selects the buffer
+            bits -= TURNAROUND_BITS + HANDSHAKE_BITS;
+
+            hal5_usb_bd_t* bd = c.dtogrx ? rxbd(n) : txbd(n);
+
+            if ((c.statrx == ep_status_valid) && (len <= rx_buffer_size(bd)))
+            {
+                memcpy(PMA + bd->addr, data, len);
+                bd->count = len;
+
+                stats.out_bytes += len;
+                handshake = hal5_usb_sim_ack;
+            }
+            else if (c.statrx == ep_status_valid)
+            {
+                // babble
+                hal5_usb_sim_drd.ISTR |= USB_ISTR_ERR;
+            }
+        }
+        else switch (c.statrx)
+        {
+            case ep_status_stall: 
+                handshake = hal5_usb_sim_stall; 
+                break;
+
+            case ep_status_nak: 
+                handshake = hal5_usb_sim_nak; 
+                break;
+
+            case ep_status_valid:
+                {
+                    hal5_usb_bd_t* bd = rxbd(n);
+
+                    if (is_double_buffered(&c))
+                    {
+                        // DTOG_RX selects the buffer, SW_BUF is DTOG_TX
+                        if (c.dtogrx == c.dtogtx)
+                        {
+                            handshake = hal5_usb_sim_nak;
+                            break;
+                        }
+
+                        bd = c.dtogrx ? rxbd(n) : txbd(n);
+                    }
+
+                    if (len > rx_buffer_size(bd))
+                    {
+                        // babble, packet is not ACKed
+                        hal5_usb_sim_drd.ISTR |= USB_ISTR_ERR;
+                        handshake = hal5_usb_sim_no_response;
+                        break;
+                    }
+
+                    memcpy(PMA + bd->addr, data, len);
+                    bd->count = len;
+
+                    stats.out_bytes += len;
+                    handshake = hal5_usb_sim_ack;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    end_transaction(bits);
+
+    if (handshake == hal5_usb_sim_ack)
+    {
+        complete_transaction(n, false, true);
+    }
+    else
+    {
+        update_istr();
+        schedule_irq();
+    }
+
+    return count_handshake(handshake);
+}
+
+hal5_usb_sim_handshake_t hal5_usb_sim_in(
+        uint8_t endp,
+        void* data,
+        size_t max_len,
+        size_t* len)
+{
+    uint64_t bits = TOKEN_BITS + TURNAROUND_BITS + HANDSHAKE_BITS;
+
+    // host schedules the transaction for the max data it can receive
+    begin_transaction(bits + TURNAROUND_BITS + DATA_BITS + 8*max_len);
+
+    const int n = find_chep(endp, true, false);
+
+    hal5_usb_sim_handshake_t handshake = hal5_usb_sim_no_response;
+
+    if (n >= 0)
+    {
+        hal5_usb_chep_t c;
+        c.v = *chep_reg(n);
+
+        if (is_iso(&c))
+        {
+            // no handshake, DTOG_TX selects the buffer
+            // the packet in it is sent, even if it is sent before
+            bits -= TURNAROUND_BITS + HANDSHAKE_BITS;
+
+            if (c.stattx == ep_status_valid)
+            {
+                hal5_usb_bd_t* bd = c.dtogtx ? rxbd(n) : txbd(n);
+
+                const size_t count = bd->count;
+
+                assert (count <= max_len);
+
+                memcpy(data, PMA + bd->addr, count);
+                *len = count;
+
+                stats.in_bytes += count;
+                bits += TURNAROUND_BITS + DATA_BITS + 8*count;
+                handshake = hal5_usb_sim_ack;
+            }
+        }
+        else switch (c.stattx)
+        {
+            case ep_status_stall: 
+                handshake = hal5_usb_sim_stall; 
+                break;
+
+            case ep_status_nak: 
+                handshake = hal5_usb_sim_nak; 
+                break;
+
+            case ep_status_valid:
+                {
+                    hal5_usb_bd_t* bd = txbd(n);
+
+                    if (is_double_buffered(&c))
+                    {
+                        // DTOG_TX selects the buffer, SW_BUF is DTOG_RX
+                        if (c.dtogtx == c.dtogrx)
+                        {
+                            handshake = hal5_usb_sim_nak;
+                            break;
+                        }
+
+                        bd = c.dtogtx ? rxbd(n) : txbd(n);
+                    }
+
+                    const size_t count = bd->count;
+
+                    // host buffer is smaller than the packet
+                    assert (count <= max_len);
+
+                    memcpy(data, PMA + bd->addr, count);
+                    *len = count;
+
+                    stats.in_bytes += count;
+                    bits += TURNAROUND_BITS + DATA_BITS + 8*count;
+                    handshake = hal5_usb_sim_ack;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    end_transaction(bits);
+
+    if (handshake == hal5_usb_sim_ack)
+    {
+        complete_transaction(n, false, false);
+    }
+    else
+    {
+        update_istr();
+        schedule_irq();
+    }
+
+    return count_handshake(handshake);
+}
+
+// OUT or IN with NAK retries
+static hal5_usb_sim_handshake_t out_until_handled(
+        uint8_t endp,
+        const void* data,
+        size_t len)
+{
+    const uint64_t start = now;
+
+    while (true)
+    {
+        hal5_usb_sim_handshake_t handshake = 
+            hal5_usb_sim_out(endp, data, len);
+
+        if (handshake != hal5_usb_sim_nak) return handshake;
+        if ((now - start) > MAX_STAGE_NS) return hal5_usb_sim_no_response;
+    }
+}
+
+static hal5_usb_sim_handshake_t in_until_handled(
+        uint8_t endp,
+        void* data,
+        size_t max_len,
+        size_t* len)
+{
+    const uint64_t start = now;
+
+    while (true)
+    {
+        hal5_usb_sim_handshake_t handshake = 
+            hal5_usb_sim_in(endp, data, max_len, len);
+
+        if (handshake != hal5_usb_sim_nak) return handshake;
+        if ((now - start) > MAX_STAGE_NS) return hal5_usb_sim_no_response;
+    }
+}
+
+static bool control_read(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request,
+        void* data,
+        size_t* len,
+        bool first_packet_only)
+{
+    assert (request->bmRequestType & 0x80);
+
+    size_t received = 0;
+
+    if (hal5_usb_sim_setup(endp, request) != hal5_usb_sim_ack) return false;
+
+    while (received < request->wLength)
+    {
+        uint8_t packet[64];
+        size_t packet_len;
+
+        if (in_until_handled(
+                    endp, 
+                    packet, 
+                    sizeof(packet), 
+                    &packet_len) != hal5_usb_sim_ack) return false;
+
+        packet_len = HAL5_MIN(packet_len, request->wLength - received);
+        memcpy(((uint8_t*) data) + received, packet, packet_len);
+        received += packet_len;
+
+        if (first_packet_only) break;
+        if (packet_len < host_mps0) break;
+    }
+
+    if (len != NULL) *len = received;
+
+    // status stage
+    return (out_until_handled(endp, NULL, 0) == hal5_usb_sim_ack);
+}
+
+bool hal5_usb_sim_control_read(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request,
+        void* data,
+        size_t* len)
+{
+    return control_read(endp, request, data, len, false);
+}
+
+bool hal5_usb_sim_control_write(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request,
+        const void* data)
+{
+    assert (!(request->bmRequestType & 0x80));
+
+    if (hal5_usb_sim_setup(endp, request) != hal5_usb_sim_ack) return false;
+
+    size_t sent = 0;
+
+    while (sent < request->wLength)
+    {
+        const size_t packet_len = 
+            HAL5_MIN(host_mps0, request->wLength - sent);
+
+        if (out_until_handled(
+                    endp, 
+                    ((const uint8_t*) data) + sent, 
+                    packet_len) != hal5_usb_sim_ack) return false;
+
+        sent += packet_len;
+    }
+
+    // status stage
+    uint8_t zlp[1];
+    size_t zlp_len;
+
+    if (in_until_handled(
+                endp, 
+                zlp, 
+                sizeof(zlp), 
+                &zlp_len) != hal5_usb_sim_ack) return false;
+
+    return (zlp_len == 0);
+}
+
+bool hal5_usb_sim_control_nodata(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request)
+{
+    assert (request->wLength == 0);
+
+    return hal5_usb_sim_control_write(endp, request, NULL);
+}
+
+bool hal5_usb_sim_enumerate(uint8_t address)
+{
+    uint8_t buffer[256];
+    size_t len;
+
+    hal5_usb_sim_bus_reset();
+
+    // like windows, read the first packet of device descriptor
+    // to learn bMaxPacketSize0 and then reset again
+    const hal5_usb_device_request_t get_device_descriptor_64 = 
+        {0x80, 0x06, 0x0100, 0x0000, 64};
+
+    if (!control_read(0, &get_device_descriptor_64, buffer, &len, true)) 
+        return false;
+    if (len < 8) return false;
+
+    const uint8_t mps0 = buffer[7];
+
+    hal5_usb_sim_bus_reset();
+    host_mps0 = mps0;
+
+    const hal5_usb_device_request_t set_address = 
+        {0x00, 0x05, address, 0x0000, 0};
+
+    if (!hal5_usb_sim_control_nodata(0, &set_address)) return false;
+    host_address = address;
+
+    const hal5_usb_device_request_t get_device_descriptor = 
+        {0x80, 0x06, 0x0100, 0x0000, 18};
+
+    if (!hal5_usb_sim_control_read(0, &get_device_descriptor, buffer, &len)) 
+        return false;
+    if (len != 18) return false;
+
+    const uint8_t num_configurations = buffer[17];
+
+    for (uint8_t i = 0; i < num_configurations; i++)
+    {
+        hal5_usb_device_request_t get_configuration_descriptor = 
+            {0x80, 0x06, 0x0200 | i, 0x0000, 9};
+
+        if (!hal5_usb_sim_control_read(
+                    0, 
+                    &get_configuration_descriptor, 
+                    buffer, 
+                    &len)) return false;
+        if (len != 9) return false;
+
+        const uint16_t total_length = buffer[2] | (buffer[3] << 8);
+        get_configuration_descriptor.wLength = 
+            HAL5_MIN(total_length, sizeof(buffer));
+
+        if (!hal5_usb_sim_control_read(
+                    0, 
+                    &get_configuration_descriptor, 
+                    buffer, 
+                    &len)) return false;
+        if (len != get_configuration_descriptor.wLength) return false;
+    }
+
+    return true;
+}
+
+bool hal5_usb_sim_attach(void (*main_loop)(void))
+{
+    hal5_usb_sim_initialize();
+    hal5_usb_sim_set_main_loop(main_loop);
+
+    hal5_usb_configure();
+    hal5_usb_device_connect();
+
+    return hal5_usb_sim_enumerate(5);
+}
+
+bool hal5_usb_sim_set_configuration(uint8_t configuration_value)
+{
+    const hal5_usb_device_request_t set_configuration = 
+        {0x00, 0x09, configuration_value, 0x0000, 0};
+
+    if (!hal5_usb_sim_control_nodata(0, &set_configuration)) return false;
+
+    return hal5_usb_device_get_state() == usb_device_state_configured;
+}
+
+int hal5_usb_sim_in_or_nak(
+        uint8_t endp,
+        void* data,
+        size_t max_len)
+{
+    size_t len;
+
+    const hal5_usb_sim_handshake_t handshake = 
+        hal5_usb_sim_in(endp, data, max_len, &len);
+
+    return (handshake == hal5_usb_sim_ack) ? (int) len : -1;
+}
@@ -0,0 +1,195 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// host simulation of USB_DRD_FS
+//
+// this is a software model of the USB_DRD_FS registers 
+// (ISTR, CNTR, FNR, DADDR, BCDR, CHEPnR) and the 2048 bytes PMA (USB SRAM),
+// together with a scripted USB host that drives SETUP, OUT and IN 
+// transactions into the device by changing the registers and the PMA as
+// the peripheral does and then calling USB_DRD_FS_IRQHandler.
+//
+// the bus is modeled with a time base in ns at USB FS speed (12Mbps),
+// transactions consume bus time, SOF is generated every 1ms and 
+// a transaction is never started if it cannot finish in the current frame.
+// the interrupt can be delayed by a configurable latency, so the time 
+// an endpoint is NAKing while the interrupt is being serviced is observable.
+// the handler can also be given a cost per PMA byte accessed, then its 
+// CHEPnR writes take effect later as if the handler was running on the mcu.
+// double buffered (DBL_BUF) bulk endpoints are modeled as well.
+// isochronous endpoints use the buffer selected by DTOG without a
+// handshake, and SOFs can be lost (ESOF).
+
+#ifndef __HAL5_USB_SIM_H__
+#define __HAL5_USB_SIM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal5_usb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// USB FS frame is 1ms
+#define HAL5_USB_SIM_FRAME_NS   (1000000ULL)
+
+// SYSCLK of the firmware (main.c), used to convert the time to cycles
+#define HAL5_USB_SIM_SYSCLK_MHZ (240ULL)
+
+typedef enum
+{
+    hal5_usb_sim_ack,
+    hal5_usb_sim_nak,
+    hal5_usb_sim_stall,
+    // endpoint disabled, wrong address, device not connected or
+    // a transmission error (e.g. packet larger than the rx buffer)
+    hal5_usb_sim_no_response,
+} hal5_usb_sim_handshake_t;
+
+typedef struct
+{
+    uint64_t irqs;
+    // SOFs sent by the host, including the lost ones
+    uint64_t sofs;
+    uint64_t acks;
+    uint64_t naks;
+    uint64_t stalls;
+    uint64_t no_responses;
+    // payload bytes in ACKed OUT/IN transactions
+    uint64_t out_bytes;
+    uint64_t in_bytes;
+} hal5_usb_sim_stats_t;
+
+// power-on state of registers and PMA, time and stats are reset too
+void hal5_usb_sim_initialize(void);
+
+// called after the interrupt handler returns, as if the main loop runs 
+// between the interrupts, e.g. to call hal5_usb_device_process_events
+// NULL (default) means nothing runs, it is reset by initialize
+void hal5_usb_sim_set_main_loop(void (*main_loop)(void));
+
+// the exception number __get_IPSR returns outside of the USB interrupt
+// handler, e.g. 14 (PendSV) while calling hal5_usb_device_process_events
+// 0 (default, thread mode) is reset by initialize
+void hal5_usb_sim_set_exception(uint32_t exception_number);
+
+// delay between an interrupt event and the time its handler takes effect
+// 0 means the handler runs immediately after the transaction
+void hal5_usb_sim_set_irq_latency(uint64_t ns);
+
+// time the interrupt handler spends for each byte read from or written to
+// PMA, CHEPnR writes of the handler take effect only after this time
+// (and the interrupt latency) is passed, 0 (default) means no cost
+void hal5_usb_sim_set_pma_access_cost(uint64_t ns_per_byte);
+
+// current bus time in ns
+uint64_t hal5_usb_sim_time(void);
+
+// idle the bus for ns, SOFs and pending interrupts are processed
+void hal5_usb_sim_advance(uint64_t ns);
+
+// the next n SOFs are not received by the peripheral, it sets ESOF instead
+// and counts them in FNR LSOF, the frame number is updated at the next SOF
+void hal5_usb_sim_lose_sofs(uint32_t n);
+
+// run pending interrupts now (ignoring the latency)
+void hal5_usb_sim_run_irq(void);
+
+const hal5_usb_sim_stats_t* hal5_usb_sim_get_stats(void);
+void hal5_usb_sim_clear_stats(void);
+
+// true if pull-up is enabled and the peripheral is not held in reset
+bool hal5_usb_sim_is_connected(void);
+
+// bus events
+void hal5_usb_sim_bus_reset(void);
+void hal5_usb_sim_suspend(void);
+void hal5_usb_sim_resume(void);
+
+// device address used in host tokens
+void hal5_usb_sim_set_address(uint8_t address);
+uint8_t hal5_usb_sim_get_address(void);
+
+// single transactions
+hal5_usb_sim_handshake_t hal5_usb_sim_setup(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request);
+
+hal5_usb_sim_handshake_t hal5_usb_sim_out(
+        uint8_t endp,
+        const void* data,
+        size_t len);
+
+// len is set to the number of bytes received if ACKed
+// for isochronous endpoints there is no handshake, ack is returned when
+// the data packet is sent (OUT) or received (IN)
+hal5_usb_sim_handshake_t hal5_usb_sim_in(
+        uint8_t endp,
+        void* data,
+        size_t max_len,
+        size_t* len);
+
+// control transfers on endp (normally 0)
+// NAKs are retried, false is returned if STALLed or not responded
+// len is set to the number of bytes received in data stage
+bool hal5_usb_sim_control_read(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request,
+        void* data,
+        size_t* len);
+
+// wLength bytes of data is sent in data stage
+bool hal5_usb_sim_control_write(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request,
+        const void* data);
+
+bool hal5_usb_sim_control_nodata(
+        uint8_t endp,
+        const hal5_usb_device_request_t* request);
+
+// typical host enumeration
+// bus reset, get device descriptor, set address and get descriptors
+// returns false if any request fails
+bool hal5_usb_sim_enumerate(uint8_t address);
+
+// power-on state, main_loop (can be NULL), hal5_usb_configure, connect and
+// enumerate with address 5, returns false if enumeration fails
+bool hal5_usb_sim_attach(void (*main_loop)(void));
+
+// Set Configuration, returns false if it fails or the device is not
+// in configured state after it
+bool hal5_usb_sim_set_configuration(uint8_t configuration_value);
+
+// single IN transaction, returns the number of bytes received if ACKed
+// or -1 otherwise (NAK, STALL or no response)
+int hal5_usb_sim_in_or_nak(
+        uint8_t endp,
+        void* data,
+        size_t max_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
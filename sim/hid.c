@@ -0,0 +1,304 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the HID driver (hal5_usb_hid.c) with sim/hid_device.c
+// - HID and report descriptors with Get Descriptor to the interface
+// - GET_REPORT, GET_IDLE and SET_IDLE class requests
+// - polls without a new report are NAKed without an interrupt
+// - a new report replaces the one not sent yet
+// - the last report is sent again at the idle rate
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "hid_device.h"
+
+#define MAX_PACKET_SIZE         (8)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint16_t get_frame_number(void)
+{
+    return USB_DRD_FS->FNR & USB_FNR_FN;
+}
+
+static void check_descriptors(void)
+{
+    uint8_t configuration[255];
+    uint8_t descriptor[255];
+    size_t len;
+
+    const hal5_usb_device_request_t get_configuration_descriptor = 
+        {0x80, 0x06, 0x0200, 0, sizeof(configuration)};
+
+    CHECK (hal5_usb_sim_control_read(
+                0, &get_configuration_descriptor, configuration, &len));
+    // configuration, interface, HID and endpoint descriptors
+    CHECK (len == (9 + 9 + 9 + 7));
+
+    const uint8_t* hid_descriptor = configuration + 9 + 9;
+    CHECK (hid_descriptor[0] == 9);
+    CHECK (hid_descriptor[1] == HAL5_USB_HID_DESCRIPTOR);
+
+    // the same HID descriptor as in the configuration descriptor
+    const hal5_usb_device_request_t get_hid_descriptor = 
+        {0x81, 0x06, HAL5_USB_HID_DESCRIPTOR << 8, 
+            HID_DEVICE_INTERFACE, sizeof(descriptor)};
+
+    CHECK (hal5_usb_sim_control_read(
+                0, &get_hid_descriptor, descriptor, &len));
+    CHECK (len == 9);
+    CHECK (memcmp(descriptor, hid_descriptor, 9) == 0);
+
+    const size_t report_descriptor_length = 
+        hid_descriptor[7] | (hid_descriptor[8] << 8);
+
+    const hal5_usb_device_request_t get_report_descriptor = 
+        {0x81, 0x06, HAL5_USB_HID_REPORT_DESCRIPTOR << 8, 
+            HID_DEVICE_INTERFACE, sizeof(descriptor)};
+
+    CHECK (hal5_usb_sim_control_read(
+                0, &get_report_descriptor, descriptor, &len));
+    CHECK (len == report_descriptor_length);
+    // usage page (generic desktop), usage (game pad), 
+    // collection (application) ... end collection
+    const uint8_t begin[] = {0x05, 0x01, 0x09, 0x05, 0xA1, 0x01};
+    CHECK (memcmp(descriptor, begin, sizeof(begin)) == 0);
+    CHECK (descriptor[len - 1] == 0xC0);
+
+    // shorter than the descriptor
+    const hal5_usb_device_request_t get_report_descriptor_short = 
+        {0x81, 0x06, HAL5_USB_HID_REPORT_DESCRIPTOR << 8, 
+            HID_DEVICE_INTERFACE, 4};
+
+    CHECK (hal5_usb_sim_control_read(
+                0, &get_report_descriptor_short, descriptor, &len));
+    CHECK (len == 4);
+
+    // no such interface
+    const hal5_usb_device_request_t get_report_descriptor_interface = 
+        {0x81, 0x06, HAL5_USB_HID_REPORT_DESCRIPTOR << 8, 
+            HID_DEVICE_INTERFACE + 1, sizeof(descriptor)};
+
+    CHECK (!hal5_usb_sim_control_read(
+                0, &get_report_descriptor_interface, descriptor, &len));
+
+    // no such descriptor (physical descriptor)
+    const hal5_usb_device_request_t get_physical_descriptor = 
+        {0x81, 0x06, 0x2300, HID_DEVICE_INTERFACE, sizeof(descriptor)};
+
+    CHECK (!hal5_usb_sim_control_read(
+                0, &get_physical_descriptor, descriptor, &len));
+}
+
+static void check_reports(void)
+{
+    uint8_t packet[MAX_PACKET_SIZE];
+
+    const hal5_usb_sim_stats_t* sim_stats = hal5_usb_sim_get_stats();
+
+    // nothing to send, NAKed by the peripheral
+    const uint64_t irqs = sim_stats->irqs;
+    for (int i = 0; i < 10; i++) 
+    {
+        CHECK (hal5_usb_sim_in_or_nak(
+                    HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == -1);
+    }
+    CHECK (sim_stats->irqs == irqs);
+
+    const uint8_t report1[HID_DEVICE_REPORT_SIZE] = {1, 2, 3, 4, 5, 6};
+    const uint8_t report2[HID_DEVICE_REPORT_SIZE] = {7, 8, 9, 10, 11, 12};
+    const uint8_t report3[HID_DEVICE_REPORT_SIZE] = {13, 14, 15, 16, 17, 18};
+
+    CHECK (hal5_usb_hid_send_report(report1));
+    CHECK (hal5_usb_sim_in_or_nak(
+                HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == 
+            HID_DEVICE_REPORT_SIZE);
+    CHECK (memcmp(packet, report1, HID_DEVICE_REPORT_SIZE) == 0);
+    CHECK (hal5_usb_sim_in_or_nak(
+                HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == -1);
+
+    // report1 is in USB SRAM, report3 replaces report2
+    CHECK (hal5_usb_hid_send_report(report1));
+    CHECK (hal5_usb_hid_send_report(report2));
+    CHECK (hal5_usb_hid_send_report(report3));
+
+    CHECK (hal5_usb_sim_in_or_nak(
+                HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == 
+            HID_DEVICE_REPORT_SIZE);
+    CHECK (memcmp(packet, report1, HID_DEVICE_REPORT_SIZE) == 0);
+    CHECK (hal5_usb_sim_in_or_nak(
+                HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == 
+            HID_DEVICE_REPORT_SIZE);
+    CHECK (memcmp(packet, report3, HID_DEVICE_REPORT_SIZE) == 0);
+    CHECK (hal5_usb_sim_in_or_nak(
+                HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == -1);
+
+    hal5_usb_hid_stats_t stats;
+    hal5_usb_hid_get_stats(&stats);
+    CHECK (stats.reports == 3);
+    CHECK (stats.reports_replaced == 1);
+    CHECK (stats.idle_reports == 0);
+
+    // the last report
+    const hal5_usb_device_request_t get_report = 
+        {0xA1, HAL5_USB_HID_GET_REPORT, HAL5_USB_HID_REPORT_INPUT << 8, 
+            HID_DEVICE_INTERFACE, HID_DEVICE_REPORT_SIZE};
+
+    size_t len;
+    CHECK (hal5_usb_sim_control_read(0, &get_report, packet, &len));
+    CHECK (len == HID_DEVICE_REPORT_SIZE);
+    CHECK (memcmp(packet, report3, HID_DEVICE_REPORT_SIZE) == 0);
+
+    // only input reports
+    const hal5_usb_device_request_t get_feature_report = 
+        {0xA1, HAL5_USB_HID_GET_REPORT, 0x0300, 
+            HID_DEVICE_INTERFACE, HID_DEVICE_REPORT_SIZE};
+
+    CHECK (!hal5_usb_sim_control_read(0, &get_feature_report, packet, &len));
+
+    hal5_usb_hid_get_stats(&stats);
+    CHECK (stats.get_reports == 1);
+}
+
+static void check_idle(void)
+{
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint8_t idle_rate = 0xFF;
+    size_t len;
+
+    const hal5_usb_device_request_t get_idle = 
+        {0xA1, HAL5_USB_HID_GET_IDLE, 0, HID_DEVICE_INTERFACE, 1};
+
+    // infinite by default
+    CHECK (hal5_usb_sim_control_read(0, &get_idle, &idle_rate, &len));
+    CHECK (len == 1);
+    CHECK (idle_rate == 0);
+
+    // nothing is sent again
+    for (int i = 0; i < 10; i++)
+    {
+        hal5_usb_sim_advance(HAL5_USB_SIM_FRAME_NS);
+        hal5_usb_hid_process();
+        CHECK (hal5_usb_sim_in_or_nak(
+                    HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == -1);
+    }
+
+    // 4 ms
+    const hal5_usb_device_request_t set_idle = 
+        {0x21, HAL5_USB_HID_SET_IDLE, 1 << 8, HID_DEVICE_INTERFACE, 0};
+
+    CHECK (hal5_usb_sim_control_nodata(0, &set_idle));
+    CHECK (hal5_usb_hid_get_idle_rate() == 1);
+
+    CHECK (hal5_usb_sim_control_read(0, &get_idle, &idle_rate, &len));
+    CHECK (idle_rate == 1);
+
+    // only for all reports (report ID 0)
+    const hal5_usb_device_request_t set_idle_report_id = 
+        {0x21, HAL5_USB_HID_SET_IDLE, (1 << 8) | 1, HID_DEVICE_INTERFACE, 0};
+
+    CHECK (!hal5_usb_sim_control_nodata(0, &set_idle_report_id));
+
+    const uint8_t report[HID_DEVICE_REPORT_SIZE] = {0xA, 0xB, 0xC, 0, 0, 0};
+
+    CHECK (hal5_usb_hid_send_report(report));
+    CHECK (hal5_usb_sim_in_or_nak(
+                HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == 
+            HID_DEVICE_REPORT_SIZE);
+
+    // the same report is sent again after 4 frames, polled every frame
+    uint16_t last_frame = get_frame_number();
+    uint32_t resent = 0;
+    for (int i = 0; (i < 100) && (resent < 10); i++)
+    {
+        hal5_usb_sim_advance(HAL5_USB_SIM_FRAME_NS);
+        hal5_usb_hid_process();
+
+        if (hal5_usb_sim_in_or_nak(
+                    HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == 
+                HID_DEVICE_REPORT_SIZE)
+        {
+            const uint16_t frame = get_frame_number();
+            CHECK (memcmp(packet, report, HID_DEVICE_REPORT_SIZE) == 0);
+            CHECK (((frame - last_frame) & USB_FNR_FN) == 4);
+            last_frame = frame;
+            resent++;
+        }
+    }
+
+    CHECK (resent == 10);
+
+    hal5_usb_hid_stats_t stats;
+    hal5_usb_hid_get_stats(&stats);
+    CHECK (stats.idle_reports == 10);
+
+    // a new report is sent at the next poll
+    const uint8_t new_report[HID_DEVICE_REPORT_SIZE] = {1, 1, 1, 1, 1, 1};
+    CHECK (hal5_usb_hid_send_report(new_report));
+    CHECK (hal5_usb_sim_in_or_nak(
+                HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == 
+            HID_DEVICE_REPORT_SIZE);
+    CHECK (memcmp(packet, new_report, HID_DEVICE_REPORT_SIZE) == 0);
+
+    // infinite again
+    const hal5_usb_device_request_t set_idle_infinite = 
+        {0x21, HAL5_USB_HID_SET_IDLE, 0, HID_DEVICE_INTERFACE, 0};
+
+    CHECK (hal5_usb_sim_control_nodata(0, &set_idle_infinite));
+
+    for (int i = 0; i < 10; i++)
+    {
+        hal5_usb_sim_advance(HAL5_USB_SIM_FRAME_NS);
+        hal5_usb_hid_process();
+        CHECK (hal5_usb_sim_in_or_nak(
+                    HID_DEVICE_IN_ENDP, packet, sizeof(packet)) == -1);
+    }
+}
+
+int main(void)
+{
+    CHECK (hid_device_initialize());
+
+    CHECK (hal5_usb_sim_attach(NULL));
+    CHECK (hal5_usb_sim_set_configuration(1));
+
+    check_descriptors();
+    check_reports();
+    check_idle();
+
+    printf("hid: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,40 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// HID device used by the simulation
+// hal5_usb_hid with the descriptors in sim/hid_device.py
+// the reports are sent by the simulation programs
+
+#ifndef __HID_DEVICE_H__
+#define __HID_DEVICE_H__
+
+#include <stdbool.h>
+
+#include "hal5_usb_hid.h"
+
+#define HID_DEVICE_INTERFACE    (0)
+#define HID_DEVICE_IN_ENDP      (1)
+// gamepad_report_descriptor(16, 4) in sim/hid_device.py
+#define HID_DEVICE_REPORT_SIZE  (6)
+
+// call once, registers the HID driver
+bool hid_device_initialize(void);
+
+#endif
@@ -0,0 +1,56 @@
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# descriptors of the HID device used by the simulation
+# see descriptors.py for the meaning of the keys and hid.py
+
+# a gamepad with 16 buttons and 4 axes (6 bytes input report)
+# interface 0 with EP1 IN (interrupt, polled every frame)
+
+from hid import hid_interface, gamepad_report_descriptor
+
+(report_descriptor, report_size) = gamepad_report_descriptor(16, 4)
+
+assert report_size == 6
+
+descriptors = {
+    'class-proto':          (0x00, 0x00, 0x00),
+    'max-packet-size-ep0':  64,
+    'ids':                  (0x1209, 0x0004),
+    'device-version':       (1, 0),
+    'manufacturer':         'metebalci',
+    'product':              'hal5 hid',
+    'append_version':       False,
+    'serial':               None,
+    'configurations':
+    [
+        {
+            'value':            1,
+            'label':            None,
+            'self-powered':     True,
+            'remote-wakeup':    False,
+            'max-power-ma':     0,
+            'interfaces':
+            [
+                hid_interface(0, 1, report_descriptor),
+            ]
+        },
+    ]
+}
@@ -0,0 +1,640 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the isochronous endpoints with sim/iso_device.c in streaming mode
+// - SOF and ESOF interrupts are enabled only with isochronous endpoints
+// - IN packets are taken from the callback at SOF, ZLPs without a stream
+// - OUT packets are handed over to the callback at SOF
+// - missed frames are counted and no packet is lost or repeated because
+//   of them, also with a service interval of 2 frames
+// - the frames are handled at ESOF when the SOFs are lost
+// - OUT to IN loopback has a constant latency in frames
+// - SET_INTERFACE and SYNCH_FRAME are passed to the device
+// it is also built with deferred processing (sim/build/iso_deferred), the
+// events are processed after each interrupt then, and also checks:
+// - the frames are handled with the buffers used in them, also when 
+//   the events are processed later
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "iso_device.h"
+
+#define MAX_PACKET_SIZE         (ISO_DEVICE_MAX_PACKET_SIZE)
+// packets in the loopback queue
+#define LOOPBACK_PACKETS        (4)
+
+#if HAL5_USB_DEFERRED_ENABLED
+#define NAME                    "iso_deferred"
+#else
+#define NAME                    "iso"
+#endif
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+typedef struct
+{
+    // number of packets handed over or taken
+    uint32_t packets;
+    // the stream is stopped after this many packets
+    uint32_t limit;
+    // OUT packets with wrong size or data
+    uint32_t errors;
+} driver_t;
+
+static driver_t in_driver;
+static driver_t out_driver;
+
+// size and data of the packet n of a stream
+static size_t packet_size(uint32_t n)
+{
+    return ((n % 4) == 3) ? (MAX_PACKET_SIZE / 2) : MAX_PACKET_SIZE;
+}
+
+static uint8_t packet_data(uint32_t n, size_t offset)
+{
+    return (uint8_t) (n * 7 + offset);
+}
+
+static bool check_packet(uint32_t n, const uint8_t* data, size_t size)
+{
+    if (size != packet_size(n)) return false;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (data[i] != packet_data(n, i)) return false;
+    }
+
+    return true;
+}
+
+static bool in_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    driver_t* driver = (driver_t*) context;
+
+    if (driver->packets == driver->limit) return false;
+
+    CHECK (*size == MAX_PACKET_SIZE);
+
+    *size = packet_size(driver->packets);
+
+    for (size_t i = 0; i < *size; i++)
+    {
+        data[i] = packet_data(driver->packets, i);
+    }
+
+    driver->packets++;
+
+    return true;
+}
+
+static bool out_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    driver_t* driver = (driver_t*) context;
+
+    if (!check_packet(driver->packets, data, *size)) driver->errors++;
+
+    driver->packets++;
+
+    return driver->packets != driver->limit;
+}
+
+static void reset_drivers(void)
+{
+    memset(&in_driver, 0, sizeof(in_driver));
+    memset(&out_driver, 0, sizeof(out_driver));
+    in_driver.limit = UINT32_MAX;
+    out_driver.limit = UINT32_MAX;
+}
+
+static void process_events(void)
+{
+    hal5_usb_device_process_events();
+}
+
+static void configure(uint8_t configuration_value)
+{
+#if HAL5_USB_DEFERRED_ENABLED
+    CHECK (hal5_usb_sim_attach(process_events));
+#else
+    CHECK (hal5_usb_sim_attach(NULL));
+#endif
+
+    // no isochronous endpoint yet
+    CHECK ((USB_DRD_FS->CNTR & (USB_CNTR_SOFM | USB_CNTR_ESOFM)) == 0);
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    CHECK ((USB_DRD_FS->CNTR & (USB_CNTR_SOFM | USB_CNTR_ESOFM)) == 
+            (USB_CNTR_SOFM | USB_CNTR_ESOFM));
+}
+
+// the transactions of a frame are right after its SOF
+static void next_frame(void)
+{
+    hal5_usb_sim_advance(
+            HAL5_USB_SIM_FRAME_NS - (hal5_usb_sim_time() % HAL5_USB_SIM_FRAME_NS));
+}
+
+static bool write_packet(uint32_t n)
+{
+    uint8_t data[MAX_PACKET_SIZE];
+    const size_t size = packet_size(n);
+
+    for (size_t i = 0; i < size; i++) data[i] = packet_data(n, i);
+
+    return hal5_usb_sim_out(ISO_DEVICE_OUT_ENDP, data, size) == 
+        hal5_usb_sim_ack;
+}
+
+static hal5_usb_endpoint_t* in_ep(void)
+{
+    return hal5_usb_device_get_endpoint(ISO_DEVICE_IN_ENDP, true);
+}
+
+static hal5_usb_endpoint_t* out_ep(void)
+{
+    return hal5_usb_device_get_endpoint(ISO_DEVICE_OUT_ENDP, false);
+}
+
+// reads a packet in each of the next frames and checks the ones with data
+// are the next packets of the stream, returns the number of ZLPs
+static uint32_t read_frames(uint32_t frames, uint32_t* next)
+{
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint32_t zlps = 0;
+
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        next_frame();
+
+        const int len = hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet));
+
+        CHECK (len >= 0);
+
+        if (len == 0)
+        {
+            zlps++;
+        }
+        else
+        {
+            CHECK (check_packet(*next, packet, len));
+            (*next)++;
+        }
+    }
+
+    return zlps;
+}
+
+static void check_in(void)
+{
+    reset_drivers();
+    configure(1);
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint32_t next = 0;
+
+    // ZLPs without a stream, missed frames are not counted
+    next_frame();
+    next_frame();
+    CHECK (hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet)) == 0);
+    CHECK (in_ep()->stats.missed_frames == 0);
+
+    hal5_usb_device_start_stream(in_ep());
+
+    // the first packet is sent in the frame after the next one
+    CHECK (read_frames(1, &next) == 1);
+    CHECK (read_frames(20, &next) == 0);
+    CHECK (next == 20);
+    // the packet sent in this frame is counted at the next SOF
+    CHECK (in_driver.packets == 21);
+    CHECK (in_ep()->stats.tx_packets == 21);
+    CHECK (in_ep()->stats.missed_frames == 0);
+
+    // not polled for 3 frames, the stream continues where it is
+    for (int i = 0; i < 3; i++) next_frame();
+    CHECK (read_frames(10, &next) == 0);
+    CHECK (next == 30);
+    CHECK (in_ep()->stats.missed_frames == 3);
+
+    // the callback stops the stream, ZLPs after the packets taken
+    in_driver.limit = in_driver.packets + 2;
+    CHECK (read_frames(10, &next) == 7);
+    CHECK (next == in_driver.limit);
+
+    // missed frames are not counted without a stream
+    const uint32_t missed = in_ep()->stats.missed_frames;
+    for (int i = 0; i < 3; i++) next_frame();
+    CHECK (in_ep()->stats.missed_frames == missed);
+
+    // restarted
+    in_driver.limit = UINT32_MAX;
+    hal5_usb_device_start_stream(in_ep());
+    CHECK (read_frames(12, &next) == 2);
+    CHECK (next == 43);
+
+    // the frames are handled at SOF
+    const hal5_usb_device_stats_t* stats = hal5_usb_device_get_stats();
+    CHECK (stats->sofs > 0);
+    CHECK (stats->missed_sofs == 0);
+
+    // the interrupts are disabled with the endpoints at bus reset
+    hal5_usb_sim_bus_reset();
+    CHECK ((USB_DRD_FS->CNTR & (USB_CNTR_SOFM | USB_CNTR_ESOFM)) == 0);
+}
+
+static void check_out(void)
+{
+    reset_drivers();
+    configure(1);
+
+    // dropped without a stream
+    next_frame();
+    CHECK (write_packet(100));
+    next_frame();
+    CHECK (out_driver.packets == 0);
+    CHECK (out_ep()->stats.rx_packets == 1);
+    CHECK (out_ep()->stats.missed_frames == 0);
+
+    hal5_usb_device_start_stream(out_ep());
+
+    // each packet is handed over at the next SOF
+    uint32_t sent = 0;
+    for (int i = 0; i < 20; i++)
+    {
+        CHECK (write_packet(sent++));
+        next_frame();
+        CHECK (out_driver.packets == sent);
+    }
+
+    CHECK (out_driver.errors == 0);
+    CHECK (out_ep()->stats.missed_frames == 0);
+
+    // not sent for 2 frames
+    next_frame();
+    next_frame();
+    CHECK (out_ep()->stats.missed_frames == 2);
+
+    // larger than max packet size, not received
+    uint8_t large[MAX_PACKET_SIZE + 4] = {0};
+    CHECK (hal5_usb_sim_out(ISO_DEVICE_OUT_ENDP, large, sizeof(large)) == 
+            hal5_usb_sim_no_response);
+    next_frame();
+    CHECK (out_ep()->stats.missed_frames == 3);
+    CHECK (hal5_usb_device_get_stats()->bus_errors == 1);
+
+    for (int i = 0; i < 5; i++)
+    {
+        CHECK (write_packet(sent++));
+        next_frame();
+    }
+
+    CHECK (out_driver.packets == sent);
+    CHECK (out_driver.errors == 0);
+
+    // the callback stops the stream, the next ones are dropped
+    out_driver.limit = out_driver.packets + 1;
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK (write_packet(sent++));
+        next_frame();
+    }
+
+    CHECK (out_driver.packets == out_driver.limit);
+    CHECK (out_ep()->stats.rx_packets == (1 + sent));
+}
+
+static void check_interval(void)
+{
+    reset_drivers();
+    // service interval of 2 frames
+    configure(2);
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint32_t next = 0;
+
+    next_frame();
+    CHECK (hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet)) == 0);
+
+    hal5_usb_device_start_stream(in_ep());
+
+    for (int i = 0; i < 20; i++)
+    {
+        next_frame();
+        next_frame();
+
+        const int len = hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet));
+
+        if (len > 0)
+        {
+            CHECK (check_packet(next, packet, len));
+            next++;
+        }
+    }
+
+    CHECK (next == 19);
+    CHECK (in_ep()->stats.missed_frames == 0);
+
+    // 2 service intervals without a packet
+    for (int i = 0; i < 6; i++) next_frame();
+    CHECK (hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet)) == 
+            packet_size(next));
+    CHECK (in_ep()->stats.missed_frames == 2);
+}
+
+static void check_lost_sofs(void)
+{
+    reset_drivers();
+    configure(1);
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint32_t next = 0;
+
+    next_frame();
+    hal5_usb_device_start_stream(in_ep());
+    hal5_usb_device_start_stream(out_ep());
+    CHECK (hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet)) == 0);
+
+    read_frames(5, &next);
+
+    const uint16_t frame = USB_DRD_FS->FNR & USB_FNR_FN;
+    const hal5_usb_device_stats_t* stats = hal5_usb_device_get_stats();
+    const uint32_t sofs = stats->sofs;
+
+    // the frames still end at ESOF
+    hal5_usb_sim_lose_sofs(2);
+
+    for (int i = 0; i < 2; i++)
+    {
+        CHECK (read_frames(1, &next) == 0);
+        CHECK ((USB_DRD_FS->FNR & USB_FNR_FN) == frame);
+        CHECK (((USB_DRD_FS->FNR & USB_FNR_LSOF) >> USB_FNR_LSOF_Pos) == 
+                (i + 1));
+    }
+
+    CHECK (read_frames(5, &next) == 0);
+    CHECK ((USB_DRD_FS->FNR & USB_FNR_FN) == ((frame + 7) & USB_FNR_FN));
+    CHECK ((USB_DRD_FS->FNR & USB_FNR_LSOF) == 0);
+
+    CHECK (stats->missed_sofs == 2);
+    CHECK (stats->sofs == (sofs + 5));
+    CHECK (in_ep()->stats.missed_frames == 0);
+    // nothing is sent to OUT
+    CHECK (out_ep()->stats.missed_frames == 12);
+}
+
+// LOOPBACK
+// the OUT packets are queued and sent back on IN
+
+static uint8_t loopback[LOOPBACK_PACKETS][MAX_PACKET_SIZE];
+static size_t loopback_size[LOOPBACK_PACKETS];
+static uint32_t loopback_head;
+static uint32_t loopback_tail;
+
+static bool loopback_out(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    CHECK ((loopback_head - loopback_tail) < LOOPBACK_PACKETS);
+
+    const uint32_t i = loopback_head % LOOPBACK_PACKETS;
+    memcpy(loopback[i], data, *size);
+    loopback_size[i] = *size;
+    loopback_head++;
+
+    return true;
+}
+
+// a ZLP if there is nothing to send back
+static bool loopback_in(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    if (loopback_head == loopback_tail)
+    {
+        *size = 0;
+        return true;
+    }
+
+    const uint32_t i = loopback_tail % LOOPBACK_PACKETS;
+    memcpy(data, loopback[i], loopback_size[i]);
+    *size = loopback_size[i];
+    loopback_tail++;
+
+    return true;
+}
+
+static void check_loopback(void)
+{
+    CHECK (hal5_usb_device_register_packet_callback(
+                0x80 | ISO_DEVICE_IN_ENDP, loopback_in, NULL));
+    CHECK (hal5_usb_device_register_packet_callback(
+                ISO_DEVICE_OUT_ENDP, loopback_out, NULL));
+
+    loopback_head = 0;
+    loopback_tail = 0;
+
+    configure(1);
+
+    next_frame();
+    hal5_usb_device_start_stream(in_ep());
+    hal5_usb_device_start_stream(out_ep());
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    int latency = -1;
+
+    for (uint32_t frame = 0; frame < 100; frame++)
+    {
+        CHECK (write_packet(sent++));
+
+        const int len = hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet));
+        CHECK (len >= 0);
+
+        next_frame();
+
+        if (len == 0) continue;
+
+        CHECK (check_packet(received, packet, len));
+
+        // frames from the OUT to the IN of the same packet
+        const int frames = (int) frame - (int) received;
+
+        if (latency < 0) latency = frames;
+        CHECK (frames == latency);
+
+        received++;
+    }
+
+    // OUT at SOF, IN at the next SOF and sent in the frame after
+    CHECK (latency == 3);
+    CHECK (received == (sent - latency));
+    CHECK (in_ep()->stats.missed_frames == 0);
+    CHECK (out_ep()->stats.missed_frames == 0);
+}
+
+// SET_INTERFACE and SYNCH_FRAME reach the _ex hooks of the device
+static void check_standard_requests(void)
+{
+    reset_drivers();
+    configure(1);
+
+    const hal5_usb_device_request_t set_interface = 
+        {0x01, 0x0B, 0x0000, 0x0000, 0};
+
+    CHECK (hal5_usb_sim_control_nodata(0, &set_interface));
+    CHECK (iso_device_stats.set_interfaces == 1);
+    CHECK (iso_device_stats.interface == 0);
+    CHECK (iso_device_stats.alternate_setting == 0);
+
+    // rejected by the device
+    const hal5_usb_device_request_t set_interface_1 = 
+        {0x01, 0x0B, 0x0001, 0x0000, 0};
+
+    CHECK (!hal5_usb_sim_control_nodata(0, &set_interface_1));
+    CHECK (iso_device_stats.set_interfaces == 2);
+    CHECK (iso_device_stats.alternate_setting == 1);
+
+    next_frame();
+    next_frame();
+
+    const hal5_usb_device_request_t synch_frame = 
+        {0x82, 0x0C, 0x0000, 0x80 | ISO_DEVICE_IN_ENDP, 2};
+
+    uint16_t frame_number = 0xFFFF;
+    size_t len = 0;
+
+    CHECK (hal5_usb_sim_control_read(0, &synch_frame, &frame_number, &len));
+    CHECK (len == 2);
+    CHECK (frame_number == (USB_DRD_FS->FNR & USB_FNR_FN));
+    CHECK (iso_device_stats.synch_frames == 1);
+
+    // not an isochronous endpoint
+    const hal5_usb_device_request_t synch_frame_ep3 = 
+        {0x82, 0x0C, 0x0000, 0x83, 2};
+
+    CHECK (!hal5_usb_sim_control_read(0, &synch_frame_ep3, &frame_number, &len));
+    CHECK (iso_device_stats.synch_frames == 2);
+}
+
+#if HAL5_USB_DEFERRED_ENABLED
+// the events of 4 frames are processed at once, as if the main loop is late
+// the buffers are exchanged late but the missed frame and the packets 
+// are counted in the frames they happen
+static void check_deferred(void)
+{
+    CHECK (hal5_usb_device_register_packet_callback(
+                0x80 | ISO_DEVICE_IN_ENDP, in_packet, &in_driver));
+
+    reset_drivers();
+    configure(1);
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint32_t next = 0;
+
+    next_frame();
+    hal5_usb_device_start_stream(in_ep());
+    CHECK (hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet)) == 0);
+    CHECK (read_frames(10, &next) == 1);
+
+    const uint32_t tx_packets = in_ep()->stats.tx_packets;
+    const uint32_t sofs = hal5_usb_device_get_stats()->sofs;
+
+    hal5_usb_sim_set_main_loop(NULL);
+
+    // the packet of the last frame is counted at the next SOF
+    // a packet in the 2nd and 4th frames, not in the 3rd
+    next_frame();
+    CHECK (hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet)) > 0);
+    next_frame();
+    next_frame();
+    CHECK (hal5_usb_sim_in_or_nak(
+                ISO_DEVICE_IN_ENDP, packet, sizeof(packet)) > 0);
+    next_frame();
+
+    CHECK (in_ep()->stats.tx_packets == tx_packets);
+
+    // SOF and CTR events
+    CHECK (hal5_usb_device_process_events() == 6);
+    hal5_usb_sim_set_main_loop(process_events);
+
+    CHECK (hal5_usb_device_get_stats()->sofs == (sofs + 4));
+    CHECK (in_ep()->stats.tx_packets == (tx_packets + 3));
+    CHECK (in_ep()->stats.missed_frames == 1);
+}
+#endif
+
+int main(void)
+{
+    CHECK (hal5_usb_device_register_packet_callback(
+                0x80 | ISO_DEVICE_IN_ENDP, in_packet, &in_driver));
+    CHECK (hal5_usb_device_register_packet_callback(
+                ISO_DEVICE_OUT_ENDP, out_packet, &out_driver));
+
+    check_in();
+    check_out();
+    check_interval();
+    check_lost_sofs();
+    check_loopback();
+    check_standard_requests();
+#if HAL5_USB_DEFERRED_ENABLED
+    check_deferred();
+#endif
+
+    printf(NAME ": %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,149 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "iso_device.h"
+
+iso_device_stats_t iso_device_stats;
+
+uint8_t hal5_usb_device_version_major_ex()
+{
+    return 1;
+}
+
+uint8_t hal5_usb_device_version_minor_ex()
+{
+    return 0;
+}
+
+bool hal5_usb_device_is_device_self_powered_ex() 
+{ 
+    return true; 
+}
+
+// there is no halt for isochronous endpoints
+
+bool hal5_usb_device_clear_endpoint_halt_ex(
+        uint8_t endpoint,
+        bool dir_in)
+{
+    return false;
+}
+
+bool hal5_usb_device_set_endpoint_halt_ex(
+        uint8_t endpoint,
+        bool dir_in)
+{
+    return false;
+}
+
+bool hal5_usb_device_is_endpoint_halt_set_ex(
+        uint8_t endpoint, 
+        bool dir_in,
+        bool* is_set) 
+{
+    return false;
+}
+
+bool hal5_usb_device_clear_device_remote_wakeup_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_set_device_remote_wakeup_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_is_device_remote_wakeup_set_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_set_test_mode_ex()
+{
+    return false;
+}
+
+bool hal5_usb_device_is_test_mode_set_ex()
+{
+    return false;
+}
+
+// the frame number is reported for the isochronous endpoints
+bool hal5_usb_device_get_synch_frame_ex(
+        uint8_t endpoint,
+        bool dir_in,
+        uint16_t* frame_number)
+{
+    iso_device_stats.synch_frames++;
+
+    const bool iso_endpoint = dir_in ? 
+        (endpoint == ISO_DEVICE_IN_ENDP) : 
+        (endpoint == ISO_DEVICE_OUT_ENDP);
+
+    if (!iso_endpoint) return false;
+
+    *frame_number = USB_DRD_FS->FNR & USB_FNR_FN;
+
+    return true;
+}
+
+void hal5_usb_device_set_configuration_ex(
+        uint8_t configuration_value)
+{
+    memset(&iso_device_stats, 0, sizeof(iso_device_stats));
+}
+
+bool hal5_usb_device_get_interface_ex(
+        uint8_t interface,
+        uint8_t* alternate_setting)
+{
+    return false;
+}
+
+// there is only alternate setting 0
+bool hal5_usb_device_set_interface_ex(
+        uint8_t interface,
+        uint8_t alternate_setting)
+{
+    iso_device_stats.set_interfaces++;
+    iso_device_stats.interface = interface;
+    iso_device_stats.alternate_setting = alternate_setting;
+
+    return alternate_setting == 0;
+}
+
+// the endpoints are in streaming mode, so these are not called
+
+void hal5_usb_device_out_stage_completed_ex(
+        hal5_usb_endpoint_t* ep)
+{
+}
+
+void hal5_usb_device_in_stage_completed_ex(
+        hal5_usb_endpoint_t* ep)
+{
+}
@@ -0,0 +1,48 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// isochronous device used by the simulation
+// the endpoints are used in streaming mode, the packet callbacks are 
+// registered by the simulation programs
+
+#ifndef __ISO_DEVICE_H__
+#define __ISO_DEVICE_H__
+
+#include <stdint.h>
+
+#include "hal5_usb_device.h"
+
+#define ISO_DEVICE_IN_ENDP          (1)
+#define ISO_DEVICE_OUT_ENDP         (2)
+#define ISO_DEVICE_MAX_PACKET_SIZE  (192)
+
+// the standard requests handled by the device, cleared at Set Configuration
+typedef struct
+{
+    uint32_t set_interfaces;
+    // of the last SET_INTERFACE
+    uint8_t interface;
+    uint8_t alternate_setting;
+    uint32_t synch_frames;
+} iso_device_stats_t;
+
+extern iso_device_stats_t iso_device_stats;
+
+#endif
@@ -0,0 +1,82 @@
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# descriptors of the isochronous device used by the simulation
+# see descriptors.py for the meaning of the keys
+
+# EP1 IN and EP2 OUT isochronous endpoints (always double buffered)
+# of 192 bytes (1 ms of 48 kHz 16-bit stereo)
+# configuration 1 has a service interval of 1 frame, configuration 2 of
+# 2 frames (bInterval=2)
+
+def iso_configuration(value, interval):
+    return {
+        'value':            value,
+        'label':            None,
+        'self-powered':     True,
+        'remote-wakeup':    False,
+        'max-power-ma':     0,
+        'interfaces':
+        [
+            {
+                'number':               0,
+                'label':                None,
+                'alternate-setting':    0,
+                'class-proto':          (0xFF, 0xFF, 0xFF),
+                'endpoints':
+                [
+                    {
+                        'address':          1,
+                        'direction':        'in',
+                        'transfer-type':    'iso',
+                        'sync-type':        'async',
+                        'usage-type':       'data',
+                        'max-packet-size':  192,
+                        'interval':         interval,
+                    },
+                    {
+                        'address':          2,
+                        'direction':        'out',
+                        'transfer-type':    'iso',
+                        'sync-type':        'async',
+                        'usage-type':       'data',
+                        'max-packet-size':  192,
+                        'interval':         interval,
+                    },
+                ]
+            }
+        ]
+    }
+
+descriptors = {
+    'class-proto':          (0x00, 0x00, 0x00),
+    'max-packet-size-ep0':  64,
+    'ids':                  (0x1209, 0x0005),
+    'device-version':       (1, 0),
+    'manufacturer':         'metebalci',
+    'product':              'hal5 iso',
+    'append_version':       False,
+    'serial':               None,
+    'configurations':
+    [
+        iso_configuration(1, 1),
+        iso_configuration(2, 2),
+    ]
+}
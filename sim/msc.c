@@ -0,0 +1,470 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the mass storage driver (hal5_usb_msc.c) with sim/msc_device.c,
+// with single and double buffered data endpoints
+// - Get Max LUN
+// - INQUIRY, TEST UNIT READY, READ CAPACITY(10), MODE SENSE(6)
+// - an unknown command fails, REQUEST SENSE reports and clears it
+// - WRITE(10) and READ(10) of single and multiple blocks
+// - READ(10) out of range fails with a STALLed IN pipe
+// - the host expects more or less data than the device (residue, STALL 
+//   and phase error)
+// - an invalid CBW STALLs both pipes until Bulk-Only Mass Storage Reset
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "msc_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+#define MAX_NAKS                (1000)
+#define BLOCK_SIZE              (HAL5_USB_MSC_BLOCK_SIZE)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void configure(uint8_t configuration_value)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    // READ(10) and WRITE(10) blocks
+    hal5_usb_sim_set_main_loop(hal5_usb_msc_process);
+}
+
+// one transaction, NAKs are retried
+static hal5_usb_sim_handshake_t out_packet(const void* data, size_t len)
+{
+    hal5_usb_sim_handshake_t handshake = hal5_usb_sim_nak;
+
+    for (uint32_t i = 0; 
+            (i < MAX_NAKS) && (handshake == hal5_usb_sim_nak); 
+            i++)
+    {
+        handshake = hal5_usb_sim_out(MSC_DEVICE_OUT_ENDP, data, len);
+    }
+
+    return handshake;
+}
+
+static hal5_usb_sim_handshake_t in_packet(void* data, size_t* len)
+{
+    hal5_usb_sim_handshake_t handshake = hal5_usb_sim_nak;
+
+    for (uint32_t i = 0; 
+            (i < MAX_NAKS) && (handshake == hal5_usb_sim_nak); 
+            i++)
+    {
+        handshake = hal5_usb_sim_in(
+                MSC_DEVICE_IN_ENDP, data, MAX_PACKET_SIZE, len);
+    }
+
+    return handshake;
+}
+
+static bool clear_halt(uint8_t address)
+{
+    const hal5_usb_device_request_t clear_feature = 
+        {0x02, 0x01, 0, address, 0};
+
+    return hal5_usb_sim_control_nodata(0, &clear_feature);
+}
+
+static bool reset_recovery(void)
+{
+    const hal5_usb_device_request_t bulk_only_reset = 
+        {0x21, HAL5_USB_MSC_BULK_ONLY_RESET, 0, MSC_DEVICE_INTERFACE, 0};
+
+    return hal5_usb_sim_control_nodata(0, &bulk_only_reset) &&
+        clear_halt(0x80 | MSC_DEVICE_IN_ENDP) &&
+        clear_halt(MSC_DEVICE_OUT_ENDP);
+}
+
+typedef struct
+{
+    // bytes transferred in the data stage
+    size_t transferred;
+    // the data stage is ended by the device with a STALL
+    // (before or after a short packet)
+    bool stalled;
+    uint8_t status;
+    uint32_t residue;
+} result_t;
+
+static uint32_t tag = 0;
+
+// runs the command in cb as the host does
+// length bytes are received to or sent from data in the data stage
+// returns false if the CBW is not accepted or CSW is not valid
+static bool command(
+        const uint8_t* cb,
+        uint8_t cb_length,
+        bool dir_in,
+        void* data,
+        uint32_t length,
+        result_t* result)
+{
+    hal5_usb_msc_cbw_t cbw;
+
+    memset(&cbw, 0, sizeof(cbw));
+    cbw.dCBWSignature = HAL5_USB_MSC_CBW_SIGNATURE;
+    cbw.dCBWTag = ++tag;
+    cbw.dCBWDataTransferLength = length;
+    cbw.bmCBWFlags = dir_in ? 0x80 : 0x00;
+    cbw.bCBWCBLength = cb_length;
+    memcpy(cbw.CBWCB, cb, cb_length);
+
+    memset(result, 0, sizeof(*result));
+
+    if (out_packet(&cbw, sizeof(cbw)) != hal5_usb_sim_ack) return false;
+
+    uint8_t* p = (uint8_t*) data;
+    hal5_usb_sim_handshake_t handshake = hal5_usb_sim_ack;
+
+    while ((result->transferred < length) && 
+            (handshake == hal5_usb_sim_ack))
+    {
+        size_t len = HAL5_MIN(MAX_PACKET_SIZE, length - result->transferred);
+
+        if (dir_in)
+        {
+            uint8_t packet[MAX_PACKET_SIZE];
+            handshake = in_packet(packet, &len);
+            if (handshake != hal5_usb_sim_ack) break;
+            memcpy(p + result->transferred, packet, len);
+            result->transferred += len;
+            // short packet ends the data stage
+            if (len < MAX_PACKET_SIZE) break;
+        }
+        else
+        {
+            handshake = out_packet(p + result->transferred, len);
+            if (handshake == hal5_usb_sim_ack) result->transferred += len;
+        }
+    }
+
+    if (handshake == hal5_usb_sim_stall)
+    {
+        result->stalled = true;
+        if (!clear_halt(dir_in ? 
+                    (0x80 | MSC_DEVICE_IN_ENDP) : MSC_DEVICE_OUT_ENDP))
+        {
+            return false;
+        }
+    }
+    else if (handshake != hal5_usb_sim_ack)
+    {
+        return false;
+    }
+
+    hal5_usb_msc_csw_t csw;
+    size_t len;
+
+    handshake = in_packet(&csw, &len);
+
+    // the CSW is tried again once after a STALL
+    if (handshake == hal5_usb_sim_stall)
+    {
+        result->stalled = true;
+        if (!clear_halt(0x80 | MSC_DEVICE_IN_ENDP)) return false;
+        handshake = in_packet(&csw, &len);
+    }
+
+    if ((handshake != hal5_usb_sim_ack) || 
+            (len != sizeof(csw)) ||
+            (csw.dCSWSignature != HAL5_USB_MSC_CSW_SIGNATURE) ||
+            (csw.dCSWTag != cbw.dCBWTag))
+    {
+        return false;
+    }
+
+    result->status = csw.bCSWStatus;
+    result->residue = csw.dCSWDataResidue;
+
+    return true;
+}
+
+static bool read_10(
+        uint32_t lba, 
+        uint16_t count, 
+        void* data, 
+        uint32_t length,
+        result_t* result)
+{
+    const uint8_t cb[10] = {
+        HAL5_USB_MSC_SCSI_READ_10, 0, 
+        lba >> 24, lba >> 16, lba >> 8, lba, 
+        0, count >> 8, count, 0};
+
+    return command(cb, sizeof(cb), true, data, length, result);
+}
+
+static bool write_10(
+        uint32_t lba, 
+        uint16_t count, 
+        const void* data, 
+        uint32_t length,
+        result_t* result)
+{
+    const uint8_t cb[10] = {
+        HAL5_USB_MSC_SCSI_WRITE_10, 0, 
+        lba >> 24, lba >> 16, lba >> 8, lba, 
+        0, count >> 8, count, 0};
+
+    return command(cb, sizeof(cb), false, (void*) data, length, result);
+}
+
+static void check_sense(uint8_t key, uint8_t asc)
+{
+    const uint8_t cb[6] = {HAL5_USB_MSC_SCSI_REQUEST_SENSE, 0, 0, 0, 18, 0};
+    uint8_t sense[18];
+    result_t result;
+
+    CHECK (command(cb, sizeof(cb), true, sense, sizeof(sense), &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (result.transferred == sizeof(sense));
+    CHECK (sense[0] == 0x70);
+    CHECK ((sense[2] & 0xF) == key);
+    CHECK (sense[12] == asc);
+}
+
+static void check_commands(void)
+{
+    uint8_t data[256];
+    size_t len;
+    result_t result;
+
+    const hal5_usb_device_request_t get_max_lun = 
+        {0xA1, HAL5_USB_MSC_GET_MAX_LUN, 0, MSC_DEVICE_INTERFACE, 1};
+
+    CHECK (hal5_usb_sim_control_read(0, &get_max_lun, data, &len));
+    CHECK (len == 1);
+    CHECK (data[0] == 0);
+
+    const uint8_t inquiry[6] = {HAL5_USB_MSC_SCSI_INQUIRY, 0, 0, 0, 36, 0};
+
+    CHECK (command(inquiry, sizeof(inquiry), true, data, 36, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (result.residue == 0);
+    CHECK (result.transferred == 36);
+    CHECK (!result.stalled);
+    CHECK (data[0] == 0x00);
+    CHECK (memcmp(&data[8], "hal5    ", 8) == 0);
+
+    const uint8_t test_unit_ready[6] = {HAL5_USB_MSC_SCSI_TEST_UNIT_READY};
+
+    CHECK (command(test_unit_ready, sizeof(test_unit_ready), 
+                false, NULL, 0, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+
+    const uint8_t read_capacity[10] = {HAL5_USB_MSC_SCSI_READ_CAPACITY_10};
+
+    CHECK (command(read_capacity, sizeof(read_capacity), 
+                true, data, 8, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (result.transferred == 8);
+    const uint8_t capacity[8] = {
+        0, 0, (MSC_DEVICE_BLOCK_COUNT - 1) >> 8, 
+        (MSC_DEVICE_BLOCK_COUNT - 1) & 0xFF,
+        0, 0, BLOCK_SIZE >> 8, BLOCK_SIZE & 0xFF};
+    CHECK (memcmp(data, capacity, sizeof(capacity)) == 0);
+
+    // the host expects more (192 bytes) than the device sends (4 bytes)
+    const uint8_t mode_sense[6] = {
+        HAL5_USB_MSC_SCSI_MODE_SENSE_6, 0, 0x3F, 0, 192, 0};
+
+    CHECK (command(mode_sense, sizeof(mode_sense), true, data, 192, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (result.transferred == 4);
+    CHECK (result.stalled);
+    CHECK (result.residue == 188);
+    // not write protected
+    CHECK (data[2] == 0x00);
+
+    const uint8_t unknown[6] = {0xFF};
+
+    CHECK (command(unknown, sizeof(unknown), false, NULL, 0, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_FAILED);
+
+    check_sense(HAL5_USB_MSC_SENSE_ILLEGAL_REQUEST, 
+            HAL5_USB_MSC_ASC_INVALID_COMMAND);
+    // it is cleared
+    check_sense(HAL5_USB_MSC_SENSE_NO_SENSE, 0);
+}
+
+static uint8_t pattern(size_t offset, uint8_t seed)
+{
+    return (uint8_t) ((offset * 7) + (offset >> 9) + seed);
+}
+
+static void check_read_write(uint8_t seed)
+{
+    static uint8_t data[64 * BLOCK_SIZE];
+    static uint8_t received[64 * BLOCK_SIZE];
+    result_t result;
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = pattern(i, seed);
+
+    // single block
+    CHECK (write_10(3, 1, data, BLOCK_SIZE, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (result.residue == 0);
+    CHECK (memcmp(&msc_device_disk[3 * BLOCK_SIZE], data, BLOCK_SIZE) == 0);
+
+    memset(received, 0, sizeof(received));
+    CHECK (read_10(3, 1, received, BLOCK_SIZE, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (result.residue == 0);
+    CHECK (result.transferred == BLOCK_SIZE);
+    CHECK (memcmp(received, data, BLOCK_SIZE) == 0);
+
+    // more blocks than the buffers, up to the last block
+    const uint32_t lba = MSC_DEVICE_BLOCK_COUNT - 64;
+
+    CHECK (write_10(lba, 64, data, sizeof(data), &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (memcmp(&msc_device_disk[lba * BLOCK_SIZE], data, sizeof(data)) == 0);
+
+    memset(received, 0, sizeof(received));
+    CHECK (read_10(lba, 64, received, sizeof(received), &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (result.transferred == sizeof(received));
+    CHECK (memcmp(received, data, sizeof(data)) == 0);
+
+    // out of range, nothing is sent
+    CHECK (read_10(MSC_DEVICE_BLOCK_COUNT - 2, 4, 
+                received, 4 * BLOCK_SIZE, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_FAILED);
+    CHECK (result.stalled);
+    CHECK (result.transferred == 0);
+    CHECK (result.residue == 4 * BLOCK_SIZE);
+    check_sense(HAL5_USB_MSC_SENSE_ILLEGAL_REQUEST, 
+            HAL5_USB_MSC_ASC_LBA_OUT_OF_RANGE);
+
+    // the host sends more (2 blocks) than the device receives (1 block)
+    CHECK (write_10(5, 1, data, 2 * BLOCK_SIZE, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (result.stalled);
+    CHECK (result.transferred == BLOCK_SIZE);
+    CHECK (result.residue == BLOCK_SIZE);
+    CHECK (memcmp(&msc_device_disk[5 * BLOCK_SIZE], data, BLOCK_SIZE) == 0);
+
+    // the host expects less (1 block) than the device sends (2 blocks)
+    CHECK (read_10(3, 2, received, BLOCK_SIZE, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PHASE_ERROR);
+    CHECK (reset_recovery());
+
+    // it continues after
+    CHECK (read_10(3, 1, received, BLOCK_SIZE, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+    CHECK (memcmp(received, data, BLOCK_SIZE) == 0);
+}
+
+static void check_invalid_cbw(void)
+{
+    hal5_usb_msc_cbw_t cbw;
+    uint8_t packet[MAX_PACKET_SIZE];
+    size_t len;
+
+    memset(&cbw, 0, sizeof(cbw));
+    cbw.dCBWSignature = 0x12345678;
+
+    const hal5_usb_ep_stats_t* in_stats = 
+        &hal5_usb_device_get_endpoint(MSC_DEVICE_IN_ENDP, true)->stats;
+    const hal5_usb_ep_stats_t* out_stats = 
+        &hal5_usb_device_get_endpoint(MSC_DEVICE_OUT_ENDP, false)->stats;
+    const uint32_t in_stalls = in_stats->stalls;
+    const uint32_t out_stalls = out_stats->stalls;
+
+    CHECK (out_packet(&cbw, sizeof(cbw)) == hal5_usb_sim_ack);
+
+    // both pipes are halted once
+    CHECK (in_stats->stalls == in_stalls + 1);
+    CHECK (out_stats->stalls == out_stalls + 1);
+
+    CHECK (in_packet(packet, &len) == hal5_usb_sim_stall);
+    CHECK (out_packet(&cbw, sizeof(cbw)) == hal5_usb_sim_stall);
+
+    // halts are not cleared until the reset
+    CHECK (clear_halt(0x80 | MSC_DEVICE_IN_ENDP));
+    CHECK (clear_halt(MSC_DEVICE_OUT_ENDP));
+    CHECK (in_packet(packet, &len) == hal5_usb_sim_stall);
+    CHECK (out_packet(&cbw, sizeof(cbw)) == hal5_usb_sim_stall);
+    CHECK (in_stats->stalls == in_stalls + 1);
+    CHECK (out_stats->stalls == out_stalls + 1);
+
+    CHECK (reset_recovery());
+
+    const uint8_t test_unit_ready[6] = {HAL5_USB_MSC_SCSI_TEST_UNIT_READY};
+    result_t result;
+
+    CHECK (command(test_unit_ready, sizeof(test_unit_ready), 
+                false, NULL, 0, &result));
+    CHECK (result.status == HAL5_USB_MSC_CSW_PASSED);
+}
+
+static void check(uint8_t configuration_value)
+{
+    configure(configuration_value);
+
+    check_commands();
+    check_read_write(configuration_value);
+    check_invalid_cbw();
+
+    hal5_usb_msc_stats_t stats;
+    hal5_usb_msc_get_stats(&stats);
+    CHECK (stats.invalid_cbws == 1);
+    // phase error and invalid CBW
+    CHECK (stats.resets == 2);
+    CHECK (stats.phase_errors == 1);
+    CHECK (stats.blocks_written == (1 + 64 + 1));
+    CHECK (stats.blocks_read == (1 + 64 + 1));
+
+    hal5_usb_sim_set_main_loop(NULL);
+}
+
+int main(void)
+{
+    CHECK (msc_device_initialize());
+
+    // single buffered
+    check(1);
+    // double buffered
+    check(2);
+
+    printf("msc: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,46 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// mass storage device used by the simulation
+// hal5_usb_msc with a RAM disk and the descriptors in sim/msc_device.py
+// hal5_usb_msc_process is called by the simulation programs
+
+#ifndef __MSC_DEVICE_H__
+#define __MSC_DEVICE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal5_usb_msc.h"
+
+#define MSC_DEVICE_INTERFACE    (0)
+#define MSC_DEVICE_IN_ENDP      (1)
+#define MSC_DEVICE_OUT_ENDP     (2)
+
+// 256 KB
+#define MSC_DEVICE_BLOCK_COUNT  (512)
+
+// the memory of the RAM disk
+extern uint8_t msc_device_disk[MSC_DEVICE_BLOCK_COUNT * HAL5_USB_MSC_BLOCK_SIZE];
+
+// call once, registers the mass storage driver with the RAM disk
+bool msc_device_initialize(void);
+
+#endif
@@ -0,0 +1,57 @@
+#
+# SPDX-FileCopyrightText: 2023 Mete Balci
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Copyright (c) 2023 Mete Balci
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# descriptors of the mass storage device used by the simulation
+# see descriptors.py for the meaning of the keys and msc.py
+
+# configuration 1 has single buffered endpoints
+# configuration 2 has the same endpoints but double buffered
+# interface 0 with EP1 IN and EP2 OUT
+
+from msc import msc_interface
+
+def msc_configuration(value, double_buffer):
+    return {
+        'value':            value,
+        'label':            None,
+        'self-powered':     True,
+        'remote-wakeup':    False,
+        'max-power-ma':     0,
+        'interfaces':
+        [
+            msc_interface(0, 1, 2, double_buffer=double_buffer),
+        ]
+    }
+
+descriptors = {
+    'class-proto':          (0x00, 0x00, 0x00),
+    'max-packet-size-ep0':  64,
+    'ids':                  (0x1209, 0x0003),
+    'device-version':       (1, 0),
+    'manufacturer':         'metebalci',
+    'product':              'hal5 msc',
+    'append_version':       False,
+    'serial':               None,
+    'configurations':
+    [
+        msc_configuration(1, False),
+        msc_configuration(2, True),
+    ]
+}
@@ -0,0 +1,207 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// checks the USB SRAM allocator (hal5_usb_pma.c) and the endpoint pool
+// - alloc, free and reuse of regions, best fit and free space reporting
+// - buffers of sim/bulk_device.c are placed as generated by 
+//   create_descriptors.py, and freed and reused across 
+//   Set Configuration and bus reset
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_pma.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define AVAILABLE (HAL5_USB_PMA_SIZE - HAL5_USB_PMA_BDT_SIZE)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static hal5_usb_pma_status_t status(void)
+{
+    hal5_usb_pma_status_t s;
+    hal5_usb_pma_get_status(&s);
+    return s;
+}
+
+static void check_buffer_sizes(void)
+{
+    CHECK (hal5_usb_pma_tx_buffer_size(1) == 4);
+    CHECK (hal5_usb_pma_tx_buffer_size(9) == 12);
+    CHECK (hal5_usb_pma_tx_buffer_size(1023) == 1024);
+
+    // 2 byte blocks, word aligned
+    CHECK (hal5_usb_pma_rx_buffer_size(8) == 8);
+    CHECK (hal5_usb_pma_rx_buffer_size(9) == 12);
+    CHECK (hal5_usb_pma_rx_buffer_size(62) == 64);
+    // 32 byte blocks
+    CHECK (hal5_usb_pma_rx_buffer_size(63) == 64);
+    CHECK (hal5_usb_pma_rx_buffer_size(64) == 64);
+    CHECK (hal5_usb_pma_rx_buffer_size(100) == 128);
+    CHECK (hal5_usb_pma_rx_buffer_size(1023) == 1024);
+}
+
+static void check_alloc(void)
+{
+    hal5_usb_pma_status_t s = status();
+    CHECK (s.free == AVAILABLE);
+    CHECK (s.largest_free == AVAILABLE);
+    CHECK (s.free_regions == 1);
+    CHECK (s.fragmentation == 0);
+
+    // packed one after the other, after the buffer descriptor table
+    const uint16_t a = hal5_usb_pma_alloc(64);
+    const uint16_t b = hal5_usb_pma_alloc(10);
+    const uint16_t c = hal5_usb_pma_alloc(128);
+    const uint16_t d = hal5_usb_pma_alloc(32);
+
+    CHECK (a == HAL5_USB_PMA_BDT_SIZE);
+    CHECK (b == a + 64);
+    CHECK (c == b + 12);
+    CHECK (d == c + 128);
+
+    // two holes (12 and 128 bytes) and the rest
+    hal5_usb_pma_free(b, 10);
+    hal5_usb_pma_free(c, 128);
+
+    s = status();
+    CHECK (s.free == AVAILABLE - 64 - 32);
+    CHECK (s.free_regions == 2);
+
+    // the freed regions are merged
+    CHECK (s.largest_free == AVAILABLE - 64 - 140 - 32);
+    CHECK (s.fragmentation > 0);
+
+    // best fit, the hole is used not the rest
+    const uint16_t e = hal5_usb_pma_alloc(100);
+    CHECK (e == b);
+
+    // larger than any free region
+    CHECK (hal5_usb_pma_alloc(AVAILABLE) == 0);
+
+    // fill all
+    const uint16_t rest = status().largest_free;
+    const uint16_t f = hal5_usb_pma_alloc(rest);
+    CHECK (f == d + 32);
+    CHECK (f + rest == HAL5_USB_PMA_SIZE);
+
+    const uint16_t hole = status().largest_free;
+    CHECK (hole == 40);
+    const uint16_t g = hal5_usb_pma_alloc(hole);
+    CHECK (g == e + 100);
+
+    s = status();
+    CHECK (s.free == 0);
+    CHECK (s.free_regions == 0);
+    CHECK (hal5_usb_pma_alloc(4) == 0);
+
+    hal5_usb_pma_free(a, 64);
+    hal5_usb_pma_free(d, 32);
+    hal5_usb_pma_free(e, 100);
+    hal5_usb_pma_free(f, rest);
+    hal5_usb_pma_free(g, hole);
+
+    s = status();
+    CHECK (s.free == AVAILABLE);
+    CHECK (s.free_regions == 1);
+}
+
+static void check_device(void)
+{
+    // endpoint 0 (64 bytes) has separate rx and tx buffers
+    const uint16_t ep0 = 2 * 64;
+    // endpoint 1 IN and endpoint 2 OUT (64 bytes), 2 buffers if double buffered
+    const uint16_t single = 2 * 64;
+    const uint16_t dbl = 2 * 2 * 64;
+
+    CHECK (hal5_usb_sim_attach(NULL));
+    CHECK (status().free == AVAILABLE - ep0);
+
+    // endpoint 0 and the two bulk endpoints are taken from the pool
+    CHECK (hal5_usb_endpoint_pool.number_of_endpoints == 3);
+    CHECK (hal5_usb_endpoint_pool.endpoints_used == 0x1);
+
+    CHECK (hal5_usb_sim_set_configuration(1));
+    CHECK (status().free == AVAILABLE - ep0 - single);
+    CHECK (hal5_usb_endpoint_pool.endpoints_used == 0x7);
+    CHECK (hal5_usb_endpoint_pool.rx_data_used == 0x3);
+    CHECK (hal5_usb_endpoint_pool.tx_data_used == 0x3);
+
+    // placed as given in hal5_usb_pma_layouts (create_descriptors.py)
+    hal5_usb_endpoint_t* ep_in = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_IN_ENDP, 
+            true);
+    CHECK (ep_in->txbd->v == (HAL5_USB_PMA_BDT_SIZE + ep0));
+    hal5_usb_endpoint_t* ep_out = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_OUT_ENDP, 
+            false);
+    // 64 bytes = 2 x 32 bytes blocks (blsize=1, num_block=1)
+    CHECK (ep_out->rxbd->addr == (HAL5_USB_PMA_BDT_SIZE + ep0 + 64));
+    CHECK (ep_out->rxbd->blsize == 1);
+    CHECK (ep_out->rxbd->num_block == 1);
+
+    CHECK (hal5_usb_sim_set_configuration(2));
+    CHECK (status().free == AVAILABLE - ep0 - dbl);
+
+    hal5_usb_endpoint_t* ep = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_OUT_ENDP, 
+            false);
+    CHECK (ep->rxbd->addr == ep->txbd->addr + 64);
+
+    CHECK (hal5_usb_sim_set_configuration(1));
+    CHECK (status().free == AVAILABLE - ep0 - single);
+    CHECK (status().free_regions == 1);
+
+    ep = hal5_usb_device_get_endpoint(BULK_DEVICE_OUT_ENDP, false);
+    CHECK (ep->rxbd->addr >= HAL5_USB_PMA_BDT_SIZE + ep0);
+
+    // the endpoints of the configuration are freed by bus reset
+    CHECK (hal5_usb_sim_enumerate(5));
+    CHECK (status().free == AVAILABLE - ep0);
+    CHECK (hal5_usb_device_get_endpoint(BULK_DEVICE_OUT_ENDP, false) == NULL);
+    CHECK (hal5_usb_endpoint_pool.endpoints_used == 0x1);
+    CHECK (hal5_usb_endpoint_pool.rx_data_used == 0x1);
+    CHECK (hal5_usb_endpoint_pool.tx_data_used == 0x1);
+}
+
+int main(void)
+{
+    check_buffer_sizes();
+    check_alloc();
+    check_device();
+
+    printf("pma_alloc: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
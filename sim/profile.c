@@ -0,0 +1,255 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the USB interrupt handler profiling with sim/bulk_device.c,
+// with single and double buffered endpoints
+// - each event is recorded once to its path (reset, CTR SETUP/OUT/IN, 
+//   suspend, wakeup, error), the counts are checked against the endpoint
+//   and device counters
+// - min, mean and max are consistent and the histogram adds up to count
+// - the device _ex callbacks take less than the handler in total
+// and prints the durations (host ns, not MCU cycles) of the double 
+// buffered run
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_profile.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+#define MAX_NAKS                (1000)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint32_t count(hal5_usb_profile_path_t path)
+{
+    hal5_usb_profile_stats_t stats;
+    hal5_usb_profile_get_stats(path, &stats);
+    return stats.count;
+}
+
+static void configure(uint8_t configuration_value)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    // like windows, enumeration resets the bus twice
+    CHECK (count(profile_path_reset) == 2);
+    CHECK (count(profile_path_ctr_setup) > 0);
+
+    hal5_usb_profile_clear_stats();
+    CHECK (count(profile_path_reset) == 0);
+
+    hal5_usb_device_clear_stats();
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    // _set_configuration_ex
+    CHECK (count(profile_path_callback) == 1);
+
+    bulk_device_start();
+}
+
+static void transfer_in(void)
+{
+    size_t received = 0;
+    uint32_t naks = 0;
+
+    while ((received < BULK_DEVICE_TRANSFER_SIZE) && (naks < MAX_NAKS))
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        size_t len;
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_in(
+                BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len);
+
+        if (handshake == hal5_usb_sim_ack) received += len;
+        else naks++;
+    }
+
+    CHECK (received == BULK_DEVICE_TRANSFER_SIZE);
+}
+
+static void transfer_out(void)
+{
+    uint8_t packet[MAX_PACKET_SIZE];
+    size_t sent = 0;
+    uint32_t naks = 0;
+
+    while ((sent < BULK_DEVICE_TRANSFER_SIZE) && (naks < MAX_NAKS))
+    {
+        const size_t len = 
+            HAL5_MIN(MAX_PACKET_SIZE, BULK_DEVICE_TRANSFER_SIZE - sent);
+
+        for (size_t i = 0; i < len; i++) 
+        {
+            packet[i] = bulk_device_pattern(sent + i);
+        }
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_out(
+                BULK_DEVICE_OUT_ENDP, packet, len);
+
+        if (handshake == hal5_usb_sim_ack) sent += len;
+        else naks++;
+    }
+
+    CHECK (sent == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (bulk_device_stats.out_transfers == 1);
+}
+
+static void check_counts(void)
+{
+    uint32_t setup_packets = 0;
+    uint32_t rx_packets = 0;
+    uint32_t tx_packets = 0;
+
+    for (uint8_t endp = 0; endp < 8; endp++)
+    {
+        for (uint8_t dir_in = 0; dir_in < 2; dir_in++)
+        {
+            const hal5_usb_endpoint_t* ep = 
+                hal5_usb_device_get_endpoint(endp, dir_in);
+
+            if (ep == NULL) continue;
+            // endpoint 0 is bidirectional, it is returned for both
+            if ((endp == 0) && dir_in) continue;
+
+            setup_packets += ep->stats.setup_packets;
+            rx_packets += ep->stats.rx_packets;
+            tx_packets += ep->stats.tx_packets;
+        }
+    }
+
+    const hal5_usb_device_stats_t* device_stats = hal5_usb_device_get_stats();
+
+    CHECK (count(profile_path_reset) == device_stats->resets);
+    CHECK (count(profile_path_ctr_setup) == setup_packets);
+    CHECK (count(profile_path_ctr_out) == (rx_packets - setup_packets));
+    CHECK (count(profile_path_ctr_in) == tx_packets);
+    CHECK (count(profile_path_suspend) == 1);
+    CHECK (count(profile_path_wakeup) == 1);
+    CHECK (count(profile_path_error) == 1);
+    CHECK (count(profile_path_sof) == 0);
+    // out and in stage completed of both transfers at least
+    CHECK (count(profile_path_callback) >= 3);
+}
+
+static void check_stats(void)
+{
+    uint64_t handler_total = 0;
+
+    for (uint32_t path = 0; path < HAL5_USB_PROFILE_NUMBER_OF_PATHS; path++)
+    {
+        hal5_usb_profile_stats_t stats;
+        hal5_usb_profile_get_stats(path, &stats);
+
+        // resets are cleared after enumeration
+        // no SOF interrupt without isochronous endpoints
+        CHECK ((stats.count > 0) || 
+                (path == profile_path_reset) || 
+                (path == profile_path_sof));
+
+        const uint32_t mean = hal5_usb_profile_mean(&stats);
+
+        CHECK (stats.min <= mean);
+        CHECK (mean <= stats.max);
+
+        uint32_t histogram_count = 0;
+        for (uint32_t i = 0; i < HAL5_USB_PROFILE_HISTOGRAM_BINS; i++)
+        {
+            histogram_count += stats.histogram[i];
+        }
+
+        CHECK (histogram_count == stats.count);
+
+        if (path != profile_path_callback) handler_total += stats.total;
+    }
+
+    hal5_usb_profile_stats_t callback_stats;
+    hal5_usb_profile_get_stats(profile_path_callback, &callback_stats);
+
+    CHECK (callback_stats.total <= handler_total);
+}
+
+static void print_stats(void)
+{
+    printf("USB_DRD_FS_IRQHandler host ns: count min mean max\n");
+
+    for (uint32_t path = 0; path < HAL5_USB_PROFILE_NUMBER_OF_PATHS; path++)
+    {
+        hal5_usb_profile_stats_t stats;
+        hal5_usb_profile_get_stats(path, &stats);
+
+        printf("%-10s %5u %7u %7u %7u\n",
+                hal5_usb_profile_path_name(path),
+                stats.count,
+                stats.min,
+                hal5_usb_profile_mean(&stats),
+                stats.max);
+    }
+}
+
+static void check(uint8_t configuration_value)
+{
+    configure(configuration_value);
+
+    transfer_in();
+    transfer_out();
+
+    // babble, a bus error
+    uint8_t babble[MAX_PACKET_SIZE + 10] = {0};
+    CHECK (hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, babble, sizeof(babble)) ==
+            hal5_usb_sim_no_response);
+    hal5_usb_sim_run_irq();
+
+    hal5_usb_sim_suspend();
+    hal5_usb_sim_resume();
+
+    check_counts();
+    check_stats();
+}
+
+int main(void)
+{
+    // single buffered
+    check(1);
+    // double buffered
+    check(2);
+
+    print_stats();
+
+    printf("profile: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,261 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// checks the traffic counters of the endpoints and the device event counters
+// of sim/bulk_device.c, with single and double buffered endpoints
+// - packets, bytes, short packets and ZLPs per direction
+// - SETUP packets and Request Errors of endpoint 0
+// - bus resets, suspends, wakeups and bus errors
+// - the counters read with the statistics vendor request
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+#define MAX_NAKS                (1000)
+#define STATS_VENDOR_REQUEST    (0x7D)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static void configure(uint8_t configuration_value)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    // like windows, enumeration resets the bus twice
+    CHECK (hal5_usb_device_get_stats()->resets == 2);
+
+    hal5_usb_device_clear_stats();
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    bulk_device_start();
+}
+
+static void check_ep0(void)
+{
+    const hal5_usb_ep_stats_t* stats = 
+        &hal5_usb_device_get_endpoint(0, false)->stats;
+
+    // Set Configuration: SETUP and status IN ZLP
+    CHECK (stats->setup_packets == 1);
+    CHECK (stats->rx_packets == 1);
+    CHECK (stats->rx_bytes == 8);
+    CHECK (stats->tx_packets == 1);
+    CHECK (stats->tx_zlps == 1);
+    CHECK (stats->stalls == 0);
+
+    // Get Status (device), 2 bytes IN and status OUT ZLP
+    const hal5_usb_device_request_t get_status = 
+        {0x80, 0x00, 0x0000, 0x0000, 2};
+
+    uint8_t data[64];
+    size_t len;
+
+    CHECK (hal5_usb_sim_control_read(0, &get_status, data, &len));
+    CHECK (stats->setup_packets == 2);
+    CHECK (stats->rx_packets == 3);
+    CHECK (stats->rx_bytes == 16);
+    CHECK (stats->rx_short_packets == 1);
+    CHECK (stats->tx_packets == 2);
+    CHECK (stats->tx_bytes == 2);
+
+    // Request Error
+    const hal5_usb_device_request_t unknown = 
+        {0x80, 0x55, 0x0000, 0x0000, 2};
+
+    CHECK (!hal5_usb_sim_control_read(0, &unknown, data, &len));
+    CHECK (stats->stalls == 1);
+}
+
+static void check_in(void)
+{
+    const hal5_usb_ep_stats_t* stats = 
+        &hal5_usb_device_get_endpoint(BULK_DEVICE_IN_ENDP, true)->stats;
+
+    size_t received = 0;
+    uint32_t naks = 0;
+
+    while ((received < BULK_DEVICE_TRANSFER_SIZE) && (naks < MAX_NAKS))
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        size_t len;
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_in(
+                BULK_DEVICE_IN_ENDP, packet, sizeof(packet), &len);
+
+        if (handshake == hal5_usb_sim_ack) received += len;
+        else naks++;
+    }
+
+    CHECK (received == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (stats->tx_packets == 
+            (BULK_DEVICE_TRANSFER_SIZE + MAX_PACKET_SIZE - 1) / MAX_PACKET_SIZE);
+    CHECK (stats->tx_bytes == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (stats->tx_zlps == 0);
+    CHECK (stats->rx_packets == 0);
+}
+
+static void check_out(void)
+{
+    const hal5_usb_ep_stats_t* stats = 
+        &hal5_usb_device_get_endpoint(BULK_DEVICE_OUT_ENDP, false)->stats;
+
+    uint8_t packet[MAX_PACKET_SIZE];
+    size_t sent = 0;
+    uint32_t naks = 0;
+
+    while ((sent < BULK_DEVICE_TRANSFER_SIZE) && (naks < MAX_NAKS))
+    {
+        const size_t len = 
+            HAL5_MIN(MAX_PACKET_SIZE, BULK_DEVICE_TRANSFER_SIZE - sent);
+
+        for (size_t i = 0; i < len; i++) 
+        {
+            packet[i] = bulk_device_pattern(sent + i);
+        }
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_out(
+                BULK_DEVICE_OUT_ENDP, packet, len);
+
+        if (handshake == hal5_usb_sim_ack) sent += len;
+        else naks++;
+    }
+
+    CHECK (sent == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (bulk_device_stats.out_transfers == 1);
+    CHECK (stats->rx_packets == 
+            (BULK_DEVICE_TRANSFER_SIZE + MAX_PACKET_SIZE - 1) / MAX_PACKET_SIZE);
+    CHECK (stats->rx_bytes == BULK_DEVICE_TRANSFER_SIZE);
+    CHECK (stats->rx_short_packets == 1);
+    CHECK (stats->setup_packets == 0);
+    CHECK (stats->tx_packets == 0);
+
+    // babble, more than max packet size is not ACKed but a bus error
+    uint8_t babble[MAX_PACKET_SIZE + 10] = {0};
+    CHECK (hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, babble, sizeof(babble)) ==
+            hal5_usb_sim_no_response);
+    hal5_usb_sim_run_irq();
+    CHECK (hal5_usb_device_get_stats()->bus_errors == 1);
+    CHECK (stats->rx_packets == 
+            (BULK_DEVICE_TRANSFER_SIZE + MAX_PACKET_SIZE - 1) / MAX_PACKET_SIZE);
+}
+
+static void check_device(void)
+{
+    const hal5_usb_device_stats_t* stats = hal5_usb_device_get_stats();
+
+    CHECK (stats->resets == 0);
+    CHECK (stats->suspends == 0);
+    CHECK (stats->wakeups == 0);
+
+    hal5_usb_sim_suspend();
+    hal5_usb_sim_resume();
+
+    CHECK (stats->suspends == 1);
+    CHECK (stats->wakeups == 1);
+    CHECK (stats->pma_overruns == 0);
+}
+
+static void check_vendor_request(void)
+{
+    // device
+    const hal5_usb_device_request_t get_device_stats = 
+        {0xC0, STATS_VENDOR_REQUEST, 0x0000, 0x0000, 64};
+
+    hal5_usb_device_stats_t device_stats;
+    size_t len;
+
+    CHECK (hal5_usb_sim_control_read(0, &get_device_stats, &device_stats, &len));
+    CHECK (len == sizeof(device_stats));
+    CHECK (memcmp(&device_stats, hal5_usb_device_get_stats(), len) == 0);
+
+    // endpoint
+    const hal5_usb_device_request_t get_ep_stats = 
+        {0xC2, STATS_VENDOR_REQUEST, 0x0000, 0x0080 | BULK_DEVICE_IN_ENDP, 64};
+
+    hal5_usb_ep_stats_t ep_stats;
+
+    CHECK (hal5_usb_sim_control_read(0, &get_ep_stats, &ep_stats, &len));
+    CHECK (len == sizeof(ep_stats));
+    CHECK (memcmp(
+                &ep_stats, 
+                &hal5_usb_device_get_endpoint(BULK_DEVICE_IN_ENDP, true)->stats,
+                len) == 0);
+    CHECK (ep_stats.tx_bytes == BULK_DEVICE_TRANSFER_SIZE);
+
+    // the endpoint does not exist
+    const hal5_usb_device_request_t get_no_ep_stats = 
+        {0xC2, STATS_VENDOR_REQUEST, 0x0000, 0x0083, 64};
+
+    CHECK (!hal5_usb_sim_control_read(0, &get_no_ep_stats, &ep_stats, &len));
+
+    // not an endpoint number (bit 3 of wIndex is set)
+    const hal5_usb_device_request_t get_invalid_ep_stats[] = {
+        {0xC2, STATS_VENDOR_REQUEST, 0x0000, 0x0089, 64},
+        {0xC2, STATS_VENDOR_REQUEST, 0x0000, 0x0008, 64}};
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        CHECK (!hal5_usb_sim_control_read(
+                    0, &get_invalid_ep_stats[i], &ep_stats, &len));
+    }
+}
+
+static void check(uint8_t configuration_value)
+{
+    configure(configuration_value);
+
+    check_ep0();
+    check_in();
+    check_out();
+    check_device();
+    check_vendor_request();
+}
+
+int main(void)
+{
+    CHECK (hal5_usb_device_register_stats_vendor_request(STATS_VENDOR_REQUEST));
+
+    // single buffered
+    check(1);
+    // double buffered
+    check(2);
+
+    printf("stats: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,208 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// host simulation replacement of the CMSIS device header
+// only the parts used by hal5_usb are provided
+// USB_DRD_FS registers and the PMA (USB SRAM) are plain memory
+// modeled by hal5_usb_sim.c
+
+#ifndef __STM32H5XX_H__
+#define __STM32H5XX_H__
+
+#include <stdint.h>
+
+#define __IO                volatile
+#define __PACKED_STRUCT     struct __attribute__((packed))
+#define __WEAK              __attribute__((weak))
+#define __USED              __attribute__((used))
+#define __ALIGNED(x)        __attribute__((aligned(x)))
+#define __STATIC_INLINE     static inline
+#define __DMB()             __sync_synchronize()
+
+#define SET_BIT(REG, BIT)       ((REG) |= (BIT))
+#define CLEAR_BIT(REG, BIT)     ((REG) &= ~(BIT))
+#define READ_BIT(REG, BIT)      ((REG) & (BIT))
+#define MODIFY_REG(REG, CLEARMASK, SETMASK) \
+    ((REG) = (((REG) & (~(CLEARMASK))) | (SETMASK)))
+
+typedef struct
+{
+    __IO uint32_t CHEP0R;
+    __IO uint32_t CHEP1R;
+    __IO uint32_t CHEP2R;
+    __IO uint32_t CHEP3R;
+    __IO uint32_t CHEP4R;
+    __IO uint32_t CHEP5R;
+    __IO uint32_t CHEP6R;
+    __IO uint32_t CHEP7R;
+    __IO uint32_t RESERVED0[8];
+    __IO uint32_t CNTR;
+    __IO uint32_t ISTR;
+    __IO uint32_t FNR;
+    __IO uint32_t DADDR;
+    __IO uint32_t RESERVED1;
+    __IO uint32_t LPMCSR;
+    __IO uint32_t BCDR;
+} USB_DRD_TypeDef;
+
+extern USB_DRD_TypeDef hal5_usb_sim_drd;
+extern uint32_t hal5_usb_sim_pma[];
+
+#define USB_DRD_BASE        ((uintptr_t) &hal5_usb_sim_drd)
+#define USB_DRD_PMAADDR     ((uintptr_t) hal5_usb_sim_pma)
+#define USB_DRD_FS          ((USB_DRD_TypeDef*) USB_DRD_BASE)
+
+#define USB_DRD_PMA_SIZE    (2048U)
+
+// 96-bit unique device ID in system memory
+extern const uint32_t hal5_sim_uid[3];
+#define UID_BASE            ((uintptr_t) hal5_sim_uid)
+
+#define USB_CNTR_USBRST_Pos     (0U)
+#define USB_CNTR_USBRST         (0x1UL << USB_CNTR_USBRST_Pos)
+#define USB_CNTR_PDWN_Pos       (1U)
+#define USB_CNTR_PDWN           (0x1UL << USB_CNTR_PDWN_Pos)
+#define USB_CNTR_SUSPRDY_Pos    (2U)
+#define USB_CNTR_SUSPRDY        (0x1UL << USB_CNTR_SUSPRDY_Pos)
+#define USB_CNTR_SUSPEN_Pos     (3U)
+#define USB_CNTR_SUSPEN         (0x1UL << USB_CNTR_SUSPEN_Pos)
+#define USB_CNTR_L2RES_Pos      (4U)
+#define USB_CNTR_L2RES          (0x1UL << USB_CNTR_L2RES_Pos)
+#define USB_CNTR_L1RES_Pos      (5U)
+#define USB_CNTR_L1RES          (0x1UL << USB_CNTR_L1RES_Pos)
+#define USB_CNTR_L1REQM_Pos     (7U)
+#define USB_CNTR_L1REQM         (0x1UL << USB_CNTR_L1REQM_Pos)
+#define USB_CNTR_ESOFM_Pos      (8U)
+#define USB_CNTR_ESOFM          (0x1UL << USB_CNTR_ESOFM_Pos)
+#define USB_CNTR_SOFM_Pos       (9U)
+#define USB_CNTR_SOFM           (0x1UL << USB_CNTR_SOFM_Pos)
+#define USB_CNTR_RESETM_Pos     (10U)
+#define USB_CNTR_RESETM         (0x1UL << USB_CNTR_RESETM_Pos)
+#define USB_CNTR_SUSPM_Pos      (11U)
+#define USB_CNTR_SUSPM          (0x1UL << USB_CNTR_SUSPM_Pos)
+#define USB_CNTR_WKUPM_Pos      (12U)
+#define USB_CNTR_WKUPM          (0x1UL << USB_CNTR_WKUPM_Pos)
+#define USB_CNTR_ERRM_Pos       (13U)
+#define USB_CNTR_ERRM           (0x1UL << USB_CNTR_ERRM_Pos)
+#define USB_CNTR_PMAOVRM_Pos    (14U)
+#define USB_CNTR_PMAOVRM        (0x1UL << USB_CNTR_PMAOVRM_Pos)
+#define USB_CNTR_CTRM_Pos       (15U)
+#define USB_CNTR_CTRM           (0x1UL << USB_CNTR_CTRM_Pos)
+#define USB_CNTR_HOST_Pos       (31U)
+#define USB_CNTR_HOST           (0x1UL << USB_CNTR_HOST_Pos)
+
+#define USB_ISTR_IDN_Pos        (0U)
+#define USB_ISTR_IDN_Msk        (0xFUL << USB_ISTR_IDN_Pos)
+#define USB_ISTR_IDN            USB_ISTR_IDN_Msk
+#define USB_ISTR_DIR_Pos        (4U)
+#define USB_ISTR_DIR_Msk        (0x1UL << USB_ISTR_DIR_Pos)
+#define USB_ISTR_DIR            USB_ISTR_DIR_Msk
+#define USB_ISTR_L1REQ_Pos      (7U)
+#define USB_ISTR_L1REQ_Msk      (0x1UL << USB_ISTR_L1REQ_Pos)
+#define USB_ISTR_L1REQ          USB_ISTR_L1REQ_Msk
+#define USB_ISTR_ESOF_Pos       (8U)
+#define USB_ISTR_ESOF_Msk       (0x1UL << USB_ISTR_ESOF_Pos)
+#define USB_ISTR_ESOF           USB_ISTR_ESOF_Msk
+#define USB_ISTR_SOF_Pos        (9U)
+#define USB_ISTR_SOF_Msk        (0x1UL << USB_ISTR_SOF_Pos)
+#define USB_ISTR_SOF            USB_ISTR_SOF_Msk
+#define USB_ISTR_RESET_Pos      (10U)
+#define USB_ISTR_RESET_Msk      (0x1UL << USB_ISTR_RESET_Pos)
+#define USB_ISTR_RESET          USB_ISTR_RESET_Msk
+#define USB_ISTR_SUSP_Pos       (11U)
+#define USB_ISTR_SUSP_Msk       (0x1UL << USB_ISTR_SUSP_Pos)
+#define USB_ISTR_SUSP           USB_ISTR_SUSP_Msk
+#define USB_ISTR_WKUP_Pos       (12U)
+#define USB_ISTR_WKUP_Msk       (0x1UL << USB_ISTR_WKUP_Pos)
+#define USB_ISTR_WKUP           USB_ISTR_WKUP_Msk
+#define USB_ISTR_ERR_Pos        (13U)
+#define USB_ISTR_ERR_Msk        (0x1UL << USB_ISTR_ERR_Pos)
+#define USB_ISTR_ERR            USB_ISTR_ERR_Msk
+#define USB_ISTR_PMAOVR_Pos     (14U)
+#define USB_ISTR_PMAOVR_Msk     (0x1UL << USB_ISTR_PMAOVR_Pos)
+#define USB_ISTR_PMAOVR         USB_ISTR_PMAOVR_Msk
+#define USB_ISTR_CTR_Pos        (15U)
+#define USB_ISTR_CTR_Msk        (0x1UL << USB_ISTR_CTR_Pos)
+#define USB_ISTR_CTR            USB_ISTR_CTR_Msk
+
+#define USB_FNR_FN_Pos          (0U)
+#define USB_FNR_FN_Msk          (0x7FFUL << USB_FNR_FN_Pos)
+#define USB_FNR_FN              USB_FNR_FN_Msk
+#define USB_FNR_LSOF_Pos        (11U)
+#define USB_FNR_LSOF_Msk        (0x3UL << USB_FNR_LSOF_Pos)
+#define USB_FNR_LSOF            USB_FNR_LSOF_Msk
+
+#define USB_DADDR_ADD_Pos       (0U)
+#define USB_DADDR_ADD_Msk       (0x7FUL << USB_DADDR_ADD_Pos)
+#define USB_DADDR_ADD           USB_DADDR_ADD_Msk
+#define USB_DADDR_EF_Pos        (7U)
+#define USB_DADDR_EF            (0x1UL << USB_DADDR_EF_Pos)
+
+#define USB_BCDR_DPPU_Pos       (15U)
+#define USB_BCDR_DPPU           (0x1UL << USB_BCDR_DPPU_Pos)
+
+// DWT cycle counter is read through HAL5_USB_READ_CYCCNT
+// and HAL5_USB_PROFILE_CLOCK
+// these are only written
+typedef struct
+{
+    __IO uint32_t CTRL;
+    __IO uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+    __IO uint32_t DEMCR;
+} DCB_Type;
+
+extern DWT_Type hal5_sim_dwt;
+extern DCB_Type hal5_sim_dcb;
+
+#define DWT (&hal5_sim_dwt)
+#define DCB (&hal5_sim_dcb)
+
+#define DWT_CTRL_CYCCNTENA_Msk  (1UL << 0)
+#define DCB_DEMCR_TRCENA_Msk    (1UL << 24)
+
+#define RCC_CCIPR4_USBSEL_Pos   (4U)
+#define RCC_CCIPR4_USBSEL_Msk   (0x3UL << RCC_CCIPR4_USBSEL_Pos)
+
+typedef struct
+{
+    __IO uint32_t CCIPR4;
+} RCC_TypeDef;
+
+extern RCC_TypeDef hal5_sim_rcc;
+
+#define RCC (&hal5_sim_rcc)
+
+typedef enum
+{
+    USB_DRD_FS_IRQn = 74,
+} IRQn_Type;
+
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority);
+void NVIC_EnableIRQ(IRQn_Type irqn);
+void NVIC_DisableIRQ(IRQn_Type irqn);
+
+// the active exception number, see hal5_usb_sim_set_exception
+uint32_t __get_IPSR(void);
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the streaming mode (packet callbacks) with sim/bulk_device.c, 
+// with single and double buffered endpoints
+// - each OUT packet is handed over to the callback as it is received
+// - each IN packet is taken from the callback, also ZLPs
+// - the endpoints NAK when the callback stops the stream until it is 
+//   started again
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+// packets until the callbacks stop the stream
+#define STREAM_PACKETS          (10)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+typedef struct
+{
+    // number of packets handed over or taken
+    uint32_t packets;
+    // the stream is stopped after this many packets
+    uint32_t limit;
+    // OUT packets with wrong size or data
+    uint32_t errors;
+} driver_t;
+
+static driver_t in_driver;
+static driver_t out_driver;
+
+// size and data of the packet n of a stream
+// every 4th packet is full, so a ZLP does not follow
+static size_t packet_size(uint32_t n)
+{
+    switch (n % 4)
+    {
+        case 0: return MAX_PACKET_SIZE;
+        case 1: return 10;
+        case 2: return 0;
+        default: return MAX_PACKET_SIZE - 1;
+    }
+}
+
+static uint8_t packet_data(uint32_t n, size_t offset)
+{
+    return (uint8_t) (n * 13 + offset);
+}
+
+static bool in_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    driver_t* driver = (driver_t*) context;
+
+    if (driver->packets == driver->limit) return false;
+
+    CHECK (*size == MAX_PACKET_SIZE);
+
+    *size = packet_size(driver->packets);
+
+    for (size_t i = 0; i < *size; i++)
+    {
+        data[i] = packet_data(driver->packets, i);
+    }
+
+    driver->packets++;
+
+    return true;
+}
+
+static bool out_packet(
+        hal5_usb_endpoint_t* ep,
+        uint8_t* data,
+        size_t* size,
+        void* context)
+{
+    driver_t* driver = (driver_t*) context;
+
+    bool ok = (*size == packet_size(driver->packets));
+
+    for (size_t i = 0; ok && (i < *size); i++)
+    {
+        ok = (data[i] == packet_data(driver->packets, i));
+    }
+
+    if (!ok) driver->errors++;
+
+    driver->packets++;
+
+    return (driver->packets < driver->limit);
+}
+
+static void configure(uint8_t configuration_value)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    memset(&bulk_device_stats, 0, sizeof(bulk_device_stats));
+}
+
+// reads packets until a NAK, checks them against the stream
+// returns the number of packets read
+static uint32_t read_stream(uint32_t first)
+{
+    uint32_t n = first;
+
+    while (n < (first + 2 * STREAM_PACKETS))
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        size_t len;
+
+        if (hal5_usb_sim_in(BULK_DEVICE_IN_ENDP, 
+                    packet, sizeof(packet), &len) != hal5_usb_sim_ack)
+        {
+            break;
+        }
+
+        CHECK (len == packet_size(n));
+
+        for (size_t i = 0; (len == packet_size(n)) && (i < len); i++)
+        {
+            CHECK (packet[i] == packet_data(n, i));
+        }
+
+        n++;
+    }
+
+    return n - first;
+}
+
+// writes the packets of the stream until a NAK
+// returns the number of packets written
+static uint32_t write_stream(uint32_t first, uint32_t count)
+{
+    uint32_t n = first;
+
+    while (n < (first + count))
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+
+        for (size_t i = 0; i < packet_size(n); i++)
+        {
+            packet[i] = packet_data(n, i);
+        }
+
+        if (hal5_usb_sim_out(BULK_DEVICE_OUT_ENDP, 
+                    packet, packet_size(n)) != hal5_usb_sim_ack)
+        {
+            break;
+        }
+
+        n++;
+    }
+
+    return n - first;
+}
+
+static void check(uint8_t configuration_value, bool double_buffered)
+{
+    memset(&in_driver, 0, sizeof(in_driver));
+    memset(&out_driver, 0, sizeof(out_driver));
+
+    in_driver.limit = STREAM_PACKETS;
+    out_driver.limit = STREAM_PACKETS;
+
+    configure(configuration_value);
+
+    hal5_usb_endpoint_t* in_ep = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_IN_ENDP, true);
+    hal5_usb_endpoint_t* out_ep = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_OUT_ENDP, false);
+
+    CHECK (in_ep->double_buffered == double_buffered);
+    CHECK (in_ep->packet == in_packet);
+    CHECK (out_ep->packet == out_packet);
+
+    // NAK until started
+    CHECK (read_stream(0) == 0);
+    CHECK (write_stream(0, 1) == 0);
+
+    hal5_usb_device_start_stream(in_ep);
+    hal5_usb_device_start_stream(out_ep);
+
+    // the packets are taken one (or two) ahead
+    CHECK (in_driver.packets == (double_buffered ? 2 : 1));
+
+    // stopped after STREAM_PACKETS
+    CHECK (read_stream(0) == STREAM_PACKETS);
+    CHECK (in_driver.packets == STREAM_PACKETS);
+
+    // each packet is handed over as it is received
+    CHECK (write_stream(0, 3) == 3);
+    CHECK (out_driver.packets == 3);
+
+    // the interrupt is handled before the next packet here
+    CHECK (write_stream(3, 2 * STREAM_PACKETS) == (STREAM_PACKETS - 3));
+    CHECK (out_driver.packets == STREAM_PACKETS);
+    CHECK (out_driver.errors == 0);
+
+    // not combined into stages
+    CHECK (bulk_device_stats.in_transfers == 0);
+    CHECK (bulk_device_stats.out_transfers == 0);
+
+    // started again
+    in_driver.limit = 2 * STREAM_PACKETS;
+    hal5_usb_device_start_stream(in_ep);
+    CHECK (read_stream(STREAM_PACKETS) == STREAM_PACKETS);
+
+    const uint32_t out_packets = out_driver.packets;
+    out_driver.limit = out_packets + STREAM_PACKETS;
+    hal5_usb_device_start_stream(out_ep);
+    CHECK (write_stream(out_packets, STREAM_PACKETS) == STREAM_PACKETS);
+    CHECK (out_driver.errors == 0);
+}
+
+int main(void)
+{
+    CHECK (!hal5_usb_device_register_packet_callback(0x80, NULL, NULL));
+    CHECK (!hal5_usb_device_register_packet_callback(0x08, NULL, NULL));
+
+    CHECK (hal5_usb_device_register_packet_callback(
+                0x80 | BULK_DEVICE_IN_ENDP, in_packet, &in_driver));
+    CHECK (hal5_usb_device_register_packet_callback(
+                BULK_DEVICE_OUT_ENDP, out_packet, &out_driver));
+
+    // single buffered
+    check(1, false);
+    // double buffered
+    check(2, true);
+
+    printf("streaming: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
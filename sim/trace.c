@@ -0,0 +1,229 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// checks the binary transaction trace (hal5_usb_trace.c) of an enumeration
+// of the example device
+// - events are recorded in order with increasing timestamps
+// - SETUP events contain the requests, transaction events the endpoint state
+// - events are dropped (not overwritten) when the ring is full
+//   and recorded again when it is read
+// - the ring is read with the trace vendor request
+// set HAL5_SIM_TRACE_DUMP to a file name to write the events of the
+// enumeration, decode_trace.py decodes it
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "hal5_usb_trace.h"
+
+#define TRACE_VENDOR_REQUEST    (0x7E)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static hal5_usb_trace_event_t events[HAL5_USB_TRACE_SIZE + 1];
+
+static void dump(const hal5_usb_trace_event_t* events, size_t n)
+{
+    const char* path = getenv("HAL5_SIM_TRACE_DUMP");
+    if (path == NULL) return;
+
+    FILE* f = fopen(path, "wb");
+    CHECK (f != NULL);
+    if (f == NULL) return;
+
+    CHECK (fwrite(events, sizeof(hal5_usb_trace_event_t), n, f) == n);
+    fclose(f);
+}
+
+static void check_enumeration(void)
+{
+    CHECK (hal5_usb_sim_enumerate(5));
+
+    hal5_usb_trace_stats_t stats;
+    hal5_usb_trace_get_stats(&stats);
+
+    CHECK (stats.dropped == 0);
+
+    const size_t n = hal5_usb_trace_read(events, HAL5_USB_TRACE_SIZE + 1);
+    CHECK (n == stats.recorded);
+    CHECK (hal5_usb_trace_read(events, 1) == 0);
+
+    dump(events, n);
+
+    // the first interrupt is bus reset
+    CHECK (events[0].type == trace_event_irq);
+    CHECK (events[0].istr & USB_ISTR_RESET);
+
+    uint32_t setups = 0;
+    uint32_t transactions = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const hal5_usb_trace_event_t* e = &events[i];
+        hal5_usb_chep_t chep;
+
+        if (i > 0) CHECK ((int32_t) (e->cycles - events[i-1].cycles) >= 0);
+
+        switch (e->type)
+        {
+            case trace_event_irq:
+                break;
+
+            case trace_event_setup:
+                // it is recorded while processing the SETUP transaction
+                CHECK (i > 0);
+                CHECK (events[i-1].type == trace_event_irq);
+                CHECK (events[i-1].istr & USB_ISTR_CTR);
+                if (setups == 0)
+                {
+                    // like windows, get device descriptor with wLength=64
+                    CHECK (e->request.bmRequestType == 0x80);
+                    CHECK (e->request.bRequest == 0x06);
+                    CHECK (e->request.wValue == 0x0100);
+                    CHECK (e->request.wLength == 64);
+                }
+                setups++;
+                break;
+
+            case trace_event_transaction:
+                chep.v = e->chep;
+                CHECK (e->endp == 0);
+                CHECK (chep.vtrx || chep.vttx);
+                if (chep.vtrx && chep.setup)
+                {
+                    CHECK (e->rxbd_count == 8);
+                    CHECK (e->rx_received == 8);
+                    CHECK (events[i-1].type == trace_event_setup);
+                    CHECK (e->standard_request != standard_request_null);
+                }
+                transactions++;
+                break;
+
+            default:
+                CHECK (false);
+        }
+    }
+
+    CHECK (setups > 0);
+    CHECK (transactions > setups);
+}
+
+// the ring is not read until it is full
+static void check_full(void)
+{
+    hal5_usb_trace_stats_t before;
+    hal5_usb_trace_get_stats(&before);
+
+    while (true)
+    {
+        CHECK (hal5_usb_sim_enumerate(5));
+
+        hal5_usb_trace_stats_t stats;
+        hal5_usb_trace_get_stats(&stats);
+
+        if (stats.recorded - before.recorded == HAL5_USB_TRACE_SIZE) 
+        {
+            CHECK (stats.dropped > 0);
+            break;
+        }
+
+        CHECK (stats.dropped == 0);
+    }
+
+    // the oldest events are kept
+    const size_t n = hal5_usb_trace_read(events, HAL5_USB_TRACE_SIZE + 1);
+    CHECK (n == HAL5_USB_TRACE_SIZE);
+    CHECK (events[0].type == trace_event_irq);
+    CHECK (events[0].istr & USB_ISTR_RESET);
+
+    // it records again after it is read
+    CHECK (hal5_usb_sim_enumerate(5));
+    CHECK (hal5_usb_trace_read(events, HAL5_USB_TRACE_SIZE) > 0);
+}
+
+static void check_vendor_request(void)
+{
+    CHECK (hal5_usb_trace_register_vendor_request(TRACE_VENDOR_REQUEST));
+
+    const hal5_usb_device_request_t get_trace = 
+        {0xC0, TRACE_VENDOR_REQUEST, 0x0000, 0x0000, 
+            HAL5_USB_TRACE_VENDOR_REQUEST_EVENTS * 
+                sizeof(hal5_usb_trace_event_t)};
+
+    hal5_usb_trace_event_t reply[HAL5_USB_TRACE_VENDOR_REQUEST_EVENTS];
+    size_t len;
+
+    // the events of this request until its SETUP is processed
+    CHECK (hal5_usb_sim_control_read(0, &get_trace, reply, &len));
+    CHECK (len == 2 * sizeof(hal5_usb_trace_event_t));
+    CHECK (reply[0].type == trace_event_irq);
+    CHECK (reply[1].type == trace_event_setup);
+    CHECK (reply[1].request.bRequest == TRACE_VENDOR_REQUEST);
+
+    // the rest of previous request (SETUP, IN and OUT transactions) 
+    // and this one
+    CHECK (hal5_usb_sim_control_read(0, &get_trace, reply, &len));
+    CHECK (len == 7 * sizeof(hal5_usb_trace_event_t));
+    CHECK (reply[0].type == trace_event_transaction);
+    CHECK (reply[0].standard_request == standard_request_class_or_vendor);
+    CHECK (reply[2].type == trace_event_transaction);
+    CHECK (reply[2].tx_sent == 2 * sizeof(hal5_usb_trace_event_t));
+    CHECK (reply[4].type == trace_event_transaction);
+    CHECK (reply[4].standard_request == standard_request_null);
+    CHECK (reply[6].type == trace_event_setup);
+
+    // limited to wLength
+    const hal5_usb_device_request_t get_one = 
+        {0xC0, TRACE_VENDOR_REQUEST, 0x0000, 0x0000, 
+            sizeof(hal5_usb_trace_event_t) + 10};
+
+    CHECK (hal5_usb_sim_control_read(0, &get_one, reply, &len));
+    CHECK (len == sizeof(hal5_usb_trace_event_t));
+}
+
+int main(void)
+{
+    hal5_usb_sim_initialize();
+    hal5_usb_configure();
+    hal5_usb_device_connect();
+
+    check_enumeration();
+    check_full();
+    check_vendor_request();
+
+    printf("trace: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,310 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Mete Balci
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (c) 2023 Mete Balci
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// checks the transfers submitted with hal5_usb_device_submit with
+// sim/bulk_device.c, with single and double buffered endpoints
+// - queued IN and OUT transfers run back to back without NAKs in between
+// - the completed callback gets its context and the actual length
+// - ZLP after a multiple of max packet size unless transfer_flag_no_zlp
+// - the queue is full after HAL5_USB_TRANSFER_QUEUE_SIZE transfers
+// - a transfer submitted in a callback (echo of OUT to IN)
+// exits with non-zero status if any step fails
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal5.h"
+#include "hal5_usb_device.h"
+#include "hal5_usb_sim.h"
+#include "bulk_device.h"
+
+#define MAX_PACKET_SIZE         (64)
+#define TRANSFER_SIZE           (256)
+
+static uint32_t failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+typedef struct
+{
+    uint32_t completed;
+    size_t last_length;
+    bool last_overflow;
+    // echo the OUT transfers to IN
+    bool echo;
+} driver_t;
+
+static driver_t in_driver;
+static driver_t out_driver;
+
+static uint8_t in_data[TRANSFER_SIZE];
+static uint8_t out_data[HAL5_USB_TRANSFER_QUEUE_SIZE][TRANSFER_SIZE];
+
+static void transfer_completed(
+        hal5_usb_endpoint_t* ep,
+        hal5_usb_transfer_t* transfer)
+{
+    driver_t* driver = (driver_t*) transfer->context;
+    driver->completed++;
+    driver->last_length = transfer->actual_length;
+    driver->last_overflow = transfer->overflow;
+
+    if (driver->echo)
+    {
+        // the echo is sent from the OUT buffer
+        // which is submitted again when the echo is completed
+        CHECK (hal5_usb_device_submit(
+                    hal5_usb_device_get_endpoint(BULK_DEVICE_IN_ENDP, true),
+                    transfer->buffer,
+                    transfer->actual_length,
+                    0,
+                    transfer_completed,
+                    &in_driver));
+    }
+    else if (ep->dir_in && out_driver.echo)
+    {
+        CHECK (hal5_usb_device_submit(
+                    hal5_usb_device_get_endpoint(BULK_DEVICE_OUT_ENDP, false),
+                    transfer->buffer,
+                    TRANSFER_SIZE,
+                    0,
+                    transfer_completed,
+                    &out_driver));
+    }
+}
+
+static void configure(uint8_t configuration_value)
+{
+    CHECK (hal5_usb_sim_attach(NULL));
+
+    CHECK (hal5_usb_sim_set_configuration(configuration_value));
+
+    memset(&bulk_device_stats, 0, sizeof(bulk_device_stats));
+}
+
+// writes size bytes in packets, returns the number of packets NAKed
+static uint32_t write_packets(const uint8_t* data, size_t size)
+{
+    size_t sent = 0;
+    uint32_t naks = 0;
+
+    while (sent < size)
+    {
+        const size_t len = HAL5_MIN(MAX_PACKET_SIZE, size - sent);
+
+        const hal5_usb_sim_handshake_t handshake = hal5_usb_sim_out(
+                BULK_DEVICE_OUT_ENDP, data + sent, len);
+
+        if (handshake != hal5_usb_sim_ack) 
+        {
+            naks++;
+            if (naks > 100) break;
+        }
+        else
+        {
+            sent += len;
+        }
+    }
+
+    return naks;
+}
+
+static void check_in(void)
+{
+    hal5_usb_endpoint_t* ep = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_IN_ENDP, true);
+
+    uint8_t packet[MAX_PACKET_SIZE];
+
+    // not started yet
+    CHECK (hal5_usb_sim_in_or_nak(
+                BULK_DEVICE_IN_ENDP, packet, sizeof(packet)) == -1);
+
+    // 100: 64+36, 128: 64+64+ZLP, 128 no ZLP: 64+64, 0: ZLP
+    CHECK (hal5_usb_device_submit(
+                ep, in_data, 100, 0, transfer_completed, &in_driver));
+    CHECK (hal5_usb_device_submit(
+                ep, in_data + 100, 128, 0, transfer_completed, &in_driver));
+    CHECK (hal5_usb_device_submit(
+                ep, in_data, 128, transfer_flag_no_zlp, 
+                transfer_completed, &in_driver));
+    CHECK (hal5_usb_device_submit(
+                ep, NULL, 0, 0, transfer_completed, &in_driver));
+    // queue is full
+    CHECK (!hal5_usb_device_submit(
+                ep, in_data, 1, 0, transfer_completed, &in_driver));
+
+    const int expected[] = {64, 36, 64, 64, 0, 64, 64, 0};
+    const uint8_t* expected_data[] = {
+        in_data, in_data+64, 
+        in_data+100, in_data+164, NULL,
+        in_data, in_data+64,
+        NULL};
+
+    for (size_t i = 0; i < sizeof(expected)/sizeof(int); i++)
+    {
+        const int len = hal5_usb_sim_in_or_nak(
+                BULK_DEVICE_IN_ENDP, packet, sizeof(packet));
+        CHECK (len == expected[i]);
+        if ((len > 0) && (len == expected[i]))
+        {
+            CHECK (memcmp(packet, expected_data[i], len) == 0);
+        }
+    }
+
+    CHECK (in_driver.completed == 4);
+    CHECK (in_driver.last_length == 0);
+    CHECK (ep->transfers_count == 0);
+    // the stage completed callback is not called for submitted transfers
+    CHECK (bulk_device_stats.in_transfers == 0);
+
+    // idle again
+    CHECK (hal5_usb_sim_in_or_nak(
+                BULK_DEVICE_IN_ENDP, packet, sizeof(packet)) == -1);
+}
+
+static void check_out(void)
+{
+    hal5_usb_endpoint_t* ep = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_OUT_ENDP, false);
+
+    uint8_t data[TRANSFER_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t) (i ^ 0x5A);
+
+    // not started yet
+    CHECK (write_packets(data, 1) > 0);
+
+    for (size_t i = 0; i < HAL5_USB_TRANSFER_QUEUE_SIZE; i++)
+    {
+        // the third one is not a multiple of max packet size for overflow
+        memset(out_data[i], 0, TRANSFER_SIZE);
+        CHECK (hal5_usb_device_submit(
+                    ep, out_data[i], (i == 2) ? 200 : TRANSFER_SIZE, 0, 
+                    transfer_completed, &out_driver));
+    }
+
+    CHECK (!hal5_usb_device_submit(
+                ep, out_data[0], TRANSFER_SIZE, 0, 
+                transfer_completed, &out_driver));
+
+    // full buffer, short packet, overflow on a full buffer
+    CHECK (write_packets(data, TRANSFER_SIZE) == 0);
+    CHECK (out_driver.completed == 1);
+    CHECK (out_driver.last_length == TRANSFER_SIZE);
+    CHECK (memcmp(out_data[0], data, TRANSFER_SIZE) == 0);
+
+    CHECK (write_packets(data, 10) == 0);
+    CHECK (out_driver.completed == 2);
+    CHECK (out_driver.last_length == 10);
+    CHECK (!out_driver.last_overflow);
+    CHECK (memcmp(out_data[1], data, 10) == 0);
+
+    CHECK (write_packets(data, TRANSFER_SIZE) == 0);
+    CHECK (out_driver.completed == 3);
+    CHECK (out_driver.last_length == 200);
+    CHECK (out_driver.last_overflow);
+    CHECK (memcmp(out_data[2], data, 200) == 0);
+
+    // the last one
+    CHECK (write_packets(data, 1) == 0);
+    CHECK (out_driver.completed == 4);
+    CHECK (ep->transfers_count == 0);
+    CHECK (bulk_device_stats.out_transfers == 0);
+
+    // NAK until submitted again
+    CHECK (write_packets(data, 1) > 0);
+}
+
+static void check_echo(void)
+{
+    hal5_usb_endpoint_t* ep = hal5_usb_device_get_endpoint(
+            BULK_DEVICE_OUT_ENDP, false);
+
+    out_driver.echo = true;
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        CHECK (hal5_usb_device_submit(
+                    ep, out_data[i], TRANSFER_SIZE, 0, 
+                    transfer_completed, &out_driver));
+    }
+
+    for (uint32_t k = 0; k < 4; k++)
+    {
+        uint8_t data[100];
+        for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t) (i + k);
+
+        CHECK (write_packets(data, sizeof(data)) == 0);
+
+        uint8_t packet[MAX_PACKET_SIZE];
+        CHECK (hal5_usb_sim_in_or_nak(
+                    BULK_DEVICE_IN_ENDP, packet, sizeof(packet)) == 64);
+        CHECK (memcmp(packet, data, 64) == 0);
+        CHECK (hal5_usb_sim_in_or_nak(
+                    BULK_DEVICE_IN_ENDP, packet, sizeof(packet)) == 36);
+        CHECK (memcmp(packet, data + 64, 36) == 0);
+    }
+
+    CHECK (out_driver.completed == 4);
+    CHECK (in_driver.completed == 4);
+
+    out_driver.echo = false;
+}
+
+static void check(uint8_t configuration_value)
+{
+    memset(&in_driver, 0, sizeof(in_driver));
+    memset(&out_driver, 0, sizeof(out_driver));
+
+    for (size_t i = 0; i < TRANSFER_SIZE; i++)
+    {
+        in_data[i] = (uint8_t) (0xA0 + i);
+    }
+
+    configure(configuration_value);
+
+    check_in();
+    check_out();
+
+    memset(&in_driver, 0, sizeof(in_driver));
+    memset(&out_driver, 0, sizeof(out_driver));
+
+    check_echo();
+}
+
+int main(void)
+{
+    // single buffered
+    check(1);
+    // double buffered
+    check(2);
+
+    printf("transfers: %s\n", (failures == 0) ? "OK" : "FAILED");
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}